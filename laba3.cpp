@@ -1,103 +1,349 @@
 #include <iostream>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cctype>
+#include <charconv>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <stack>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 enum NumberType { COMPLEX, QUATERNION, CALCULATOR };
 
-class ComplexNumber {
+// Способ комплексного деления (a + bi) / (c + di):
+// DIVISION_NAIVE - домножение на сопряжённое, как operator/. c^2 + d^2
+//   переполняется уже при |c|, |d| ~ 1e154 и обнуляется при ~1e-162;
+// DIVISION_SMITH - метод Смита с масштабированием (Baudin, Smith 2012):
+//   весь диапазон T, ошибка в несколько ulp, но два-три деления
+//   (в векторном ядре четыре);
+// DIVISION_RECIPROCAL - одно деление 1 / (c^2 + d^2) и умножения:
+//   вдвое быстрее DIVISION_NAIVE, тот же диапазон, ошибка чуть больше.
+enum DivisionMode { DIVISION_NAIVE, DIVISION_SMITH, DIVISION_RECIPROCAL };
+
+inline const char* divisionModeName(DivisionMode mode) {
+    switch (mode) {
+        case DIVISION_SMITH: return "smith";
+        case DIVISION_RECIPROCAL: return "reciprocal";
+        default: return "naive";
+    }
+}
+
+// Накопление сумм произведений: операторами (два округления на
+// слагаемое), через fma (одно) или с компенсацией ошибки
+enum AccumulationMode { ACCUMULATE_PLAIN, ACCUMULATE_FUSED, ACCUMULATE_COMPENSATED };
+
+inline const char* accumulationModeName(AccumulationMode mode) {
+    switch (mode) {
+        case ACCUMULATE_FUSED: return "fused";
+        case ACCUMULATE_COMPENSATED: return "compensated";
+        default: return "plain";
+    }
+}
+
+// Схема вычисления многочлена: Горнер (последовательная цепочка) или
+// Эстрин (дерево, больше независимых умножений)
+enum PolynomialScheme { POLYNOMIAL_HORNER, POLYNOMIAL_ESTRIN };
+
+inline const char* polynomialSchemeName(PolynomialScheme scheme) {
+    return scheme == POLYNOMIAL_ESTRIN ? "estrin" : "horner";
+}
+
+// Имя скалярного типа для сообщений тестов и замеров
+template <typename T>
+const char* scalarTypeName() {
+    if (std::is_same<T, float>::value)
+        return "float";
+    if (std::is_same<T, double>::value)
+        return "double";
+    return "long double";
+}
+
+// Точность, при которой число записывается кратчайшим образом
+// и читается обратно без потерь
+const int ROUND_TRIP_PRECISION = -1;
+
+// Размер буфера под запись одного числа с точностью по умолчанию
+const size_t MAX_FORMAT_LENGTH = 256;
+
+// Запись скаляра в [first, last) через std::to_chars: кратчайшая при
+// ROUND_TRIP_PRECISION, иначе как printf("%.*g"). 0, если не хватило места
+template <typename T>
+char* formatScalar(char* first, char* last, T value, int precision) {
+    if (!first)
+        return 0;
+    std::to_chars_result result = precision < 0 ? std::to_chars(first, last, value)
+        : std::to_chars(first, last, value, std::chars_format::general, precision);
+    return result.ec == std::errc() ? result.ptr : 0;
+}
+
+// Запись length символов text; 0, если не хватило места
+inline char* formatText(char* first, char* last, const char* text, size_t length) {
+    if (!first || (size_t)(last - first) < length)
+        return 0;
+    std::memcpy(first, text, length);
+    return first + length;
+}
+
+// Слагаемое " + 2i" или " - 2i": знак отдельно, модуль после него
+template <typename T>
+char* formatTerm(char* first, char* last, T value, int precision, char unit) {
+    if (value >= 0) {
+        first = formatText(first, last, " + ", 3);
+        first = formatScalar(first, last, value, precision);
+    } else {
+        first = formatText(first, last, " - ", 3);
+        first = formatScalar(first, last, std::fabs(value), precision);
+    }
+    return formatText(first, last, &unit, 1);
+}
+
+// Вывод числа в std::cout с его текущей точностью и переводом строки
+template <typename Number>
+void printFormatted(const Number& value) {
+    int precision = (int)std::cout.precision();
+    char buffer[MAX_FORMAT_LENGTH];
+    char* end = value.format(buffer, buffer + sizeof(buffer) - 1, precision);
+    if (end) {
+        *end++ = '\n';
+        std::cout.write(buffer, end - buffer);
+        return;
+    }
+    // Очень большая точность: буфер нужного размера
+    std::string large(4 * (precision + 16), '\0');
+    end = value.format(&large[0], &large[0] + large.size(), precision);
+    std::cout.write(large.data(), end - large.data()) << '\n';
+}
+
+// Комплексное число над скалярным типом T (float, double, long double).
+// Все арифметические операции constexpr, поэтому выражения
+// из констант вычисляются ещё при компиляции.
+template <typename T>
+class BasicComplexNumber {
 private:
-    double real;
-    double imaginary;
-    NumberType type;
+    T real;
+    T imaginary;
+
+    static constexpr T magnitude(T x) { return x < 0 ? -x : x; }
+
+    // Действительная часть (a + bi) / (c + di) при |d| <= |c|, r = d / c,
+    // t = 1 / (c + d * r). Если b * r теряется в нуле, умножаем на t раньше
+    static constexpr T smithPart(T a, T b, T c, T d, T r, T t) {
+        if (r != 0) {
+            T br = b * r;
+            return br != 0 ? (a + br) * t : a * t + (b * t) * r;
+        }
+        return (a + d * (b / c)) * t;
+    }
+
+    // Метод Смита с масштабированием операндов на степени двойки:
+    // промежуточные значения не переполняются и не теряются в нуле
+    constexpr BasicComplexNumber smithDivide(const BasicComplexNumber& other) const {
+        const T halfEpsilon = std::numeric_limits<T>::epsilon() / 2;
+        // После деления на 8 |c + d * r| < max / 4, и t = 1 / (c + d * r)
+        // остаётся нормализованным числом
+        const T huge = std::numeric_limits<T>::max() / 8;
+        const T tiny = std::numeric_limits<T>::min() * 2 / halfEpsilon;
+        const T up = 2 / (halfEpsilon * halfEpsilon);
+        T a = real, b = imaginary, c = other.real, d = other.imaginary;
+        T ab = magnitude(a) > magnitude(b) ? magnitude(a) : magnitude(b);
+        T cd = magnitude(c) > magnitude(d) ? magnitude(c) : magnitude(d);
+        T scale = 1;
+        if (ab >= huge) {
+            a *= T(0.125);
+            b *= T(0.125);
+            scale *= 8;
+        }
+        if (cd >= huge) {
+            c *= T(0.125);
+            d *= T(0.125);
+            scale *= T(0.125);
+        }
+        if (ab <= tiny) {
+            a *= up;
+            b *= up;
+            scale /= up;
+        }
+        if (cd <= tiny) {
+            c *= up;
+            d *= up;
+            scale *= up;
+        }
+        // (a + bi) / (c + di) = conj((b + ai) / (d + ci))
+        if (magnitude(d) > magnitude(c)) {
+            T r = c / d;
+            T t = 1 / (d + c * r);
+            return BasicComplexNumber(smithPart(b, a, d, c, r, t) * scale, -smithPart(a, -b, d, c, r, t) * scale);
+        }
+        T r = d / c;
+        T t = 1 / (c + d * r);
+        return BasicComplexNumber(smithPart(a, b, c, d, r, t) * scale, smithPart(b, -a, c, d, r, t) * scale);
+    }
 
 public:
+    typedef T value_type;
+
+    // Вид числа известен при компиляции и не хранится в каждом объекте
+    static constexpr NumberType kind = COMPLEX;
+
     // Конструктор по умолчанию
-    ComplexNumber() : real(0), imaginary(0), type(COMPLEX) {}
+    constexpr BasicComplexNumber() : real(0), imaginary(0) {}
 
     // Конструктор инициализации
-    ComplexNumber(double r, double i) : real(r), imaginary(i), type(COMPLEX) {}
+    constexpr BasicComplexNumber(T r, T i) : real(r), imaginary(i) {}
 
-    // Конструктор копирования
-    ComplexNumber(const ComplexNumber& other) : real(other.real), imaginary(other.imaginary), type(COMPLEX) {}
+    // Копирование и перемещение по умолчанию: тип тривиально копируемый,
+    // векторы и стеки переносят его как memcpy
 
     // Методы доступа
-    double getReal() const { return real; }
-    double getImaginary() const { return imaginary; }
-    NumberType getType() const { return type; }
+    constexpr T getReal() const { return real; }
+    constexpr T getImaginary() const { return imaginary; }
+    constexpr NumberType getType() const { return kind; }
 
-    void setReal(double r) { real = r; }
-    void setImaginary(double i) { imaginary = i; }
+    constexpr void setReal(T r) { real = r; }
+    constexpr void setImaginary(T i) { imaginary = i; }
 
     // Операции сложения
-    ComplexNumber operator+(const ComplexNumber& other) const {
-        return ComplexNumber(real + other.real, imaginary + other.imaginary);
+    constexpr BasicComplexNumber operator+(const BasicComplexNumber& other) const {
+        return BasicComplexNumber(real + other.real, imaginary + other.imaginary);
     }
 
     // Операция вычитания
-    ComplexNumber operator-(const ComplexNumber& other) const {
-        return ComplexNumber(real - other.real, imaginary - other.imaginary);
+    constexpr BasicComplexNumber operator-(const BasicComplexNumber& other) const {
+        return BasicComplexNumber(real - other.real, imaginary - other.imaginary);
     }
 
     // Операция умножения
     // ac - bd + (ad + bc)i
-    ComplexNumber operator*(const ComplexNumber& other) const {
-        return ComplexNumber(real * other.real - imaginary * other.imaginary,
-                             real * other.imaginary + imaginary * other.real);
+    constexpr BasicComplexNumber operator*(const BasicComplexNumber& other) const {
+        return BasicComplexNumber(real * other.real - imaginary * other.imaginary,
+                                  real * other.imaginary + imaginary * other.real);
     }
 
     // Операция деления
     // домножаем на сопряженное, получаем в знаменателе c^2 + d^2
     // в числителе получаем (a + bi)*(c - di)
-    ComplexNumber operator/(const ComplexNumber& other) const {
-        double denominator = other.real * other.real + other.imaginary * other.imaginary;
-        return ComplexNumber((real * other.real + imaginary * other.imaginary) / denominator,
-                             (imaginary * other.real - real * other.imaginary) / denominator);
+    constexpr BasicComplexNumber operator/(const BasicComplexNumber& other) const {
+        T denominator = other.real * other.real + other.imaginary * other.imaginary;
+        return BasicComplexNumber((real * other.real + imaginary * other.imaginary) / denominator,
+                                  (imaginary * other.real - real * other.imaginary) / denominator);
     }
 
+    // Деление выбранным способом, см. DivisionMode
+    constexpr BasicComplexNumber divide(const BasicComplexNumber& other, DivisionMode mode) const {
+        if (mode == DIVISION_SMITH)
+            return smithDivide(other);
+        if (mode == DIVISION_RECIPROCAL) {
+            T inverse = 1 / (other.real * other.real + other.imaginary * other.imaginary);
+            return BasicComplexNumber((real * other.real + imaginary * other.imaginary) * inverse,
+                                      (imaginary * other.real - real * other.imaginary) * inverse);
+        }
+        return *this / other;
+    }
 
-    virtual void print() const {
-        if (imaginary >= 0)
-            std::cout << real << " + " << imaginary << "i" << std::endl;
-        else
-            std::cout << real << " - " << fabs(imaginary) << "i" << std::endl;
+
+    void print() const { printFormatted(*this); }
+
+    // Запись в [first, last) в виде "3 + 4i", как печатает print(), без
+    // перевода строки. Возвращает конец записи или 0, если не хватило места
+    char* format(char* first, char* last, int precision = ROUND_TRIP_PRECISION) const {
+        first = formatScalar(first, last, real, precision);
+        return formatTerm(first, last, imaginary, precision, 'i');
     }
 
     // Тестирование
     static void test() {
-        ComplexNumber c1(3, 4);
-        ComplexNumber c2(1, 2);
+        BasicComplexNumber c1(3, 4);
+        BasicComplexNumber c2(1, 2);
 
         // Тест конструктора по умолчанию
-        ComplexNumber c3;
+        BasicComplexNumber c3;
         assert(c3.getReal() == 0 && c3.getImaginary() == 0);
 
         // Тест конструктора инициализации
         assert(c1.getReal() == 3 && c1.getImaginary() == 4);
 
         // Тест конструктора копирования
-        ComplexNumber c4 = c1;
+        BasicComplexNumber c4 = c1;
         assert(c4.getReal() == c1.getReal() && c4.getImaginary() == c1.getImaginary());
+        assert(std::is_trivially_copyable_v<BasicComplexNumber>);
+        assert(std::is_nothrow_move_constructible_v<BasicComplexNumber>);
 
         // Тест арифметических операций
-        ComplexNumber sum = c1 + c2;
+        BasicComplexNumber sum = c1 + c2;
         assert(sum.getReal() == 4 && sum.getImaginary() == 6);
 
-        ComplexNumber difference = c1 - c2;
+        BasicComplexNumber difference = c1 - c2;
         assert(difference.getReal() == 2 && difference.getImaginary() == 2);
 
-        ComplexNumber product = c1 * c2;
+        BasicComplexNumber product = c1 * c2;
         assert(product.getReal() == -5 && product.getImaginary() == 10);
 
-        ComplexNumber quotient = c1 / c2;
+        BasicComplexNumber quotient = c1 / c2;
 
         // Добавляем допуск для сравнения с плавающей точкой
         double epsilon = 1e-6;
         assert(fabs(quotient.getReal() - 2.2) < epsilon);
         assert(fabs(quotient.getImaginary() + 0.4) < epsilon); // Ожидаем -0.4
 
+        // Тест способов деления
+        const DivisionMode modes[] = { DIVISION_NAIVE, DIVISION_SMITH, DIVISION_RECIPROCAL };
+        for (DivisionMode mode : modes) {
+            BasicComplexNumber q = c1.divide(c2, mode);
+            assert(fabs(q.getReal() - 2.2) < epsilon && fabs(q.getImaginary() + 0.4) < epsilon);
+            q = c2.divide(BasicComplexNumber(1, 3), mode);
+            assert(fabs(q.getReal() - 0.7) < epsilon && fabs(q.getImaginary() + 0.1) < epsilon);
+        }
+        assert(c1.divide(c2, DIVISION_NAIVE).getReal() == quotient.getReal());
+
+        // Крайние значения: c^2 + d^2 переполняется или обнуляется,
+        // способ Смита всё равно даёт 1 и i
+        const T extremes[] = { std::numeric_limits<T>::max() / 4, std::numeric_limits<T>::min() * 4,
+                               std::numeric_limits<T>::denorm_min() * 8 };
+        for (T x : extremes) {
+            BasicComplexNumber z(x, x);
+            BasicComplexNumber one = z.divide(z, DIVISION_SMITH);
+            assert(one.getReal() == 1 && one.getImaginary() == 0);
+            BasicComplexNumber unit = BasicComplexNumber(-x, x).divide(z, DIVISION_SMITH);
+            assert(unit.getReal() == 0 && unit.getImaginary() == 1);
+            assert(!std::isfinite((z / z).getReal()));
+        }
+        BasicComplexNumber wide = BasicComplexNumber(1, 1).divide(BasicComplexNumber(std::numeric_limits<T>::max() / 4, 1), DIVISION_SMITH);
+        assert(wide.getReal() > 0 && std::isfinite(wide.getReal()) && wide.getImaginary() != 0);
+
         // Тест геттеров и сеттеров
-        ComplexNumber c5;
+        BasicComplexNumber c5;
         c5.setReal(5.5);
         c5.setImaginary(-2.5);
         assert(c5.getReal() == 5.5);
@@ -109,122 +355,174 @@ public:
         assert(c5.getReal() == 10.0);
         assert(c5.getImaginary() == 5.0);
 
-        std::cout << "All tests passed for ComplexNumber!" << std::endl;
+        std::cout << "All tests passed for ComplexNumber<" << scalarTypeName<T>() << ">!" << std::endl;
     }
 };
 
+typedef BasicComplexNumber<double> ComplexNumber;
+
+// Трёхмерный вектор, который поворачивают единичные кватернионы
+template <typename T>
+struct BasicVector3 {
+    T x;
+    T y;
+    T z;
+
+    constexpr BasicVector3() : x(0), y(0), z(0) {}
+    constexpr BasicVector3(T x, T y, T z) : x(x), y(y), z(z) {}
+};
+
+typedef BasicVector3<double> Vector3;
 
-class Quaternion : public ComplexNumber {
+// Кватернион a + bi + cj + dk над скалярным типом T хранится плоско:
+// четыре T подряд, без базового класса, указателя на таблицу виртуальных
+// функций и поля типа. Для double это ровно 32 байта, тип тривиально
+// копируется, массивы кватернионов можно копировать через memcpy
+// и отображать из файла через mmap.
+template <typename T>
+class alignas(4 * sizeof(T)) BasicQuaternion {
 private:
-    // ComplexNumber first;
-    ComplexNumber second; // Комплексное число для части c + di
-    NumberType type;
+    T a;
+    T b;
+    T c;
+    T d;
 public:
+    typedef T value_type;
+
+    // Вид числа известен при компиляции и не хранится в каждом объекте
+    static constexpr NumberType kind = QUATERNION;
+
     //конструктор по умолчанию
-    Quaternion() : ComplexNumber(0, 0), second(0, 0), type(QUATERNION) {}
+    constexpr BasicQuaternion() : a(0), b(0), c(0), d(0) {}
     // конструктор инициализации
-    Quaternion(long double a, long double b, long double c, long double d)
-        : ComplexNumber(a, b), second(c, d), type(QUATERNION) {}
+    constexpr BasicQuaternion(T a, T b, T c, T d)
+        : a(a), b(b), c(c), d(d) {}
+    // расширение комплексного числа a + bi до a + bi + 0j + 0k
+    explicit constexpr BasicQuaternion(const BasicComplexNumber<T>& z)
+        : a(z.getReal()), b(z.getImaginary()), c(0), d(0) {}
 
     // Конструктор копирования
-    Quaternion(const Quaternion& other)
-        : ComplexNumber(other.getA(), other.getB()), second(other.getC(), other.getD()), type(other.type) {}
+    constexpr BasicQuaternion(const BasicQuaternion& other) = default;
+    constexpr BasicQuaternion& operator=(const BasicQuaternion& other) = default;
 
     // Сеттеры для каждой части кватерниона
-    void setA(long double a) { setReal(a); }
-    void setB(long double b) { setImaginary(b); }
-    void setC(long double c) { second.setReal(c); }
-    void setD(long double d) { second.setImaginary(d); }
+    constexpr void setA(T a) { this->a = a; }
+    constexpr void setB(T b) { this->b = b; }
+    constexpr void setC(T c) { this->c = c; }
+    constexpr void setD(T d) { this->d = d; }
     // геттеры для кватерниона
-    long double getA() const { return getReal(); }
-    long double getB() const { return getImaginary(); }
-    long double getC() const { return second.getReal(); }
-    long double getD() const { return second.getImaginary(); }
-    NumberType getType() const { return type; }
+    constexpr T getA() const { return a; }
+    constexpr T getB() const { return b; }
+    constexpr T getC() const { return c; }
+    constexpr T getD() const { return d; }
+    constexpr NumberType getType() const { return kind; }
 
-    Quaternion operator+(const Quaternion& other) const {
-        return Quaternion(getA() + other.getA(),
-                          getB() + other.getB(),
-                          getC() + other.getC(),
-                          getD() + other.getD());
-    }
+    // Доступ к части a + bi, как раньше через базовый ComplexNumber
+    constexpr T getReal() const { return a; }
+    constexpr T getImaginary() const { return b; }
+    constexpr void setReal(T r) { a = r; }
+    constexpr void setImaginary(T i) { b = i; }
 
-    Quaternion operator-(const Quaternion& other) const {
-        return Quaternion(getA() - other.getA(),
-                          getB() - other.getB(),
-                          getC() - other.getC(),
-                          getD() - other.getD());
+    constexpr BasicQuaternion operator+(const BasicQuaternion& other) const {
+        return BasicQuaternion(a + other.a, b + other.b, c + other.c, d + other.d);
     }
 
-    Quaternion operator*(const Quaternion& other) const {
-        long double a = getA();
-        long double b = getB();
-        long double c = getC();
-        long double d = getD();
+    constexpr BasicQuaternion operator-(const BasicQuaternion& other) const {
+        return BasicQuaternion(a - other.a, b - other.b, c - other.c, d - other.d);
+    }
 
-        long double new_a = a * other.getA() - b * other.getB() - c * other.getC() - d * other.getD();
-        long double new_b = a * other.getB() + b * other.getA() + c * other.getD() - d * other.getC();
-        long double new_c = a * other.getC() - b * other.getD() + c * other.getA() + d * other.getB();
-        long double new_d = a * other.getD() + b * other.getC() - c * other.getB() + d * other.getA();
+    constexpr BasicQuaternion operator*(const BasicQuaternion& other) const {
+        T new_a = a * other.a - b * other.b - c * other.c - d * other.d;
+        T new_b = a * other.b + b * other.a + c * other.d - d * other.c;
+        T new_c = a * other.c - b * other.d + c * other.a + d * other.b;
+        T new_d = a * other.d + b * other.c - c * other.b + d * other.a;
 
-        return Quaternion(new_a, new_b, new_c, new_d);
+        return BasicQuaternion(new_a, new_b, new_c, new_d);
     }
 
-    Quaternion operator/(const Quaternion& other) const {
-        Quaternion conjugateOther(other.getA(), -other.getB(), -other.getC(), -other.getD());
-        long double denominator = other.norm();
+    constexpr BasicQuaternion operator/(const BasicQuaternion& other) const {
+        T denominator = other.norm();
+
+        return (*this * other.conjugate()) * (T(1) / denominator);
+    }
 
-        return (*this * conjugateOther) * (1.0 / denominator);
+    // Деление на единичный кватернион: обратный к нему - сопряжённый,
+    // норма не считается. Для неединичного other результат неверен
+    constexpr BasicQuaternion divideUnit(const BasicQuaternion& other) const {
+        return *this * other.conjugate();
     }
     // добавил умножение на скаляр
-    Quaternion operator*(long double scalar) const {
-        return Quaternion(getA() * scalar, getB() * scalar, getC() * scalar, getD() * scalar);
+    constexpr BasicQuaternion operator*(T scalar) const {
+        return BasicQuaternion(a * scalar, b * scalar, c * scalar, d * scalar);
     }
     // высчитывание нормы кватерниона
-    long double norm() const {
-        return (getA() * getA() + getB() * getB() + getC() * getC() + getD() * getD());
+    constexpr T norm() const {
+        return (a * a + b * b + c * c + d * d);
     }
-    //для вывода
-    virtual void print() const override {
-    // Выводим a + bi
-    std::cout << getA() << " + " << getB() << "i";
 
-    // Выводим c + dk
-    if (getC() >= 0) {
-        std::cout << " + " << getC() << "j";
-    } else {
-        std::cout << " - " << fabs(getC()) << "j";
+    // Сопряжённый a - bi - cj - dk
+    constexpr BasicQuaternion conjugate() const {
+        return BasicQuaternion(a, -b, -c, -d);
     }
 
-    if (getD() >= 0) {
-        std::cout << " + " << getD() << "k";
-    } else {
-        std::cout << " - " << fabs(getD()) << "k";
+    // Обратный: сопряжённый, делённый на норму
+    constexpr BasicQuaternion inverse() const {
+        return conjugate() * (T(1) / norm());
+    }
+
+    // Кватернион той же ориентации с единичной длиной
+    BasicQuaternion normalized() const {
+        return *this * (T(1) / std::sqrt(norm()));
+    }
+
+    // Поворот вектора единичным кватернионом за 15 умножений вместо
+    // двух произведений Гамильтона q * v * q^-1:
+    // t = 2u x v, v' = v + a t + u x t, где u = (b, c, d)
+    constexpr BasicVector3<T> rotate(const BasicVector3<T>& v) const {
+        T ub = b + b, uc = c + c, ud = d + d;
+        T tx = uc * v.z - ud * v.y;
+        T ty = ud * v.x - ub * v.z;
+        T tz = ub * v.y - uc * v.x;
+        return BasicVector3<T>(v.x + a * tx + (c * tz - d * ty),
+                               v.y + a * ty + (d * tx - b * tz),
+                               v.z + a * tz + (b * ty - c * tx));
     }
+    //для вывода
+    void print() const { printFormatted(*this); }
 
-    std::cout << "\n";
+    // Запись в [first, last) в виде "1 + 2i - 3j + 4k", как печатает print(),
+    // без перевода строки. Возвращает конец записи или 0, если не хватило места
+    char* format(char* first, char* last, int precision = ROUND_TRIP_PRECISION) const {
+        first = formatScalar(first, last, a, precision);
+        first = formatText(first, last, " + ", 3);
+        first = formatScalar(first, last, b, precision);
+        first = formatText(first, last, "i", 1);
+        first = formatTerm(first, last, c, precision, 'j');
+        return formatTerm(first, last, d, precision, 'k');
     }
 
     static void test() {
     // Создание объектов
-    Quaternion q1(1.0, 2.0, 3.0, 4.0);
-    Quaternion q2(5.0, 6.0, 7.0, 8.0);
+    BasicQuaternion q1(1.0, 2.0, 3.0, 4.0);
+    BasicQuaternion q2(5.0, 6.0, 7.0, 8.0);
 
     // Тест конструктора по умолчанию
-    Quaternion q_default;
+    BasicQuaternion q_default;
     assert(q_default.getA() == 0.0);
     assert(q_default.getB() == 0.0);
     assert(q_default.getC() == 0.0);
     assert(q_default.getD() == 0.0);
 
     // Тест конструктора копирования
-    Quaternion q_copy(q1);
+    BasicQuaternion q_copy(q1);
     assert(q_copy.getA() == q1.getA());
     assert(q_copy.getB() == q1.getB());
     assert(q_copy.getC() == q1.getC());
     assert(q_copy.getD() == q1.getD());
+    assert(std::is_trivially_copyable_v<BasicQuaternion>);
+    assert(std::is_nothrow_move_constructible_v<BasicQuaternion>);
 
-    Quaternion q;
+    BasicQuaternion q;
     //тест сеттеров
     // Устанавливаем значения
     q.setA(10.0);
@@ -245,36 +543,69 @@ public:
     assert(q1.getD() == 4.0);
 
     // Тест арифметических операций
-    Quaternion sum = q1 + q2;
+    BasicQuaternion sum = q1 + q2;
     assert(sum.getA() == 6.0);
     assert(sum.getB() == 8.0);
     assert(sum.getC() == 10.0);
     assert(sum.getD() == 12.0);
 
-    Quaternion diff = q1 - q2;
+    BasicQuaternion diff = q1 - q2;
     assert(diff.getA() == -4.0);
     assert(diff.getB() == -4.0);
     assert(diff.getC() == -4.0);
     assert(diff.getD() == -4.0);
 
-    Quaternion product = q1 * q2;
+    BasicQuaternion product = q1 * q2;
     assert(product.getA() == -60.0);
     assert(product.getB() == 12.0);
     assert(product.getC() == 30.0);
     assert(product.getD() == 24.0);
 
-    Quaternion quotient = q1 / q2;
+    BasicQuaternion quotient = q1 / q2;
     assert(fabs(quotient.getA() - 0.402299) < 1e-6);
     assert(fabs(quotient.getB() - 0.045977) < 1e-6);
     assert(fabs(quotient.getC()) < 1e-6);
     assert(fabs(quotient.getD() - 0.091954) < 1e-6);
 
     // Тест нормы
-    long double norm_q1 = q1.norm();
+    T norm_q1 = q1.norm();
     assert(fabs(norm_q1 - (1.0*1.0 + 2.0*2.0 + 3.0*3.0 + 4.0*4.0)) < 1e-6);
+
+    // Тест сопряжённого, обратного и нормирования
+    BasicQuaternion conjugate = q1.conjugate();
+    assert(conjugate.getA() == 1.0 && conjugate.getB() == -2.0 && conjugate.getC() == -3.0 && conjugate.getD() == -4.0);
+    BasicQuaternion identity = q1 * q1.inverse();
+    assert(fabs(identity.getA() - 1) < 1e-6 && fabs(identity.getB()) < 1e-6);
+    assert(fabs(identity.getC()) < 1e-6 && fabs(identity.getD()) < 1e-6);
+    BasicQuaternion unit = q2.normalized();
+    assert(fabs(unit.norm() - 1) < 1e-6);
+    assert(fabs(unit.getB() / unit.getA() - 6.0 / 5.0) < 1e-6);
+
+    // Для единичного кватерниона деление без нормы совпадает с обычным
+    BasicQuaternion unitQuotient = q1.divideUnit(unit);
+    BasicQuaternion generalQuotient = q1 / unit;
+    assert(fabs(unitQuotient.getA() - generalQuotient.getA()) < 1e-5);
+    assert(fabs(unitQuotient.getD() - generalQuotient.getD()) < 1e-5);
+
+    // Поворот на 90 градусов вокруг оси z переводит x в y
+    T half = std::sqrt(T(0.5));
+    BasicVector3<T> turned = BasicQuaternion(half, 0, 0, half).rotate(BasicVector3<T>(1, 0, 0));
+    assert(fabs(turned.x) < 1e-6 && fabs(turned.y - 1) < 1e-6 && turned.z == 0);
+
+    // Поворот совпадает с q * v * q^-1
+    BasicVector3<T> v(T(0.5), -2, 3);
+    BasicVector3<T> rotated = unit.rotate(v);
+    BasicQuaternion sandwich = unit * BasicQuaternion(0, v.x, v.y, v.z) * unit.conjugate();
+    assert(fabs(rotated.x - sandwich.getB()) < 1e-5 && fabs(rotated.y - sandwich.getC()) < 1e-5);
+    assert(fabs(rotated.z - sandwich.getD()) < 1e-5);
     
+    // Тест точности хранения: значение не округляется до double
+    BasicQuaternion precise(1 + std::numeric_limits<T>::epsilon(), 0, 0, 0);
+    assert(precise.getA() != 1);
+    assert((precise - BasicQuaternion(1, 0, 0, 0)).getA() == std::numeric_limits<T>::epsilon());
+
     // Тест умножения на скаляр
-    Quaternion scalar_mult = q1 * 2.0;
+    BasicQuaternion scalar_mult = q1 * 2.0;
     assert(scalar_mult.getA() == 2.0);
     assert(scalar_mult.getB() == 4.0);
     assert(scalar_mult.getC() == 6.0);
@@ -286,166 +617,8639 @@ public:
     std::cout << std::endl;
 
     // Убедимся, что программа дошла до конца без ошибок
-    std::cout << "All tests passed for Quaternion!" << std::endl;
+    std::cout << "All tests passed for Quaternion<" << scalarTypeName<T>() << ">!" << std::endl;
     }
 };
 
-class Calculator {
+typedef BasicQuaternion<double> Quaternion;
+
+static_assert(sizeof(Quaternion) == 32, "Quaternion must be exactly four doubles");
+static_assert(sizeof(BasicQuaternion<float>) == 16, "BasicQuaternion<float> must be exactly four floats");
+static_assert(alignof(Quaternion) == 32, "Quaternion must be aligned to 32 bytes");
+static_assert(std::is_trivially_copyable<Quaternion>::value, "Quaternion must be trivially copyable");
+static_assert(std::is_standard_layout<Quaternion>::value, "Quaternion must have standard layout");
+static_assert(sizeof(ComplexNumber) == 16, "ComplexNumber must be exactly two doubles");
+static_assert(std::is_trivially_copyable<ComplexNumber>::value, "ComplexNumber must be trivially copyable");
+static_assert(std::is_standard_layout<ComplexNumber>::value, "ComplexNumber must have standard layout");
+
+// Смешанные операции. Комплексное число a + bi - это кватернион
+// a + bi + 0j + 0k, но его нулевые части c и d в вычислениях не участвуют:
+// произведение стоит 8 умножений вместо 16. Для конечных значений
+// результат совпадает с расширением до Quaternion (с точностью до знака нуля).
+template <typename T>
+constexpr BasicQuaternion<T> operator+(const BasicComplexNumber<T>& x, const BasicQuaternion<T>& y) {
+    return BasicQuaternion<T>(x.getReal() + y.getA(), x.getImaginary() + y.getB(), y.getC(), y.getD());
+}
+
+template <typename T>
+constexpr BasicQuaternion<T> operator+(const BasicQuaternion<T>& x, const BasicComplexNumber<T>& y) {
+    return BasicQuaternion<T>(x.getA() + y.getReal(), x.getB() + y.getImaginary(), x.getC(), x.getD());
+}
+
+template <typename T>
+constexpr BasicQuaternion<T> operator-(const BasicComplexNumber<T>& x, const BasicQuaternion<T>& y) {
+    return BasicQuaternion<T>(x.getReal() - y.getA(), x.getImaginary() - y.getB(), -y.getC(), -y.getD());
+}
+
+template <typename T>
+constexpr BasicQuaternion<T> operator-(const BasicQuaternion<T>& x, const BasicComplexNumber<T>& y) {
+    return BasicQuaternion<T>(x.getA() - y.getReal(), x.getB() - y.getImaginary(), x.getC(), x.getD());
+}
+
+// (a + bi)(w + xi + yj + zk)
+template <typename T>
+constexpr BasicQuaternion<T> operator*(const BasicComplexNumber<T>& x, const BasicQuaternion<T>& y) {
+    T a = x.getReal(), b = x.getImaginary();
+    return BasicQuaternion<T>(a * y.getA() - b * y.getB(), a * y.getB() + b * y.getA(),
+                              a * y.getC() - b * y.getD(), a * y.getD() + b * y.getC());
+}
+
+// (w + xi + yj + zk)(a + bi)
+template <typename T>
+constexpr BasicQuaternion<T> operator*(const BasicQuaternion<T>& x, const BasicComplexNumber<T>& y) {
+    T a = y.getReal(), b = y.getImaginary();
+    return BasicQuaternion<T>(x.getA() * a - x.getB() * b, x.getA() * b + x.getB() * a,
+                              x.getC() * a + x.getD() * b, x.getD() * a - x.getC() * b);
+}
+
+// Деление, как у Quaternion: на сопряжённое и на обратную норму
+template <typename T>
+constexpr BasicQuaternion<T> operator/(const BasicComplexNumber<T>& x, const BasicQuaternion<T>& y) {
+    BasicQuaternion<T> conjugate(y.getA(), -y.getB(), -y.getC(), -y.getD());
+    return (x * conjugate) * (T(1) / y.norm());
+}
+
+template <typename T>
+constexpr BasicQuaternion<T> operator/(const BasicQuaternion<T>& x, const BasicComplexNumber<T>& y) {
+    T denominator = y.getReal() * y.getReal() + y.getImaginary() * y.getImaginary();
+    return (x * BasicComplexNumber<T>(y.getReal(), -y.getImaginary())) * (T(1) / denominator);
+}
+
+// Арифметика над константами сворачивается при компиляции
+static_assert((ComplexNumber(3, 4) * ComplexNumber(1, 2)).getReal() == -5, "constexpr complex product");
+static_assert((ComplexNumber(3, 4) / ComplexNumber(3, 4)).getReal() == 1, "constexpr complex quotient");
+static_assert((Quaternion(1, 2, 3, 4) * Quaternion(5, 6, 7, 8)).getA() == -60, "constexpr quaternion product");
+static_assert(Quaternion(1, 2, 3, 4).norm() == 30, "constexpr quaternion norm");
+static_assert((ComplexNumber(1, 2) * Quaternion(5, 6, 7, 8)).getD() == 22, "constexpr mixed product");
+
+// ------------------------------------------------------------------
+// Пакетная арифметика: хранение SoA (отдельные массивы компонент)
+// и векторные ядра AVX2/AVX-512 с выбором реализации во время выполнения
+// ------------------------------------------------------------------
+
+#if defined(__GNUC__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#define NO_INLINE __attribute__((noinline))
+#else
+#define FORCE_INLINE inline
+#define NO_INLINE
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#define TARGET_AVX2_FMA __attribute__((target("avx2,fma")))
+#define TARGET_FMA __attribute__((target("fma")))
+#else
+#define HAVE_X86_SIMD 0
+#endif
+
+// Ядра между BEGIN_EXACT_KERNELS и END_EXACT_KERNELS собираются без слияния
+// умножения и сложения в FMA: так результат на любом уровне SIMD совпадает
+// со скалярными операторами. GCC 12 при SLP-векторизации собирает чередующиеся
+// a * b + c и a * b - c в vfmaddsub, не глядя на fp-contract (так сливалось
+// скалярное ядро произведения кватернионов), поэтому SLP здесь тоже выключен:
+// векторные ядра написаны на векторных типах и в нём не нуждаются.
+// Сами операторы встраиваются в вызывающий код и округляются по его флагам;
+// у GCC по умолчанию -ffp-contract=fast, и если цель сборки умеет FMA
+// (-march=native, -mfma), a * b + c может слиться. Для побитовой
+// воспроизводимости программа собирается так:
+//   g++ -std=c++17 -O2 -ffp-contract=off -pthread laba3.cpp -o laba3
+// а с -march=native ещё и с -fno-tree-slp-vectorize.
+#if defined(__clang__)
+#define BEGIN_EXACT_KERNELS _Pragma("float_control(push)") _Pragma("clang fp contract(off)")
+#define END_EXACT_KERNELS _Pragma("float_control(pop)")
+#elif defined(__GNUC__)
+#define BEGIN_EXACT_KERNELS _Pragma("GCC push_options") \
+    _Pragma("GCC optimize(\"fp-contract=off\", \"no-tree-slp-vectorize\")")
+#define END_EXACT_KERNELS _Pragma("GCC pop_options")
+#else
+#define BEGIN_EXACT_KERNELS
+#define END_EXACT_KERNELS
+#endif
+
+// Цель сборки умеет FMA, и операторы вне ядер могли слиться при компиляции
+#if defined(__FP_FAST_FMA) || defined(__FP_FAST_FMAF)
+const bool OPERATORS_MAY_CONTRACT = true;
+#else
+const bool OPERATORS_MAY_CONTRACT = false;
+#endif
+
+// Сравнение результата ядра с тем же выражением на операторах: побитовое
+// (NaN равен NaN), а при OPERATORS_MAY_CONTRACT - с допуском 16 ulp от scale,
+// модуля слагаемых выражения. Одно слияние меняет результат не больше чем
+// на ulp произведения, поэтому при сокращении сравнивать с |expected| нельзя
+template <typename T>
+bool matchesOperator(T expected, T actual, T scale) {
+    if (expected == actual || (std::isnan(expected) && std::isnan(actual)))
+        return true;
+    return OPERATORS_MAY_CONTRACT && std::fabs(expected - actual) <= 16 * std::numeric_limits<T>::epsilon() * scale;
+}
+
+// Выравнивание столбцов по границе кэш-линии
+const size_t SIMD_ALIGNMENT = 64;
+
+// Аллокатор, выдающий память, выровненную по SIMD_ALIGNMENT
+template <typename T>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(SIMD_ALIGNMENT)));
+    }
+    void deallocate(T* p, size_t) {
+        ::operator delete(p, std::align_val_t(SIMD_ALIGNMENT));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T> >;
+
+// Счётчик вызовов глобального operator new: тесты и замеры по нему
+// проверяют, что установившееся вычисление не выделяет память.
+// Замена operator new берёт атомарный инкремент на каждое выделение во
+// всей программе, поэтому включается только для тестов и замеров:
+// -DCOUNT_ALLOCATIONS=1. Без неё счётчик всегда 0, а проверки пропускаются.
+// Замены не встраиваются, иначе GCC путает пары malloc/delete
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS 0
+#endif
+
+#if COUNT_ALLOCATIONS
+std::atomic<size_t> allocationCount(0);
+
+NO_INLINE void* operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+NO_INLINE void* operator new(size_t size, std::align_val_t alignment) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    void* p = 0;
+    if (posix_memalign(&p, std::max(sizeof(void*), (size_t)alignment), size ? size : 1) == 0)
+        return p;
+    throw std::bad_alloc();
+}
+
+NO_INLINE void operator delete(void* p) noexcept { std::free(p); }
+NO_INLINE void operator delete(void* p, size_t) noexcept { std::free(p); }
+NO_INLINE void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+NO_INLINE void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+#endif
+
+// Число выделений с начала работы; без COUNT_ALLOCATIONS - 0
+inline size_t allocationsSoFar() {
+#if COUNT_ALLOCATIONS
+    return allocationCount.load(std::memory_order_relaxed);
+#else
+    return 0;
+#endif
+}
+
+// Монотонная арена: память выдаётся сдвигом указателя внутри блоков,
+// отдельные объекты не освобождаются. rewind() и reset() возвращают
+// арену к отметке за O(1), блоки остаются, поэтому повторные
+// вычисления того же размера больше не обращаются к malloc.
+class MonotonicArena {
+public:
+    // Положение в арене, к которому можно вернуться
+    struct Marker {
+        size_t block;
+        size_t offset;
+    };
+
+    static const size_t FIRST_BLOCK = 64 * 1024;
+
 private:
-    NumberType type;
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    Marker top;
+
 public:
+    MonotonicArena() : top{ 0, 0 } {}
 
-    Calculator() : type(CALCULATOR) {
-        std::cout << "Calculator initialized with default constructor." << std::endl;
+    ~MonotonicArena() {
+        for (const Block& block : blocks)
+            ::operator delete(block.data, std::align_val_t(SIMD_ALIGNMENT));
     }
 
-    // Конструктор инициализации
-    Calculator(int value) : type(CALCULATOR) {
-        std::cout << "Calculator initialized with value: " << value << std::endl;
-    }
+    MonotonicArena(const MonotonicArena&) = delete;
+    MonotonicArena& operator=(const MonotonicArena&) = delete;
 
-    // Конструктор копирования
-    Calculator(const Calculator& other) : type(CALCULATOR) {
-        std::cout << "Calculator copied." << std::endl;
+    void* allocate(size_t bytes, size_t alignment) {
+        for (;; ++top.block, top.offset = 0) {
+            if (top.block == blocks.size()) {
+                size_t size = blocks.empty() ? FIRST_BLOCK : blocks.back().size * 2;
+                while (size < bytes + alignment)
+                    size *= 2;
+                Block block = { static_cast<char*>(::operator new(size, std::align_val_t(SIMD_ALIGNMENT))), size };
+                blocks.push_back(block);
+            }
+            const Block& block = blocks[top.block];
+            size_t start = (top.offset + alignment - 1) / alignment * alignment;
+            if (start + bytes <= block.size) {
+                top.offset = start + bytes;
+                return block.data + start;
+            }
+        }
     }
-    
-    // Метод для выполнения операции над комплексными числами
-    void performOperation(std::stack<ComplexNumber>& stack, char operation) {
-        ComplexNumber num2 = stack.top();
-        stack.pop();
-        ComplexNumber num1 = stack.top();
-        stack.pop();
 
-        ComplexNumber result(0, 0);
-        switch (operation) {
-            case '+':
-                result = num1 + num2;
-                break;
-            case '-':
-                result = num1 - num2;
-                break;
-            case '*':
-                result = num1 * num2;
-                break;
-            case '/':
-                result = num1 / num2;
-                break;
-            default:
-                std::cout << "Invalid operation" << std::endl;
-                break;
-        }
+    Marker mark() const { return top; }
+    void rewind(Marker marker) { top = marker; }
+    void reset() { top = Marker{ 0, 0 }; }
 
-        stack.push(result);
+    // Сколько памяти арена держит у системы
+    size_t capacity() const {
+        size_t total = 0;
+        for (const Block& block : blocks)
+            total += block.size;
+        return total;
     }
 
-    // Метод для выполнения операции над кватернионами
-    void performOperation(std::stack<Quaternion>& stack, char operation) {
-        Quaternion q2 = stack.top();
-        stack.pop();
-        Quaternion q1 = stack.top();
-        stack.pop();
+    // Тестирование
+    static void test();
+};
 
-        Quaternion result(0, 0, 0, 0);
-        switch (operation) {
-            case '+':
-                result = q1 + q2;
-                break;
-            case '-':
-                result = q1 - q2;
-                break;
-            case '*':
-                result = q1 * q2;
-                break;
-            case '/':
-                result = q1 / q2;
-                break;
-            default:
-                std::cout << "Invalid operation" << std::endl;
-                break;
-        }
+// Своя арена у каждого потока: пул не делит её между исполнителями
+inline MonotonicArena& threadArena() {
+    thread_local MonotonicArena arena;
+    return arena;
+}
 
-        stack.push(result);
-    }
+// Область вычисления: всё, что выделено в арене внутри неё,
+// освобождается разом при выходе
+class ArenaScope {
+private:
+    MonotonicArena& arena;
+    MonotonicArena::Marker marker;
 
+public:
+    explicit ArenaScope(MonotonicArena& arena = threadArena()) : arena(arena), marker(arena.mark()) {}
+    ~ArenaScope() { arena.rewind(marker); }
 
-void runTests() {
-    // Тесты для комплексных чисел
-    std::stack<ComplexNumber> complexStack;
-    complexStack.push(ComplexNumber(3, 4));  // 3 + 4i
-    complexStack.push(ComplexNumber(1, 2));  // 1 + 2i
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+};
 
-    // Сложение
-    performOperation(complexStack, '+');
-    ComplexNumber result = complexStack.top();
-    assert(result.getReal() == 4 && result.getImaginary() == 6);
-    std::cout << "Test 1 - Complex Addition passed.\n";
+// Аллокатор для стандартных контейнеров поверх арены;
+// deallocate ничего не делает, память вернёт rewind()
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
 
-    // Вычитание
-    complexStack.push(ComplexNumber(3, 4));
-    complexStack.push(ComplexNumber(1, 2));
-    performOperation(complexStack, '-');
-    result = complexStack.top();
-    assert(result.getReal() == 2 && result.getImaginary() == 2);
-    std::cout << "Test 2 - Complex Subtraction passed.\n";
+    MonotonicArena* arena;
 
-    // Умножение
-    complexStack.push(ComplexNumber(3, 4));
-    complexStack.push(ComplexNumber(1, 2));
-    performOperation(complexStack, '*');
-    result = complexStack.top();
-    assert(result.getReal() == -5 && result.getImaginary() == 10);
-    std::cout << "Test 3 - Complex Multiplication passed.\n";
+    ArenaAllocator(MonotonicArena& arena = threadArena()) : arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
 
-    // Деление
-    complexStack.push(ComplexNumber(3, 4));
-    complexStack.push(ComplexNumber(1, 2));
-    performOperation(complexStack, '/');
-    result = complexStack.top();
-    assert(std::abs(result.getReal() - 2.2) < 1e-6 && std::abs(result.getImaginary() + 0.4) < 1e-6);
-    std::cout << "Test 4 - Complex Division passed.\n";
+    T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
 
-    // Тесты для кватернионов
-    std::stack<Quaternion> quaternionStack;
-    quaternionStack.push(Quaternion(1, 2, 3, 4));  // 1 + 2i + 3j + 4k
-    quaternionStack.push(Quaternion(5, 6, 7, 8));  // 5 + 6i + 7j + 8k
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
 
-    // Сложение
-    performOperation(quaternionStack, '+');
-    Quaternion qResult = quaternionStack.top();
-    assert(qResult.getReal() == 6 && qResult.getB() == 8 && qResult.getC() == 10 && qResult.getD() == 12);
-    std::cout << "Test 5 - Quaternion Addition passed.\n";
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
 
-    // Вычитание
-    quaternionStack.push(Quaternion(1, 8, 3, 4));
-    quaternionStack.push(Quaternion(5, 6, 7, 8));
-    performOperation(quaternionStack, '-');
-    qResult = quaternionStack.top();
-    assert(qResult.getReal() == -4 && qResult.getB() == 2 && qResult.getC() == -4 && qResult.getD() == -4);
-    std::cout << "Test 6 - Quaternion Subtraction passed.\n";
+// Стек операндов калькулятора в арене: значения лежат подряд,
+// а не в разбросанных по куче кусках std::deque
+template <typename T>
+using ArenaStack = std::stack<T, ArenaVector<T> >;
 
-    // Умножение
-    quaternionStack.push(Quaternion(1, 2, 3, 4));
-    quaternionStack.push(Quaternion(5, 6, 7, 8));
-    performOperation(quaternionStack, '*');
-    qResult = quaternionStack.top();
-    assert(qResult.getReal() == -60 && qResult.getB() == 12 && qResult.getC() == 30 && qResult.getD() == 24);
-    std::cout << "Test 7 - Quaternion Multiplication passed.\n";
+void MonotonicArena::test() {
+    MonotonicArena arena;
+    assert(arena.capacity() == 0);
 
-    // Деление
-    quaternionStack.push(Quaternion(1, 2, 3, 4));
-    quaternionStack.push(Quaternion(5, 6, 7, 8));
-    performOperation(quaternionStack, '/');
-    qResult = quaternionStack.top();
-    assert(std::abs(qResult.getReal() - 0.402299) < 1e-6 &&
+    // Выравнивание и непересекающиеся куски
+    char* a = static_cast<char*>(arena.allocate(3, 1));
+    double* b = static_cast<double*>(arena.allocate(sizeof(double), alignof(double)));
+    void* c = arena.allocate(100, 64);
+    assert(reinterpret_cast<uintptr_t>(b) % alignof(double) == 0);
+    assert(reinterpret_cast<uintptr_t>(c) % 64 == 0);
+    assert((char*)b >= a + 3 && (char*)c >= (char*)(b + 1));
+
+    // Отметка и возврат: та же память выдаётся снова
+    Marker marker = arena.mark();
+    void* first = arena.allocate(1000, 8);
+    arena.rewind(marker);
+    assert(arena.allocate(1000, 8) == first);
+
+    // Большие запросы - новые блоки; после reset блоки переиспользуются
+    arena.allocate(3 * FIRST_BLOCK, 8);
+    size_t capacity = arena.capacity();
+    assert(capacity > 3 * FIRST_BLOCK);
+    size_t before = allocationsSoFar();
+    for (int round = 0; round < 10; ++round) {
+        arena.reset();
+        assert(arena.allocate(3, 1) == a);
+        arena.allocate(3 * FIRST_BLOCK, 8);
+    }
+    assert(allocationsSoFar() == before && arena.capacity() == capacity);
+
+    // Контейнеры в арене и вложенные области
+    {
+        ArenaScope outer(arena);
+        ArenaVector<int> values{ ArenaAllocator<int>(arena) };
+        for (int i = 0; i < 1000; ++i)
+            values.push_back(i);
+        MonotonicArena::Marker inside = arena.mark();
+        {
+            ArenaScope inner(arena);
+            ArenaVector<double> scratch(100, 1.0, ArenaAllocator<double>(arena));
+            assert(scratch[99] == 1.0);
+        }
+        assert(arena.mark().block == inside.block && arena.mark().offset == inside.offset);
+        assert(values[999] == 999);
+    }
+
+    std::cout << "All tests passed for MonotonicArena!" << std::endl;
+}
+
+// Уровень векторных инструкций
+enum SimdLevel { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+
+inline const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SIMD_AVX2: return "avx2";
+        case SIMD_AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+// Определяем лучший уровень, который поддерживают процессор и ОС
+inline SimdLevel detectSimdLevel() {
+#if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+#endif
+    return SIMD_SCALAR;
+}
+
+inline SimdLevel& simdLevelStorage() {
+    static SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+// Текущий уровень, которым пользуются пакетные операции
+inline SimdLevel simdLevel() { return simdLevelStorage(); }
+
+// Принудительный выбор уровня (не выше доступного), например для тестов
+inline void setSimdLevel(SimdLevel level) {
+    SimdLevel best = detectSimdLevel();
+    simdLevelStorage() = level > best ? best : level;
+}
+
+// Есть ли аппаратное FMA. В AVX-512 оно входит всегда, в AVX2 - нет
+inline bool hasHardwareFma() {
+#if HAVE_X86_SIMD
+    static const bool supported = (__builtin_cpu_init(), __builtin_cpu_supports("fma") != 0);
+    return supported;
+#else
+    return false;
+#endif
+}
+
+// Вектор из Lanes элементов типа T (векторное расширение GCC/Clang).
+// Конкретные инструкции определяются атрибутом target вызывающей функции.
+template <typename T, int Lanes>
+struct SimdVec {
+    typedef T type __attribute__((vector_size(Lanes * sizeof(T))));
+};
+
+// Сколько элементов T помещается в регистр шириной Bytes.
+// Векторов из long double нет, для него остаётся скалярный проход.
+template <typename T, int Bytes>
+struct SimdLanes {
+    static const int value = std::is_same<T, float>::value || std::is_same<T, double>::value
+                                 ? Bytes / (int)sizeof(T) : 1;
+};
+
+// Тип элемента вектора V; для скаляра - сам V
+template <typename V, bool Scalar = std::is_arithmetic<V>::value>
+struct SimdElement {
+    typedef V type;
+};
+
+template <typename V>
+struct SimdElement<V, false> {
+    typedef typename std::decay<decltype(std::declval<V>()[0])>::type type;
+};
+
+template <typename V, typename T>
+FORCE_INLINE void simdLoad(V& v, const T* p) {
+    std::memcpy(&v, p, sizeof(V));
+}
+
+template <typename V, typename T>
+FORCE_INLINE void simdStore(T* p, const V& v) {
+    std::memcpy(p, &v, sizeof(V));
+}
+
+// Все элементы вектора равны value; для скаляра - просто присваивание
+template <typename V, typename T>
+FORCE_INLINE void simdBroadcast(V& v, T value) {
+    if constexpr (std::is_arithmetic<V>::value) {
+        v = value;
+    } else {
+        T lanes[sizeof(V) / sizeof(T)];
+        for (size_t l = 0; l < sizeof(V) / sizeof(T); ++l)
+            lanes[l] = value;
+        simdLoad(v, lanes);
+    }
+}
+
+// out = a * b + c с одним округлением. Для вектора - по элементам:
+// в функциях с TARGET_AVX2_FMA и TARGET_AVX512 это одна инструкция
+template <typename V>
+FORCE_INLINE void simdFma(const V& a, const V& b, const V& c, V& out) {
+    if constexpr (std::is_arithmetic<V>::value) {
+        out = std::fma(a, b, c);
+    } else {
+        for (size_t l = 0; l < sizeof(V) / sizeof(a[0]); ++l)
+            out[l] = std::fma(a[l], b[l], c[l]);
+    }
+}
+
+BEGIN_EXACT_KERNELS
+
+// Поэлементные операции: одна и та же формула для скаляра и для вектора.
+// Порядок действий повторяет операторы ComplexNumber.
+struct ComplexAddOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V& a, const V& b, const V& c, const V& d, V& re, V& im) {
+        re = a + c;
+        im = b + d;
+    }
+};
+
+struct ComplexSubOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V& a, const V& b, const V& c, const V& d, V& re, V& im) {
+        re = a - c;
+        im = b - d;
+    }
+};
+
+// ac - bd + (ad + bc)i
+struct ComplexMulOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V& a, const V& b, const V& c, const V& d, V& re, V& im) {
+        re = a * c - b * d;
+        im = a * d + b * c;
+    }
+};
+
+// (a + bi)(c - di) / (c^2 + d^2)
+struct ComplexDivOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V& a, const V& b, const V& c, const V& d, V& re, V& im) {
+        V denominator = c * c + d * d;
+        re = (a * c + b * d) / denominator;
+        im = (b * c - a * d) / denominator;
+    }
+};
+
+// Деление с одним делением 1 / (c^2 + d^2), как
+// ComplexNumber::divide(..., DIVISION_RECIPROCAL)
+struct ComplexReciprocalDivOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V& a, const V& b, const V& c, const V& d, V& re, V& im) {
+        typedef typename SimdElement<V>::type T;
+        V inverse = T(1) / (c * c + d * d);
+        re = (a * c + b * d) * inverse;
+        im = (b * c - a * d) * inverse;
+    }
+};
+
+// Метод Смита с масштабированием, как ComplexNumber::divide(..., DIVISION_SMITH),
+// но без ветвлений: считаются все ветви, нужная выбирается поэлементно.
+// Результат совпадает со скалярным побитово.
+struct ComplexSmithDivOp {
+    template <typename V>
+    static FORCE_INLINE void part(const V& a, const V& b, const V& c, const V& d, const V& r, const V& t, V& out) {
+        V br = b * r;
+        V common = (a + br) * t;
+        V lost = a * t + (b * t) * r;
+        V flat = (a + d * (b / c)) * t;
+        out = r != 0 ? (br != 0 ? common : lost) : flat;
+    }
+
+    template <typename V>
+    static FORCE_INLINE void apply(const V& a0, const V& b0, const V& c0, const V& d0, V& re, V& im) {
+        typedef typename SimdElement<V>::type T;
+        const T halfEpsilon = std::numeric_limits<T>::epsilon() / 2;
+        const T huge = std::numeric_limits<T>::max() / 8;
+        const T tiny = std::numeric_limits<T>::min() * 2 / halfEpsilon;
+        const T up = 2 / (halfEpsilon * halfEpsilon);
+        const T down = 1 / up;
+        V one = V() + T(1);
+        V absA = a0 < 0 ? -a0 : a0;
+        V absB = b0 < 0 ? -b0 : b0;
+        V absC = c0 < 0 ? -c0 : c0;
+        V absD = d0 < 0 ? -d0 : d0;
+        V ab = absA > absB ? absA : absB;
+        V cd = absC > absD ? absC : absD;
+        V a = ab >= huge ? a0 * T(0.125) : a0;
+        V b = ab >= huge ? b0 * T(0.125) : b0;
+        V c = cd >= huge ? c0 * T(0.125) : c0;
+        V d = cd >= huge ? d0 * T(0.125) : d0;
+        V scale = ab >= huge ? one * 8 : one;
+        scale = cd >= huge ? scale * T(0.125) : scale;
+        a = ab <= tiny ? a * up : a;
+        b = ab <= tiny ? b * up : b;
+        scale = ab <= tiny ? scale * down : scale;
+        c = cd <= tiny ? c * up : c;
+        d = cd <= tiny ? d * up : d;
+        scale = cd <= tiny ? scale * up : scale;
+
+        // При |d| > |c| меняем местами части: (b + ai) / (d + ci)
+        auto swapped = (d < 0 ? -d : d) > (c < 0 ? -c : c);
+        V x = swapped ? b : a;
+        V y = swapped ? a : b;
+        V p = swapped ? d : c;
+        V q = swapped ? c : d;
+        V r = q / p;
+        V t = 1 / (p + q * r);
+        V e, f;
+        part(x, y, p, q, r, t, e);
+        part(y, -x, p, q, r, t, f);
+        re = e * scale;
+        im = (swapped ? -f : f) * scale;
+    }
+};
+
+// Проход по массивам: векторная часть по Lanes элементов и скалярный хвост
+template <typename Op, typename T, int Lanes>
+FORCE_INLINE void complexBinaryImpl(const T* ar, const T* ai, const T* br, const T* bi,
+                                    T* outR, T* outI, size_t n) {
+    size_t i = 0;
+    if constexpr (Lanes > 1) {
+        typedef typename SimdVec<T, Lanes>::type V;
+        for (; i + Lanes <= n; i += Lanes) {
+            V a, b, c, d, re, im;
+            simdLoad(a, ar + i);
+            simdLoad(b, ai + i);
+            simdLoad(c, br + i);
+            simdLoad(d, bi + i);
+            Op::apply(a, b, c, d, re, im);
+            simdStore(outR + i, re);
+            simdStore(outI + i, im);
+        }
+    }
+    for (; i < n; ++i) {
+        T re, im;
+        Op::apply(ar[i], ai[i], br[i], bi[i], re, im);
+        outR[i] = re;
+        outI[i] = im;
+    }
+}
+
+template <typename Op, typename T>
+void complexKernelScalar(const T* ar, const T* ai, const T* br, const T* bi, T* outR, T* outI, size_t n) {
+    complexBinaryImpl<Op, T, 1>(ar, ai, br, bi, outR, outI, n);
+}
+
+#if HAVE_X86_SIMD
+template <typename Op, typename T>
+TARGET_AVX2 void complexKernelAvx2(const T* ar, const T* ai, const T* br, const T* bi, T* outR, T* outI, size_t n) {
+    complexBinaryImpl<Op, T, SimdLanes<T, 32>::value>(ar, ai, br, bi, outR, outI, n);
+}
+
+template <typename Op, typename T>
+TARGET_AVX512 void complexKernelAvx512(const T* ar, const T* ai, const T* br, const T* bi, T* outR, T* outI, size_t n) {
+    complexBinaryImpl<Op, T, SimdLanes<T, 64>::value>(ar, ai, br, bi, outR, outI, n);
+}
+#endif
+
+END_EXACT_KERNELS
+
+// Таблица ядер для одного уровня SIMD
+template <typename T>
+struct ComplexKernels {
+    typedef void (*Kernel)(const T* ar, const T* ai, const T* br, const T* bi, T* outR, T* outI, size_t n);
+
+    Kernel add;
+    Kernel sub;
+    Kernel mul;
+    Kernel div;
+    Kernel divSmith;
+    Kernel divReciprocal;
+
+    Kernel divide(DivisionMode mode) const {
+        return mode == DIVISION_SMITH ? divSmith : mode == DIVISION_RECIPROCAL ? divReciprocal : div;
+    }
+};
+
+template <typename T>
+const ComplexKernels<T>& complexKernels(SimdLevel level) {
+    static const ComplexKernels<T> scalar = {
+        complexKernelScalar<ComplexAddOp, T>, complexKernelScalar<ComplexSubOp, T>,
+        complexKernelScalar<ComplexMulOp, T>, complexKernelScalar<ComplexDivOp, T>,
+        complexKernelScalar<ComplexSmithDivOp, T>, complexKernelScalar<ComplexReciprocalDivOp, T>
+    };
+#if HAVE_X86_SIMD
+    static const ComplexKernels<T> avx2 = {
+        complexKernelAvx2<ComplexAddOp, T>, complexKernelAvx2<ComplexSubOp, T>,
+        complexKernelAvx2<ComplexMulOp, T>, complexKernelAvx2<ComplexDivOp, T>,
+        complexKernelAvx2<ComplexSmithDivOp, T>, complexKernelAvx2<ComplexReciprocalDivOp, T>
+    };
+    static const ComplexKernels<T> avx512 = {
+        complexKernelAvx512<ComplexAddOp, T>, complexKernelAvx512<ComplexSubOp, T>,
+        complexKernelAvx512<ComplexMulOp, T>, complexKernelAvx512<ComplexDivOp, T>,
+        complexKernelAvx512<ComplexSmithDivOp, T>, complexKernelAvx512<ComplexReciprocalDivOp, T>
+    };
+    if (level == SIMD_AVX512)
+        return avx512;
+    if (level == SIMD_AVX2)
+        return avx2;
+#endif
+    return scalar;
+}
+
+// Слитое умножение-сложение a * b + c: каждая компонента - цепочка fma,
+// начиная с c, с одним округлением на шаг и без временных чисел.
+// Эти ядра нарочно вне BEGIN_EXACT_KERNELS: с операторами они не
+// совпадают, но fma округляется однозначно, поэтому результат один
+// и тот же на любом уровне SIMD.
+struct ComplexFmaOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V& a, const V& b, const V& c, const V& d, const V& e, const V& f,
+                                   V& re, V& im) {
+        V negB = -b, t;
+        simdFma(negB, d, e, t);
+        simdFma(a, c, t, re);
+        simdFma(b, c, f, t);
+        simdFma(a, d, t, im);
+    }
+};
+
+template <typename T, int Lanes>
+FORCE_INLINE void complexFmaImpl(const T* ar, const T* ai, const T* br, const T* bi, const T* cr, const T* ci,
+                                 T* outR, T* outI, size_t n) {
+    size_t i = 0;
+    if constexpr (Lanes > 1) {
+        typedef typename SimdVec<T, Lanes>::type V;
+        for (; i + Lanes <= n; i += Lanes) {
+            V a, b, c, d, e, f, re, im;
+            simdLoad(a, ar + i);
+            simdLoad(b, ai + i);
+            simdLoad(c, br + i);
+            simdLoad(d, bi + i);
+            simdLoad(e, cr + i);
+            simdLoad(f, ci + i);
+            ComplexFmaOp::apply(a, b, c, d, e, f, re, im);
+            simdStore(outR + i, re);
+            simdStore(outI + i, im);
+        }
+    }
+    for (; i < n; ++i) {
+        T re, im;
+        ComplexFmaOp::apply(ar[i], ai[i], br[i], bi[i], cr[i], ci[i], re, im);
+        outR[i] = re;
+        outI[i] = im;
+    }
+}
+
+template <typename T>
+void complexFmaScalar(const T* ar, const T* ai, const T* br, const T* bi, const T* cr, const T* ci,
+                      T* outR, T* outI, size_t n) {
+    complexFmaImpl<T, 1>(ar, ai, br, bi, cr, ci, outR, outI, n);
+}
+
+#if HAVE_X86_SIMD
+template <typename T>
+TARGET_AVX2_FMA void complexFmaAvx2(const T* ar, const T* ai, const T* br, const T* bi, const T* cr, const T* ci,
+                                    T* outR, T* outI, size_t n) {
+    complexFmaImpl<T, SimdLanes<T, 32>::value>(ar, ai, br, bi, cr, ci, outR, outI, n);
+}
+
+template <typename T>
+TARGET_AVX512 void complexFmaAvx512(const T* ar, const T* ai, const T* br, const T* bi, const T* cr, const T* ci,
+                                    T* outR, T* outI, size_t n) {
+    complexFmaImpl<T, SimdLanes<T, 64>::value>(ar, ai, br, bi, cr, ci, outR, outI, n);
+}
+#endif
+
+template <typename T>
+using ComplexFmaKernel = void (*)(const T* ar, const T* ai, const T* br, const T* bi, const T* cr, const T* ci,
+                                  T* outR, T* outI, size_t n);
+
+// Ядро fma для уровня SIMD; на AVX2 без аппаратного FMA - скалярное
+template <typename T>
+ComplexFmaKernel<T> complexFmaKernel(SimdLevel level) {
+#if HAVE_X86_SIMD
+    if (level == SIMD_AVX512)
+        return complexFmaAvx512<T>;
+    if (level == SIMD_AVX2 && hasHardwareFma())
+        return complexFmaAvx2<T>;
+#endif
+    return complexFmaScalar<T>;
+}
+
+// a * b + c
+template <typename T>
+FORCE_INLINE BasicComplexNumber<T> fma(const BasicComplexNumber<T>& a, const BasicComplexNumber<T>& b,
+                          const BasicComplexNumber<T>& c) {
+    T re, im;
+    ComplexFmaOp::apply(a.getReal(), a.getImaginary(), b.getReal(), b.getImaginary(), c.getReal(),
+                        c.getImaginary(), re, im);
+    return BasicComplexNumber<T>(re, im);
+}
+
+// Ленивое выражение, см. раздел expression templates ниже
+template <typename Derived>
+struct Expression;
+
+// Набор комплексных чисел: действительные и мнимые части лежат
+// в двух отдельных выровненных массивах.
+// Результаты +, -, *, / побитово совпадают с операторами BasicComplexNumber<T>,
+// если операторы собраны без слияния в FMA (см. BEGIN_EXACT_KERNELS).
+template <typename T>
+class BasicComplexBatch {
+public:
+    typedef BasicComplexNumber<T> Number;
+
+private:
+    AlignedVector<T> real;
+    AlignedVector<T> imaginary;
+
+    // Общая часть поэлементных операций
+    static void apply(typename ComplexKernels<T>::Kernel kernel, const BasicComplexBatch& a, const BasicComplexBatch& b, BasicComplexBatch& out) {
+        assert(a.size() == b.size());
+        out.resize(a.size());
+        kernel(a.realData(), a.imagData(), b.realData(), b.imagData(),
+               out.realData(), out.imagData(), a.size());
+    }
+
+public:
+    // Конструктор по умолчанию
+    BasicComplexBatch() {}
+
+    // Конструктор инициализации: n нулевых чисел
+    explicit BasicComplexBatch(size_t n) : real(n), imaginary(n) {}
+
+    size_t size() const { return real.size(); }
+
+    void resize(size_t n) {
+        real.resize(n);
+        imaginary.resize(n);
+    }
+
+    void reserve(size_t n) {
+        real.reserve(n);
+        imaginary.reserve(n);
+    }
+
+    void append(const Number& c) {
+        real.push_back(c.getReal());
+        imaginary.push_back(c.getImaginary());
+    }
+
+    // Методы доступа
+    Number get(size_t i) const { return Number(real[i], imaginary[i]); }
+
+    void set(size_t i, const Number& c) {
+        real[i] = c.getReal();
+        imaginary[i] = c.getImaginary();
+    }
+
+    T* realData() { return real.data(); }
+    const T* realData() const { return real.data(); }
+    T* imagData() { return imaginary.data(); }
+    const T* imagData() const { return imaginary.data(); }
+
+    // Указатель на k-ю компоненту (0 - действительная часть, 1 - мнимая)
+    T* data(int k) { return k == 0 ? real.data() : imaginary.data(); }
+    const T* data(int k) const { return k == 0 ? real.data() : imaginary.data(); }
+
+    // Вычисление ленивого выражения за один проход
+    template <typename E>
+    BasicComplexBatch& operator=(const Expression<E>& expression) {
+        evaluate(expression, *this);
+        return *this;
+    }
+
+    // Поэлементные операции, результат записывается в out
+    static void add(const BasicComplexBatch& a, const BasicComplexBatch& b, BasicComplexBatch& out) {
+        apply(complexKernels<T>(simdLevel()).add, a, b, out);
+    }
+
+    static void sub(const BasicComplexBatch& a, const BasicComplexBatch& b, BasicComplexBatch& out) {
+        apply(complexKernels<T>(simdLevel()).sub, a, b, out);
+    }
+
+    static void mul(const BasicComplexBatch& a, const BasicComplexBatch& b, BasicComplexBatch& out) {
+        apply(complexKernels<T>(simdLevel()).mul, a, b, out);
+    }
+
+    static void div(const BasicComplexBatch& a, const BasicComplexBatch& b, BasicComplexBatch& out) {
+        apply(complexKernels<T>(simdLevel()).div, a, b, out);
+    }
+
+    // out = a * b + c через fma, побитово как ::fma для каждого элемента
+    static void fma(const BasicComplexBatch& a, const BasicComplexBatch& b, const BasicComplexBatch& c,
+                    BasicComplexBatch& out) {
+        assert(a.size() == b.size() && a.size() == c.size());
+        out.resize(a.size());
+        complexFmaKernel<T>(simdLevel())(a.realData(), a.imagData(), b.realData(), b.imagData(), c.realData(),
+                                         c.imagData(), out.realData(), out.imagData(), a.size());
+    }
+
+    // Деление выбранным способом, побитово как ComplexNumber::divide
+    static void div(const BasicComplexBatch& a, const BasicComplexBatch& b, BasicComplexBatch& out, DivisionMode mode) {
+        apply(complexKernels<T>(simdLevel()).divide(mode), a, b, out);
+    }
+
+    BasicComplexBatch operator+(const BasicComplexBatch& other) const {
+        BasicComplexBatch result;
+        add(*this, other, result);
+        return result;
+    }
+
+    BasicComplexBatch operator-(const BasicComplexBatch& other) const {
+        BasicComplexBatch result;
+        sub(*this, other, result);
+        return result;
+    }
+
+    BasicComplexBatch operator*(const BasicComplexBatch& other) const {
+        BasicComplexBatch result;
+        mul(*this, other, result);
+        return result;
+    }
+
+    BasicComplexBatch operator/(const BasicComplexBatch& other) const {
+        BasicComplexBatch result;
+        div(*this, other, result);
+        return result;
+    }
+
+    // Тестирование
+    static void test() {
+        // Значения из ComplexNumber::test() + случайные числа.
+        // Размер не кратен ширине вектора, чтобы проверить и хвост.
+        const size_t n = 1029;
+        BasicComplexBatch a, b;
+        a.append(Number(3, 4));
+        b.append(Number(1, 2));
+        std::mt19937_64 rng(42);
+        std::uniform_real_distribution<double> dist(-100.0, 100.0);
+        for (size_t i = 1; i < n; ++i) {
+            a.append(Number(T(dist(rng)), T(dist(rng))));
+            b.append(Number(T(dist(rng)), T(dist(rng))));
+        }
+        assert(a.size() == n && b.size() == n);
+
+        SimdLevel saved = simdLevel();
+        const SimdLevel levels[] = { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+        for (SimdLevel level : levels) {
+            if (level > detectSimdLevel())
+                continue;
+            setSimdLevel(level);
+
+            BasicComplexBatch sum = a + b;
+            BasicComplexBatch difference = a - b;
+            BasicComplexBatch product = a * b;
+            BasicComplexBatch quotient = a / b;
+
+            // Те же значения, что проверяются в ComplexNumber::test()
+            assert(sum.get(0).getReal() == 4 && sum.get(0).getImaginary() == 6);
+            assert(difference.get(0).getReal() == 2 && difference.get(0).getImaginary() == 2);
+            assert(product.get(0).getReal() == -5 && product.get(0).getImaginary() == 10);
+            assert(fabs(quotient.get(0).getReal() - 2.2) < 1e-6);
+            assert(fabs(quotient.get(0).getImaginary() + 0.4) < 1e-6);
+
+            // Совпадение со скалярными операторами (см. matchesOperator):
+            // сложение не сливается, для * и / допуск от |x| |y| и |x| / |y|
+            for (size_t i = 0; i < n; ++i) {
+                Number x = a.get(i), y = b.get(i);
+                Number expected[] = { x + y, x - y, x * y, x / y };
+                Number actual[] = { sum.get(i), difference.get(i), product.get(i), quotient.get(i) };
+                T xSize = std::hypot(x.getReal(), x.getImaginary()), ySize = std::hypot(y.getReal(), y.getImaginary());
+                T scales[] = { 0, 0, xSize * ySize, xSize / ySize };
+                for (int k = 0; k < 4; ++k) {
+                    assert(matchesOperator(expected[k].getReal(), actual[k].getReal(), scales[k]));
+                    assert(matchesOperator(expected[k].getImaginary(), actual[k].getImaginary(), scales[k]));
+                }
+            }
+
+            // Способы деления, в том числе на крайних значениях
+            BasicComplexBatch x = a, y = b;
+            const T extremes[] = { std::numeric_limits<T>::max() / 4, std::numeric_limits<T>::min() * 4,
+                                   std::numeric_limits<T>::denorm_min() * 8, T(0), T(1) };
+            for (size_t i = 0; i < 64; ++i) {
+                x.set(i, Number(extremes[i % 5], -extremes[i / 5 % 5]));
+                y.set(i, Number(extremes[i / 25 % 5] * T(3), extremes[i % 5]));
+            }
+            const DivisionMode modes[] = { DIVISION_NAIVE, DIVISION_SMITH, DIVISION_RECIPROCAL };
+            for (DivisionMode mode : modes) {
+                BasicComplexBatch divided;
+                div(x, y, divided, mode);
+                for (size_t i = 0; i < n; ++i) {
+                    Number expected = x.get(i).divide(y.get(i), mode);
+                    Number actual = divided.get(i);
+                    T scale = std::hypot(x.get(i).getReal(), x.get(i).getImaginary()) /
+                              std::hypot(y.get(i).getReal(), y.get(i).getImaginary());
+                    assert(matchesOperator(expected.getReal(), actual.getReal(), scale));
+                    assert(matchesOperator(expected.getImaginary(), actual.getImaginary(), scale));
+                }
+            }
+
+            // Слитое умножение-сложение: побитово как ::fma для чисел
+            BasicComplexBatch fused;
+            fma(a, b, b, fused);
+            assert(fused.get(0).getReal() == -4 && fused.get(0).getImaginary() == 12);
+            for (size_t i = 0; i < n; ++i) {
+                Number expected = ::fma(a.get(i), b.get(i), b.get(i));
+                assert(expected.getReal() == fused.get(i).getReal());
+                assert(expected.getImaginary() == fused.get(i).getImaginary());
+            }
+        }
+        setSimdLevel(saved);
+
+        // (1 + e)^2 - 1: операторы теряют e^2, fma - нет
+        const T e = std::ldexp(T(1), -std::numeric_limits<T>::digits / 2 - 1);
+        Number fused = ::fma(Number(1 + e, 0), Number(1 + e, 0), Number(-1, 0));
+        assert(fused.getReal() == 2 * e + e * e && fused.getImaginary() == 0);
+        assert((Number(1 + e, 0) * Number(1 + e, 0) + Number(-1, 0)).getReal() == 2 * e || OPERATORS_MAY_CONTRACT);
+
+        std::cout << "All tests passed for ComplexBatch<" << scalarTypeName<T>() << "> ("
+                  << simdLevelName(simdLevel()) << ")!" << std::endl;
+    }
+};
+
+typedef BasicComplexBatch<double> ComplexBatch;
+
+// Ядра для кватернионов: компоненты a, b, c, d лежат в четырёх
+// отдельных массивах, x[k], y[k], out[k] - указатели на k-ю компоненту
+
+BEGIN_EXACT_KERNELS
+
+struct QuaternionAddOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        for (int k = 0; k < 4; ++k)
+            r[k] = x[k] + y[k];
+    }
+};
+
+struct QuaternionSubOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        for (int k = 0; k < 4; ++k)
+            r[k] = x[k] - y[k];
+    }
+};
+
+// Произведение Гамильтона, порядок слагаемых как в Quaternion::operator*
+struct QuaternionMulOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        r[0] = x[0] * y[0] - x[1] * y[1] - x[2] * y[2] - x[3] * y[3];
+        r[1] = x[0] * y[1] + x[1] * y[0] + x[2] * y[3] - x[3] * y[2];
+        r[2] = x[0] * y[2] - x[1] * y[3] + x[2] * y[0] + x[3] * y[1];
+        r[3] = x[0] * y[3] + x[1] * y[2] - x[2] * y[1] + x[3] * y[0];
+    }
+};
+
+// Слитое деление x * conj(y) * (1 / |y|^2): сопряжённое не строится,
+// смена знаков подставлена прямо в произведение Гамильтона.
+// Порядок слагаемых тот же, что у Quaternion::operator/, поэтому
+// результат совпадает с ним побитово.
+struct QuaternionDivOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        V inverse = 1 / (y[0] * y[0] + y[1] * y[1] + y[2] * y[2] + y[3] * y[3]);
+        r[0] = (x[0] * y[0] + x[1] * y[1] + x[2] * y[2] + x[3] * y[3]) * inverse;
+        r[1] = (x[1] * y[0] - x[0] * y[1] - x[2] * y[3] + x[3] * y[2]) * inverse;
+        r[2] = (x[1] * y[3] - x[0] * y[2] + x[2] * y[0] - x[3] * y[1]) * inverse;
+        r[3] = (-(x[0] * y[3]) - x[1] * y[2] + x[2] * y[1] + x[3] * y[0]) * inverse;
+    }
+};
+
+struct QuaternionConjugateOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, V* r) {
+        r[0] = x[0];
+        r[1] = -x[1];
+        r[2] = -x[2];
+        r[3] = -x[3];
+    }
+};
+
+// Норма в смысле Quaternion::norm(): сумма квадратов компонент
+struct QuaternionNormOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, V& r) {
+        r = x[0] * x[0] + x[1] * x[1] + x[2] * x[2] + x[3] * x[3];
+    }
+};
+
+// Корень по элементам: скаляр или вектор. Корень округляется точно,
+// поэтому результат совпадает со скалярным std::sqrt. Для регистров
+// AVX2 и AVX-512 ниже перегрузки с одной инструкцией vsqrtpd/vsqrtps;
+// общий вариант остаётся для скаляра. Перегрузки не FORCE_INLINE:
+// операции без target-атрибута, встраиваются уже в целевые ядра.
+// Для AVX-512 маска из одних единиц: _mm512_sqrt_pd в GCC 12 берёт
+// неинициализированный источник и даёт -Wmaybe-uninitialized
+template <typename V>
+FORCE_INLINE void simdSqrt(const V& x, V& out) {
+    if constexpr (std::is_arithmetic<V>::value) {
+        out = std::sqrt(x);
+    } else {
+        for (int lane = 0; lane < (int)(sizeof(V) / sizeof(x[0])); ++lane)
+            out[lane] = std::sqrt(x[lane]);
+    }
+}
+
+#if HAVE_X86_SIMD
+TARGET_AVX2 inline void simdSqrt(const SimdVec<double, 4>::type& x, SimdVec<double, 4>::type& out) {
+    out = (SimdVec<double, 4>::type)_mm256_sqrt_pd((__m256d)x);
+}
+
+TARGET_AVX2 inline void simdSqrt(const SimdVec<float, 8>::type& x, SimdVec<float, 8>::type& out) {
+    out = (SimdVec<float, 8>::type)_mm256_sqrt_ps((__m256)x);
+}
+
+TARGET_AVX512 inline void simdSqrt(const SimdVec<double, 8>::type& x, SimdVec<double, 8>::type& out) {
+    out = (SimdVec<double, 8>::type)_mm512_maskz_sqrt_pd((__mmask8)-1, (__m512d)x);
+}
+
+TARGET_AVX512 inline void simdSqrt(const SimdVec<float, 16>::type& x, SimdVec<float, 16>::type& out) {
+    out = (SimdVec<float, 16>::type)_mm512_maskz_sqrt_ps((__mmask16)-1, (__m512)x);
+}
+#endif
+
+// Как Quaternion::inverse(): сопряжённый, умноженный на 1 / норму
+struct QuaternionInverseOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, V* r) {
+        V inverse = 1 / (x[0] * x[0] + x[1] * x[1] + x[2] * x[2] + x[3] * x[3]);
+        r[0] = x[0] * inverse;
+        r[1] = -x[1] * inverse;
+        r[2] = -x[2] * inverse;
+        r[3] = -x[3] * inverse;
+    }
+};
+
+// Как Quaternion::normalized()
+struct QuaternionNormalizeOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, V* r) {
+        V length;
+        simdSqrt(x[0] * x[0] + x[1] * x[1] + x[2] * x[2] + x[3] * x[3], length);
+        V scale = 1 / length;
+        for (int k = 0; k < 4; ++k)
+            r[k] = x[k] * scale;
+    }
+};
+
+// Как Quaternion::divideUnit(): x * conj(y) без деления на норму
+struct QuaternionUnitDivOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        r[0] = x[0] * y[0] + x[1] * y[1] + x[2] * y[2] + x[3] * y[3];
+        r[1] = x[1] * y[0] - x[0] * y[1] - x[2] * y[3] + x[3] * y[2];
+        r[2] = x[1] * y[3] - x[0] * y[2] + x[2] * y[0] - x[3] * y[1];
+        r[3] = -(x[0] * y[3]) - x[1] * y[2] + x[2] * y[1] + x[3] * y[0];
+    }
+};
+
+// Как Quaternion::rotate(): q - кватернион, v и r - по три компоненты
+struct QuaternionRotateOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* q, const V* v, V* r) {
+        V ub = q[1] + q[1], uc = q[2] + q[2], ud = q[3] + q[3];
+        V tx = uc * v[2] - ud * v[1];
+        V ty = ud * v[0] - ub * v[2];
+        V tz = ub * v[1] - uc * v[0];
+        r[0] = v[0] + q[0] * tx + (q[2] * tz - q[3] * ty);
+        r[1] = v[1] + q[0] * ty + (q[3] * tx - q[1] * tz);
+        r[2] = v[2] + q[0] * tz + (q[1] * ty - q[2] * tx);
+    }
+};
+
+template <typename Op, typename T, int Lanes>
+FORCE_INLINE void quaternionBinaryImpl(const T* const* x, const T* const* y, T* const* out, size_t n) {
+    size_t i = 0;
+    if constexpr (Lanes > 1) {
+        typedef typename SimdVec<T, Lanes>::type V;
+        for (; i + Lanes <= n; i += Lanes) {
+            V vx[4], vy[4], vr[4];
+            for (int k = 0; k < 4; ++k) {
+                simdLoad(vx[k], x[k] + i);
+                simdLoad(vy[k], y[k] + i);
+            }
+            Op::apply(vx, vy, vr);
+            for (int k = 0; k < 4; ++k)
+                simdStore(out[k] + i, vr[k]);
+        }
+    }
+    for (; i < n; ++i) {
+        T sx[4], sy[4], sr[4];
+        for (int k = 0; k < 4; ++k) {
+            sx[k] = x[k][i];
+            sy[k] = y[k][i];
+        }
+        Op::apply(sx, sy, sr);
+        for (int k = 0; k < 4; ++k)
+            out[k][i] = sr[k];
+    }
+}
+
+template <typename Op, typename T, int Lanes>
+FORCE_INLINE void quaternionUnaryImpl(const T* const* x, T* const* out, size_t n) {
+    size_t i = 0;
+    if constexpr (Lanes > 1) {
+        typedef typename SimdVec<T, Lanes>::type V;
+        for (; i + Lanes <= n; i += Lanes) {
+            V vx[4], vr[4];
+            for (int k = 0; k < 4; ++k)
+                simdLoad(vx[k], x[k] + i);
+            Op::apply(vx, vr);
+            for (int k = 0; k < 4; ++k)
+                simdStore(out[k] + i, vr[k]);
+        }
+    }
+    for (; i < n; ++i) {
+        T sx[4], sr[4];
+        for (int k = 0; k < 4; ++k)
+            sx[k] = x[k][i];
+        Op::apply(sx, sr);
+        for (int k = 0; k < 4; ++k)
+            out[k][i] = sr[k];
+    }
+}
+
+template <typename T, int Lanes>
+FORCE_INLINE void quaternionNormImpl(const T* const* x, T* out, size_t n) {
+    size_t i = 0;
+    if constexpr (Lanes > 1) {
+        typedef typename SimdVec<T, Lanes>::type V;
+        for (; i + Lanes <= n; i += Lanes) {
+            V vx[4], vr;
+            for (int k = 0; k < 4; ++k)
+                simdLoad(vx[k], x[k] + i);
+            QuaternionNormOp::apply(vx, vr);
+            simdStore(out + i, vr);
+        }
+    }
+    for (; i < n; ++i) {
+        T sx[4];
+        for (int k = 0; k < 4; ++k)
+            sx[k] = x[k][i];
+        QuaternionNormOp::apply(sx, out[i]);
+    }
+}
+
+template <typename T, int Lanes>
+FORCE_INLINE void quaternionRotateImpl(const T* const* q, const T* const* v, T* const* out, size_t n) {
+    size_t i = 0;
+    if constexpr (Lanes > 1) {
+        typedef typename SimdVec<T, Lanes>::type V;
+        for (; i + Lanes <= n; i += Lanes) {
+            V vq[4], vv[3], vr[3];
+            for (int k = 0; k < 4; ++k)
+                simdLoad(vq[k], q[k] + i);
+            for (int k = 0; k < 3; ++k)
+                simdLoad(vv[k], v[k] + i);
+            QuaternionRotateOp::apply(vq, vv, vr);
+            for (int k = 0; k < 3; ++k)
+                simdStore(out[k] + i, vr[k]);
+        }
+    }
+    for (; i < n; ++i) {
+        T sq[4], sv[3], sr[3];
+        for (int k = 0; k < 4; ++k)
+            sq[k] = q[k][i];
+        for (int k = 0; k < 3; ++k)
+            sv[k] = v[k][i];
+        QuaternionRotateOp::apply(sq, sv, sr);
+        for (int k = 0; k < 3; ++k)
+            out[k][i] = sr[k];
+    }
+}
+
+template <typename Op, typename T>
+void quaternionKernelScalar(const T* const* x, const T* const* y, T* const* out, size_t n) {
+    quaternionBinaryImpl<Op, T, 1>(x, y, out, n);
+}
+
+template <typename T>
+void quaternionConjugateScalar(const T* const* x, T* const* out, size_t n) {
+    quaternionUnaryImpl<QuaternionConjugateOp, T, 1>(x, out, n);
+}
+
+template <typename T>
+void quaternionNormScalar(const T* const* x, T* out, size_t n) {
+    quaternionNormImpl<T, 1>(x, out, n);
+}
+
+template <typename Op, typename T>
+void quaternionUnaryScalar(const T* const* x, T* const* out, size_t n) {
+    quaternionUnaryImpl<Op, T, 1>(x, out, n);
+}
+
+template <typename T>
+void quaternionRotateScalar(const T* const* q, const T* const* v, T* const* out, size_t n) {
+    quaternionRotateImpl<T, 1>(q, v, out, n);
+}
+
+#if HAVE_X86_SIMD
+template <typename Op, typename T>
+TARGET_AVX2 void quaternionKernelAvx2(const T* const* x, const T* const* y, T* const* out, size_t n) {
+    quaternionBinaryImpl<Op, T, SimdLanes<T, 32>::value>(x, y, out, n);
+}
+
+template <typename T>
+TARGET_AVX2 void quaternionConjugateAvx2(const T* const* x, T* const* out, size_t n) {
+    quaternionUnaryImpl<QuaternionConjugateOp, T, SimdLanes<T, 32>::value>(x, out, n);
+}
+
+template <typename T>
+TARGET_AVX2 void quaternionNormAvx2(const T* const* x, T* out, size_t n) {
+    quaternionNormImpl<T, SimdLanes<T, 32>::value>(x, out, n);
+}
+
+template <typename Op, typename T>
+TARGET_AVX2 void quaternionUnaryAvx2(const T* const* x, T* const* out, size_t n) {
+    quaternionUnaryImpl<Op, T, SimdLanes<T, 32>::value>(x, out, n);
+}
+
+template <typename T>
+TARGET_AVX2 void quaternionRotateAvx2(const T* const* q, const T* const* v, T* const* out, size_t n) {
+    quaternionRotateImpl<T, SimdLanes<T, 32>::value>(q, v, out, n);
+}
+
+template <typename Op, typename T>
+TARGET_AVX512 void quaternionKernelAvx512(const T* const* x, const T* const* y, T* const* out, size_t n) {
+    quaternionBinaryImpl<Op, T, SimdLanes<T, 64>::value>(x, y, out, n);
+}
+
+template <typename T>
+TARGET_AVX512 void quaternionConjugateAvx512(const T* const* x, T* const* out, size_t n) {
+    quaternionUnaryImpl<QuaternionConjugateOp, T, SimdLanes<T, 64>::value>(x, out, n);
+}
+
+template <typename T>
+TARGET_AVX512 void quaternionNormAvx512(const T* const* x, T* out, size_t n) {
+    quaternionNormImpl<T, SimdLanes<T, 64>::value>(x, out, n);
+}
+
+template <typename Op, typename T>
+TARGET_AVX512 void quaternionUnaryAvx512(const T* const* x, T* const* out, size_t n) {
+    quaternionUnaryImpl<Op, T, SimdLanes<T, 64>::value>(x, out, n);
+}
+
+template <typename T>
+TARGET_AVX512 void quaternionRotateAvx512(const T* const* q, const T* const* v, T* const* out, size_t n) {
+    quaternionRotateImpl<T, SimdLanes<T, 64>::value>(q, v, out, n);
+}
+#endif
+
+END_EXACT_KERNELS
+
+template <typename T>
+struct QuaternionKernels {
+    typedef void (*Kernel)(const T* const* x, const T* const* y, T* const* out, size_t n);
+    typedef void (*UnaryKernel)(const T* const* x, T* const* out, size_t n);
+    typedef void (*NormKernel)(const T* const* x, T* out, size_t n);
+
+    // Поворот: q - кватернионы, v и out - по три компоненты векторов
+    typedef void (*RotateKernel)(const T* const* q, const T* const* v, T* const* out, size_t n);
+
+    Kernel add;
+    Kernel sub;
+    Kernel mul;
+    Kernel div;
+    UnaryKernel conjugate;
+    NormKernel norm;
+    UnaryKernel inverse;
+    UnaryKernel normalize;
+    Kernel divUnit;
+    RotateKernel rotate;
+};
+
+template <typename T>
+const QuaternionKernels<T>& quaternionKernels(SimdLevel level) {
+    static const QuaternionKernels<T> scalar = {
+        quaternionKernelScalar<QuaternionAddOp, T>, quaternionKernelScalar<QuaternionSubOp, T>,
+        quaternionKernelScalar<QuaternionMulOp, T>, quaternionKernelScalar<QuaternionDivOp, T>,
+        quaternionConjugateScalar<T>, quaternionNormScalar<T>,
+        quaternionUnaryScalar<QuaternionInverseOp, T>, quaternionUnaryScalar<QuaternionNormalizeOp, T>,
+        quaternionKernelScalar<QuaternionUnitDivOp, T>, quaternionRotateScalar<T>
+    };
+#if HAVE_X86_SIMD
+    static const QuaternionKernels<T> avx2 = {
+        quaternionKernelAvx2<QuaternionAddOp, T>, quaternionKernelAvx2<QuaternionSubOp, T>,
+        quaternionKernelAvx2<QuaternionMulOp, T>, quaternionKernelAvx2<QuaternionDivOp, T>,
+        quaternionConjugateAvx2<T>, quaternionNormAvx2<T>,
+        quaternionUnaryAvx2<QuaternionInverseOp, T>, quaternionUnaryAvx2<QuaternionNormalizeOp, T>,
+        quaternionKernelAvx2<QuaternionUnitDivOp, T>, quaternionRotateAvx2<T>
+    };
+    static const QuaternionKernels<T> avx512 = {
+        quaternionKernelAvx512<QuaternionAddOp, T>, quaternionKernelAvx512<QuaternionSubOp, T>,
+        quaternionKernelAvx512<QuaternionMulOp, T>, quaternionKernelAvx512<QuaternionDivOp, T>,
+        quaternionConjugateAvx512<T>, quaternionNormAvx512<T>,
+        quaternionUnaryAvx512<QuaternionInverseOp, T>, quaternionUnaryAvx512<QuaternionNormalizeOp, T>,
+        quaternionKernelAvx512<QuaternionUnitDivOp, T>, quaternionRotateAvx512<T>
+    };
+    if (level == SIMD_AVX512)
+        return avx512;
+    if (level == SIMD_AVX2)
+        return avx2;
+#endif
+    return scalar;
+}
+
+// x * y + z цепочками fma, начиная с z; слагаемые произведения
+// Гамильтона в том же порядке, что в QuaternionMulOp (см. ComplexFmaOp)
+struct QuaternionFmaOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, const V* z, V* r) {
+        V n[4] = { -x[0], -x[1], -x[2], -x[3] };
+        V t;
+        simdFma(x[0], y[0], z[0], t);
+        simdFma(n[1], y[1], t, t);
+        simdFma(n[2], y[2], t, t);
+        simdFma(n[3], y[3], t, r[0]);
+        simdFma(x[0], y[1], z[1], t);
+        simdFma(x[1], y[0], t, t);
+        simdFma(x[2], y[3], t, t);
+        simdFma(n[3], y[2], t, r[1]);
+        simdFma(x[0], y[2], z[2], t);
+        simdFma(n[1], y[3], t, t);
+        simdFma(x[2], y[0], t, t);
+        simdFma(x[3], y[1], t, r[2]);
+        simdFma(x[0], y[3], z[3], t);
+        simdFma(x[1], y[2], t, t);
+        simdFma(n[2], y[1], t, t);
+        simdFma(x[3], y[0], t, r[3]);
+    }
+};
+
+template <typename T, int Lanes>
+FORCE_INLINE void quaternionFmaImpl(const T* const* x, const T* const* y, const T* const* z, T* const* out,
+                                    size_t n) {
+    size_t i = 0;
+    if constexpr (Lanes > 1) {
+        typedef typename SimdVec<T, Lanes>::type V;
+        for (; i + Lanes <= n; i += Lanes) {
+            V vx[4], vy[4], vz[4], vr[4];
+            for (int k = 0; k < 4; ++k) {
+                simdLoad(vx[k], x[k] + i);
+                simdLoad(vy[k], y[k] + i);
+                simdLoad(vz[k], z[k] + i);
+            }
+            QuaternionFmaOp::apply(vx, vy, vz, vr);
+            for (int k = 0; k < 4; ++k)
+                simdStore(out[k] + i, vr[k]);
+        }
+    }
+    for (; i < n; ++i) {
+        T sx[4], sy[4], sz[4], sr[4];
+        for (int k = 0; k < 4; ++k) {
+            sx[k] = x[k][i];
+            sy[k] = y[k][i];
+            sz[k] = z[k][i];
+        }
+        QuaternionFmaOp::apply(sx, sy, sz, sr);
+        for (int k = 0; k < 4; ++k)
+            out[k][i] = sr[k];
+    }
+}
+
+template <typename T>
+void quaternionFmaScalar(const T* const* x, const T* const* y, const T* const* z, T* const* out, size_t n) {
+    quaternionFmaImpl<T, 1>(x, y, z, out, n);
+}
+
+#if HAVE_X86_SIMD
+template <typename T>
+TARGET_AVX2_FMA void quaternionFmaAvx2(const T* const* x, const T* const* y, const T* const* z, T* const* out,
+                                       size_t n) {
+    quaternionFmaImpl<T, SimdLanes<T, 32>::value>(x, y, z, out, n);
+}
+
+template <typename T>
+TARGET_AVX512 void quaternionFmaAvx512(const T* const* x, const T* const* y, const T* const* z, T* const* out,
+                                       size_t n) {
+    quaternionFmaImpl<T, SimdLanes<T, 64>::value>(x, y, z, out, n);
+}
+#endif
+
+template <typename T>
+using QuaternionFmaKernel = void (*)(const T* const* x, const T* const* y, const T* const* z, T* const* out,
+                                     size_t n);
+
+template <typename T>
+QuaternionFmaKernel<T> quaternionFmaKernel(SimdLevel level) {
+#if HAVE_X86_SIMD
+    if (level == SIMD_AVX512)
+        return quaternionFmaAvx512<T>;
+    if (level == SIMD_AVX2 && hasHardwareFma())
+        return quaternionFmaAvx2<T>;
+#endif
+    return quaternionFmaScalar<T>;
+}
+
+// x * y + z
+template <typename T>
+FORCE_INLINE BasicQuaternion<T> fma(const BasicQuaternion<T>& x, const BasicQuaternion<T>& y, const BasicQuaternion<T>& z) {
+    T sx[4] = { x.getA(), x.getB(), x.getC(), x.getD() };
+    T sy[4] = { y.getA(), y.getB(), y.getC(), y.getD() };
+    T sz[4] = { z.getA(), z.getB(), z.getC(), z.getD() };
+    T r[4];
+    QuaternionFmaOp::apply(sx, sy, sz, r);
+    return BasicQuaternion<T>(r[0], r[1], r[2], r[3]);
+}
+
+// Набор трёхмерных векторов: x, y, z в трёх выровненных массивах
+template <typename T>
+class BasicVector3Batch {
+public:
+    typedef BasicVector3<T> Vector;
+
+private:
+    AlignedVector<T> lanes[3];
+
+public:
+    BasicVector3Batch() {}
+
+    explicit BasicVector3Batch(size_t n) {
+        resize(n);
+    }
+
+    size_t size() const { return lanes[0].size(); }
+
+    void resize(size_t n) {
+        for (int k = 0; k < 3; ++k)
+            lanes[k].resize(n);
+    }
+
+    void append(const Vector& v) {
+        lanes[0].push_back(v.x);
+        lanes[1].push_back(v.y);
+        lanes[2].push_back(v.z);
+    }
+
+    Vector get(size_t i) const { return Vector(lanes[0][i], lanes[1][i], lanes[2][i]); }
+
+    void set(size_t i, const Vector& v) {
+        lanes[0][i] = v.x;
+        lanes[1][i] = v.y;
+        lanes[2][i] = v.z;
+    }
+
+    // Указатель на k-ю компоненту (0 - x, 1 - y, 2 - z)
+    T* data(int k) { return lanes[k].data(); }
+    const T* data(int k) const { return lanes[k].data(); }
+};
+
+typedef BasicVector3Batch<double> Vector3Batch;
+
+// Набор кватернионов: компоненты a, b, c, d хранятся в четырёх
+// отдельных выровненных массивах.
+// Все операции побитово совпадают с операторами BasicQuaternion<T>, если
+// операторы собраны без слияния в FMA (см. BEGIN_EXACT_KERNELS).
+template <typename T>
+class BasicQuaternionBatch {
+public:
+    typedef BasicQuaternion<T> Number;
+
+private:
+    AlignedVector<T> lanes[4];
+
+    void pointers(const T* p[4]) const {
+        for (int k = 0; k < 4; ++k)
+            p[k] = lanes[k].data();
+    }
+
+    void pointers(T* p[4]) {
+        for (int k = 0; k < 4; ++k)
+            p[k] = lanes[k].data();
+    }
+
+    static void apply(typename QuaternionKernels<T>::Kernel kernel,
+                      const BasicQuaternionBatch& x, const BasicQuaternionBatch& y, BasicQuaternionBatch& out) {
+        assert(x.size() == y.size());
+        out.resize(x.size());
+        const T* px[4];
+        const T* py[4];
+        T* pout[4];
+        x.pointers(px);
+        y.pointers(py);
+        out.pointers(pout);
+        kernel(px, py, pout, x.size());
+    }
+
+    static void unary(typename QuaternionKernels<T>::UnaryKernel kernel,
+                      const BasicQuaternionBatch& x, BasicQuaternionBatch& out) {
+        out.resize(x.size());
+        const T* px[4];
+        T* pout[4];
+        x.pointers(px);
+        out.pointers(pout);
+        kernel(px, pout, x.size());
+    }
+
+public:
+    // Конструктор по умолчанию
+    BasicQuaternionBatch() {}
+
+    // Конструктор инициализации: n нулевых кватернионов
+    explicit BasicQuaternionBatch(size_t n) {
+        resize(n);
+    }
+
+    size_t size() const { return lanes[0].size(); }
+
+    void resize(size_t n) {
+        for (int k = 0; k < 4; ++k)
+            lanes[k].resize(n);
+    }
+
+    void reserve(size_t n) {
+        for (int k = 0; k < 4; ++k)
+            lanes[k].reserve(n);
+    }
+
+    void append(const Number& q) {
+        lanes[0].push_back(q.getA());
+        lanes[1].push_back(q.getB());
+        lanes[2].push_back(q.getC());
+        lanes[3].push_back(q.getD());
+    }
+
+    // Методы доступа
+    Number get(size_t i) const {
+        return Number(lanes[0][i], lanes[1][i], lanes[2][i], lanes[3][i]);
+    }
+
+    void set(size_t i, const Number& q) {
+        lanes[0][i] = q.getA();
+        lanes[1][i] = q.getB();
+        lanes[2][i] = q.getC();
+        lanes[3][i] = q.getD();
+    }
+
+    // Указатель на k-ю компоненту (0 - a, 1 - b, 2 - c, 3 - d)
+    T* data(int k) { return lanes[k].data(); }
+    const T* data(int k) const { return lanes[k].data(); }
+
+    // Вычисление ленивого выражения за один проход
+    template <typename E>
+    BasicQuaternionBatch& operator=(const Expression<E>& expression) {
+        evaluate(expression, *this);
+        return *this;
+    }
+
+    // Поэлементные операции, результат записывается в out
+    static void add(const BasicQuaternionBatch& x, const BasicQuaternionBatch& y, BasicQuaternionBatch& out) {
+        apply(quaternionKernels<T>(simdLevel()).add, x, y, out);
+    }
+
+    static void sub(const BasicQuaternionBatch& x, const BasicQuaternionBatch& y, BasicQuaternionBatch& out) {
+        apply(quaternionKernels<T>(simdLevel()).sub, x, y, out);
+    }
+
+    // Произведение Гамильтона
+    static void mul(const BasicQuaternionBatch& x, const BasicQuaternionBatch& y, BasicQuaternionBatch& out) {
+        apply(quaternionKernels<T>(simdLevel()).mul, x, y, out);
+    }
+
+    // Слитое деление без промежуточного сопряжённого
+    static void div(const BasicQuaternionBatch& x, const BasicQuaternionBatch& y, BasicQuaternionBatch& out) {
+        apply(quaternionKernels<T>(simdLevel()).div, x, y, out);
+    }
+
+    static void conjugate(const BasicQuaternionBatch& x, BasicQuaternionBatch& out) {
+        unary(quaternionKernels<T>(simdLevel()).conjugate, x, out);
+    }
+
+    static void inverse(const BasicQuaternionBatch& x, BasicQuaternionBatch& out) {
+        unary(quaternionKernels<T>(simdLevel()).inverse, x, out);
+    }
+
+    static void normalize(const BasicQuaternionBatch& x, BasicQuaternionBatch& out) {
+        unary(quaternionKernels<T>(simdLevel()).normalize, x, out);
+    }
+
+    // out = x * y + z через fma, побитово как ::fma для каждого элемента
+    static void fma(const BasicQuaternionBatch& x, const BasicQuaternionBatch& y, const BasicQuaternionBatch& z,
+                    BasicQuaternionBatch& out) {
+        assert(x.size() == y.size() && x.size() == z.size());
+        out.resize(x.size());
+        const T* px[4];
+        const T* py[4];
+        const T* pz[4];
+        T* pout[4];
+        x.pointers(px);
+        y.pointers(py);
+        z.pointers(pz);
+        out.pointers(pout);
+        quaternionFmaKernel<T>(simdLevel())(px, py, pz, pout, x.size());
+    }
+
+    // Деление на единичные кватернионы, см. Quaternion::divideUnit
+    static void divUnit(const BasicQuaternionBatch& x, const BasicQuaternionBatch& y, BasicQuaternionBatch& out) {
+        apply(quaternionKernels<T>(simdLevel()).divUnit, x, y, out);
+    }
+
+    // Поворот vectors[i] единичным кватернионом rotations[i]
+    static void rotate(const BasicQuaternionBatch& rotations, const BasicVector3Batch<T>& vectors,
+                       BasicVector3Batch<T>& out) {
+        assert(rotations.size() == vectors.size());
+        out.resize(vectors.size());
+        const T* pq[4];
+        const T* pv[3] = { vectors.data(0), vectors.data(1), vectors.data(2) };
+        T* pout[3] = { out.data(0), out.data(1), out.data(2) };
+        rotations.pointers(pq);
+        quaternionKernels<T>(simdLevel()).rotate(pq, pv, pout, vectors.size());
+    }
+
+    // Нормы всех кватернионов набора
+    static void norm(const BasicQuaternionBatch& x, AlignedVector<T>& out) {
+        out.resize(x.size());
+        const T* px[4];
+        x.pointers(px);
+        quaternionKernels<T>(simdLevel()).norm(px, out.data(), x.size());
+    }
+
+    BasicQuaternionBatch operator+(const BasicQuaternionBatch& other) const {
+        BasicQuaternionBatch result;
+        add(*this, other, result);
+        return result;
+    }
+
+    BasicQuaternionBatch operator-(const BasicQuaternionBatch& other) const {
+        BasicQuaternionBatch result;
+        sub(*this, other, result);
+        return result;
+    }
+
+    BasicQuaternionBatch operator*(const BasicQuaternionBatch& other) const {
+        BasicQuaternionBatch result;
+        mul(*this, other, result);
+        return result;
+    }
+
+    BasicQuaternionBatch operator/(const BasicQuaternionBatch& other) const {
+        BasicQuaternionBatch result;
+        div(*this, other, result);
+        return result;
+    }
+
+    // Тестирование
+    static void test() {
+        const size_t n = 1031;
+        BasicQuaternionBatch x, y;
+        x.append(Number(1.0, 2.0, 3.0, 4.0));
+        y.append(Number(5.0, 6.0, 7.0, 8.0));
+        std::mt19937_64 rng(7);
+        std::uniform_real_distribution<double> dist(-10.0, 10.0);
+        for (size_t i = 1; i < n; ++i) {
+            x.append(Number(T(dist(rng)), T(dist(rng)), T(dist(rng)), T(dist(rng))));
+            y.append(Number(T(dist(rng)), T(dist(rng)), T(dist(rng)), T(dist(rng))));
+        }
+
+        SimdLevel saved = simdLevel();
+        const SimdLevel levels[] = { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+        for (SimdLevel level : levels) {
+            if (level > detectSimdLevel())
+                continue;
+            setSimdLevel(level);
+
+            BasicQuaternionBatch sum = x + y;
+            BasicQuaternionBatch diff = x - y;
+            BasicQuaternionBatch product = x * y;
+            BasicQuaternionBatch quotient = x / y;
+            BasicQuaternionBatch conj;
+            conjugate(x, conj);
+            AlignedVector<T> norms;
+            norm(x, norms);
+
+            // Значения из Quaternion::test()
+            Number p = product.get(0);
+            assert(p.getA() == -60.0 && p.getB() == 12.0 && p.getC() == 30.0 && p.getD() == 24.0);
+            Number q = quotient.get(0);
+            assert(fabs(q.getA() - 0.402299) < 1e-6);
+            assert(fabs(q.getB() - 0.045977) < 1e-6);
+            assert(fabs(q.getC()) < 1e-6);
+            assert(fabs(q.getD() - 0.091954) < 1e-6);
+            assert(norms[0] == 30.0);
+
+            // Совпадение со скалярными операторами (см. matchesOperator):
+            // сложение не сливается, для * и / допуск от |a| |b| и |a| / |b|
+            for (size_t i = 0; i < n; ++i) {
+                Number a = x.get(i), b = y.get(i);
+                Number expected[] = { a + b, a - b, a * b, a / b };
+                Number actual[] = { sum.get(i), diff.get(i), product.get(i), quotient.get(i) };
+                T aSize = std::sqrt(a.norm()), bSize = std::sqrt(b.norm());
+                T scales[] = { 0, 0, aSize * bSize, aSize / bSize };
+                for (int k = 0; k < 4; ++k) {
+                    assert(matchesOperator(expected[k].getA(), actual[k].getA(), scales[k]));
+                    assert(matchesOperator(expected[k].getB(), actual[k].getB(), scales[k]));
+                    assert(matchesOperator(expected[k].getC(), actual[k].getC(), scales[k]));
+                    assert(matchesOperator(expected[k].getD(), actual[k].getD(), scales[k]));
+                }
+                Number c = conj.get(i);
+                assert(c.getA() == a.getA() && c.getB() == -a.getB() && c.getC() == -a.getC() && c.getD() == -a.getD());
+                assert(matchesOperator(norms[i], a.norm(), a.norm()));
+            }
+
+            // Обратные, нормирование, деление на единичные и поворот
+            BasicQuaternionBatch inverses, units, unitQuotients;
+            BasicVector3Batch<T> vectors, rotated;
+            for (size_t i = 0; i < n; ++i)
+                vectors.append(BasicVector3<T>(y.get(i).getB(), y.get(i).getC(), y.get(i).getD()));
+            inverse(x, inverses);
+            normalize(y, units);
+            divUnit(x, units, unitQuotients);
+            rotate(units, vectors, rotated);
+            // Допуск (см. matchesOperator) от |a|^-1, 1, |a| и |v|
+            for (size_t i = 0; i < n; ++i) {
+                Number unit = y.get(i).normalized();
+                Number expected[] = { x.get(i).inverse(), unit, x.get(i).divideUnit(unit) };
+                Number actual[] = { inverses.get(i), units.get(i), unitQuotients.get(i) };
+                T xSize = std::sqrt(x.get(i).norm());
+                T scales[] = { 1 / xSize, 1, xSize };
+                for (int k = 0; k < 3; ++k) {
+                    assert(matchesOperator(expected[k].getA(), actual[k].getA(), scales[k]));
+                    assert(matchesOperator(expected[k].getB(), actual[k].getB(), scales[k]));
+                    assert(matchesOperator(expected[k].getC(), actual[k].getC(), scales[k]));
+                    assert(matchesOperator(expected[k].getD(), actual[k].getD(), scales[k]));
+                }
+                BasicVector3<T> v = vectors.get(i);
+                BasicVector3<T> turned = unit.rotate(v);
+                T vSize = std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+                assert(matchesOperator(turned.x, rotated.get(i).x, vSize));
+                assert(matchesOperator(turned.y, rotated.get(i).y, vSize));
+                assert(matchesOperator(turned.z, rotated.get(i).z, vSize));
+            }
+
+            // Слитое умножение-сложение: побитово как ::fma для чисел
+            BasicQuaternionBatch fused;
+            fma(x, y, x, fused);
+            for (size_t i = 0; i < n; ++i) {
+                Number expected = ::fma(x.get(i), y.get(i), x.get(i));
+                Number actual = fused.get(i);
+                assert(expected.getA() == actual.getA() && expected.getB() == actual.getB());
+                assert(expected.getC() == actual.getC() && expected.getD() == actual.getD());
+                Number plain = x.get(i) * y.get(i) + x.get(i);
+                assert(fabs(actual.getA() - plain.getA()) <= 1e-3 * (1 + fabs(plain.getA())));
+            }
+        }
+        setSimdLevel(saved);
+
+        std::cout << "All tests passed for QuaternionBatch<" << scalarTypeName<T>() << "> ("
+                  << simdLevelName(simdLevel()) << ")!" << std::endl;
+    }
+};
+
+typedef BasicQuaternionBatch<double> QuaternionBatch;
+
+// Число или набор, вид которых становится известен только во время
+// выполнения (заголовок файла, аргумент командной строки). Вариант
+// разбирается один раз на границе Calculator, дальше работают
+// статические типы и ядра без проверок на каждом элементе
+typedef std::variant<ComplexNumber, Quaternion> AnyNumber;
+typedef std::variant<ComplexBatch, QuaternionBatch> AnyBatch;
+
+inline NumberType numberType(const AnyNumber& value) {
+    return std::visit([](const auto& number) { return number.kind; }, value);
+}
+
+inline NumberType numberType(const AnyBatch& value) {
+    return std::visit([](const auto& batch) {
+        typedef typename std::decay<decltype(batch)>::type Batch;
+        return Batch::Number::kind;
+    }, value);
+}
+
+// ------------------------------------------------------------------
+// Ленивые выражения (expression templates): цепочка операций над
+// числами или наборами строит дерево узлов, а вычисляется целиком
+// за один проход в момент присваивания, без промежуточных объектов
+// ------------------------------------------------------------------
+
+// Сведения о типе числа, нужные обобщённому коду
+template <typename Number>
+struct NumberTraits;
+
+template <typename T>
+struct NumberTraits<BasicComplexNumber<T> > {
+    typedef T Scalar;
+    typedef BasicComplexBatch<T> Batch;
+    static const NumberType type = BasicComplexNumber<T>::kind;
+    static const int components = 2;
+
+    static void split(const BasicComplexNumber<T>& n, T* c) {
+        c[0] = n.getReal();
+        c[1] = n.getImaginary();
+    }
+    static BasicComplexNumber<T> join(const T* c) { return BasicComplexNumber<T>(c[0], c[1]); }
+
+    // Поэлементная операция '+', '-', '*' или '/' над столбцами компонент;
+    // на другой операции false, r не меняется
+    static bool apply(char operation, const T* const* x, const T* const* y, T* const* r, size_t n) {
+        const ComplexKernels<T>& kernels = complexKernels<T>(simdLevel());
+        typename ComplexKernels<T>::Kernel kernel;
+        switch (operation) {
+            case '+': kernel = kernels.add; break;
+            case '-': kernel = kernels.sub; break;
+            case '*': kernel = kernels.mul; break;
+            case '/': kernel = kernels.div; break;
+            default: return false;
+        }
+        kernel(x[0], x[1], y[0], y[1], r[0], r[1], n);
+        return true;
+    }
+};
+
+template <typename T>
+struct NumberTraits<BasicQuaternion<T> > {
+    typedef T Scalar;
+    typedef BasicQuaternionBatch<T> Batch;
+    static const NumberType type = BasicQuaternion<T>::kind;
+    static const int components = 4;
+
+    static void split(const BasicQuaternion<T>& n, T* c) {
+        c[0] = n.getA();
+        c[1] = n.getB();
+        c[2] = n.getC();
+        c[3] = n.getD();
+    }
+    static BasicQuaternion<T> join(const T* c) { return BasicQuaternion<T>(c[0], c[1], c[2], c[3]); }
+
+    // Поэлементная операция '+', '-', '*' или '/' над столбцами компонент;
+    // на другой операции false, r не меняется
+    static bool apply(char operation, const T* const* x, const T* const* y, T* const* r, size_t n) {
+        const QuaternionKernels<T>& kernels = quaternionKernels<T>(simdLevel());
+        typename QuaternionKernels<T>::Kernel kernel;
+        switch (operation) {
+            case '+': kernel = kernels.add; break;
+            case '-': kernel = kernels.sub; break;
+            case '*': kernel = kernels.mul; break;
+            case '/': kernel = kernels.div; break;
+            default: return false;
+        }
+        kernel(x, y, r, n);
+        return true;
+    }
+};
+
+// Числа произвольного вида в одном стеке: результат остаётся комплексным,
+// пока оба операнда комплексные, и становится кватернионом только
+// в операции с кватернионом (через смешанные операции выше)
+inline AnyNumber operator+(const AnyNumber& x, const AnyNumber& y) {
+    return std::visit([](const auto& a, const auto& b) { return AnyNumber(a + b); }, x, y);
+}
+
+inline AnyNumber operator-(const AnyNumber& x, const AnyNumber& y) {
+    return std::visit([](const auto& a, const auto& b) { return AnyNumber(a - b); }, x, y);
+}
+
+inline AnyNumber operator*(const AnyNumber& x, const AnyNumber& y) {
+    return std::visit([](const auto& a, const auto& b) { return AnyNumber(a * b); }, x, y);
+}
+
+inline AnyNumber operator/(const AnyNumber& x, const AnyNumber& y) {
+    return std::visit([](const auto& a, const auto& b) { return AnyNumber(a / b); }, x, y);
+}
+
+// Для MixedProgram: константы 2, 3i остаются комплексными,
+// 4j и 5k - кватернионы. Столбцового выполнения у смешанной программы нет
+template <>
+struct NumberTraits<AnyNumber> {
+    typedef double Scalar;
+    typedef AnyBatch Batch;
+    static const int components = 4;
+
+    static AnyNumber join(const double* c) {
+        if (c[2] == 0 && c[3] == 0)
+            return ComplexNumber(c[0], c[1]);
+        return Quaternion(c[0], c[1], c[2], c[3]);
+    }
+};
+
+BEGIN_EXACT_KERNELS
+
+// Смешанные пакетные операции: комплексный столбец не расширяется
+// до кватернионного. У комплексного операнда нет частей c и d, поэтому
+// произведение - 8 умножений вместо 16, а сумма копирует c и d второго
+// операнда. Порядок действий - как у смешанных операторов, так что
+// результат совпадает с ними побитово.
+// Комплекс слева: x - две компоненты, y - четыре
+struct ComplexQuaternionAddOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        r[0] = x[0] + y[0];
+        r[1] = x[1] + y[1];
+        r[2] = y[2];
+        r[3] = y[3];
+    }
+};
+
+struct ComplexQuaternionSubOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        r[0] = x[0] - y[0];
+        r[1] = x[1] - y[1];
+        r[2] = -y[2];
+        r[3] = -y[3];
+    }
+};
+
+struct ComplexQuaternionMulOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        r[0] = x[0] * y[0] - x[1] * y[1];
+        r[1] = x[0] * y[1] + x[1] * y[0];
+        r[2] = x[0] * y[2] - x[1] * y[3];
+        r[3] = x[0] * y[3] + x[1] * y[2];
+    }
+};
+
+// x * conj(y) * (1 / |y|^2)
+struct ComplexQuaternionDivOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        V c[4] = { y[0], -y[1], -y[2], -y[3] };
+        V inverse = 1 / (y[0] * y[0] + y[1] * y[1] + y[2] * y[2] + y[3] * y[3]);
+        ComplexQuaternionMulOp::apply(x, c, r);
+        for (int k = 0; k < 4; ++k)
+            r[k] = r[k] * inverse;
+    }
+};
+
+// Кватернион слева: x - четыре компоненты, y - две
+struct QuaternionComplexAddOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        r[0] = x[0] + y[0];
+        r[1] = x[1] + y[1];
+        r[2] = x[2];
+        r[3] = x[3];
+    }
+};
+
+struct QuaternionComplexSubOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        r[0] = x[0] - y[0];
+        r[1] = x[1] - y[1];
+        r[2] = x[2];
+        r[3] = x[3];
+    }
+};
+
+struct QuaternionComplexMulOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        r[0] = x[0] * y[0] - x[1] * y[1];
+        r[1] = x[0] * y[1] + x[1] * y[0];
+        r[2] = x[2] * y[0] + x[3] * y[1];
+        r[3] = x[3] * y[0] - x[2] * y[1];
+    }
+};
+
+// x * conj(y) * (1 / |y|^2)
+struct QuaternionComplexDivOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        V c[2] = { y[0], -y[1] };
+        V inverse = 1 / (y[0] * y[0] + y[1] * y[1]);
+        QuaternionComplexMulOp::apply(x, c, r);
+        for (int k = 0; k < 4; ++k)
+            r[k] = r[k] * inverse;
+    }
+};
+
+// XParts и YParts - число компонент операндов (2 или 4), результат - кватернион
+template <typename Op, typename T, int Lanes, int XParts, int YParts>
+FORCE_INLINE void mixedImpl(const T* const* x, const T* const* y, T* const* out, size_t n) {
+    size_t i = 0;
+    if constexpr (Lanes > 1) {
+        typedef typename SimdVec<T, Lanes>::type V;
+        for (; i + Lanes <= n; i += Lanes) {
+            V vx[XParts], vy[YParts], vr[4];
+            for (int k = 0; k < XParts; ++k)
+                simdLoad(vx[k], x[k] + i);
+            for (int k = 0; k < YParts; ++k)
+                simdLoad(vy[k], y[k] + i);
+            Op::apply(vx, vy, vr);
+            for (int k = 0; k < 4; ++k)
+                simdStore(out[k] + i, vr[k]);
+        }
+    }
+    for (; i < n; ++i) {
+        T sx[XParts], sy[YParts], sr[4];
+        for (int k = 0; k < XParts; ++k)
+            sx[k] = x[k][i];
+        for (int k = 0; k < YParts; ++k)
+            sy[k] = y[k][i];
+        Op::apply(sx, sy, sr);
+        for (int k = 0; k < 4; ++k)
+            out[k][i] = sr[k];
+    }
+}
+
+template <typename Op, typename T, int XParts, int YParts>
+void mixedScalar(const T* const* x, const T* const* y, T* const* out, size_t n) {
+    mixedImpl<Op, T, 1, XParts, YParts>(x, y, out, n);
+}
+
+#if HAVE_X86_SIMD
+template <typename Op, typename T, int XParts, int YParts>
+TARGET_AVX2 void mixedAvx2(const T* const* x, const T* const* y, T* const* out, size_t n) {
+    mixedImpl<Op, T, SimdLanes<T, 32>::value, XParts, YParts>(x, y, out, n);
+}
+
+template <typename Op, typename T, int XParts, int YParts>
+TARGET_AVX512 void mixedAvx512(const T* const* x, const T* const* y, T* const* out, size_t n) {
+    mixedImpl<Op, T, SimdLanes<T, 64>::value, XParts, YParts>(x, y, out, n);
+}
+#endif
+
+END_EXACT_KERNELS
+
+// Ядра смешанных операций '+', '-', '*', '/' для уровня SIMD
+template <typename T>
+struct MixedKernels {
+    typedef typename QuaternionKernels<T>::Kernel Kernel;
+
+    Kernel complexLeft[4];
+    Kernel quaternionLeft[4];
+};
+
+template <typename T>
+const MixedKernels<T>& mixedKernels(SimdLevel level) {
+    static const MixedKernels<T> scalar = {
+        { mixedScalar<ComplexQuaternionAddOp, T, 2, 4>, mixedScalar<ComplexQuaternionSubOp, T, 2, 4>,
+          mixedScalar<ComplexQuaternionMulOp, T, 2, 4>, mixedScalar<ComplexQuaternionDivOp, T, 2, 4> },
+        { mixedScalar<QuaternionComplexAddOp, T, 4, 2>, mixedScalar<QuaternionComplexSubOp, T, 4, 2>,
+          mixedScalar<QuaternionComplexMulOp, T, 4, 2>, mixedScalar<QuaternionComplexDivOp, T, 4, 2> }
+    };
+#if HAVE_X86_SIMD
+    static const MixedKernels<T> avx2 = {
+        { mixedAvx2<ComplexQuaternionAddOp, T, 2, 4>, mixedAvx2<ComplexQuaternionSubOp, T, 2, 4>,
+          mixedAvx2<ComplexQuaternionMulOp, T, 2, 4>, mixedAvx2<ComplexQuaternionDivOp, T, 2, 4> },
+        { mixedAvx2<QuaternionComplexAddOp, T, 4, 2>, mixedAvx2<QuaternionComplexSubOp, T, 4, 2>,
+          mixedAvx2<QuaternionComplexMulOp, T, 4, 2>, mixedAvx2<QuaternionComplexDivOp, T, 4, 2> }
+    };
+    static const MixedKernels<T> avx512 = {
+        { mixedAvx512<ComplexQuaternionAddOp, T, 2, 4>, mixedAvx512<ComplexQuaternionSubOp, T, 2, 4>,
+          mixedAvx512<ComplexQuaternionMulOp, T, 2, 4>, mixedAvx512<ComplexQuaternionDivOp, T, 2, 4> },
+        { mixedAvx512<QuaternionComplexAddOp, T, 4, 2>, mixedAvx512<QuaternionComplexSubOp, T, 4, 2>,
+          mixedAvx512<QuaternionComplexMulOp, T, 4, 2>, mixedAvx512<QuaternionComplexDivOp, T, 4, 2> }
+    };
+    if (level == SIMD_AVX512)
+        return avx512;
+    if (level == SIMD_AVX2)
+        return avx2;
+#endif
+    return scalar;
+}
+
+// Номер операции в таблице ядер; -1, если это не '+', '-', '*', '/'
+inline int mixedOperationIndex(char operation) {
+    switch (operation) {
+        case '+': return 0;
+        case '-': return 1;
+        case '*': return 2;
+        case '/': return 3;
+        default: return -1;
+    }
+}
+
+// out = x op y поэлементно; false для неизвестной операции.
+// Ядро выбирается один раз на весь набор
+template <typename T>
+bool mixedBatch(char operation, const BasicComplexBatch<T>& x, const BasicQuaternionBatch<T>& y,
+                BasicQuaternionBatch<T>& out) {
+    int index = mixedOperationIndex(operation);
+    if (index < 0)
+        return false;
+    assert(x.size() == y.size());
+    out.resize(x.size());
+    const T* px[2] = { x.data(0), x.data(1) };
+    const T* py[4] = { y.data(0), y.data(1), y.data(2), y.data(3) };
+    T* pout[4] = { out.data(0), out.data(1), out.data(2), out.data(3) };
+    mixedKernels<T>(simdLevel()).complexLeft[index](px, py, pout, x.size());
+    return true;
+}
+
+template <typename T>
+bool mixedBatch(char operation, const BasicQuaternionBatch<T>& x, const BasicComplexBatch<T>& y,
+                BasicQuaternionBatch<T>& out) {
+    int index = mixedOperationIndex(operation);
+    if (index < 0)
+        return false;
+    assert(x.size() == y.size());
+    out.resize(x.size());
+    const T* px[4] = { x.data(0), x.data(1), x.data(2), x.data(3) };
+    const T* py[2] = { y.data(0), y.data(1) };
+    T* pout[4] = { out.data(0), out.data(1), out.data(2), out.data(3) };
+    mixedKernels<T>(simdLevel()).quaternionLeft[index](px, py, pout, x.size());
+    return true;
+}
+
+// Компенсированная сумма по компонентам (алгоритм Ноймайера): ошибка
+// округления каждого сложения копится отдельно и прибавляется в конце.
+// addProduct раскладывает каждое скалярное произведение через fma
+// в точную сумму двух чисел (Dot2 Огиты, Рампа и Оиси), поэтому
+// результат почти такой, как если бы сумма считалась с двойной точностью.
+template <typename Number>
+class CompensatedSum {
+    typedef NumberTraits<Number> Traits;
+    typedef typename Traits::Scalar T;
+
+    T sum[Traits::components];
+    T error[Traits::components];
+
+    FORCE_INLINE void addScalar(int k, T x) {
+        T s = sum[k] + x;
+        if (std::fabs(sum[k]) >= std::fabs(x))
+            error[k] += (sum[k] - s) + x;
+        else
+            error[k] += (x - s) + sum[k];
+        sum[k] = s;
+    }
+
+    FORCE_INLINE void addProductScalar(int k, T x, T y) {
+        T p = x * y;
+        addScalar(k, p);
+        error[k] += std::fma(x, y, -p);
+    }
+
+    // Слагаемые произведений, знаки как в операторах *
+    template <typename U>
+    FORCE_INLINE void addProductTerms(const BasicComplexNumber<U>& a, const BasicComplexNumber<U>& b) {
+        addProductScalar(0, a.getReal(), b.getReal());
+        addProductScalar(0, -a.getImaginary(), b.getImaginary());
+        addProductScalar(1, a.getReal(), b.getImaginary());
+        addProductScalar(1, a.getImaginary(), b.getReal());
+    }
+
+    template <typename U>
+    FORCE_INLINE void addProductTerms(const BasicQuaternion<U>& x, const BasicQuaternion<U>& y) {
+        U a = x.getA(), b = x.getB(), c = x.getC(), d = x.getD();
+        U e = y.getA(), f = y.getB(), g = y.getC(), h = y.getD();
+        addProductScalar(0, a, e);
+        addProductScalar(0, -b, f);
+        addProductScalar(0, -c, g);
+        addProductScalar(0, -d, h);
+        addProductScalar(1, a, f);
+        addProductScalar(1, b, e);
+        addProductScalar(1, c, h);
+        addProductScalar(1, -d, g);
+        addProductScalar(2, a, g);
+        addProductScalar(2, -b, h);
+        addProductScalar(2, c, e);
+        addProductScalar(2, d, f);
+        addProductScalar(3, a, h);
+        addProductScalar(3, b, g);
+        addProductScalar(3, -c, f);
+        addProductScalar(3, d, e);
+    }
+
+public:
+    CompensatedSum() {
+        for (int k = 0; k < Traits::components; ++k)
+            sum[k] = error[k] = 0;
+    }
+
+    FORCE_INLINE void add(const Number& x) {
+        T c[Traits::components];
+        Traits::split(x, c);
+        for (int k = 0; k < Traits::components; ++k)
+            addScalar(k, c[k]);
+    }
+
+    // Прибавить a * b
+    FORCE_INLINE void addProduct(const Number& a, const Number& b) { addProductTerms(a, b); }
+
+    Number value() const {
+        T c[Traits::components];
+        for (int k = 0; k < Traits::components; ++k)
+            c[k] = sum[k] + error[k];
+        return Traits::join(c);
+    }
+};
+
+template <typename Batch>
+FORCE_INLINE typename Batch::Number dotImpl(const Batch& a, const Batch& b, AccumulationMode mode) {
+    typedef typename Batch::Number Number;
+    if (mode == ACCUMULATE_COMPENSATED) {
+        CompensatedSum<Number> sum;
+        for (size_t i = 0; i < a.size(); ++i)
+            sum.addProduct(a.get(i), b.get(i));
+        return sum.value();
+    }
+    Number sum;
+    for (size_t i = 0; i < a.size(); ++i)
+        sum = mode == ACCUMULATE_FUSED ? fma(a.get(i), b.get(i), sum) : sum + a.get(i) * b.get(i);
+    return sum;
+}
+
+template <typename Batch>
+NO_INLINE typename Batch::Number dotScalar(const Batch& a, const Batch& b, AccumulationMode mode) {
+    return dotImpl(a, b, mode);
+}
+
+#if HAVE_X86_SIMD
+// Тот же код, но std::fma становится одной инструкцией, а не вызовом.
+// Код скалярный, поэтому нужен только FMA, без AVX2
+template <typename Batch>
+TARGET_FMA NO_INLINE typename Batch::Number dotFma(const Batch& a, const Batch& b, AccumulationMode mode) {
+    return dotImpl(a, b, mode);
+}
+#endif
+
+// Сумма a[i] * b[i] (без сопряжения) в выбранном режиме накопления.
+// Слагаемые всегда идут по порядку, так что результат воспроизводим
+template <typename Batch>
+typename Batch::Number dot(const Batch& a, const Batch& b, AccumulationMode mode = ACCUMULATE_PLAIN) {
+    assert(a.size() == b.size());
+#if HAVE_X86_SIMD
+    // Уровень SIMD_SCALAR, выбранный через setSimdLevel, отключает и FMA
+    if (mode != ACCUMULATE_PLAIN && simdLevel() != SIMD_SCALAR && hasHardwareFma())
+        return dotFma(a, b, mode);
+#endif
+    return dotScalar(a, b, mode);
+}
+
+// Тестирование
+void testAccumulation() {
+    // 1e16 + 1 - 1e16: обычная сумма теряет единицу, компенсированная - нет
+    ComplexBatch a, b;
+    a.append(ComplexNumber(1e16, 0));
+    a.append(ComplexNumber(1, 1));
+    a.append(ComplexNumber(-1e16, 0));
+    for (int i = 0; i < 3; ++i)
+        b.append(ComplexNumber(1, 0));
+    assert(dot(a, b).getReal() == 0);
+    assert(dot(a, b, ACCUMULATE_FUSED).getReal() == 0);
+    ComplexNumber exact = dot(a, b, ACCUMULATE_COMPENSATED);
+    assert(exact.getReal() == 1 && exact.getImaginary() == 1);
+
+    // Ошибки самих произведений: (1 + e)(1 - e) = 1 - e^2 не представимо,
+    // но fma прибавляет его к -1 точно
+    const double e = std::ldexp(1.0, -30);
+    QuaternionBatch x, y;
+    x.append(Quaternion(-1, 0, 0, 0));
+    y.append(Quaternion(1, 0, 0, 0));
+    x.append(Quaternion(1 + e, 0, 0, 0));
+    y.append(Quaternion(1 - e, 0, 0, 0));
+    assert(dot(x, y).getA() == 0 || OPERATORS_MAY_CONTRACT);
+    assert(dot(x, y, ACCUMULATE_FUSED).getA() == -e * e);
+    assert(dot(x, y, ACCUMULATE_COMPENSATED).getA() == -e * e);
+
+    // На обычных данных все режимы близки к сумме в long double,
+    // компенсированный - ближе всех
+    std::mt19937_64 rng(71);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    QuaternionBatch p, q;
+    BasicQuaternion<long double> reference;
+    for (int i = 0; i < 10000; ++i) {
+        Quaternion u(dist(rng), dist(rng), dist(rng), dist(rng)), v(dist(rng), dist(rng), dist(rng), dist(rng));
+        p.append(u);
+        q.append(v);
+        reference = reference + BasicQuaternion<long double>(u.getA(), u.getB(), u.getC(), u.getD()) *
+                                    BasicQuaternion<long double>(v.getA(), v.getB(), v.getC(), v.getD());
+    }
+    double errors[3];
+    const AccumulationMode modes[] = { ACCUMULATE_PLAIN, ACCUMULATE_FUSED, ACCUMULATE_COMPENSATED };
+    for (int m = 0; m < 3; ++m) {
+        Quaternion sum = dot(p, q, modes[m]);
+        errors[m] = (double)std::fabs(sum.getB() - reference.getB());
+        assert(errors[m] < 1e-10);
+
+        // Без SIMD (и без инструкции FMA) - тот же результат побитово
+        SimdLevel saved = simdLevel();
+        setSimdLevel(SIMD_SCALAR);
+        Quaternion scalar = dot(p, q, modes[m]);
+        setSimdLevel(saved);
+        assert(scalar.getA() == sum.getA() && scalar.getB() == sum.getB());
+        assert(scalar.getC() == sum.getC() && scalar.getD() == sum.getD());
+    }
+    // Компенсированная сумма ошибается не больше, чем на половину ulp
+    double halfUlp = std::fabs((double)reference.getB()) * std::numeric_limits<double>::epsilon() / 2;
+    assert(errors[2] <= halfUlp && errors[2] <= errors[0] && errors[2] <= errors[1]);
+
+    CompensatedSum<ComplexNumber> tiny;
+    for (int i = 0; i < 1000; ++i)
+        tiny.add(ComplexNumber(0.1, -0.1));
+    assert(tiny.value().getReal() == 100 && tiny.value().getImaginary() == -100);
+
+    std::cout << "All tests passed for compensated accumulation!" << std::endl;
+}
+
+BEGIN_EXACT_KERNELS
+
+// Операции узлов: те же формулы, что в пакетных ядрах, поэтому ленивый
+// и обычный пути дают побитово одинаковый результат
+template <typename ComplexOp, typename QuaternionOp>
+struct ExpressionOp {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r, std::integral_constant<int, 2>) {
+        ComplexOp::apply(x[0], x[1], y[0], y[1], r[0], r[1]);
+    }
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r, std::integral_constant<int, 4>) {
+        QuaternionOp::apply(x, y, r);
+    }
+};
+
+typedef ExpressionOp<ComplexAddOp, QuaternionAddOp> ExpressionAdd;
+typedef ExpressionOp<ComplexSubOp, QuaternionSubOp> ExpressionSub;
+typedef ExpressionOp<ComplexMulOp, QuaternionMulOp> ExpressionMul;
+typedef ExpressionOp<ComplexDivOp, QuaternionDivOp> ExpressionDiv;
+
+// Базовый класс узлов (CRTP)
+template <typename Derived>
+struct Expression {
+    const Derived& self() const { return static_cast<const Derived&>(*this); }
+};
+
+// Лист дерева: одно число, одинаковое для всех элементов
+template <typename Number>
+class ScalarTerminal : public Expression<ScalarTerminal<Number> > {
+private:
+    typedef NumberTraits<Number> Traits;
+    typename Traits::Scalar value[Traits::components];
+
+public:
+    typedef Number Value;
+    static const int operations = 0;
+
+    explicit ScalarTerminal(const Number& n) { Traits::split(n, value); }
+
+    size_t size() const { return 0; }
+
+    template <typename V>
+    FORCE_INLINE void eval(size_t, V* out) const {
+        for (int k = 0; k < Traits::components; ++k)
+            simdBroadcast(out[k], value[k]);
+    }
+};
+
+// Лист дерева: набор чисел, хранится по ссылке
+template <typename Batch>
+class BatchTerminal : public Expression<BatchTerminal<Batch> > {
+private:
+    const Batch& batch;
+
+public:
+    typedef typename Batch::Number Value;
+    static const int operations = 0;
+
+    explicit BatchTerminal(const Batch& b) : batch(b) {}
+
+    size_t size() const { return batch.size(); }
+
+    template <typename V>
+    FORCE_INLINE void eval(size_t i, V* out) const {
+        for (int k = 0; k < NumberTraits<Value>::components; ++k)
+            simdLoad(out[k], batch.data(k) + i);
+    }
+};
+
+// Узел двуместной операции, потомки хранятся по значению
+template <typename Op, typename L, typename R>
+class BinaryExpression : public Expression<BinaryExpression<Op, L, R> > {
+private:
+    L left;
+    R right;
+
+public:
+    typedef typename L::Value Value;
+    static_assert(std::is_same<Value, typename R::Value>::value, "operands of a lazy expression must have the same type");
+    // Число операций; обычные операторы создали бы operations - 1 промежуточных объектов
+    static const int operations = L::operations + R::operations + 1;
+
+    BinaryExpression(const L& l, const R& r) : left(l), right(r) {}
+
+    size_t size() const {
+        size_t l = left.size(), r = right.size();
+        assert(l == 0 || r == 0 || l == r);
+        return l != 0 ? l : r;
+    }
+
+    template <typename V>
+    FORCE_INLINE void eval(size_t i, V* out) const {
+        const int components = NumberTraits<Value>::components;
+        V x[components], y[components];
+        left.eval(i, x);
+        right.eval(i, y);
+        Op::apply(x, y, out, std::integral_constant<int, components>());
+    }
+
+    // Выражение без наборов можно сразу присвоить числу
+    operator Value() const { return evaluate(*this); }
+};
+
+// Проход по элементам: блоками по Lanes и скалярный хвост
+template <typename E, typename T, int Lanes>
+FORCE_INLINE void evaluateImpl(const E& e, T* const* out, size_t n) {
+    const int components = NumberTraits<typename E::Value>::components;
+    size_t i = 0;
+    if constexpr (Lanes > 1) {
+        typedef typename SimdVec<T, Lanes>::type V;
+        for (; i + Lanes <= n; i += Lanes) {
+            V r[components];
+            e.eval(i, r);
+            for (int k = 0; k < components; ++k)
+                simdStore(out[k] + i, r[k]);
+        }
+    }
+    for (; i < n; ++i) {
+        T r[components];
+        e.eval(i, r);
+        for (int k = 0; k < components; ++k)
+            out[k][i] = r[k];
+    }
+}
+
+template <typename E, typename T>
+void evaluateScalar(const E& e, T* const* out, size_t n) {
+    evaluateImpl<E, T, 1>(e, out, n);
+}
+
+#if HAVE_X86_SIMD
+template <typename E, typename T>
+TARGET_AVX2 void evaluateAvx2(const E& e, T* const* out, size_t n) {
+    evaluateImpl<E, T, SimdLanes<T, 32>::value>(e, out, n);
+}
+
+template <typename E, typename T>
+TARGET_AVX512 void evaluateAvx512(const E& e, T* const* out, size_t n) {
+    evaluateImpl<E, T, SimdLanes<T, 64>::value>(e, out, n);
+}
+#endif
+
+// Значение выражения, в котором нет наборов
+template <typename E>
+typename E::Value evaluate(const Expression<E>& expression) {
+    typedef NumberTraits<typename E::Value> Traits;
+    assert(expression.self().size() == 0);
+    typename Traits::Scalar c[Traits::components];
+    expression.self().eval(0, c);
+    return Traits::join(c);
+}
+
+END_EXACT_KERNELS
+
+// Поэлементное значение выражения над наборами, записывается в out
+template <typename E>
+void evaluate(const Expression<E>& expression, typename NumberTraits<typename E::Value>::Batch& out) {
+    typedef NumberTraits<typename E::Value> Traits;
+    typedef typename Traits::Scalar T;
+    const E& e = expression.self();
+    size_t n = e.size();
+    out.resize(n);
+    T* pointers[Traits::components];
+    for (int k = 0; k < Traits::components; ++k)
+        pointers[k] = out.data(k);
+#if HAVE_X86_SIMD
+    if (simdLevel() == SIMD_AVX512) {
+        evaluateAvx512(e, pointers, n);
+        return;
+    }
+    if (simdLevel() == SIMD_AVX2) {
+        evaluateAvx2(e, pointers, n);
+        return;
+    }
+#endif
+    evaluateScalar(e, pointers, n);
+}
+
+// Начало ленивого выражения
+template <typename T>
+ScalarTerminal<BasicComplexNumber<T> > lazy(const BasicComplexNumber<T>& n) {
+    return ScalarTerminal<BasicComplexNumber<T> >(n);
+}
+
+template <typename T>
+ScalarTerminal<BasicQuaternion<T> > lazy(const BasicQuaternion<T>& n) {
+    return ScalarTerminal<BasicQuaternion<T> >(n);
+}
+
+template <typename T>
+BatchTerminal<BasicComplexBatch<T> > lazy(const BasicComplexBatch<T>& b) {
+    return BatchTerminal<BasicComplexBatch<T> >(b);
+}
+
+template <typename T>
+BatchTerminal<BasicQuaternionBatch<T> > lazy(const BasicQuaternionBatch<T>& b) {
+    return BatchTerminal<BasicQuaternionBatch<T> >(b);
+}
+
+// Набор хранится по ссылке, временный набор пережил бы выражение
+template <typename T>
+void lazy(const BasicComplexBatch<T>&&) = delete;
+template <typename T>
+void lazy(const BasicQuaternionBatch<T>&&) = delete;
+
+// Операторы над узлами; число с другой стороны оборачивается автоматически
+#define LAZY_OPERATOR(symbol, Op)                                                              \
+    template <typename L, typename R>                                                          \
+    BinaryExpression<Op, L, R> operator symbol(const Expression<L>& l, const Expression<R>& r) { \
+        return BinaryExpression<Op, L, R>(l.self(), r.self());                                 \
+    }                                                                                          \
+    template <typename L>                                                                      \
+    BinaryExpression<Op, L, ScalarTerminal<typename L::Value> >                                \
+    operator symbol(const Expression<L>& l, const typename L::Value& r) {                      \
+        return BinaryExpression<Op, L, ScalarTerminal<typename L::Value> >(                    \
+            l.self(), ScalarTerminal<typename L::Value>(r));                                   \
+    }                                                                                          \
+    template <typename R>                                                                      \
+    BinaryExpression<Op, ScalarTerminal<typename R::Value>, R>                                 \
+    operator symbol(const typename R::Value& l, const Expression<R>& r) {                      \
+        return BinaryExpression<Op, ScalarTerminal<typename R::Value>, R>(                     \
+            ScalarTerminal<typename R::Value>(l), r.self());                                   \
+    }
+
+LAZY_OPERATOR(+, ExpressionAdd)
+LAZY_OPERATOR(-, ExpressionSub)
+LAZY_OPERATOR(*, ExpressionMul)
+LAZY_OPERATOR(/, ExpressionDiv)
+
+#undef LAZY_OPERATOR
+
+// Тестирование: ленивый путь совпадает с обычными операторами
+void testExpressions() {
+    ComplexNumber c1(3, 4), c2(1, 2), c3(-2, 5), c4(0.5, -1.5);
+    ComplexNumber eagerComplex = (c1 * c2 + c3) / c4;
+    ComplexNumber lazyComplex = (lazy(c1) * c2 + c3) / c4;
+    assert(lazyComplex.getReal() == eagerComplex.getReal());
+    assert(lazyComplex.getImaginary() == eagerComplex.getImaginary());
+
+    ComplexNumber sum = lazy(c1) + c2;
+    assert(sum.getReal() == 4 && sum.getImaginary() == 6);
+
+    // Знак нуля как у операторов: -0 + -0 = -0
+    ComplexNumber negativeZero(-0.0, -0.0);
+    ComplexNumber zeroSum = lazy(negativeZero) + negativeZero;
+    assert(std::signbit(zeroSum.getReal()) && std::signbit(zeroSum.getImaginary()));
+
+    Quaternion q1(1, 2, 3, 4), q2(5, 6, 7, 8), q3(-1, 0.5, 2, -3), q4(2, -1, 0.25, 1);
+    Quaternion eagerQuaternion = (q1 * q2 + q3) / q4;
+    Quaternion lazyQuaternion = (lazy(q1) * q2 + q3) / q4;
+    assert(lazyQuaternion.getA() == eagerQuaternion.getA());
+    assert(lazyQuaternion.getB() == eagerQuaternion.getB());
+    assert(lazyQuaternion.getC() == eagerQuaternion.getC());
+    assert(lazyQuaternion.getD() == eagerQuaternion.getD());
+
+    Quaternion product = lazy(q1) * q2;
+    assert(product.getA() == -60 && product.getB() == 12 && product.getC() == 30 && product.getD() == 24);
+
+    typedef decltype((lazy(q1) * q2 + q3) / q4) ChainExpression;
+    static_assert(ChainExpression::operations == 3, "three operations in the chain");
+
+    // Поэлементно над наборами, в том числе с числом-константой
+    const size_t n = 1027;
+    std::mt19937_64 rng(3);
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+    ComplexBatch ca, cb, cc;
+    QuaternionBatch qa, qb, qc;
+    for (size_t i = 0; i < n; ++i) {
+        ca.append(ComplexNumber(dist(rng), dist(rng)));
+        cb.append(ComplexNumber(dist(rng), dist(rng)));
+        cc.append(ComplexNumber(dist(rng), dist(rng)));
+        qa.append(Quaternion(dist(rng), dist(rng), dist(rng), dist(rng)));
+        qb.append(Quaternion(dist(rng), dist(rng), dist(rng), dist(rng)));
+        qc.append(Quaternion(dist(rng), dist(rng), dist(rng), dist(rng)));
+    }
+
+    SimdLevel saved = simdLevel();
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+    for (SimdLevel level : levels) {
+        if (level > detectSimdLevel())
+            continue;
+        setSimdLevel(level);
+
+        ComplexBatch zeros, zeroSums;
+        for (size_t i = 0; i < 19; ++i)
+            zeros.append(negativeZero);
+        zeroSums = lazy(zeros) + negativeZero;
+        for (size_t i = 0; i < zeros.size(); ++i)
+            assert(std::signbit(zeroSums.realData()[i]) && std::signbit(zeroSums.imagData()[i]));
+
+        ComplexBatch complexResult;
+        complexResult = (lazy(ca) * lazy(cb) + c1) / lazy(cc);
+        QuaternionBatch quaternionResult;
+        quaternionResult = (lazy(qa) * lazy(qb) + lazy(qc)) / q4;
+        assert(complexResult.size() == n && quaternionResult.size() == n);
+
+        // Допуск (см. matchesOperator) от (|a| |b| + |c|) / |d|
+        for (size_t i = 0; i < n; ++i) {
+            ComplexNumber expectedComplex = (ca.get(i) * cb.get(i) + c1) / cc.get(i);
+            auto size = [](const ComplexNumber& z) { return std::hypot(z.getReal(), z.getImaginary()); };
+            double complexScale = (size(ca.get(i)) * size(cb.get(i)) + size(c1)) / size(cc.get(i));
+            assert(matchesOperator(expectedComplex.getReal(), complexResult.get(i).getReal(), complexScale));
+            assert(matchesOperator(expectedComplex.getImaginary(), complexResult.get(i).getImaginary(), complexScale));
+
+            Quaternion expectedQuaternion = (qa.get(i) * qb.get(i) + qc.get(i)) / q4;
+            Quaternion actual = quaternionResult.get(i);
+            double quaternionScale = (std::sqrt(qa.get(i).norm() * qb.get(i).norm()) + std::sqrt(qc.get(i).norm()))
+                                     / std::sqrt(q4.norm());
+            assert(matchesOperator(expectedQuaternion.getA(), actual.getA(), quaternionScale));
+            assert(matchesOperator(expectedQuaternion.getB(), actual.getB(), quaternionScale));
+            assert(matchesOperator(expectedQuaternion.getC(), actual.getC(), quaternionScale));
+            assert(matchesOperator(expectedQuaternion.getD(), actual.getD(), quaternionScale));
+        }
+    }
+    setSimdLevel(saved);
+
+    std::cout << "All tests passed for lazy expressions!" << std::endl;
+}
+
+// ------------------------------------------------------------------
+// Пул потоков с перехватом задач (work stealing) для больших пакетов
+// ------------------------------------------------------------------
+
+// У каждого исполнителя своя очередь: свои задачи он берёт с конца,
+// а когда они кончаются, забирает задачи из начала чужих очередей.
+// Вызывающий поток тоже исполнитель (номер 0) и работает внутри wait(),
+// поэтому ThreadPool(1) выполняет всё последовательно без потоков.
+// Задачи не должны сами обращаться к тому же пулу.
+class ThreadPool {
+public:
+    typedef std::function<void(size_t worker)> Task;
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue> > queues;
+    std::vector<std::thread> threads;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::atomic<long> queued;
+    std::atomic<size_t> pending;
+    bool stopping;
+    // Первое исключение из задач до ближайшего wait()
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    // Выполнить одну задачу: свою с конца или чужую с начала очереди.
+    // Исключение задачи запоминается, а задача всё равно считается
+    // выполненной, иначе wait() ждал бы её вечно
+    bool runOne(size_t worker) {
+        size_t count = queues.size();
+        for (size_t i = 0; i < count; ++i) {
+            WorkerQueue& queue = *queues[(worker + i) % count];
+            Task task;
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.tasks.empty())
+                    continue;
+                if (i == 0) {
+                    task = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                } else {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+            }
+            --queued;
+            try {
+                task(worker);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+            if (pending.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(sleepMutex);
+                done.notify_all();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(size_t worker) {
+        for (;;) {
+            if (runOne(worker))
+                continue;
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this]() { return stopping || queued > 0; });
+            if (stopping)
+                return;
+        }
+    }
+
+public:
+    // threads - общее число исполнителей вместе с вызывающим потоком,
+    // 0 - по числу ядер
+    explicit ThreadPool(size_t threads = 0) : queued(0), pending(0), stopping(false) {
+        if (threads == 0)
+            threads = std::thread::hardware_concurrency();
+        if (threads == 0)
+            threads = 1;
+        for (size_t i = 0; i < threads; ++i)
+            queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+        for (size_t i = 1; i < threads; ++i)
+            this->threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+
+    // Число исполнителей
+    size_t size() const { return queues.size(); }
+
+    // Поставить задачу в очередь исполнителя worker
+    void submit(size_t worker, Task task) {
+        ++pending;
+        {
+            std::lock_guard<std::mutex> lock(queues[worker % queues.size()]->mutex);
+            queues[worker % queues.size()]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            ++queued;
+        }
+        wake.notify_one();
+    }
+
+    // Дождаться всех задач, помогая их выполнять. Если задача бросила
+    // исключение, первое из них бросается отсюда после завершения всех
+    void wait() {
+        while (pending > 0) {
+            if (runOne(0))
+                continue;
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            done.wait(lock, [this]() { return pending == 0 || queued > 0; });
+        }
+        std::exception_ptr failure;
+        {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            std::swap(failure, error);
+        }
+        if (failure)
+            std::rethrow_exception(failure);
+    }
+
+    // body(begin, end, worker) для кусков [begin, end) длиной grain.
+    // Соседние куски попадают в очередь одного исполнителя.
+    template <typename F>
+    void parallelFor(size_t begin, size_t end, size_t grain, F body) {
+        if (begin >= end)
+            return;
+        if (grain == 0)
+            grain = 1;
+        size_t blocks = (end - begin + grain - 1) / grain;
+        if (queues.size() == 1 || blocks == 1) {
+            for (size_t start = begin; start < end; start += grain)
+                body(start, std::min(end, start + grain), (size_t)0);
+            return;
+        }
+        for (size_t block = 0; block < blocks; ++block) {
+            size_t start = begin + block * grain;
+            size_t finish = std::min(end, start + grain);
+            submit(block * queues.size() / blocks, [&body, start, finish](size_t worker) {
+                body(start, finish, worker);
+            });
+        }
+        wait();
+    }
+
+    // Свёртка [begin, end) с фиксированным разбиением на блоки по block
+    // элементов: map(begin, end) сворачивает блок слева направо, затем
+    // результаты блоков сворачиваются combine тоже слева направо.
+    // Разбиение не зависит от числа потоков, поэтому результат одинаков
+    // побитово при любом размере пула, а порядок операндов сохраняется
+    // (важно для некоммутативного умножения кватернионов).
+    template <typename R, typename Map, typename Combine>
+    R parallelReduce(size_t begin, size_t end, size_t block, R identity, Map map, Combine combine) {
+        if (begin >= end)
+            return identity;
+        if (block == 0)
+            block = 1;
+        size_t blocks = (end - begin + block - 1) / block;
+        std::vector<R> partial(blocks, identity);
+        parallelFor(0, blocks, 1, [&](size_t first, size_t last, size_t) {
+            for (size_t b = first; b < last; ++b)
+                partial[b] = map(begin + b * block, std::min(end, begin + (b + 1) * block));
+        });
+        R result = partial[0];
+        for (size_t b = 1; b < blocks; ++b)
+            result = combine(result, partial[b]);
+        return result;
+    }
+
+    // Тестирование
+    static void test() {
+        const size_t n = 100003;
+        for (size_t threads = 1; threads <= 4; ++threads) {
+            ThreadPool pool(threads);
+            assert(pool.size() == threads);
+
+            // Каждый индекс обрабатывается ровно один раз
+            std::vector<int> visits(n, 0);
+            pool.parallelFor(0, n, 1000, [&](size_t begin, size_t end, size_t worker) {
+                assert(worker < threads);
+                for (size_t i = begin; i < end; ++i)
+                    ++visits[i];
+            });
+            for (size_t i = 0; i < n; ++i)
+                assert(visits[i] == 1);
+
+            // Пул можно использовать повторно
+            std::atomic<size_t> total(0);
+            for (int round = 0; round < 3; ++round)
+                pool.parallelFor(0, n, 777, [&](size_t begin, size_t end, size_t) { total += end - begin; });
+            assert(total == 3 * n);
+
+            size_t sum = pool.parallelReduce(0, n, 1000, (size_t)0,
+                [](size_t begin, size_t end) {
+                    size_t s = 0;
+                    for (size_t i = begin; i < end; ++i)
+                        s += i;
+                    return s;
+                },
+                [](size_t x, size_t y) { return x + y; });
+            assert(sum == n * (n - 1) / 2);
+
+            // Исключение задачи доходит до вызывающего, остальные куски
+            // на пуле выполняются (без пула цикл обрывается), пул
+            // остаётся рабочим
+            std::atomic<size_t> done(0);
+            bool caught = false;
+            try {
+                pool.parallelFor(0, n, 1000, [&](size_t begin, size_t end, size_t) {
+                    if (begin <= n / 2 && n / 2 < end)
+                        throw std::runtime_error("block failed");
+                    done += end - begin;
+                });
+            } catch (const std::runtime_error& e) {
+                caught = std::string(e.what()) == "block failed";
+            }
+            assert(caught && (threads == 1 || done == n - 1000));
+            total = 0;
+            pool.parallelFor(0, n, 777, [&](size_t begin, size_t end, size_t) { total += end - begin; });
+            assert(total == n);
+        }
+
+        std::cout << "All tests passed for ThreadPool!" << std::endl;
+    }
+};
+
+// ------------------------------------------------------------------
+// Композиция поворотов: упорядоченные параллельные произведение
+// и префиксные произведения массива кватернионов
+// ------------------------------------------------------------------
+
+// Блок, на которые делится массив; от него зависит только расстановка
+// скобок, но не порядок множителей и не число потоков
+const size_t PRODUCT_BLOCK = 4096;
+
+// Последовательное произведение first[begin] * ... * first[end - 1].
+// Если renormalizeEvery > 0, после каждых renormalizeEvery умножений
+// промежуточный результат приводится к единичной норме.
+template <typename T>
+BasicQuaternion<T> sequentialProduct(const BasicQuaternion<T>* first, size_t begin, size_t end,
+                                     size_t renormalizeEvery) {
+    BasicQuaternion<T> accumulator = first[begin];
+    size_t sinceRenormalize = 0;
+    for (size_t i = begin + 1; i < end; ++i) {
+        accumulator = accumulator * first[i];
+        if (renormalizeEvery != 0 && ++sinceRenormalize == renormalizeEvery) {
+            accumulator = accumulator.normalized();
+            sinceRenormalize = 0;
+        }
+    }
+    return accumulator;
+}
+
+// Произведение first[0] * first[1] * ... * first[n - 1] на пуле потоков.
+// Умножение Гамильтона ассоциативно, но не коммутативно, поэтому блоки
+// перемножаются параллельно, а их результаты - строго слева направо.
+// Результат одинаков побитово при любом числе потоков.
+// renormalizeEvery > 0 имеет смысл только для цепочек поворотов
+// (единичных кватернионов): он сдерживает дрейф нормы.
+template <typename T>
+BasicQuaternion<T> reduceProduct(const BasicQuaternion<T>* first, size_t n, ThreadPool& pool,
+                                 size_t renormalizeEvery = 0) {
+    if (n == 0)
+        return BasicQuaternion<T>(1, 0, 0, 0);
+    return pool.parallelReduce(0, n, PRODUCT_BLOCK, BasicQuaternion<T>(1, 0, 0, 0),
+        [&](size_t begin, size_t end) { return sequentialProduct(first, begin, end, renormalizeEvery); },
+        [&](const BasicQuaternion<T>& x, const BasicQuaternion<T>& y) {
+            BasicQuaternion<T> product = x * y;
+            return renormalizeEvery != 0 ? product.normalized() : product;
+        });
+}
+
+// Префиксные произведения: out[i] = first[0] * first[1] * ... * first[i].
+// Три прохода: произведения блоков (параллельно), префиксы блоков
+// (последовательно, слева направо), затем каждый блок домножается
+// справа на свои элементы, начиная с префикса предыдущих блоков.
+// out может совпадать с first.
+template <typename T>
+void inclusiveScanProduct(const BasicQuaternion<T>* first, size_t n, BasicQuaternion<T>* out,
+                          ThreadPool& pool, size_t renormalizeEvery = 0) {
+    if (n == 0)
+        return;
+    size_t blocks = (n + PRODUCT_BLOCK - 1) / PRODUCT_BLOCK;
+    std::vector<BasicQuaternion<T> > prefix(blocks);
+    pool.parallelFor(0, blocks - 1, 1, [&](size_t firstBlock, size_t lastBlock, size_t) {
+        for (size_t b = firstBlock; b < lastBlock; ++b)
+            prefix[b + 1] = sequentialProduct(first, b * PRODUCT_BLOCK, (b + 1) * PRODUCT_BLOCK, renormalizeEvery);
+    });
+    for (size_t b = 2; b < blocks; ++b) {
+        prefix[b] = prefix[b - 1] * prefix[b];
+        if (renormalizeEvery != 0)
+            prefix[b] = prefix[b].normalized();
+    }
+
+    pool.parallelFor(0, blocks, 1, [&](size_t firstBlock, size_t lastBlock, size_t) {
+        for (size_t b = firstBlock; b < lastBlock; ++b) {
+            size_t begin = b * PRODUCT_BLOCK;
+            size_t end = std::min(n, begin + PRODUCT_BLOCK);
+            BasicQuaternion<T> running = b == 0 ? first[0] : prefix[b] * first[begin];
+            out[begin] = running;
+            size_t sinceRenormalize = 0;
+            for (size_t i = begin + 1; i < end; ++i) {
+                running = running * first[i];
+                if (renormalizeEvery != 0 && ++sinceRenormalize == renormalizeEvery) {
+                    running = running.normalized();
+                    sinceRenormalize = 0;
+                }
+                out[i] = running;
+            }
+        }
+    });
+}
+
+// Тестирование
+void testQuaternionChains() {
+    const size_t n = 3 * PRODUCT_BLOCK + 123;
+    std::mt19937_64 rng(9);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    std::vector<Quaternion> rotations;
+    for (size_t i = 0; i < n; ++i)
+        rotations.push_back(Quaternion(dist(rng), dist(rng), dist(rng), dist(rng)).normalized());
+
+    std::vector<Quaternion> expected(n);
+    expected[0] = rotations[0];
+    for (size_t i = 1; i < n; ++i)
+        expected[i] = expected[i - 1] * rotations[i];
+
+    Quaternion first;
+    for (size_t threads = 1; threads <= 4; ++threads) {
+        ThreadPool pool(threads);
+        Quaternion product = reduceProduct(rotations.data(), n, pool);
+        if (threads == 1)
+            first = product;
+        assert(product.getA() == first.getA() && product.getB() == first.getB() &&
+               product.getC() == first.getC() && product.getD() == first.getD());
+        assert(std::fabs(product.getA() - expected[n - 1].getA()) < 1e-9);
+        assert(std::fabs(product.getD() - expected[n - 1].getD()) < 1e-9);
+
+        std::vector<Quaternion> scan(n);
+        inclusiveScanProduct(rotations.data(), n, scan.data(), pool);
+        for (size_t i = 0; i < n; ++i) {
+            assert(std::fabs(scan[i].getA() - expected[i].getA()) < 1e-9);
+            assert(std::fabs(scan[i].getB() - expected[i].getB()) < 1e-9);
+            assert(std::fabs(scan[i].getC() - expected[i].getC()) < 1e-9);
+            assert(std::fabs(scan[i].getD() - expected[i].getD()) < 1e-9);
+        }
+        // Первый блок считается в том же порядке, что и последовательно
+        // (побитово, если операторы собраны без слияния)
+        assert(scan[10].getA() == expected[10].getA() || OPERATORS_MAY_CONTRACT);
+
+        // Перестановка множителей меняет результат: порядок важен
+        std::vector<Quaternion> reversed(rotations.rbegin(), rotations.rend());
+        Quaternion reversedProduct = reduceProduct(reversed.data(), n, pool);
+        assert(std::fabs(reversedProduct.getB() - product.getB()) > 1e-6 ||
+               std::fabs(reversedProduct.getC() - product.getC()) > 1e-6);
+
+        // С перенормировкой норма остаётся единичной
+        Quaternion normalized = reduceProduct(rotations.data(), n, pool, 256);
+        assert(std::fabs(normalized.norm() - 1) < 1e-14);
+        inclusiveScanProduct(rotations.data(), n, scan.data(), pool, 256);
+        assert(std::fabs(scan[n - 1].norm() - 1) < 1e-14);
+    }
+
+    // Пустой массив даёт единицу
+    ThreadPool pool(2);
+    Quaternion unit = reduceProduct((const Quaternion*)0, 0, pool);
+    assert(unit.getA() == 1 && unit.getB() == 0 && unit.getC() == 0 && unit.getD() == 0);
+
+    std::cout << "All tests passed for quaternion product chains!" << std::endl;
+}
+
+// ------------------------------------------------------------------
+// Быстрое преобразование Фурье над массивами BasicComplexBatch.
+// Алгоритм Стокхэма со смешанным основанием (4, 2, 3 и любые простые
+// множители): каждый этап читает один буфер и пишет другой, выход сразу
+// в естественном порядке, без перестановки битов. Этапы по основаниям
+// 2 и 4 векторные, большие простые основания - по Блюстейну.
+// Прямое преобразование: X[k] = sum x[j] * exp(-2 pi i j k / n),
+// обратное - с exp(+2 pi i j k / n) и делением на n.
+// ------------------------------------------------------------------
+
+// С этой длины этапы делятся между потоками пула
+const size_t FFT_PARALLEL_SIZE = 1 << 14;
+
+// Примерное число бабочек в одном куске параллельного этапа
+const size_t FFT_GRAIN = 4096;
+
+// body(begin, end, worker) для [0, n): на пуле, если он есть и n велико
+template <typename F>
+void fftRange(ThreadPool* pool, size_t n, size_t grain, F body) {
+    if (pool == 0 || pool->size() == 1 || n < FFT_PARALLEL_SIZE)
+        body((size_t)0, n, (size_t)0);
+    else
+        pool->parallelFor(0, n, grain, body);
+}
+
+// exp(-2 pi i j / n); угол считается в long double от j mod n
+template <typename T>
+void unitRoot(size_t j, size_t n, T& re, T& im) {
+    const long double pi = 3.141592653589793238462643383279502884L;
+    long double angle = -2 * pi * (long double)(j % n) / (long double)n;
+    re = (T)std::cos(angle);
+    im = (T)std::sin(angle);
+}
+
+// Планов в общем кэше, после которых из него уходят неиспользуемые
+const size_t FFT_PLAN_CACHE_SIZE = 64;
+
+// Кэш планов: один неизменяемый план на длину, общий для всех потоков.
+// Последний план потока берётся без блокировки, остальные - из словаря
+// по длине. План строится вне блокировки: план Блюстейна сам берёт
+// план из кэша. Когда в словаре FFT_PLAN_CACHE_SIZE планов, из него
+// удаляются те, которые больше никто не держит
+template <typename Plan>
+std::shared_ptr<const Plan> cachedPlan(size_t n) {
+    static thread_local std::shared_ptr<const Plan> last;
+    if (last && last->size() == n)
+        return last;
+    static std::mutex mutex;
+    static std::map<size_t, std::shared_ptr<const Plan> > plans;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = plans.find(n);
+        if (found != plans.end())
+            return last = found->second;
+    }
+    std::shared_ptr<const Plan> plan = std::make_shared<const Plan>(n);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (plans.size() >= FFT_PLAN_CACHE_SIZE) {
+        for (auto it = plans.begin(); it != plans.end();)
+            it = it->second.use_count() == 1 ? plans.erase(it) : std::next(it);
+    }
+    return last = plans.emplace(n, plan).first->second;
+}
+
+BEGIN_EXACT_KERNELS
+
+// Бабочки по основаниям 2 и 4 над V - вектором или скаляром T.
+// Указатели уже сдвинуты на q; выходы лежат через stride s
+template <typename V, typename T>
+FORCE_INLINE void fftRotate(const V& br, const V& bi, const V& wr, const V& wi, T* outR, T* outI) {
+    simdStore(outR, V(br * wr - bi * wi));
+    simdStore(outI, V(br * wi + bi * wr));
+}
+
+template <typename V, typename T>
+FORCE_INLINE void fftButterfly2(const T* a0r, const T* a0i, const T* a1r, const T* a1i, T* yr, T* yi, size_t s,
+                                const V& wr, const V& wi) {
+    V ar, ai, br, bi;
+    simdLoad(ar, a0r);
+    simdLoad(ai, a0i);
+    simdLoad(br, a1r);
+    simdLoad(bi, a1i);
+    simdStore(yr, V(ar + br));
+    simdStore(yi, V(ai + bi));
+    fftRotate(V(ar - br), V(ai - bi), wr, wi, yr + s, yi + s);
+}
+
+template <typename V, typename T>
+FORCE_INLINE void fftButterfly4(const T* const* ar, const T* const* ai, T* yr, T* yi, size_t s, const V* wr,
+                                const V* wi) {
+    V a0r, a0i, a1r, a1i, a2r, a2i, a3r, a3i;
+    simdLoad(a0r, ar[0]);
+    simdLoad(a0i, ai[0]);
+    simdLoad(a1r, ar[1]);
+    simdLoad(a1i, ai[1]);
+    simdLoad(a2r, ar[2]);
+    simdLoad(a2i, ai[2]);
+    simdLoad(a3r, ar[3]);
+    simdLoad(a3i, ai[3]);
+    V t0r = a0r + a2r, t0i = a0i + a2i;
+    V t1r = a0r - a2r, t1i = a0i - a2i;
+    V t2r = a1r + a3r, t2i = a1i + a3i;
+    // (a1 - a3) * (-i)
+    V t3r = a1i - a3i, t3i = a3r - a1r;
+    simdStore(yr, V(t0r + t2r));
+    simdStore(yi, V(t0i + t2i));
+    fftRotate(V(t1r + t3r), V(t1i + t3i), wr[0], wi[0], yr + s, yi + s);
+    fftRotate(V(t0r - t2r), V(t0i - t2i), wr[1], wi[1], yr + 2 * s, yi + 2 * s);
+    fftRotate(V(t1r - t3r), V(t1i - t3i), wr[2], wi[2], yr + 3 * s, yi + 3 * s);
+}
+
+// Столбцы q из [q, qEnd) одного p: векторами по Lanes, остаток -
+// векторами вдвое уже и так до скаляра. Ранние этапы с малым шагом
+// (s = 4 при 8 элементах в регистре) тоже идут векторами
+template <typename T, int Lanes>
+FORCE_INLINE void fftColumns2(const T* a0r, const T* a0i, const T* a1r, const T* a1i, T* yr, T* yi, size_t s,
+                              T wr, T wi, size_t q, size_t qEnd) {
+    typedef typename std::conditional<Lanes == 1, T, typename SimdVec<T, Lanes>::type>::type V;
+    if (q + Lanes <= qEnd) {
+        V vr, vi;
+        simdBroadcast(vr, wr);
+        simdBroadcast(vi, wi);
+        for (; q + Lanes <= qEnd; q += Lanes)
+            fftButterfly2(a0r + q, a0i + q, a1r + q, a1i + q, yr + q, yi + q, s, vr, vi);
+    }
+    if constexpr (Lanes > 1)
+        fftColumns2<T, Lanes / 2>(a0r, a0i, a1r, a1i, yr, yi, s, wr, wi, q, qEnd);
+}
+
+template <typename T, int Lanes>
+FORCE_INLINE void fftColumns4(const T* const* ar, const T* const* ai, T* yr, T* yi, size_t s, const T* wr,
+                              const T* wi, size_t q, size_t qEnd) {
+    typedef typename std::conditional<Lanes == 1, T, typename SimdVec<T, Lanes>::type>::type V;
+    if (q + Lanes <= qEnd) {
+        V vr[3], vi[3];
+        for (int k = 0; k < 3; ++k) {
+            simdBroadcast(vr[k], wr[k]);
+            simdBroadcast(vi[k], wi[k]);
+        }
+        for (; q + Lanes <= qEnd; q += Lanes) {
+            const T* br[4] = { ar[0] + q, ar[1] + q, ar[2] + q, ar[3] + q };
+            const T* bi[4] = { ai[0] + q, ai[1] + q, ai[2] + q, ai[3] + q };
+            fftButterfly4(br, bi, yr + q, yi + q, s, vr, vi);
+        }
+    }
+    if constexpr (Lanes > 1)
+        fftColumns4<T, Lanes / 2>(ar, ai, yr, yi, s, wr, wi, q, qEnd);
+}
+
+// Этап по основанию 2 или 4 (см. FftPlan), векторами по q, где входы
+// и выходы лежат подряд. Множители одного p общие для всех q. Без
+// слияния векторы совпадают со скаляром побитово, так что результат
+// не зависит от уровня SIMD и от разбиения между потоками
+template <typename T, int Lanes>
+FORCE_INLINE void fftRadix2Impl(const T* xr, const T* xi, T* yr, T* yi, const T* twiddleRe, const T* twiddleIm,
+                                size_t m, size_t s, size_t pBegin, size_t pEnd, size_t qBegin, size_t qEnd) {
+    for (size_t p = pBegin; p < pEnd; ++p)
+        fftColumns2<T, Lanes>(xr + s * p, xi + s * p, xr + s * (p + m), xi + s * (p + m), yr + s * 2 * p,
+                              yi + s * 2 * p, s, twiddleRe[p], twiddleIm[p], qBegin, qEnd);
+}
+
+template <typename T, int Lanes>
+FORCE_INLINE void fftRadix4Impl(const T* xr, const T* xi, T* yr, T* yi, const T* twiddleRe, const T* twiddleIm,
+                                size_t m, size_t s, size_t pBegin, size_t pEnd, size_t qBegin, size_t qEnd) {
+    for (size_t p = pBegin; p < pEnd; ++p) {
+        const T* ar[4] = { xr + s * p, xr + s * (p + m), xr + s * (p + 2 * m), xr + s * (p + 3 * m) };
+        const T* ai[4] = { xi + s * p, xi + s * (p + m), xi + s * (p + 2 * m), xi + s * (p + 3 * m) };
+        fftColumns4<T, Lanes>(ar, ai, yr + s * 4 * p, yi + s * 4 * p, s, twiddleRe + 3 * p, twiddleIm + 3 * p,
+                              qBegin, qEnd);
+    }
+}
+
+template <typename T>
+void fftRadix2Scalar(const T* xr, const T* xi, T* yr, T* yi, const T* twiddleRe, const T* twiddleIm, size_t m,
+                     size_t s, size_t pBegin, size_t pEnd, size_t qBegin, size_t qEnd) {
+    fftRadix2Impl<T, 1>(xr, xi, yr, yi, twiddleRe, twiddleIm, m, s, pBegin, pEnd, qBegin, qEnd);
+}
+
+template <typename T>
+void fftRadix4Scalar(const T* xr, const T* xi, T* yr, T* yi, const T* twiddleRe, const T* twiddleIm, size_t m,
+                     size_t s, size_t pBegin, size_t pEnd, size_t qBegin, size_t qEnd) {
+    fftRadix4Impl<T, 1>(xr, xi, yr, yi, twiddleRe, twiddleIm, m, s, pBegin, pEnd, qBegin, qEnd);
+}
+
+#if HAVE_X86_SIMD
+template <typename T>
+TARGET_AVX2 void fftRadix2Avx2(const T* xr, const T* xi, T* yr, T* yi, const T* twiddleRe, const T* twiddleIm,
+                               size_t m, size_t s, size_t pBegin, size_t pEnd, size_t qBegin, size_t qEnd) {
+    fftRadix2Impl<T, SimdLanes<T, 32>::value>(xr, xi, yr, yi, twiddleRe, twiddleIm, m, s, pBegin, pEnd, qBegin, qEnd);
+}
+
+template <typename T>
+TARGET_AVX2 void fftRadix4Avx2(const T* xr, const T* xi, T* yr, T* yi, const T* twiddleRe, const T* twiddleIm,
+                               size_t m, size_t s, size_t pBegin, size_t pEnd, size_t qBegin, size_t qEnd) {
+    fftRadix4Impl<T, SimdLanes<T, 32>::value>(xr, xi, yr, yi, twiddleRe, twiddleIm, m, s, pBegin, pEnd, qBegin, qEnd);
+}
+
+template <typename T>
+TARGET_AVX512 void fftRadix2Avx512(const T* xr, const T* xi, T* yr, T* yi, const T* twiddleRe, const T* twiddleIm,
+                                   size_t m, size_t s, size_t pBegin, size_t pEnd, size_t qBegin, size_t qEnd) {
+    fftRadix2Impl<T, SimdLanes<T, 64>::value>(xr, xi, yr, yi, twiddleRe, twiddleIm, m, s, pBegin, pEnd, qBegin, qEnd);
+}
+
+template <typename T>
+TARGET_AVX512 void fftRadix4Avx512(const T* xr, const T* xi, T* yr, T* yi, const T* twiddleRe, const T* twiddleIm,
+                                   size_t m, size_t s, size_t pBegin, size_t pEnd, size_t qBegin, size_t qEnd) {
+    fftRadix4Impl<T, SimdLanes<T, 64>::value>(xr, xi, yr, yi, twiddleRe, twiddleIm, m, s, pBegin, pEnd, qBegin, qEnd);
+}
+#endif
+
+END_EXACT_KERNELS
+
+// Ядра этапов по основаниям 2 и 4 для одного уровня SIMD
+template <typename T>
+struct FftKernels {
+    typedef void (*Radix)(const T* xr, const T* xi, T* yr, T* yi, const T* twiddleRe, const T* twiddleIm, size_t m,
+                          size_t s, size_t pBegin, size_t pEnd, size_t qBegin, size_t qEnd);
+
+    Radix radix2;
+    Radix radix4;
+};
+
+template <typename T>
+const FftKernels<T>& fftKernels(SimdLevel level) {
+    static const FftKernels<T> scalar = { fftRadix2Scalar<T>, fftRadix4Scalar<T> };
+#if HAVE_X86_SIMD
+    static const FftKernels<T> avx2 = { fftRadix2Avx2<T>, fftRadix4Avx2<T> };
+    static const FftKernels<T> avx512 = { fftRadix2Avx512<T>, fftRadix4Avx512<T> };
+    if (level == SIMD_AVX512)
+        return avx512;
+    if (level == SIMD_AVX2)
+        return avx2;
+#endif
+    return scalar;
+}
+
+// С этого основания этап считается по Блюстейну (свёрткой через
+// БПФ длины степени двойки), а не ДПФ в лоб за radix^2
+const size_t FFT_BLUESTEIN_RADIX = 64;
+
+// План комплексного преобразования длины n
+template <typename T>
+class FftPlan {
+    // Этап: основание radix, длина подпреобразования length, шаг stride
+    // (length * stride == n). Поворачивающие множители w^(p*k),
+    // w = exp(-2 pi i / length), p < length / radix, 1 <= k < radix,
+    // лежат с индекса twiddle + p * (radix - 1) + k - 1; для
+    // произвольного основания с индекса roots лежат корни степени radix,
+    // для основания от FFT_BLUESTEIN_RADIX chirp - номер в chirps
+    struct Stage {
+        size_t radix;
+        size_t length;
+        size_t stride;
+        size_t twiddle;
+        size_t roots;
+        size_t chirp;
+    };
+
+    // ДПФ длины radix по Блюстейну: X[k] = c[k] sum x[j] c[j] conj(c[k - j]),
+    // c[j] = exp(-pi i j^2 / radix). Сумма - циклическая свёртка длины
+    // plan->size() >= 2 radix - 1; filter - спектр conj(c), продолженного
+    // по кругу
+    struct Chirp {
+        std::shared_ptr<const FftPlan> plan;
+        AlignedVector<T> chirpRe;
+        AlignedVector<T> chirpIm;
+        AlignedVector<T> filterRe;
+        AlignedVector<T> filterIm;
+
+        explicit Chirp(size_t radix) : chirpRe(radix), chirpIm(radix) {
+            size_t size = 1;
+            while (size < 2 * radix - 1)
+                size *= 2;
+            plan = cachedPlan<FftPlan>(size);
+            filterRe.assign(size, 0);
+            filterIm.assign(size, 0);
+            for (size_t j = 0; j < radix; ++j) {
+                unitRoot(j * j % (2 * radix), 2 * radix, chirpRe[j], chirpIm[j]);
+                filterRe[j] = chirpRe[j];
+                filterIm[j] = -chirpIm[j];
+                if (j != 0) {
+                    filterRe[size - j] = chirpRe[j];
+                    filterIm[size - j] = -chirpIm[j];
+                }
+            }
+            AlignedVector<T> workRe(size), workIm(size);
+            plan->forward(filterRe.data(), filterIm.data(), filterRe.data(), filterIm.data(), workRe.data(),
+                          workIm.data());
+        }
+    };
+
+    size_t n;
+    std::vector<Stage> stages;
+    std::vector<Chirp> chirps;
+    // Рабочая память одного исполнителя для этапов Блюстейна (в каждой
+    // из двух плоскостей): свёртка и буфер её преобразования
+    size_t scratch;
+    AlignedVector<T> twiddleRe;
+    AlignedVector<T> twiddleIm;
+
+    // Основания по порядку: сначала 4, затем 2, 3 и остальные простые
+    static std::vector<size_t> factorize(size_t n) {
+        std::vector<size_t> radices;
+        while (n % 4 == 0) {
+            radices.push_back(4);
+            n /= 4;
+        }
+        if (n % 2 == 0) {
+            radices.push_back(2);
+            n /= 2;
+        }
+        for (size_t p = 3; p * p <= n; p += 2) {
+            while (n % p == 0) {
+                radices.push_back(p);
+                n /= p;
+            }
+        }
+        if (n > 1)
+            radices.push_back(n);
+        return radices;
+    }
+
+    void radix3(const Stage& stage, const T* xr, const T* xi, T* yr, T* yi, size_t pBegin, size_t pEnd,
+                size_t qBegin, size_t qEnd) const {
+        size_t m = stage.length / 3, s = stage.stride;
+        // exp(-2 pi i / 3) = -1/2 - i h
+        const T h = std::sqrt((T)3) / 2;
+        for (size_t p = pBegin; p < pEnd; ++p) {
+            const T* wr = twiddleRe.data() + stage.twiddle + 2 * p;
+            const T* wi = twiddleIm.data() + stage.twiddle + 2 * p;
+            for (size_t q = qBegin; q < qEnd; ++q) {
+                size_t j = q + s * p;
+                T a0r = xr[j], a0i = xi[j];
+                T a1r = xr[j + s * m], a1i = xi[j + s * m];
+                T a2r = xr[j + 2 * s * m], a2i = xi[j + 2 * s * m];
+                T tr = a1r + a2r, ti = a1i + a2i;
+                T ur = a0r - tr / 2, ui = a0i - ti / 2;
+                // (a1 - a2) * (-i h)
+                T vr = (a1i - a2i) * h, vi = (a2r - a1r) * h;
+                T b1r = ur + vr, b1i = ui + vi;
+                T b2r = ur - vr, b2i = ui - vi;
+                size_t k = q + s * 3 * p;
+                yr[k] = a0r + tr;
+                yi[k] = a0i + ti;
+                yr[k + s] = b1r * wr[0] - b1i * wi[0];
+                yi[k + s] = b1r * wi[0] + b1i * wr[0];
+                yr[k + 2 * s] = b2r * wr[1] - b2i * wi[1];
+                yi[k + 2 * s] = b2r * wi[1] + b2i * wr[1];
+            }
+        }
+    }
+
+    // Простое основание меньше FFT_BLUESTEIN_RADIX: ДПФ длины radix в лоб
+    void radixAny(const Stage& stage, const T* xr, const T* xi, T* yr, T* yi, size_t pBegin, size_t pEnd,
+                  size_t qBegin, size_t qEnd) const {
+        size_t r = stage.radix, m = stage.length / r, s = stage.stride;
+        const T* rootRe = twiddleRe.data() + stage.roots;
+        const T* rootIm = twiddleIm.data() + stage.roots;
+        T ar[FFT_BLUESTEIN_RADIX], ai[FFT_BLUESTEIN_RADIX];
+        for (size_t p = pBegin; p < pEnd; ++p) {
+            const T* wr = twiddleRe.data() + stage.twiddle + (r - 1) * p;
+            const T* wi = twiddleIm.data() + stage.twiddle + (r - 1) * p;
+            for (size_t q = qBegin; q < qEnd; ++q) {
+                for (size_t j = 0; j < r; ++j) {
+                    ar[j] = xr[q + s * (p + j * m)];
+                    ai[j] = xi[q + s * (p + j * m)];
+                }
+                for (size_t k = 0; k < r; ++k) {
+                    T br = ar[0], bi = ai[0];
+                    for (size_t j = 1, index = k; j < r; ++j) {
+                        br += ar[j] * rootRe[index] - ai[j] * rootIm[index];
+                        bi += ar[j] * rootIm[index] + ai[j] * rootRe[index];
+                        index += k;
+                        if (index >= r)
+                            index -= r;
+                    }
+                    size_t out = q + s * (r * p + k);
+                    if (k == 0) {
+                        yr[out] = br;
+                        yi[out] = bi;
+                    } else {
+                        yr[out] = br * wr[k - 1] - bi * wi[k - 1];
+                        yi[out] = br * wi[k - 1] + bi * wr[k - 1];
+                    }
+                }
+            }
+        }
+    }
+
+    // Большое простое основание: каждое ДПФ длины radix - свёртка
+    // через два преобразования длины степени двойки в памяти scratch
+    void radixBluestein(const Stage& stage, const T* xr, const T* xi, T* yr, T* yi, size_t pBegin, size_t pEnd,
+                        size_t qBegin, size_t qEnd, T* scratchRe, T* scratchIm) const {
+        size_t r = stage.radix, m = stage.length / r, s = stage.stride;
+        const Chirp& chirp = chirps[stage.chirp];
+        size_t size = chirp.plan->size();
+        T* ar = scratchRe;
+        T* ai = scratchIm;
+        T* workRe = scratchRe + size;
+        T* workIm = scratchIm + size;
+        for (size_t p = pBegin; p < pEnd; ++p) {
+            const T* wr = twiddleRe.data() + stage.twiddle + (r - 1) * p;
+            const T* wi = twiddleIm.data() + stage.twiddle + (r - 1) * p;
+            for (size_t q = qBegin; q < qEnd; ++q) {
+                for (size_t j = 0; j < r; ++j) {
+                    T xjr = xr[q + s * (p + j * m)], xji = xi[q + s * (p + j * m)];
+                    ar[j] = xjr * chirp.chirpRe[j] - xji * chirp.chirpIm[j];
+                    ai[j] = xjr * chirp.chirpIm[j] + xji * chirp.chirpRe[j];
+                }
+                std::fill(ar + r, ar + size, (T)0);
+                std::fill(ai + r, ai + size, (T)0);
+                chirp.plan->forward(ar, ai, ar, ai, workRe, workIm);
+                for (size_t i = 0; i < size; ++i) {
+                    T cr = ar[i], ci = ai[i];
+                    ar[i] = cr * chirp.filterRe[i] - ci * chirp.filterIm[i];
+                    ai[i] = cr * chirp.filterIm[i] + ci * chirp.filterRe[i];
+                }
+                chirp.plan->inverse(ar, ai, ar, ai, workRe, workIm);
+                for (size_t k = 0; k < r; ++k) {
+                    T br = ar[k] * chirp.chirpRe[k] - ai[k] * chirp.chirpIm[k];
+                    T bi = ar[k] * chirp.chirpIm[k] + ai[k] * chirp.chirpRe[k];
+                    size_t out = q + s * (r * p + k);
+                    if (k == 0) {
+                        yr[out] = br;
+                        yi[out] = bi;
+                    } else {
+                        yr[out] = br * wr[k - 1] - bi * wi[k - 1];
+                        yi[out] = br * wi[k - 1] + bi * wr[k - 1];
+                    }
+                }
+            }
+        }
+    }
+
+    void runStage(const Stage& stage, const T* xr, const T* xi, T* yr, T* yi, size_t pBegin, size_t pEnd,
+                  size_t qBegin, size_t qEnd, T* scratchRe, T* scratchIm) const {
+        const FftKernels<T>& kernels = fftKernels<T>(simdLevel());
+        const T* wr = twiddleRe.data() + stage.twiddle;
+        const T* wi = twiddleIm.data() + stage.twiddle;
+        size_t m = stage.length / stage.radix;
+        switch (stage.radix) {
+        case 2:
+            kernels.radix2(xr, xi, yr, yi, wr, wi, m, stage.stride, pBegin, pEnd, qBegin, qEnd);
+            break;
+        case 3:
+            radix3(stage, xr, xi, yr, yi, pBegin, pEnd, qBegin, qEnd);
+            break;
+        case 4:
+            kernels.radix4(xr, xi, yr, yi, wr, wi, m, stage.stride, pBegin, pEnd, qBegin, qEnd);
+            break;
+        default:
+            if (stage.radix >= FFT_BLUESTEIN_RADIX)
+                radixBluestein(stage, xr, xi, yr, yi, pBegin, pEnd, qBegin, qEnd, scratchRe, scratchIm);
+            else
+                radixAny(stage, xr, xi, yr, yi, pBegin, pEnd, qBegin, qEnd);
+        }
+    }
+
+    // Этап на пуле: делится по p на первых этапах и по q на последних,
+    // каждый выход пишется ровно одним куском, поэтому результат
+    // не зависит от числа потоков. Исполнитель worker берёт свою часть
+    // рабочей памяти этапов Блюстейна
+    void stage(const Stage& stage, const T* xr, const T* xi, T* yr, T* yi, T* scratchRe, T* scratchIm,
+               ThreadPool* pool) const {
+        size_t m = stage.length / stage.radix, s = stage.stride;
+        if (m >= s) {
+            fftRange(pool, m, std::max<size_t>(1, FFT_GRAIN / s), [&](size_t begin, size_t end, size_t worker) {
+                runStage(stage, xr, xi, yr, yi, begin, end, 0, s, scratchRe + worker * scratch,
+                         scratchIm + worker * scratch);
+            });
+        } else {
+            fftRange(pool, s, std::max<size_t>(1, FFT_GRAIN / m), [&](size_t begin, size_t end, size_t worker) {
+                runStage(stage, xr, xi, yr, yi, 0, m, begin, end, scratchRe + worker * scratch,
+                         scratchIm + worker * scratch);
+            });
+        }
+    }
+
+public:
+    explicit FftPlan(size_t n) : n(n), scratch(0) {
+        size_t length = n, stride = 1;
+        for (size_t radix : factorize(n)) {
+            Stage stage = { radix, length, stride, twiddleRe.size(), 0, 0 };
+            size_t m = length / radix;
+            for (size_t p = 0; p < m; ++p) {
+                for (size_t k = 1; k < radix; ++k) {
+                    T re, im;
+                    unitRoot(p * k, length, re, im);
+                    twiddleRe.push_back(re);
+                    twiddleIm.push_back(im);
+                }
+            }
+            if (radix >= FFT_BLUESTEIN_RADIX) {
+                stage.chirp = chirps.size();
+                chirps.push_back(Chirp(radix));
+                scratch = std::max(scratch, 2 * chirps.back().plan->size());
+            } else if (radix > 4) {
+                stage.roots = twiddleRe.size();
+                for (size_t j = 0; j < radix; ++j) {
+                    T re, im;
+                    unitRoot(j, radix, re, im);
+                    twiddleRe.push_back(re);
+                    twiddleIm.push_back(im);
+                }
+            }
+            stages.push_back(stage);
+            length = m;
+            stride *= radix;
+        }
+    }
+
+    size_t size() const { return n; }
+
+    // Длина рабочего буфера для пула из workers исполнителей (без пула - 1)
+    size_t workSize(size_t workers = 1) const { return n + workers * scratch; }
+
+    // Основания этапов
+    std::vector<size_t> radices() const {
+        std::vector<size_t> result;
+        for (const Stage& stage : stages)
+            result.push_back(stage.radix);
+        return result;
+    }
+
+    // Прямое преобразование in -> out; work - буфер длины workSize()
+    // для числа исполнителей pool. out может совпадать с in, work - нет.
+    void forward(const T* inRe, const T* inIm, T* outRe, T* outIm, T* workRe, T* workIm,
+                 ThreadPool* pool = 0) const {
+        if (stages.empty()) {
+            if (n == 1) {
+                outRe[0] = inRe[0];
+                outIm[0] = inIm[0];
+            }
+            return;
+        }
+        // Буферы чередуются так, чтобы последний этап писал в out
+        bool odd = stages.size() % 2 == 1;
+        if (odd && inRe == outRe) {
+            std::copy(inRe, inRe + n, workRe);
+            std::copy(inIm, inIm + n, workIm);
+            inRe = workRe;
+            inIm = workIm;
+        }
+        const T* xr = inRe;
+        const T* xi = inIm;
+        T* yr = odd ? outRe : workRe;
+        T* yi = odd ? outIm : workIm;
+        for (const Stage& s : stages) {
+            stage(s, xr, xi, yr, yi, workRe + n, workIm + n, pool);
+            xr = yr;
+            xi = yi;
+            yr = yr == outRe ? workRe : outRe;
+            yi = yi == outIm ? workIm : outIm;
+        }
+    }
+
+    // Обратное преобразование с делением на n. Через прямое:
+    // перестановка действительной и мнимой частей на входе и выходе
+    // превращает exp(-...) в exp(+...), так что отдельные таблицы не нужны
+    void inverse(const T* inRe, const T* inIm, T* outRe, T* outIm, T* workRe, T* workIm,
+                 ThreadPool* pool = 0) const {
+        forward(inIm, inRe, outIm, outRe, workIm, workRe, pool);
+        const T scale = (T)1 / (T)n;
+        fftRange(pool, n, FFT_GRAIN, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; ++i) {
+                outRe[i] *= scale;
+                outIm[i] *= scale;
+            }
+        });
+    }
+};
+
+// План преобразования действительного сигнала чётной длины n через
+// комплексное длины n / 2: чётные отсчёты идут в действительную часть,
+// нечётные - в мнимую, спектры половин разделяются по симметрии
+template <typename T>
+class RealFftPlan {
+    size_t n;
+    std::shared_ptr<const FftPlan<T> > half;
+    // exp(-2 pi i k / n), k <= n / 2
+    AlignedVector<T> twiddleRe;
+    AlignedVector<T> twiddleIm;
+
+public:
+    explicit RealFftPlan(size_t n) : n(n), half(cachedPlan<FftPlan<T> >(n / 2)) {
+        assert(n % 2 == 0);
+        for (size_t k = 0; k <= n / 2; ++k) {
+            T re, im;
+            unitRoot(k, n, re, im);
+            twiddleRe.push_back(re);
+            twiddleIm.push_back(im);
+        }
+    }
+
+    size_t size() const { return n; }
+
+    // Длина рабочего буфера, как у FftPlan::workSize
+    size_t workSize(size_t workers = 1) const { return n / 2 + half->workSize(workers); }
+
+    // Спектр X[0..n/2] сигнала in; work - буфер длины workSize()
+    void forward(const T* in, T* outRe, T* outIm, T* workRe, T* workIm, ThreadPool* pool = 0) const {
+        size_t m = n / 2;
+        T* zr = workRe;
+        T* zi = workIm;
+        fftRange(pool, m, FFT_GRAIN, [&](size_t begin, size_t end, size_t) {
+            for (size_t j = begin; j < end; ++j) {
+                zr[j] = in[2 * j];
+                zi[j] = in[2 * j + 1];
+            }
+        });
+        half->forward(zr, zi, zr, zi, workRe + m, workIm + m, pool);
+        // E = (Z[k] + conj(Z[m-k])) / 2, O = (Z[k] - conj(Z[m-k])) / 2i,
+        // X[k] = E + exp(-2 pi i k / n) * O
+        fftRange(pool, m + 1, FFT_GRAIN, [&](size_t begin, size_t end, size_t) {
+            for (size_t k = begin; k < end; ++k) {
+                size_t j = k == m ? 0 : k;
+                size_t c = k == 0 ? 0 : m - k;
+                T er = (zr[j] + zr[c]) / 2, ei = (zi[j] - zi[c]) / 2;
+                T orr = (zi[j] + zi[c]) / 2, oi = (zr[c] - zr[j]) / 2;
+                outRe[k] = er + orr * twiddleRe[k] - oi * twiddleIm[k];
+                outIm[k] = ei + orr * twiddleIm[k] + oi * twiddleRe[k];
+            }
+        });
+    }
+
+    // Сигнал длины n по спектру X[0..n/2]; work - буфер длины workSize()
+    void inverse(const T* inRe, const T* inIm, T* out, T* workRe, T* workIm, ThreadPool* pool = 0) const {
+        size_t m = n / 2;
+        T* zr = workRe;
+        T* zi = workIm;
+        // E = (X[k] + conj(X[m-k])) / 2, O = (X[k] - conj(X[m-k])) / 2 *
+        // exp(2 pi i k / n), Z = E + i O
+        fftRange(pool, m, FFT_GRAIN, [&](size_t begin, size_t end, size_t) {
+            for (size_t k = begin; k < end; ++k) {
+                T er = (inRe[k] + inRe[m - k]) / 2, ei = (inIm[k] - inIm[m - k]) / 2;
+                T dr = (inRe[k] - inRe[m - k]) / 2, di = (inIm[k] + inIm[m - k]) / 2;
+                T orr = dr * twiddleRe[k] + di * twiddleIm[k];
+                T oi = di * twiddleRe[k] - dr * twiddleIm[k];
+                zr[k] = er - oi;
+                zi[k] = ei + orr;
+            }
+        });
+        half->inverse(zr, zi, zr, zi, workRe + m, workIm + m, pool);
+        fftRange(pool, m, FFT_GRAIN, [&](size_t begin, size_t end, size_t) {
+            for (size_t j = begin; j < end; ++j) {
+                out[2 * j] = zr[j];
+                out[2 * j + 1] = zi[j];
+            }
+        });
+    }
+};
+
+// Исполнителей, под которых нужен рабочий буфер
+inline size_t fftWorkers(ThreadPool* pool) { return pool != 0 ? pool->size() : 1; }
+
+// Прямое (inverse == false) или обратное преобразование массива.
+// out может совпадать с in. pool - необязательный пул для больших n.
+// work - рабочий буфер: с ним повторные вызовы той же длины на том же
+// пуле (или без пула) не выделяют память - ни для любых оснований,
+// ни для этапов Блюстейна
+template <typename T>
+void fft(const BasicComplexBatch<T>& in, BasicComplexBatch<T>& out, BasicComplexBatch<T>& work, bool inverse = false,
+         ThreadPool* pool = 0) {
+    size_t n = in.size();
+    out.resize(n);
+    if (n == 0)
+        return;
+    std::shared_ptr<const FftPlan<T> > plan = cachedPlan<FftPlan<T> >(n);
+    work.resize(plan->workSize(fftWorkers(pool)));
+    if (inverse)
+        plan->inverse(in.realData(), in.imagData(), out.realData(), out.imagData(), work.realData(), work.imagData(), pool);
+    else
+        plan->forward(in.realData(), in.imagData(), out.realData(), out.imagData(), work.realData(), work.imagData(), pool);
+}
+
+template <typename T>
+void fft(const BasicComplexBatch<T>& in, BasicComplexBatch<T>& out, bool inverse = false, ThreadPool* pool = 0) {
+    BasicComplexBatch<T> work;
+    fft(in, out, work, inverse, pool);
+}
+
+// Спектр X[0..n/2] действительного сигнала in длины n; work - как у fft
+template <typename T>
+void realFft(const T* in, size_t n, BasicComplexBatch<T>& out, BasicComplexBatch<T>& work, ThreadPool* pool = 0) {
+    out.resize(n == 0 ? 0 : n / 2 + 1);
+    if (n == 0)
+        return;
+    if (n % 2 == 1) {
+        // Нечётная длина: комплексное преобразование с нулевой мнимой
+        // частью на месте в начале work, дальше - его рабочий буфер
+        std::shared_ptr<const FftPlan<T> > plan = cachedPlan<FftPlan<T> >(n);
+        work.resize(n + plan->workSize(fftWorkers(pool)));
+        T* zr = work.realData();
+        T* zi = work.imagData();
+        std::copy(in, in + n, zr);
+        std::fill(zi, zi + n, (T)0);
+        plan->forward(zr, zi, zr, zi, zr + n, zi + n, pool);
+        std::copy(zr, zr + n / 2 + 1, out.realData());
+        std::copy(zi, zi + n / 2 + 1, out.imagData());
+        return;
+    }
+    std::shared_ptr<const RealFftPlan<T> > plan = cachedPlan<RealFftPlan<T> >(n);
+    work.resize(plan->workSize(fftWorkers(pool)));
+    plan->forward(in, out.realData(), out.imagData(), work.realData(), work.imagData(), pool);
+}
+
+template <typename T>
+void realFft(const T* in, size_t n, BasicComplexBatch<T>& out, ThreadPool* pool = 0) {
+    BasicComplexBatch<T> work;
+    realFft(in, n, out, work, pool);
+}
+
+// Действительный сигнал длины n по спектру X[0..n/2]; work - как у fft
+template <typename T>
+void inverseRealFft(const BasicComplexBatch<T>& in, size_t n, T* out, BasicComplexBatch<T>& work,
+                    ThreadPool* pool = 0) {
+    assert(in.size() == n / 2 + 1 || n == 0);
+    if (n == 0)
+        return;
+    if (n % 2 == 1) {
+        // Нечётная длина: спектр достраивается по симметрии
+        // X[n-k] = conj(X[k]) в начале work и обращается на месте
+        std::shared_ptr<const FftPlan<T> > plan = cachedPlan<FftPlan<T> >(n);
+        work.resize(n + plan->workSize(fftWorkers(pool)));
+        T* zr = work.realData();
+        T* zi = work.imagData();
+        for (size_t k = 0; k <= n / 2; ++k) {
+            zr[k] = in.realData()[k];
+            zi[k] = in.imagData()[k];
+            if (k != 0) {
+                zr[n - k] = in.realData()[k];
+                zi[n - k] = -in.imagData()[k];
+            }
+        }
+        plan->inverse(zr, zi, zr, zi, zr + n, zi + n, pool);
+        std::copy(zr, zr + n, out);
+        return;
+    }
+    std::shared_ptr<const RealFftPlan<T> > plan = cachedPlan<RealFftPlan<T> >(n);
+    work.resize(plan->workSize(fftWorkers(pool)));
+    plan->inverse(in.realData(), in.imagData(), out, work.realData(), work.imagData(), pool);
+}
+
+template <typename T>
+void inverseRealFft(const BasicComplexBatch<T>& in, size_t n, T* out, ThreadPool* pool = 0) {
+    BasicComplexBatch<T> work;
+    inverseRealFft(in, n, out, work, pool);
+}
+
+// ДПФ по определению за O(n^2) на операторах ComplexNumber - эталон
+template <typename T>
+std::vector<BasicComplexNumber<T> > naiveDft(const std::vector<BasicComplexNumber<T> >& in, bool inverse = false) {
+    size_t n = in.size();
+    std::vector<BasicComplexNumber<T> > roots(n), out(n);
+    for (size_t j = 0; j < n; ++j) {
+        T re, im;
+        unitRoot(j, n, re, im);
+        roots[j] = BasicComplexNumber<T>(re, inverse ? -im : im);
+    }
+    for (size_t k = 0; k < n; ++k) {
+        BasicComplexNumber<T> sum;
+        for (size_t j = 0, index = 0; j < n; ++j) {
+            sum = sum + in[j] * roots[index];
+            index += k;
+            if (index >= n)
+                index -= n;
+        }
+        out[k] = inverse ? BasicComplexNumber<T>(sum.getReal() / n, sum.getImaginary() / n) : sum;
+    }
+    return out;
+}
+
+// Тестирование
+void testFft() {
+    std::mt19937_64 rng(31);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    const size_t sizes[] = { 1, 2, 3, 4, 5, 6, 7, 8, 12, 15, 16, 30, 49, 61, 64, 97, 100, 243, 256, 514, 1000, 1009, 1024 };
+    for (size_t n : sizes) {
+        std::vector<ComplexNumber> signal;
+        ComplexBatch batch;
+        std::vector<double> real;
+        for (size_t i = 0; i < n; ++i) {
+            signal.push_back(ComplexNumber(dist(rng), dist(rng)));
+            batch.append(signal.back());
+            real.push_back(signal.back().getReal());
+        }
+        double tolerance = 1e-13 * n + 1e-14;
+
+        // Прямое преобразование совпадает с ДПФ по определению
+        std::vector<ComplexNumber> expected = naiveDft(signal);
+        ComplexBatch spectrum;
+        fft(batch, spectrum);
+        for (size_t k = 0; k < n; ++k) {
+            assert(std::fabs(spectrum.get(k).getReal() - expected[k].getReal()) < tolerance);
+            assert(std::fabs(spectrum.get(k).getImaginary() - expected[k].getImaginary()) < tolerance);
+        }
+
+        // Обратное - тоже, и возвращает исходный сигнал
+        std::vector<ComplexNumber> expectedInverse = naiveDft(signal, true);
+        ComplexBatch restored;
+        fft(batch, restored, true);
+        for (size_t k = 0; k < n; ++k) {
+            assert(std::fabs(restored.get(k).getReal() - expectedInverse[k].getReal()) < tolerance);
+            assert(std::fabs(restored.get(k).getImaginary() - expectedInverse[k].getImaginary()) < tolerance);
+        }
+        fft(spectrum, restored, true);
+        for (size_t k = 0; k < n; ++k) {
+            assert(std::fabs(restored.get(k).getReal() - signal[k].getReal()) < tolerance);
+            assert(std::fabs(restored.get(k).getImaginary() - signal[k].getImaginary()) < tolerance);
+        }
+
+        // На месте - тот же результат побитово
+        ComplexBatch inPlace = batch;
+        fft(inPlace, inPlace);
+        for (size_t k = 0; k < n; ++k)
+            assert(inPlace.realData()[k] == spectrum.realData()[k] && inPlace.imagData()[k] == spectrum.imagData()[k]);
+
+        // Действительный сигнал: половина спектра и обратный путь
+        std::vector<ComplexNumber> realSignal;
+        for (double x : real)
+            realSignal.push_back(ComplexNumber(x, 0));
+        std::vector<ComplexNumber> expectedReal = naiveDft(realSignal);
+        ComplexBatch half;
+        realFft(real.data(), n, half);
+        assert(half.size() == n / 2 + 1);
+        for (size_t k = 0; k <= n / 2; ++k) {
+            assert(std::fabs(half.get(k).getReal() - expectedReal[k].getReal()) < tolerance);
+            assert(std::fabs(half.get(k).getImaginary() - expectedReal[k].getImaginary()) < tolerance);
+        }
+        std::vector<double> back(n);
+        inverseRealFft(half, n, back.data());
+        for (size_t i = 0; i < n; ++i)
+            assert(std::fabs(back[i] - real[i]) < tolerance);
+    }
+
+    // Разложение на основания
+    std::vector<size_t> radices = cachedPlan<FftPlan<double> >(2 * 4 * 4 * 3 * 3 * 7)->radices();
+    assert((radices == std::vector<size_t>{ 4, 4, 2, 3, 3, 7 }));
+
+    // План на длину строится один раз; переполнение кэша не трогает
+    // планы, которые кто-то держит
+    assert(cachedPlan<FftPlan<double> >(1024) == cachedPlan<FftPlan<double> >(1024));
+    assert(cachedPlan<FftPlan<double> >(1024) != cachedPlan<FftPlan<double> >(512));
+    std::shared_ptr<const FftPlan<double> > held = cachedPlan<FftPlan<double> >(1024);
+    for (size_t n = 1; n <= 2 * FFT_PLAN_CACHE_SIZE; ++n)
+        assert(cachedPlan<FftPlan<double> >(n)->size() == n);
+    assert(cachedPlan<FftPlan<double> >(1024) == held);
+
+    // С общим рабочим буфером повторные вызовы не выделяют память:
+    // степень двойки, произвольное основание, Блюстейн, действительный
+    // сигнал чётной и нечётной длины
+    for (size_t n : { 1024, 1000, 105, 67, 10007, 1001 }) {
+        ComplexBatch reused(n), reusedSpectrum, work, half;
+        std::vector<double> reusedReal(n, 1.0);
+        for (int round = 0; round < 4; ++round) {
+            size_t before = allocationsSoFar();
+            fft(reused, reusedSpectrum, work, round % 2 == 1);
+            realFft(reusedReal.data(), n, half, work);
+            inverseRealFft(half, n, reusedReal.data(), work);
+            assert(round == 0 || allocationsSoFar() == before);
+        }
+    }
+
+    // На пуле результат одинаков побитово при любом числе потоков
+    const size_t big = 3 * (1 << 15);
+    ComplexBatch large;
+    std::vector<double> largeReal;
+    for (size_t i = 0; i < big; ++i) {
+        large.append(ComplexNumber(dist(rng), dist(rng)));
+        largeReal.push_back(dist(rng));
+    }
+    ComplexBatch single, singleHalf;
+    fft(large, single);
+    realFft(largeReal.data(), big, singleHalf);
+    // Этап Блюстейна на пуле: у каждого исполнителя своя рабочая память
+    const size_t chirped = 67 * 256;
+    ComplexBatch chirpedSignal, chirpedSingle;
+    for (size_t i = 0; i < chirped; ++i)
+        chirpedSignal.append(ComplexNumber(dist(rng), dist(rng)));
+    fft(chirpedSignal, chirpedSingle);
+
+    // Этапы по основаниям 2 и 4 дают одно и то же на любом уровне SIMD
+    SimdLevel saved = simdLevel();
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+    for (SimdLevel level : levels) {
+        if (level > detectSimdLevel())
+            continue;
+        setSimdLevel(level);
+        ComplexBatch vectorized;
+        fft(large, vectorized);
+        for (size_t k = 0; k < big; ++k)
+            assert(vectorized.realData()[k] == single.realData()[k] && vectorized.imagData()[k] == single.imagData()[k]);
+    }
+    setSimdLevel(saved);
+    for (size_t threads = 2; threads <= 4; ++threads) {
+        ThreadPool pool(threads);
+        ComplexBatch parallel, parallelHalf, restored;
+        fft(large, parallel, false, &pool);
+        for (size_t k = 0; k < big; ++k)
+            assert(parallel.realData()[k] == single.realData()[k] && parallel.imagData()[k] == single.imagData()[k]);
+        realFft(largeReal.data(), big, parallelHalf, &pool);
+        for (size_t k = 0; k <= big / 2; ++k)
+            assert(parallelHalf.realData()[k] == singleHalf.realData()[k]);
+        fft(parallel, restored, true, &pool);
+        for (size_t k = 0; k < big; k += 997)
+            assert(std::fabs(restored.get(k).getReal() - large.get(k).getReal()) < 1e-12);
+        ComplexBatch chirpedParallel;
+        fft(chirpedSignal, chirpedParallel, false, &pool);
+        for (size_t k = 0; k < chirped; ++k)
+            assert(chirpedParallel.realData()[k] == chirpedSingle.realData()[k] &&
+                   chirpedParallel.imagData()[k] == chirpedSingle.imagData()[k]);
+    }
+
+    // Другие типы компонент
+    BasicComplexBatch<float> floats, floatSpectrum;
+    for (size_t i = 0; i < 12; ++i)
+        floats.append(BasicComplexNumber<float>((float)i, 0));
+    fft(floats, floatSpectrum);
+    assert(std::fabs(floatSpectrum.get(0).getReal() - 66) < 1e-4f);
+
+    std::cout << "All tests passed for FFT!" << std::endl;
+}
+
+// ------------------------------------------------------------------
+// Плотные матрицы комплексных чисел и кватернионов и их умножение.
+// Компоненты лежат в отдельных плоскостях (как в наборах), строки подряд.
+// Умножение блочное: панель B и полоса A упаковываются так, чтобы
+// плитка C (GEMM_TILE_ROWS строк на несколько векторов столбцов)
+// копилась в регистрах. Слагаемые по k идут в том же порядке, что
+// в тройном цикле на операторах, поэтому результат совпадает с ним
+// побитово при любом уровне SIMD и любом числе потоков.
+// ------------------------------------------------------------------
+
+// Строк A в одном блоке (делятся между потоками) и столбцов B в панели
+const size_t GEMM_BLOCK_ROWS = 64;
+const size_t GEMM_BLOCK_COLUMNS = 256;
+
+// Глубина блока по k в скалярах: для кватернионов вдвое меньше,
+// чтобы упакованная панель B занимала столько же памяти
+const size_t GEMM_BLOCK_DEPTH = 512;
+
+// Высота плитки C в регистрах
+const int GEMM_TILE_ROWS = 2;
+
+// Произведение двух чисел в виде массивов компонент
+template <int Components>
+struct GemmMulOp;
+
+template <>
+struct GemmMulOp<2> {
+    template <typename V>
+    static FORCE_INLINE void apply(const V* x, const V* y, V* r) {
+        ComplexMulOp::apply(x[0], x[1], y[0], y[1], r[0], r[1]);
+    }
+};
+
+template <>
+struct GemmMulOp<4> : QuaternionMulOp {};
+
+BEGIN_EXACT_KERNELS
+
+// C[rows x cols] += полоса A * панель B. packedA: полосы по Rows строк,
+// для каждого k компоненты Rows чисел подряд; packedB: панели по
+// Lanes * Vectors столбцов, для каждого k плоскости компонент подряд.
+// Недостающие строки и столбцы в упаковке заполнены нулями.
+template <typename T, int Components, int Lanes, int Vectors>
+FORCE_INLINE void gemmBlockImpl(const T* packedA, const T* packedB, size_t depth, size_t rows, size_t cols,
+                                T* const* c, size_t ldc) {
+    typedef typename std::conditional<Lanes == 1, T, typename SimdVec<T, Lanes>::type>::type V;
+    const int Rows = GEMM_TILE_ROWS;
+    const int Width = Lanes * Vectors;
+    for (size_t j = 0; j < cols; j += Width) {
+        const T* panel = packedB + j * depth * Components;
+        size_t tileCols = std::min<size_t>(Width, cols - j);
+        for (size_t i = 0; i < rows; i += Rows) {
+            const T* sliver = packedA + i * depth * Components;
+            size_t tileRows = std::min<size_t>(Rows, rows - i);
+
+            T tile[Components][Rows][Width];
+            for (int k = 0; k < Components; ++k)
+                for (int r = 0; r < Rows; ++r)
+                    for (int w = 0; w < Width; ++w)
+                        tile[k][r][w] = (size_t)r < tileRows && (size_t)w < tileCols ? c[k][(i + r) * ldc + j + w] : 0;
+            V acc[Components][Rows][Vectors];
+            for (int k = 0; k < Components; ++k)
+                for (int r = 0; r < Rows; ++r)
+                    for (int v = 0; v < Vectors; ++v)
+                        simdLoad(acc[k][r][v], &tile[k][r][v * Lanes]);
+
+            // Без полного развёртывания -O2 оставляет аккумуляторы в памяти
+            for (size_t p = 0; p < depth; ++p) {
+                const T* bp = panel + p * Components * Width;
+                const T* ap = sliver + p * Components * Rows;
+                V y[Vectors][Components];
+#pragma GCC unroll 8
+                for (int v = 0; v < Vectors; ++v)
+#pragma GCC unroll 8
+                    for (int k = 0; k < Components; ++k)
+                        simdLoad(y[v][k], bp + k * Width + v * Lanes);
+#pragma GCC unroll 8
+                for (int r = 0; r < Rows; ++r) {
+                    V x[Components];
+#pragma GCC unroll 8
+                    for (int k = 0; k < Components; ++k)
+                        simdBroadcast(x[k], ap[k * Rows + r]);
+#pragma GCC unroll 8
+                    for (int v = 0; v < Vectors; ++v) {
+                        V product[Components];
+                        GemmMulOp<Components>::apply(x, y[v], product);
+#pragma GCC unroll 8
+                        for (int k = 0; k < Components; ++k)
+                            acc[k][r][v] = acc[k][r][v] + product[k];
+                    }
+                }
+            }
+
+            for (int k = 0; k < Components; ++k)
+                for (int r = 0; r < Rows; ++r)
+                    for (int v = 0; v < Vectors; ++v)
+                        simdStore(&tile[k][r][v * Lanes], acc[k][r][v]);
+            for (int k = 0; k < Components; ++k)
+                for (size_t r = 0; r < tileRows; ++r)
+                    for (size_t w = 0; w < tileCols; ++w)
+                        c[k][(i + r) * ldc + j + w] = tile[k][r][w];
+        }
+    }
+}
+
+// Векторов на строку плитки: у кватернионов вдвое больше компонент
+template <int Components>
+struct GemmVectors {
+    static const int value = Components == 2 ? 2 : 1;
+};
+
+template <typename T, int Components>
+void gemmBlockScalar(const T* packedA, const T* packedB, size_t depth, size_t rows, size_t cols, T* const* c,
+                     size_t ldc) {
+    gemmBlockImpl<T, Components, 1, GemmVectors<Components>::value>(packedA, packedB, depth, rows, cols, c, ldc);
+}
+
+#if HAVE_X86_SIMD
+template <typename T, int Components>
+TARGET_AVX2 void gemmBlockAvx2(const T* packedA, const T* packedB, size_t depth, size_t rows, size_t cols,
+                               T* const* c, size_t ldc) {
+    gemmBlockImpl<T, Components, SimdLanes<T, 32>::value, GemmVectors<Components>::value>(
+        packedA, packedB, depth, rows, cols, c, ldc);
+}
+
+template <typename T, int Components>
+TARGET_AVX512 void gemmBlockAvx512(const T* packedA, const T* packedB, size_t depth, size_t rows, size_t cols,
+                                   T* const* c, size_t ldc) {
+    gemmBlockImpl<T, Components, SimdLanes<T, 64>::value, GemmVectors<Components>::value>(
+        packedA, packedB, depth, rows, cols, c, ldc);
+}
+#endif
+
+END_EXACT_KERNELS
+
+// Ядро блока для одного уровня SIMD и ширина его панели B
+template <typename T>
+struct GemmKernel {
+    typedef void (*Block)(const T* packedA, const T* packedB, size_t depth, size_t rows, size_t cols, T* const* c,
+                          size_t ldc);
+
+    Block block;
+    size_t width;
+};
+
+template <typename T, int Components>
+const GemmKernel<T>& gemmKernel(SimdLevel level) {
+    const size_t vectors = GemmVectors<Components>::value;
+    static const GemmKernel<T> scalar = { gemmBlockScalar<T, Components>, vectors };
+#if HAVE_X86_SIMD
+    static const GemmKernel<T> avx2 = { gemmBlockAvx2<T, Components>, SimdLanes<T, 32>::value * vectors };
+    static const GemmKernel<T> avx512 = { gemmBlockAvx512<T, Components>, SimdLanes<T, 64>::value * vectors };
+    if (level == SIMD_AVX512)
+        return avx512;
+    if (level == SIMD_AVX2)
+        return avx2;
+#endif
+    return scalar;
+}
+
+// Плотная матрица rows x columns
+template <typename Number>
+class Matrix {
+public:
+    typedef NumberTraits<Number> Traits;
+    typedef typename Traits::Scalar Scalar;
+    static const int components = Traits::components;
+
+private:
+    size_t rowCount;
+    size_t columnCount;
+    AlignedVector<Scalar> planes[components];
+
+    // Полоса A[i0 .. i0 + rows) x [k0 .. k0 + depth), см. gemmBlockImpl
+    static void packRows(const Matrix& a, size_t i0, size_t rows, size_t k0, size_t depth,
+                         AlignedVector<Scalar>& packed) {
+        const size_t height = GEMM_TILE_ROWS;
+        size_t slivers = (rows + height - 1) / height;
+        packed.resize(slivers * height * depth * components);
+        Scalar* out = packed.data();
+        for (size_t s = 0; s < slivers; ++s)
+            for (size_t p = 0; p < depth; ++p)
+                for (int k = 0; k < components; ++k)
+                    for (size_t r = 0; r < height; ++r) {
+                        size_t i = s * height + r;
+                        *out++ = i < rows ? a.planes[k][(i0 + i) * a.columnCount + k0 + p] : 0;
+                    }
+    }
+
+    // Панель B[k0 .. k0 + depth) x [j0 .. j0 + cols), см. gemmBlockImpl
+    static void packColumns(const Matrix& b, size_t k0, size_t depth, size_t j0, size_t cols, size_t width,
+                            AlignedVector<Scalar>& packed) {
+        size_t panels = (cols + width - 1) / width;
+        packed.resize(panels * width * depth * components);
+        Scalar* out = packed.data();
+        for (size_t s = 0; s < panels; ++s)
+            for (size_t p = 0; p < depth; ++p)
+                for (int k = 0; k < components; ++k)
+                    for (size_t w = 0; w < width; ++w) {
+                        size_t j = s * width + w;
+                        *out++ = j < cols ? b.planes[k][(k0 + p) * b.columnCount + j0 + j] : 0;
+                    }
+    }
+
+public:
+    // Конструктор по умолчанию
+    Matrix() : rowCount(0), columnCount(0) {}
+
+    // Конструктор инициализации: нулевая матрица
+    Matrix(size_t rows, size_t columns) : rowCount(0), columnCount(0) { assign(rows, columns); }
+
+    size_t rows() const { return rowCount; }
+    size_t columns() const { return columnCount; }
+
+    // Нулевая матрица нового размера
+    void assign(size_t rows, size_t columns) {
+        rowCount = rows;
+        columnCount = columns;
+        for (int k = 0; k < components; ++k)
+            planes[k].assign(rows * columns, 0);
+    }
+
+    // Методы доступа
+    Number get(size_t i, size_t j) const {
+        Scalar c[components];
+        for (int k = 0; k < components; ++k)
+            c[k] = planes[k][i * columnCount + j];
+        return Traits::join(c);
+    }
+
+    void set(size_t i, size_t j, const Number& value) {
+        Scalar c[components];
+        Traits::split(value, c);
+        for (int k = 0; k < components; ++k)
+            planes[k][i * columnCount + j] = c[k];
+    }
+
+    // Плоскость k-й компоненты, строки подряд
+    Scalar* data(int k) { return planes[k].data(); }
+    const Scalar* data(int k) const { return planes[k].data(); }
+
+    // out = a * b тройным циклом на операторах - эталон
+    static void multiplyNaive(const Matrix& a, const Matrix& b, Matrix& out) {
+        assert(a.columns() == b.rows() && &out != &a && &out != &b);
+        out.assign(a.rows(), b.columns());
+        for (size_t i = 0; i < a.rows(); ++i) {
+            for (size_t j = 0; j < b.columns(); ++j) {
+                Number sum;
+                for (size_t k = 0; k < a.columns(); ++k)
+                    sum = sum + a.get(i, k) * b.get(k, j);
+                out.set(i, j, sum);
+            }
+        }
+    }
+
+    // out = a * b блочным умножением. С пулом блоки строк A делятся
+    // между потоками; блоки по k идут по порядку, так что каждый
+    // элемент C копится в том же порядке, что и без пула
+    static void multiply(const Matrix& a, const Matrix& b, Matrix& out, ThreadPool* pool = 0) {
+        assert(a.columns() == b.rows());
+        if (&out == &a || &out == &b) {
+            Matrix result;
+            multiply(a, b, result, pool);
+            out = std::move(result);
+            return;
+        }
+        size_t m = a.rows(), n = b.columns(), depth = a.columns();
+        out.assign(m, n);
+        const GemmKernel<Scalar>& kernel = gemmKernel<Scalar, components>(simdLevel());
+        const size_t blockDepth = GEMM_BLOCK_DEPTH / components;
+        size_t blocks = (m + GEMM_BLOCK_ROWS - 1) / GEMM_BLOCK_ROWS;
+        AlignedVector<Scalar> packedB;
+        std::vector<AlignedVector<Scalar> > packedA(pool != 0 ? pool->size() : 1);
+
+        for (size_t j0 = 0; j0 < n; j0 += GEMM_BLOCK_COLUMNS) {
+            size_t cols = std::min(GEMM_BLOCK_COLUMNS, n - j0);
+            for (size_t k0 = 0; k0 < depth; k0 += blockDepth) {
+                size_t d = std::min(blockDepth, depth - k0);
+                packColumns(b, k0, d, j0, cols, kernel.width, packedB);
+                auto body = [&](size_t first, size_t last, size_t worker) {
+                    for (size_t block = first; block < last; ++block) {
+                        size_t i0 = block * GEMM_BLOCK_ROWS;
+                        size_t rows = std::min(GEMM_BLOCK_ROWS, m - i0);
+                        packRows(a, i0, rows, k0, d, packedA[worker]);
+                        Scalar* c[components];
+                        for (int k = 0; k < components; ++k)
+                            c[k] = out.planes[k].data() + i0 * n + j0;
+                        kernel.block(packedA[worker].data(), packedB.data(), d, rows, cols, c, n);
+                    }
+                };
+                if (pool != 0)
+                    pool->parallelFor(0, blocks, 1, body);
+                else
+                    body(0, blocks, 0);
+            }
+        }
+    }
+
+    // Тестирование
+    static void test() {
+        std::mt19937_64 rng(51);
+        std::uniform_real_distribution<double> dist(-1.0, 1.0);
+        // Размеры не кратны ни плиткам, ни блокам
+        const size_t m = 2 * GEMM_BLOCK_ROWS + 7;
+        const size_t depth = GEMM_BLOCK_DEPTH / components + 37;
+        const size_t n = GEMM_BLOCK_COLUMNS + 13;
+        Matrix a(m, depth), b(depth, n);
+        for (int k = 0; k < components; ++k) {
+            for (Scalar& x : a.planes[k])
+                x = (Scalar)dist(rng);
+            for (Scalar& x : b.planes[k])
+                x = (Scalar)dist(rng);
+        }
+        Matrix expected;
+        multiplyNaive(a, b, expected);
+
+        SimdLevel saved = simdLevel();
+        const SimdLevel levels[] = { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+        for (SimdLevel level : levels) {
+            if (level > detectSimdLevel())
+                continue;
+            setSimdLevel(level);
+            for (size_t threads = 0; threads <= 3; ++threads) {
+                std::unique_ptr<ThreadPool> pool(threads == 0 ? 0 : new ThreadPool(threads));
+                Matrix product;
+                multiply(a, b, product, pool.get());
+                assert(product.rows() == m && product.columns() == n);
+                // Совпадение с тройным циклом: побитовое, если операторы
+                // собраны без слияния, иначе допуск от длины суммы
+                for (int k = 0; k < components; ++k)
+                    for (size_t i = 0; i < product.planes[k].size(); ++i)
+                        assert(matchesOperator(expected.planes[k][i], product.planes[k][i],
+                                               (Scalar)(depth * components)));
+            }
+        }
+        setSimdLevel(saved);
+
+        // Небольшой пример вручную и умножение на месте
+        Matrix x(1, 2), y(2, 1);
+        Scalar one[components] = { 1 }, two[components] = { 0, 1 };
+        x.set(0, 0, Traits::join(one));
+        x.set(0, 1, Traits::join(two));
+        y.set(0, 0, Traits::join(two));
+        y.set(1, 0, Traits::join(two));
+        Matrix::multiply(x, y, x);
+        // 1 * i + i * i = -1 + i
+        assert(x.rows() == 1 && x.columns() == 1);
+        assert(x.data(0)[0] == -1 && x.data(1)[0] == 1);
+
+        // Пустые размеры
+        Matrix empty(3, 0), other(0, 4), zero;
+        multiply(empty, other, zero);
+        assert(zero.rows() == 3 && zero.columns() == 4 && zero.data(0)[11] == 0);
+
+        std::cout << "All tests passed for Matrix (" << components << " components)!" << std::endl;
+    }
+};
+
+typedef Matrix<ComplexNumber> ComplexMatrix;
+typedef Matrix<Quaternion> QuaternionMatrix;
+
+// ------------------------------------------------------------------
+// Многочлены с комплексными коэффициентами: вычисление сразу во многих
+// точках (схемы Горнера и Эстрина) и поиск всех корней методом
+// Аберта - Эрлиха.
+// ------------------------------------------------------------------
+
+// Эстрин считает коэффициенты кусками по 8: внутри куска - дерево
+// умножений на z, z^2, z^4, сами куски - по Горнеру в z^8
+const size_t ESTRIN_CHUNK = 8;
+
+// Точек в одном куске при вычислении на пуле
+const size_t POLYNOMIAL_GRAIN = 16384;
+
+// Корни ищутся в масштабе 2^e, если оценка их модулей вне [2^-16, 2^17)
+const int ROOT_RESCALE_EXPONENT = 16;
+
+BEGIN_EXACT_KERNELS
+
+// out = a * z + b на операциях ComplexMulOp и ComplexAddOp, то есть
+// с тем же округлением, что и a * z + b на операторах
+template <typename V>
+FORCE_INLINE void complexMulAdd(const V& ar, const V& ai, const V& zr, const V& zi, const V& br, const V& bi,
+                                V& outR, V& outI) {
+    V pr, pi;
+    ComplexMulOp::apply(ar, ai, zr, zi, pr, pi);
+    ComplexAddOp::apply(pr, pi, br, bi, outR, outI);
+}
+
+// Горнер для Group векторов точек одновременно: цепочки независимы,
+// так что задержка умножения одной точки перекрывается другими
+template <typename T, typename V, int Group>
+FORCE_INLINE void hornerGroup(const T* cr, const T* ci, size_t degree, const V* zr, const V* zi, V* outR,
+                              V* outI) {
+    V accR[Group], accI[Group];
+#pragma GCC unroll 8
+    for (int g = 0; g < Group; ++g) {
+        simdBroadcast(accR[g], cr[degree]);
+        simdBroadcast(accI[g], ci[degree]);
+    }
+    for (size_t k = degree; k-- > 0;) {
+        V br, bi;
+        simdBroadcast(br, cr[k]);
+        simdBroadcast(bi, ci[k]);
+#pragma GCC unroll 8
+        for (int g = 0; g < Group; ++g)
+            complexMulAdd(accR[g], accI[g], zr[g], zi[g], br, bi, accR[g], accI[g]);
+    }
+#pragma GCC unroll 8
+    for (int g = 0; g < Group; ++g) {
+        outR[g] = accR[g];
+        outI[g] = accI[g];
+    }
+}
+
+// Один кусок Эстрина: c[0] + c[1] z + ... + c[7] z^7
+template <typename T, typename V>
+FORCE_INLINE void estrinChunk(const T* cr, const T* ci, const V* zr, const V* zi, V& outR, V& outI) {
+    // zr[0..2], zi[0..2] - z, z^2, z^4
+    V pr[4], pi[4];
+#pragma GCC unroll 4
+    for (int j = 0; j < 4; ++j) {
+        V ar, ai, br, bi;
+        simdBroadcast(ar, cr[2 * j + 1]);
+        simdBroadcast(ai, ci[2 * j + 1]);
+        simdBroadcast(br, cr[2 * j]);
+        simdBroadcast(bi, ci[2 * j]);
+        complexMulAdd(ar, ai, zr[0], zi[0], br, bi, pr[j], pi[j]);
+    }
+    V qr[2], qi[2];
+    complexMulAdd(pr[1], pi[1], zr[1], zi[1], pr[0], pi[0], qr[0], qi[0]);
+    complexMulAdd(pr[3], pi[3], zr[1], zi[1], pr[2], pi[2], qr[1], qi[1]);
+    complexMulAdd(qr[1], qi[1], zr[2], zi[2], qr[0], qi[0], outR, outI);
+}
+
+// Эстрин: коэффициенты дополнены нулями до целого числа кусков
+template <typename T, typename V, int Group>
+FORCE_INLINE void estrinGroup(const T* cr, const T* ci, size_t degree, const V* zr, const V* zi, V* outR,
+                              V* outI) {
+    size_t chunks = degree / ESTRIN_CHUNK + 1;
+#pragma GCC unroll 4
+    for (int g = 0; g < Group; ++g) {
+        // z, z^2, z^4, z^8
+        V powR[4], powI[4];
+        powR[0] = zr[g];
+        powI[0] = zi[g];
+        for (int j = 1; j < 4; ++j)
+            ComplexMulOp::apply(powR[j - 1], powI[j - 1], powR[j - 1], powI[j - 1], powR[j], powI[j]);
+        V accR, accI;
+        estrinChunk(cr + (chunks - 1) * ESTRIN_CHUNK, ci + (chunks - 1) * ESTRIN_CHUNK, powR, powI, accR, accI);
+        for (size_t j = chunks - 1; j-- > 0;) {
+            V chunkR, chunkI;
+            estrinChunk(cr + j * ESTRIN_CHUNK, ci + j * ESTRIN_CHUNK, powR, powI, chunkR, chunkI);
+            complexMulAdd(accR, accI, powR[3], powI[3], chunkR, chunkI, accR, accI);
+        }
+        outR[g] = accR;
+        outI[g] = accI;
+    }
+}
+
+template <typename T, typename V, int Group, bool Estrin>
+FORCE_INLINE void polynomialGroup(const T* cr, const T* ci, size_t degree, const T* zr, const T* zi, T* outR,
+                                  T* outI) {
+    const size_t width = sizeof(V) / sizeof(T);
+    V vzr[Group], vzi[Group], vr[Group], vi[Group];
+    for (int g = 0; g < Group; ++g) {
+        simdLoad(vzr[g], zr + g * width);
+        simdLoad(vzi[g], zi + g * width);
+    }
+    if (Estrin)
+        estrinGroup<T, V, Group>(cr, ci, degree, vzr, vzi, vr, vi);
+    else
+        hornerGroup<T, V, Group>(cr, ci, degree, vzr, vzi, vr, vi);
+    for (int g = 0; g < Group; ++g) {
+        simdStore(outR + g * width, vr[g]);
+        simdStore(outI + g * width, vi[g]);
+    }
+}
+
+// Значения многочлена степени degree в n точках z
+template <typename T, int Lanes, bool Estrin>
+FORCE_INLINE void polynomialImpl(const T* cr, const T* ci, size_t degree, const T* zr, const T* zi, T* outR,
+                                 T* outI, size_t n) {
+    // Эстрину своего параллелизма хватает, и регистров ему нужно больше
+    const int Group = Estrin ? 2 : 4;
+    size_t i = 0;
+    if constexpr (Lanes > 1) {
+        typedef typename SimdVec<T, Lanes>::type V;
+        for (; i + Group * Lanes <= n; i += Group * Lanes)
+            polynomialGroup<T, V, Group, Estrin>(cr, ci, degree, zr + i, zi + i, outR + i, outI + i);
+        for (; i + Lanes <= n; i += Lanes)
+            polynomialGroup<T, V, 1, Estrin>(cr, ci, degree, zr + i, zi + i, outR + i, outI + i);
+    }
+    for (; i < n; ++i)
+        polynomialGroup<T, T, 1, Estrin>(cr, ci, degree, zr + i, zi + i, outR + i, outI + i);
+}
+
+template <typename T, bool Estrin>
+void polynomialScalar(const T* cr, const T* ci, size_t degree, const T* zr, const T* zi, T* outR, T* outI,
+                      size_t n) {
+    polynomialImpl<T, 1, Estrin>(cr, ci, degree, zr, zi, outR, outI, n);
+}
+
+#if HAVE_X86_SIMD
+template <typename T, bool Estrin>
+TARGET_AVX2 void polynomialAvx2(const T* cr, const T* ci, size_t degree, const T* zr, const T* zi, T* outR,
+                                T* outI, size_t n) {
+    polynomialImpl<T, SimdLanes<T, 32>::value, Estrin>(cr, ci, degree, zr, zi, outR, outI, n);
+}
+
+template <typename T, bool Estrin>
+TARGET_AVX512 void polynomialAvx512(const T* cr, const T* ci, size_t degree, const T* zr, const T* zi, T* outR,
+                                    T* outI, size_t n) {
+    polynomialImpl<T, SimdLanes<T, 64>::value, Estrin>(cr, ci, degree, zr, zi, outR, outI, n);
+}
+#endif
+
+END_EXACT_KERNELS
+
+template <typename T>
+struct PolynomialKernels {
+    typedef void (*Kernel)(const T* cr, const T* ci, size_t degree, const T* zr, const T* zi, T* outR, T* outI,
+                           size_t n);
+
+    Kernel horner;
+    Kernel estrin;
+
+    Kernel scheme(PolynomialScheme scheme) const { return scheme == POLYNOMIAL_ESTRIN ? estrin : horner; }
+};
+
+template <typename T>
+const PolynomialKernels<T>& polynomialKernels(SimdLevel level) {
+    static const PolynomialKernels<T> scalar = { polynomialScalar<T, false>, polynomialScalar<T, true> };
+#if HAVE_X86_SIMD
+    static const PolynomialKernels<T> avx2 = { polynomialAvx2<T, false>, polynomialAvx2<T, true> };
+    static const PolynomialKernels<T> avx512 = { polynomialAvx512<T, false>, polynomialAvx512<T, true> };
+    if (level == SIMD_AVX512)
+        return avx512;
+    if (level == SIMD_AVX2)
+        return avx2;
+#endif
+    return scalar;
+}
+
+// Результат поиска корней: converged == false, если за отведённые
+// итерации поправки не стали меньше допуска (корни тогда приближённые)
+struct RootStatus {
+    bool converged;
+    size_t iterations;
+};
+
+// Многочлен c[0] + c[1] z + ... + c[n] z^n
+template <typename T>
+class BasicPolynomial {
+public:
+    typedef BasicComplexNumber<T> Number;
+
+private:
+    // Коэффициенты по возрастанию степени, дополненные нулями до целого
+    // числа кусков Эстрина
+    AlignedVector<T> real;
+    AlignedVector<T> imaginary;
+    size_t degreeValue;
+
+    // p(z) и p'(z) за один проход Горнера; bound = sum |c[k]| |z|^k,
+    // через него оценивается ошибка округления самого p(z)
+    void evaluateWithDerivative(const Number& z, Number& value, Number& derivative, T& bound) const {
+        T radius = magnitude(z);
+        value = coefficient(degreeValue);
+        derivative = Number();
+        bound = magnitude(value);
+        for (size_t k = degreeValue; k-- > 0;) {
+            derivative = derivative * z + value;
+            value = value * z + coefficient(k);
+            bound = bound * radius + magnitude(coefficient(k));
+        }
+    }
+
+    static T magnitude(const Number& z) { return std::hypot(z.getReal(), z.getImaginary()); }
+
+public:
+    // Конструктор по умолчанию: нулевой многочлен
+    BasicPolynomial() : real(ESTRIN_CHUNK), imaginary(ESTRIN_CHUNK), degreeValue(0) {}
+
+    // Конструктор инициализации: коэффициенты по возрастанию степени.
+    // Нулевые старшие коэффициенты отбрасываются
+    explicit BasicPolynomial(const std::vector<Number>& coefficients) : degreeValue(0) {
+        for (size_t k = 0; k < coefficients.size(); ++k)
+            if (coefficients[k].getReal() != 0 || coefficients[k].getImaginary() != 0)
+                degreeValue = k;
+        size_t padded = (degreeValue / ESTRIN_CHUNK + 1) * ESTRIN_CHUNK;
+        real.assign(padded, 0);
+        imaginary.assign(padded, 0);
+        for (size_t k = 0; k <= degreeValue && k < coefficients.size(); ++k) {
+            real[k] = coefficients[k].getReal();
+            imaginary[k] = coefficients[k].getImaginary();
+        }
+    }
+
+    // Приведённый многочлен (z - roots[0]) (z - roots[1]) ...
+    static BasicPolynomial fromRoots(const std::vector<Number>& roots) {
+        std::vector<Number> c(1, Number(1, 0));
+        for (const Number& root : roots) {
+            c.push_back(Number());
+            for (size_t k = c.size() - 1; k > 0; --k)
+                c[k] = c[k - 1] - root * c[k];
+            c[0] = Number() - root * c[0];
+        }
+        return BasicPolynomial(c);
+    }
+
+    size_t degree() const { return degreeValue; }
+
+    Number coefficient(size_t k) const {
+        return k <= degreeValue ? Number(real[k], imaginary[k]) : Number();
+    }
+
+    BasicPolynomial derivative() const {
+        std::vector<Number> c;
+        for (size_t k = 1; k <= degreeValue; ++k)
+            c.push_back(coefficient(k) * Number(T(k), 0));
+        return BasicPolynomial(c);
+    }
+
+    // Значение в точке по Горнеру на операторах
+    Number operator()(const Number& z) const {
+        Number value = coefficient(degreeValue);
+        for (size_t k = degreeValue; k-- > 0;)
+            value = value * z + coefficient(k);
+        return value;
+    }
+
+    // Значение в точке по выбранной схеме; побитово совпадает с
+    // пакетным вычислением той же схемой
+    Number evaluate(const Number& z, PolynomialScheme scheme) const {
+        T zr = z.getReal(), zi = z.getImaginary(), outR, outI;
+        polynomialKernels<T>(SIMD_SCALAR).scheme(scheme)(real.data(), imaginary.data(), degreeValue, &zr, &zi,
+                                                         &outR, &outI, 1);
+        return Number(outR, outI);
+    }
+
+    // Значения во всех точках набора; с пулом точки делятся на куски
+    void evaluate(const BasicComplexBatch<T>& points, BasicComplexBatch<T>& out,
+                  PolynomialScheme scheme = POLYNOMIAL_HORNER, ThreadPool* pool = 0) const {
+        out.resize(points.size());
+        typename PolynomialKernels<T>::Kernel kernel = polynomialKernels<T>(simdLevel()).scheme(scheme);
+        auto body = [&](size_t begin, size_t end, size_t) {
+            kernel(real.data(), imaginary.data(), degreeValue, points.realData() + begin, points.imagData() + begin,
+                   out.realData() + begin, out.imagData() + begin, end - begin);
+        };
+        if (pool != 0)
+            pool->parallelFor(0, points.size(), POLYNOMIAL_GRAIN, body);
+        else
+            body(0, points.size(), 0);
+    }
+
+    // Все корни с кратностью методом Аберта - Эрлиха: для каждого
+    // приближения z[k] поправка w = r / (1 - r * sum 1 / (z[k] - z[j])),
+    // r = p(z[k]) / p'(z[k]). Все поправки итерации считаются по старым
+    // приближениям (как у Якоби), поэтому корни делятся между потоками,
+    // а результат одинаков при любом их числе. Приближение замораживается,
+    // когда |p(z)| не больше оценки ошибки округления или поправка
+    // меньше допуска: дальше точность ограничена самим вычислением p.
+    // При очень больших или малых коэффициентах c^2 + d^2 в operator/
+    // переполняется или обнуляется, поэтому итерации идут по приведённому
+    // многочлену p / c[n], а если оценка модулей корней далека от 1 -
+    // ещё и по p(2^e w) / 2^(e n) (умножение на степень двойки точное).
+    // Деления r и w, где знаменатель может быть сколь угодно мал, - по Смиту.
+    RootStatus roots(std::vector<Number>& out, ThreadPool* pool = 0, size_t maxIterations = 500) const {
+        size_t n = degreeValue;
+        out.assign(n, Number());
+        RootStatus status = { true, 0 };
+        if (n == 0)
+            return status;
+        Number lead = coefficient(n);
+        if (lead.getReal() != 1 || lead.getImaginary() != 0) {
+            std::vector<Number> monic(n + 1);
+            for (size_t k = 0; k < n; ++k)
+                monic[k] = coefficient(k).divide(lead, DIVISION_SMITH);
+            monic[n] = Number(1, 0);
+            return BasicPolynomial(monic).roots(out, pool, maxIterations);
+        }
+
+        // Начальные приближения - на окружности радиуса оценки Фудзивары
+        // для модулей корней, с поворотом, чтобы не попасть в симметрию
+        T leading = magnitude(coefficient(n));
+        T radius = 0;
+        for (size_t k = 0; k < n; ++k)
+            radius = std::max(radius, std::pow(magnitude(coefficient(k)) / leading, T(1) / T(n - k)));
+        radius = radius == 0 ? T(1) : radius;
+        int exponent = std::ilogb(radius);
+        if (exponent > ROOT_RESCALE_EXPONENT || exponent < -ROOT_RESCALE_EXPONENT) {
+            std::vector<Number> scaled(n + 1);
+            for (size_t k = 0; k <= n; ++k) {
+                int shift = -exponent * (int)(n - k);
+                scaled[k] = Number(std::ldexp(coefficient(k).getReal(), shift),
+                                   std::ldexp(coefficient(k).getImaginary(), shift));
+            }
+            status = BasicPolynomial(scaled).roots(out, pool, maxIterations);
+            for (Number& root : out)
+                root = Number(std::ldexp(root.getReal(), exponent), std::ldexp(root.getImaginary(), exponent));
+            return status;
+        }
+        const long double pi = 3.141592653589793238462643383279502884L;
+        for (size_t k = 0; k < n; ++k) {
+            long double angle = 2 * pi * k / n + 0.4L;
+            out[k] = Number(T(radius * std::cos(angle)), T(radius * std::sin(angle)));
+        }
+
+        const T tolerance = 16 * std::numeric_limits<T>::epsilon();
+        const T noise = 4 * (n + 1) * std::numeric_limits<T>::epsilon();
+        std::vector<Number> next(n);
+        std::vector<char> settled(n, 0);
+        const Number one(1, 0);
+        while (status.iterations < maxIterations) {
+            ++status.iterations;
+            auto body = [&](size_t begin, size_t end, size_t) {
+                for (size_t k = begin; k < end; ++k) {
+                    next[k] = out[k];
+                    if (settled[k])
+                        continue;
+                    Number value, slope;
+                    T bound;
+                    evaluateWithDerivative(out[k], value, slope, bound);
+                    if (magnitude(value) <= noise * bound) {
+                        settled[k] = 1;
+                        continue;
+                    }
+                    Number ratio = value.divide(slope, DIVISION_SMITH);
+                    Number sum;
+                    for (size_t j = 0; j < n; ++j)
+                        if (j != k)
+                            sum = sum + one / (out[k] - out[j]);
+                    Number correction = ratio.divide(one - ratio * sum, DIVISION_SMITH);
+                    next[k] = out[k] - correction;
+                    settled[k] = magnitude(correction) <= tolerance * magnitude(next[k]);
+                }
+            };
+            if (pool != 0)
+                pool->parallelFor(0, n, 16, body);
+            else
+                body(0, n, 0);
+            out.swap(next);
+            if (std::find(settled.begin(), settled.end(), 0) == settled.end())
+                return status;
+        }
+        status.converged = false;
+        return status;
+    }
+
+    // Тестирование
+    static void test() {
+        std::mt19937_64 rng(91);
+        std::uniform_real_distribution<double> dist(-1.0, 1.0);
+
+        // p(z) = 1 + 2z + 3z^2 в точке i: 1 + 2i - 3
+        BasicPolynomial p({ Number(1, 0), Number(2, 0), Number(3, 0) });
+        assert(p.degree() == 2);
+        assert(p(Number(0, 1)).getReal() == -2 && p(Number(0, 1)).getImaginary() == 2);
+        assert(p.derivative().degree() == 1 && p.derivative().coefficient(1).getReal() == 6);
+        BasicPolynomial trimmed({ Number(5, 0), Number(), Number() });
+        assert(trimmed.degree() == 0 && trimmed(Number(7, 7)).getReal() == 5);
+
+        // Степени до нескольких кусков Эстрина, точки - с хвостом
+        const size_t degrees[] = { 0, 1, 5, 7, 8, 9, 31, 40 };
+        const size_t n = 1037;
+        BasicComplexBatch<T> points;
+        for (size_t i = 0; i < n; ++i)
+            points.append(Number(T(dist(rng)), T(dist(rng))));
+        for (size_t degree : degrees) {
+            std::vector<Number> c;
+            for (size_t k = 0; k <= degree; ++k)
+                c.push_back(Number(T(dist(rng)), T(dist(rng))));
+            BasicPolynomial q(c);
+
+            SimdLevel saved = simdLevel();
+            const SimdLevel levels[] = { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+            for (SimdLevel level : levels) {
+                if (level > detectSimdLevel())
+                    continue;
+                setSimdLevel(level);
+                BasicComplexBatch<T> horner, estrin;
+                q.evaluate(points, horner);
+                q.evaluate(points, estrin, POLYNOMIAL_ESTRIN);
+                for (size_t i = 0; i < n; ++i) {
+                    // Горнер - как операторы, Эстрин - как его скалярный
+                    // вариант (см. matchesOperator, допуск от (n + 1)
+                    // sum |c_k| |z|^k), и оба близки друг к другу
+                    Number expected = q(points.get(i));
+                    T radius = std::hypot(points.get(i).getReal(), points.get(i).getImaginary());
+                    T bound = 0;
+                    for (size_t k = degree + 1; k-- > 0;)
+                        bound = bound * radius + std::hypot(c[k].getReal(), c[k].getImaginary());
+                    T operatorScale = bound * T(degree + 1);
+                    assert(matchesOperator(expected.getReal(), horner.get(i).getReal(), operatorScale));
+                    assert(matchesOperator(expected.getImaginary(), horner.get(i).getImaginary(), operatorScale));
+                    Number tree = q.evaluate(points.get(i), POLYNOMIAL_ESTRIN);
+                    assert(matchesOperator(tree.getReal(), estrin.get(i).getReal(), operatorScale));
+                    assert(matchesOperator(tree.getImaginary(), estrin.get(i).getImaginary(), operatorScale));
+                    T scale = 1 + std::fabs(expected.getReal()) + std::fabs(expected.getImaginary());
+                    T precision = std::numeric_limits<T>::epsilon() * 64 * (degree + 1);
+                    assert(std::fabs(estrin.get(i).getReal() - expected.getReal()) <= precision * scale);
+                    assert(std::fabs(estrin.get(i).getImaginary() - expected.getImaginary()) <= precision * scale);
+                }
+            }
+            setSimdLevel(saved);
+        }
+
+        // Корни z^2 + 1
+        std::vector<Number> found;
+        RootStatus status = BasicPolynomial({ Number(1, 0), Number(), Number(1, 0) }).roots(found);
+        assert(status.converged && found.size() == 2);
+        for (const Number& root : found)
+            assert(std::fabs(root.getReal()) < 1e-6 && std::fabs(std::fabs(root.getImaginary()) - 1) < 1e-6);
+
+        // p = s z^2 - s при s у границ диапазона: корни +-1, и при
+        // s - степени двойки побитово те же, что при s = 1. z^2 - t^2
+        // с очень малым t - корни +-t
+        const T accuracy = std::is_same<T, float>::value ? T(1e-2) : T(1e-6);
+        const T huge = std::ldexp(T(1), std::numeric_limits<T>::max_exponent * 7 / 8);
+        const T tiny = std::ldexp(T(1), std::numeric_limits<T>::min_exponent * 7 / 8);
+        std::vector<Number> unscaled;
+        BasicPolynomial({ Number(-1, 0), Number(), Number(1, 0) }).roots(unscaled);
+        for (T scale : { huge, tiny, T(1) / huge, T(1) / tiny }) {
+            status = BasicPolynomial({ Number(-scale, 0), Number(), Number(scale, 0) }).roots(found);
+            assert(status.converged && found.size() == 2);
+            for (size_t k = 0; k < 2; ++k) {
+                assert(std::fabs(std::fabs(found[k].getReal()) - 1) < accuracy && std::fabs(found[k].getImaginary()) < accuracy);
+                assert(found[k].getReal() == unscaled[k].getReal() && found[k].getImaginary() == unscaled[k].getImaginary());
+            }
+            assert(found[0].getReal() * found[1].getReal() < 0);
+        }
+        const T small = std::sqrt(tiny);
+        status = BasicPolynomial({ Number(-small * small, 0), Number(), Number(1, 0) }).roots(found);
+        assert(status.converged && found.size() == 2);
+        for (const Number& root : found)
+            assert(std::fabs(std::fabs(root.getReal()) - small) < accuracy * small &&
+                   std::fabs(root.getImaginary()) < accuracy * small);
+
+        // Известные различные корни находятся все, на пуле - те же самые
+        // Во float близкие корни разрешаются хуже, поэтому их меньше
+        const size_t rootCount = std::is_same<T, float>::value ? 8 : 24;
+        std::vector<Number> expected;
+        for (size_t k = 0; k < rootCount; ++k)
+            expected.push_back(Number(T(dist(rng)), T(dist(rng))));
+        BasicPolynomial product = fromRoots(expected);
+        assert(product.degree() == rootCount);
+        status = product.roots(found);
+        assert(status.converged && found.size() == expected.size());
+        for (const Number& root : expected) {
+            T nearest = std::numeric_limits<T>::max();
+            for (const Number& candidate : found)
+                nearest = std::min(nearest, magnitude(candidate - root));
+            assert(nearest < accuracy);
+        }
+        for (size_t threads = 2; threads <= 3; ++threads) {
+            ThreadPool pool(threads);
+            std::vector<Number> parallel;
+            RootStatus parallelStatus = product.roots(parallel, &pool);
+            assert(parallelStatus.iterations == status.iterations);
+            for (size_t k = 0; k < found.size(); ++k)
+                assert(parallel[k].getReal() == found[k].getReal() && parallel[k].getImaginary() == found[k].getImaginary());
+
+            BasicComplexBatch<T> single, pooled;
+            product.evaluate(points, single, POLYNOMIAL_ESTRIN);
+            product.evaluate(points, pooled, POLYNOMIAL_ESTRIN, &pool);
+            for (size_t i = 0; i < n; ++i)
+                assert(single.realData()[i] == pooled.realData()[i]);
+        }
+
+        std::cout << "All tests passed for Polynomial<" << scalarTypeName<T>() << ">!" << std::endl;
+    }
+};
+
+typedef BasicPolynomial<double> Polynomial;
+
+// ------------------------------------------------------------------
+// Разбор текстовых литералов: "3 + 4i", "3-4i", "1 + 2i - 3j + 4k".
+// Принимается всё, что печатают print(), и запись без пробелов.
+// Числа читаются std::from_chars, без выделения памяти и исключений.
+// ------------------------------------------------------------------
+
+// Результат разбора: message == 0, если ошибок нет.
+// Строка и столбец ошибки считаются с 1.
+struct ParseStatus {
+    const char* message;
+    size_t line;
+    size_t column;
+
+    bool ok() const { return message == 0; }
+};
+
+template <typename Number>
+class LiteralParser {
+public:
+    typedef NumberTraits<Number> Traits;
+    typedef typename Traits::Scalar Scalar;
+    typedef typename Traits::Batch Batch;
+
+    // Меньшие куски буфера не делятся между потоками
+    static const size_t PARALLEL_CHUNK = 1 << 16;
+
+private:
+    static bool isBlank(char ch) { return ch == ' ' || ch == '\t' || ch == '\r'; }
+
+    static const char* skipBlanks(const char* p, const char* last) {
+        while (p < last && isBlank(*p))
+            ++p;
+        return p;
+    }
+
+    static const char* lineEnd(const char* p, const char* last) {
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', last - p));
+        return newline ? newline : last;
+    }
+
+    // Слагаемое вида "2.5", "-3j", "4k": число и, возможно, мнимая единица
+    static const char* parseTerm(const char* p, const char* last, Scalar& value, int& component,
+                                 const char*& error) {
+        std::from_chars_result parsed = std::from_chars(p, last, value);
+        if (parsed.ec == std::errc::result_out_of_range) {
+            error = "number out of range";
+            return 0;
+        }
+        if (parsed.ec != std::errc()) {
+            error = "expected a number";
+            return 0;
+        }
+        p = parsed.ptr;
+        component = 0;
+        if (p < last && (*p == 'i' || *p == 'j' || *p == 'k')) {
+            component = *p - 'i' + 1;
+            ++p;
+        }
+        return p;
+    }
+
+    // Число записей (непустых строк) и переводов строки в [first, last)
+    static size_t countRecords(const char* first, const char* last, size_t& newlines) {
+        size_t records = 0;
+        newlines = 0;
+        while (first < last) {
+            const char* end = lineEnd(first, last);
+            if (skipBlanks(first, end) < end)
+                ++records;
+            if (end < last)
+                ++newlines;
+            first = end + 1;
+        }
+        return records;
+    }
+
+    // Разбор строк [first, last) в out начиная с позиции row;
+    // firstLine - номер первой строки куска. rows - число разобранных записей.
+    static ParseStatus parseLines(const char* first, const char* last, size_t firstLine,
+                                  Batch& out, size_t row, size_t& rows) {
+        Scalar* columns[Traits::components];
+        for (int k = 0; k < Traits::components; ++k)
+            columns[k] = out.data(k) + row;
+
+        ParseStatus status = { 0, 0, 0 };
+        rows = 0;
+        for (size_t line = firstLine; first < last; ++line) {
+            const char* end = lineEnd(first, last);
+            if (skipBlanks(first, end) < end) {
+                Number value;
+                const char* error = 0;
+                const char* stop = parse(first, end, value, error);
+                if (stop != end) {
+                    status.message = error ? error : "unexpected characters after the number";
+                    status.line = line;
+                    status.column = (error ? stop : skipBlanks(stop, end)) - first + 1;
+                    return status;
+                }
+                Scalar c[Traits::components];
+                Traits::split(value, c);
+                for (int k = 0; k < Traits::components; ++k)
+                    columns[k][rows] = c[k];
+                ++rows;
+            }
+            first = end + 1;
+        }
+        return status;
+    }
+
+public:
+    // Разбор одного литерала из [first, last), окружающие пробелы пропускаются.
+    // Возвращает указатель за разобранным текстом: литерал может закончиться
+    // раньше last, например перед запятой. При ошибке value не меняется,
+    // error получает описание, а возвращается место ошибки.
+    static const char* parse(const char* first, const char* last, Number& value, const char*& error) {
+        Scalar c[Traits::components] = {};
+        int previous = -1;
+        const char* p = skipBlanks(first, last);
+        bool firstTerm = true;
+        while (firstTerm || p < last) {
+            Scalar sign = 1;
+            if (!firstTerm) {
+                if (*p != '+' && *p != '-')
+                    break;
+                if (*p == '-')
+                    sign = -1;
+                p = skipBlanks(p + 1, last);
+            }
+            const char* termStart = p;
+            Scalar term;
+            int component;
+            p = parseTerm(p, last, term, component, error);
+            if (!p)
+                return termStart;
+            if (component >= Traits::components) {
+                error = "complex numbers have no j or k part";
+                return termStart;
+            }
+            if (component <= previous) {
+                error = "parts must follow in the order real, i, j, k";
+                return termStart;
+            }
+            c[component] = sign * term;
+            previous = component;
+            firstTerm = false;
+            p = skipBlanks(p, last);
+        }
+        error = 0;
+        value = Traits::join(c);
+        return p;
+    }
+
+    // Разбор буфера, по одному литералу в строке; пустые строки пропускаются.
+    // При ошибке в out остаются записи, разобранные до неё.
+    static ParseStatus parseBuffer(const char* data, size_t size, Batch& out) {
+        size_t rows = 0, newlines = 0;
+        out.resize(countRecords(data, data + size, newlines));
+        ParseStatus status = parseLines(data, data + size, 1, out, 0, rows);
+        out.resize(rows);
+        return status;
+    }
+
+    // То же на пуле потоков: буфер режется по границам строк, первый
+    // проход считает строки и записи кусков, второй пишет каждый кусок
+    // в свою часть out. Результат и ошибка те же, что в однопоточном разборе.
+    static ParseStatus parseBuffer(const char* data, size_t size, Batch& out, ThreadPool& pool) {
+        size_t pieces = std::min(pool.size() * 4, size / PARALLEL_CHUNK + 1);
+        std::vector<const char*> bounds(pieces + 1, data + size);
+        bounds[0] = data;
+        for (size_t i = 1; i < pieces; ++i) {
+            const char* cut = std::max(bounds[i - 1], data + size * i / pieces);
+            bounds[i] = std::min(lineEnd(cut, data + size) + 1, data + size);
+        }
+
+        std::vector<size_t> firstRow(pieces + 1, 0), firstLine(pieces + 1, 1);
+        pool.parallelFor(0, pieces, 1, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; ++i)
+                firstRow[i + 1] = countRecords(bounds[i], bounds[i + 1], firstLine[i + 1]);
+        });
+        for (size_t i = 1; i <= pieces; ++i) {
+            firstRow[i] += firstRow[i - 1];
+            firstLine[i] += firstLine[i - 1];
+        }
+
+        out.resize(firstRow[pieces]);
+        std::vector<ParseStatus> statuses(pieces);
+        std::vector<size_t> rows(pieces, 0);
+        pool.parallelFor(0, pieces, 1, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; ++i)
+                statuses[i] = parseLines(bounds[i], bounds[i + 1], firstLine[i], out, firstRow[i], rows[i]);
+        });
+        for (size_t i = 0; i < pieces; ++i) {
+            if (!statuses[i].ok()) {
+                out.resize(firstRow[i] + rows[i]);
+                return statuses[i];
+            }
+        }
+        return statuses.empty() ? ParseStatus{ 0, 0, 0 } : statuses[0];
+    }
+};
+
+// Запись массивов чисел по одному в строке в буфер вызывающего.
+// Пишутся только целые строки: когда буфер заполнен, вызывающий
+// сбрасывает его и продолжает с возвращённой позиции.
+template <typename Number>
+class LiteralFormatter {
+public:
+    typedef typename NumberTraits<Number>::Batch Batch;
+
+private:
+    template <typename Get>
+    static size_t formatLines(Get get, size_t begin, size_t end, char* first, char* last,
+                              char*& written, int precision) {
+        size_t i = begin;
+        written = first;
+        for (; i < end; ++i) {
+            char* stop = get(i).format(written, last - 1, precision);
+            if (!stop)
+                break;
+            *stop = '\n';
+            written = stop + 1;
+        }
+        return i - begin;
+    }
+
+public:
+    // Значения values[begin, end); written получает конец записи.
+    // Возвращает число записанных значений
+    static size_t formatArray(const Number* values, size_t begin, size_t end, char* first, char* last,
+                              char*& written, int precision = ROUND_TRIP_PRECISION) {
+        return formatLines([values](size_t i) -> const Number& { return values[i]; },
+                           begin, end, first, last, written, precision);
+    }
+
+    // То же для набора batch[begin, end)
+    static size_t formatBatch(const Batch& batch, size_t begin, size_t end, char* first, char* last,
+                              char*& written, int precision = ROUND_TRIP_PRECISION) {
+        return formatLines([&batch](size_t i) { return batch.get(i); },
+                           begin, end, first, last, written, precision);
+    }
+};
+
+// Вывод print() в строку, чтобы проверить разбор и запись
+template <typename Number>
+std::string printed(const Number& value) {
+    std::ostringstream out;
+    std::streambuf* saved = std::cout.rdbuf(out.rdbuf());
+    value.print();
+    std::cout.rdbuf(saved);
+    return out.str();
+}
+
+// Тестирование
+void testLiteralParser() {
+    typedef LiteralParser<ComplexNumber> ComplexParser;
+    typedef LiteralParser<Quaternion> QuaternionParser;
+    const char* error = 0;
+    ComplexNumber c;
+    Quaternion q;
+
+    // Запись print() и запись без пробелов
+    std::string text = "3 + 4i";
+    assert(ComplexParser::parse(text.data(), text.data() + text.size(), c, error) == text.data() + text.size());
+    assert(c.getReal() == 3 && c.getImaginary() == 4);
+    text = "3-4i";
+    ComplexParser::parse(text.data(), text.data() + text.size(), c, error);
+    assert(c.getReal() == 3 && c.getImaginary() == -4);
+    text = "-1.5e3 - 0.25i";
+    ComplexParser::parse(text.data(), text.data() + text.size(), c, error);
+    assert(c.getReal() == -1500 && c.getImaginary() == -0.25);
+    text = "1+2i-3j+4k";
+    QuaternionParser::parse(text.data(), text.data() + text.size(), q, error);
+    assert(q.getA() == 1 && q.getB() == 2 && q.getC() == -3 && q.getD() == 4);
+    text = "7";
+    QuaternionParser::parse(text.data(), text.data() + text.size(), q, error);
+    assert(q.getA() == 7 && q.getB() == 0 && q.getC() == 0 && q.getD() == 0);
+
+    // Всё, что печатает print(), читается обратно
+    ComplexNumber complexValues[] = { ComplexNumber(3, 4), ComplexNumber(3, -4), ComplexNumber(-0.5, 0) };
+    for (const ComplexNumber& value : complexValues) {
+        text = printed(value);
+        assert(ComplexParser::parse(text.data(), text.data() + text.size() - 1, c, error) == text.data() + text.size() - 1);
+        assert(c.getReal() == value.getReal() && c.getImaginary() == value.getImaginary());
+    }
+    Quaternion quaternionValues[] = { Quaternion(1, 2, 3, 4), Quaternion(1, -2, -3, -4), Quaternion(-1e-7, 0.5, 0, 1e20) };
+    for (const Quaternion& value : quaternionValues) {
+        text = printed(value);
+        assert(QuaternionParser::parse(text.data(), text.data() + text.size() - 1, q, error) == text.data() + text.size() - 1);
+        assert(q.getA() == value.getA() && q.getB() == value.getB() &&
+               q.getC() == value.getC() && q.getD() == value.getD());
+    }
+
+    // Ошибки: место и описание, без исключений
+    text = "3 + x";
+    assert(ComplexParser::parse(text.data(), text.data() + text.size(), c, error) == text.data() + 4);
+    assert(error != 0);
+    text = "1 + 2j";
+    assert(ComplexParser::parse(text.data(), text.data() + text.size(), c, error) == text.data() + 4);
+    text = "1 + 2k + 3j";
+    assert(QuaternionParser::parse(text.data(), text.data() + text.size(), q, error) == text.data() + 9);
+
+    // Буфер: по литералу в строке, пустые строки пропускаются
+    text = "1 + 2i + 3j + 4k\n\n5-6i-7j-8k\r\n  9  \n";
+    QuaternionBatch batch;
+    ParseStatus status = QuaternionParser::parseBuffer(text.data(), text.size(), batch);
+    assert(status.ok() && batch.size() == 3);
+    assert(batch.get(1).getD() == -8 && batch.get(2).getA() == 9);
+
+    text = "1 + 2i\n3 - 4i\n\n5 + 6i 7\n";
+    ComplexBatch complexBatch;
+    status = ComplexParser::parseBuffer(text.data(), text.size(), complexBatch);
+    assert(!status.ok() && status.line == 4 && status.column == 8);
+    assert(complexBatch.size() == 2 && complexBatch.get(1).getImaginary() == -4);
+
+    // Многопоточный разбор совпадает с однопоточным
+    std::mt19937_64 rng(11);
+    std::uniform_real_distribution<double> dist(-100.0, 100.0);
+    std::string big;
+    const size_t n = 50000;
+    for (size_t i = 0; i < n; ++i) {
+        big += printed(Quaternion(dist(rng), dist(rng), dist(rng), dist(rng)));
+        if (i % 7 == 0)
+            big += "\n";
+    }
+    QuaternionBatch sequential, parallel;
+    assert(QuaternionParser::parseBuffer(big.data(), big.size(), sequential).ok());
+    assert(sequential.size() == n);
+    for (size_t threads = 1; threads <= 4; ++threads) {
+        ThreadPool pool(threads);
+        assert(QuaternionParser::parseBuffer(big.data(), big.size(), parallel, pool).ok());
+        assert(parallel.size() == n);
+        for (int k = 0; k < 4; ++k)
+            assert(std::memcmp(parallel.data(k), sequential.data(k), n * sizeof(double)) == 0);
+
+        std::string broken = big;
+        size_t at = broken.size() * 3 / 4;
+        at = broken.find('\n', at) + 1;
+        broken.insert(at, "1 + ?\n");
+        size_t line = std::count(broken.begin(), broken.begin() + at, '\n') + 1;
+        ParseStatus failed = QuaternionParser::parseBuffer(broken.data(), broken.size(), parallel, pool);
+        QuaternionBatch prefix;
+        ParseStatus expected = QuaternionParser::parseBuffer(broken.data(), broken.size(), prefix);
+        assert(!failed.ok() && failed.line == line && failed.column == 5);
+        assert(expected.line == failed.line && parallel.size() == prefix.size());
+    }
+
+    std::cout << "All tests passed for LiteralParser!" << std::endl;
+}
+
+// Тестирование
+void testLiteralFormatter() {
+    char buffer[MAX_FORMAT_LENGTH];
+
+    // print() пишет то же, что прежние вставки в std::cout
+    ComplexNumber complexValues[] = { ComplexNumber(3, 4), ComplexNumber(3, -4), ComplexNumber(-0.0, -0.0),
+                                      ComplexNumber(1.0 / 3, 1e-300), ComplexNumber(123456789, -1e21),
+                                      ComplexNumber(INFINITY, NAN) };
+    for (const ComplexNumber& c : complexValues) {
+        std::ostringstream expected;
+        if (c.getImaginary() >= 0)
+            expected << c.getReal() << " + " << c.getImaginary() << "i\n";
+        else
+            expected << c.getReal() << " - " << std::fabs(c.getImaginary()) << "i\n";
+        assert(printed(c) == expected.str());
+    }
+    Quaternion quaternionValues[] = { Quaternion(1, 2, 3, 4), Quaternion(1, -2, -3, -4),
+                                      Quaternion(0.1, 2.5e-8, -7.25, 1e100), Quaternion(-0.0, -INFINITY, 0, NAN) };
+    for (const Quaternion& q : quaternionValues) {
+        std::ostringstream expected;
+        expected << q.getA() << " + " << q.getB() << "i";
+        if (q.getC() >= 0)
+            expected << " + " << q.getC() << "j";
+        else
+            expected << " - " << std::fabs(q.getC()) << "j";
+        if (q.getD() >= 0)
+            expected << " + " << q.getD() << "k";
+        else
+            expected << " - " << std::fabs(q.getD()) << "k";
+        expected << "\n";
+        assert(printed(q) == expected.str());
+    }
+
+    // Точность std::cout учитывается
+    std::streamsize savedPrecision = std::cout.precision(12);
+    assert(printed(ComplexNumber(1.0 / 3, 2)) == "0.333333333333 + 2i\n");
+    std::cout.precision(savedPrecision);
+
+    // Кратчайшая запись читается обратно побитово
+    std::mt19937_64 rng(12);
+    std::uniform_real_distribution<double> dist(-1e6, 1e6);
+    const char* error = 0;
+    for (int i = 0; i < 1000; ++i) {
+        Quaternion q(dist(rng), dist(rng) * 1e-9, dist(rng), dist(rng) * 1e9);
+        char* end = q.format(buffer, buffer + sizeof(buffer));
+        Quaternion parsed;
+        assert(LiteralParser<Quaternion>::parse(buffer, end, parsed, error) == end);
+        assert(parsed.getA() == q.getA() && parsed.getB() == q.getB() &&
+               parsed.getC() == q.getC() && parsed.getD() == q.getD());
+    }
+
+    // Нехватка места - 0, буфер не переполняется
+    assert(Quaternion(1, 2, 3, 4).format(buffer, buffer + 10) == 0);
+    assert(ComplexNumber(3, 4).format(buffer, buffer + 6) == buffer + 6);
+
+    // Массив по частям через маленький буфер: то же, что подряд print()
+    std::vector<ComplexNumber> values;
+    std::string expected;
+    for (int i = 0; i < 200; ++i) {
+        values.push_back(ComplexNumber(dist(rng), dist(rng)));
+        expected += printed(values.back());
+    }
+    ComplexBatch batch;
+    for (const ComplexNumber& c : values)
+        batch.append(c);
+    for (int useBatch = 0; useBatch < 2; ++useBatch) {
+        std::string text;
+        char chunk[100];
+        size_t done = 0;
+        while (done < values.size()) {
+            char* written = 0;
+            size_t count = useBatch
+                ? LiteralFormatter<ComplexNumber>::formatBatch(batch, done, batch.size(), chunk, chunk + sizeof(chunk), written, 6)
+                : LiteralFormatter<ComplexNumber>::formatArray(values.data(), done, values.size(), chunk, chunk + sizeof(chunk), written, 6);
+            assert(count > 0);
+            text.append(chunk, written);
+            done += count;
+        }
+        assert(text == expected);
+    }
+
+    std::cout << "All tests passed for LiteralFormatter!" << std::endl;
+}
+
+// ------------------------------------------------------------------
+// Двоичный столбцовый формат для наборов чисел между этапами обработки.
+// Заголовок 64 байта, затем столбцы компонент (SoA), каждый с границы
+// 64 байт. Порядок байтов родной для машины. Чтение - через mmap, без
+// разбора и копирования: открытие стоит только отказов страниц.
+// ------------------------------------------------------------------
+
+struct ColumnFileHeader {
+    char magic[8];          // "LB3COLS" и ноль
+    uint32_t version;
+    uint32_t type;          // NumberType: COMPLEX или QUATERNION
+    uint32_t scalarSize;    // sizeof скалярного типа
+    uint32_t components;    // 2 или 4
+    uint64_t count;         // число элементов
+    uint64_t offsets[4];    // смещения столбцов от начала файла
+};
+
+static_assert(sizeof(ColumnFileHeader) == 64, "column file header must take 64 bytes");
+
+const char COLUMN_FILE_MAGIC[8] = { 'L', 'B', '3', 'C', 'O', 'L', 'S', 0 };
+const uint32_t COLUMN_FILE_VERSION = 1;
+
+// Столбцы лежат с этой границы
+const size_t COLUMN_FILE_ALIGNMENT = 64;
+
+inline uint64_t alignColumnOffset(uint64_t offset) {
+    return (offset + COLUMN_FILE_ALIGNMENT - 1) / COLUMN_FILE_ALIGNMENT * COLUMN_FILE_ALIGNMENT;
+}
+
+// Набор, столбцы которого принадлежат кому-то другому (например,
+// отображённому файлу). Только чтение; столбцы можно передавать
+// прямо в ядра NumberTraits<Number>::apply
+template <typename Number>
+class ColumnView {
+public:
+    typedef NumberTraits<Number> Traits;
+    typedef typename Traits::Scalar Scalar;
+
+private:
+    const Scalar* columns[Traits::components];
+    size_t count;
+
+public:
+    ColumnView() : count(0) {
+        for (int k = 0; k < Traits::components; ++k)
+            columns[k] = 0;
+    }
+
+    ColumnView(const Scalar* const* data, size_t n) : count(n) {
+        for (int k = 0; k < Traits::components; ++k)
+            columns[k] = data[k];
+    }
+
+    size_t size() const { return count; }
+    const Scalar* data(int k) const { return columns[k]; }
+    const Scalar* const* columnData() const { return columns; }
+
+    Number get(size_t i) const {
+        Scalar c[Traits::components];
+        for (int k = 0; k < Traits::components; ++k)
+            c[k] = columns[k][i];
+        return Traits::join(c);
+    }
+
+    // Копирование элементов [begin, end) в набор
+    void copyTo(typename Traits::Batch& out, size_t begin, size_t end) const {
+        out.resize(end - begin);
+        for (int k = 0; k < Traits::components; ++k)
+            std::memcpy(out.data(k), columns[k] + begin, (end - begin) * sizeof(Scalar));
+    }
+};
+
+// Отображённый в память столбцовый файл. Ошибки открытия не бросают
+// исключений: valid() и errorMessage(), как у CalculatorProgram
+class ColumnFile {
+private:
+    void* mapping;
+    size_t mappingSize;
+    ColumnFileHeader header;
+    std::string error;
+
+    bool fail(const std::string& message) {
+        close();
+        error = message;
+        return false;
+    }
+
+public:
+    ColumnFile() : mapping(0), mappingSize(0), header() {}
+
+    explicit ColumnFile(const std::string& path) : mapping(0), mappingSize(0), header() { open(path); }
+
+    ~ColumnFile() { close(); }
+
+    ColumnFile(const ColumnFile&) = delete;
+    ColumnFile& operator=(const ColumnFile&) = delete;
+
+    bool open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return fail("cannot open " + path + ": " + std::strerror(errno));
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(ColumnFileHeader)) {
+            ::close(fd);
+            return fail(path + " is too short for a column file");
+        }
+        mappingSize = info.st_size;
+        mapping = mmap(0, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            mapping = 0;
+            return fail("cannot map " + path + ": " + std::strerror(errno));
+        }
+
+        std::memcpy(&header, mapping, sizeof(header));
+        if (std::memcmp(header.magic, COLUMN_FILE_MAGIC, sizeof(COLUMN_FILE_MAGIC)) != 0)
+            return fail(path + " is not a column file");
+        if (header.version != COLUMN_FILE_VERSION)
+            return fail(path + " has unsupported version " + std::to_string(header.version));
+        if (!((header.type == COMPLEX && header.components == 2) ||
+              (header.type == QUATERNION && header.components == 4)))
+            return fail(path + " has an unknown element type");
+        if (header.scalarSize == 0 || header.count > mappingSize / header.scalarSize)
+            return fail(path + " has a corrupt element count");
+        for (uint32_t k = 0; k < header.components; ++k) {
+            uint64_t offset = header.offsets[k];
+            if (offset % COLUMN_FILE_ALIGNMENT != 0 || offset < sizeof(ColumnFileHeader) ||
+                offset > mappingSize || header.count * header.scalarSize > mappingSize - offset)
+                return fail(path + " is truncated or has a corrupt column offset");
+        }
+        error.clear();
+        return true;
+    }
+
+    void close() {
+        if (mapping)
+            munmap(mapping, mappingSize);
+        mapping = 0;
+        mappingSize = 0;
+        header = ColumnFileHeader();
+    }
+
+    bool valid() const { return mapping != 0; }
+    const std::string& errorMessage() const { return error; }
+
+    NumberType type() const { return (NumberType)header.type; }
+    size_t scalarSize() const { return header.scalarSize; }
+    size_t size() const { return header.count; }
+
+    // Хранит ли файл числа типа Number
+    template <typename Number>
+    bool holds() const {
+        typedef NumberTraits<Number> Traits;
+        return valid() && header.type == (uint32_t)Traits::type &&
+               header.scalarSize == sizeof(typename Traits::Scalar);
+    }
+
+    // Столбцы файла без копирования; пустой вид, если тип не совпадает
+    template <typename Number>
+    ColumnView<Number> view() const {
+        typedef NumberTraits<Number> Traits;
+        typedef typename Traits::Scalar Scalar;
+        if (!holds<Number>())
+            return ColumnView<Number>();
+        const Scalar* columns[Traits::components];
+        for (int k = 0; k < Traits::components; ++k)
+            columns[k] = reinterpret_cast<const Scalar*>(static_cast<const char*>(mapping) + header.offsets[k]);
+        return ColumnView<Number>(columns, header.count);
+    }
+};
+
+// Копия столбцов файла в набор того вида, что записан в заголовке.
+// false для файлов не над double
+inline bool loadBatch(const ColumnFile& file, AnyBatch& out) {
+    if (file.holds<ComplexNumber>()) {
+        file.view<ComplexNumber>().copyTo(out.emplace<ComplexBatch>(), 0, file.size());
+        return true;
+    }
+    if (file.holds<Quaternion>()) {
+        file.view<Quaternion>().copyTo(out.emplace<QuaternionBatch>(), 0, file.size());
+        return true;
+    }
+    return false;
+}
+
+// Потоковая запись столбцового файла. Место под capacity элементов
+// размечается сразу (незаписанная часть остаётся дырой в разреженном
+// файле), значения копятся в буфере по столбцам и пишутся pwrite.
+// close() записывает итоговое число элементов в заголовок. После ошибки
+// запись прекращается, а файл остаётся без заголовка и не откроется.
+template <typename Number>
+class ColumnFileWriter {
+public:
+    typedef NumberTraits<Number> Traits;
+    typedef typename Traits::Scalar Scalar;
+    typedef typename Traits::Batch Batch;
+
+    // Элементов в буфере каждого столбца
+    static const size_t BUFFER_ELEMENTS = 8192;
+
+private:
+    int fd;
+    size_t capacity;
+    size_t count;
+    size_t buffered;
+    ColumnFileHeader header;
+    AlignedVector<Scalar> buffers[Traits::components];
+    std::string error;
+
+    bool fail(const std::string& message) {
+        if (error.empty())
+            error = message;
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+        return false;
+    }
+
+    bool writeAll(const void* data, size_t bytes, uint64_t offset) {
+        const char* p = static_cast<const char*>(data);
+        while (bytes > 0) {
+            ssize_t written = pwrite(fd, p, bytes, offset);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                return fail(std::string("write failed: ") + std::strerror(errno));
+            }
+            p += written;
+            bytes -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    // Запись столбцов columns[k][0, n) за уже записанными элементами
+    bool writeColumns(const Scalar* const* columns, size_t n) {
+        for (int k = 0; k < Traits::components; ++k)
+            if (!writeAll(columns[k], n * sizeof(Scalar), header.offsets[k] + count * sizeof(Scalar)))
+                return false;
+        count += n;
+        return true;
+    }
+
+    bool flush() {
+        if (buffered == 0)
+            return true;
+        const Scalar* columns[Traits::components];
+        for (int k = 0; k < Traits::components; ++k)
+            columns[k] = buffers[k].data();
+        size_t n = buffered;
+        buffered = 0;
+        return writeColumns(columns, n);
+    }
+
+    bool reserveRows(size_t n) {
+        if (fd < 0)
+            return false;
+        if (n > capacity - count - buffered)
+            return fail("column file capacity of " + std::to_string(capacity) + " elements exceeded");
+        return true;
+    }
+
+public:
+    ColumnFileWriter(const std::string& path, size_t capacity)
+        : fd(-1), capacity(capacity), count(0), buffered(0), header() {
+        std::memcpy(header.magic, COLUMN_FILE_MAGIC, sizeof(COLUMN_FILE_MAGIC));
+        header.version = COLUMN_FILE_VERSION;
+        header.type = Traits::type;
+        header.scalarSize = sizeof(Scalar);
+        header.components = Traits::components;
+        uint64_t offset = sizeof(ColumnFileHeader);
+        for (int k = 0; k < Traits::components; ++k) {
+            header.offsets[k] = alignColumnOffset(offset);
+            offset = header.offsets[k] + (uint64_t)capacity * sizeof(Scalar);
+        }
+        for (int k = 0; k < Traits::components; ++k)
+            buffers[k].resize(BUFFER_ELEMENTS);
+
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fail("cannot create " + path + ": " + std::strerror(errno));
+            return;
+        }
+        if (ftruncate(fd, offset) != 0)
+            fail("cannot reserve " + path + ": " + std::strerror(errno));
+    }
+
+    ~ColumnFileWriter() { close(); }
+
+    ColumnFileWriter(const ColumnFileWriter&) = delete;
+    ColumnFileWriter& operator=(const ColumnFileWriter&) = delete;
+
+    bool valid() const { return error.empty(); }
+    const std::string& errorMessage() const { return error; }
+    size_t size() const { return count + buffered; }
+
+    bool append(const Number& value) {
+        if (!reserveRows(1))
+            return false;
+        Scalar c[Traits::components];
+        Traits::split(value, c);
+        for (int k = 0; k < Traits::components; ++k)
+            buffers[k][buffered] = c[k];
+        if (++buffered == BUFFER_ELEMENTS)
+            return flush();
+        return true;
+    }
+
+    // Элементы batch[begin, end) пишутся прямо из столбцов набора
+    bool append(const Batch& batch, size_t begin, size_t end) {
+        if (!reserveRows(end - begin) || !flush())
+            return false;
+        const Scalar* columns[Traits::components];
+        for (int k = 0; k < Traits::components; ++k)
+            columns[k] = batch.data(k) + begin;
+        return writeColumns(columns, end - begin);
+    }
+
+    bool append(const Batch& batch) { return append(batch, 0, batch.size()); }
+
+    // Дописывает буфер и заголовок, обрезает неиспользованный хвост
+    // последнего столбца. Вызывается и из деструктора
+    bool close() {
+        if (fd < 0)
+            return valid();
+        if (!flush())
+            return false;
+        header.count = count;
+        if (!writeAll(&header, sizeof(header), 0))
+            return false;
+        uint64_t end = header.offsets[Traits::components - 1] + (uint64_t)count * sizeof(Scalar);
+        if (ftruncate(fd, end) != 0)
+            return fail(std::string("cannot trim column file: ") + std::strerror(errno));
+        if (::close(fd) != 0) {
+            fd = -1;
+            return fail(std::string("cannot close column file: ") + std::strerror(errno));
+        }
+        fd = -1;
+        return true;
+    }
+};
+
+// Новый пустой файл с уникальным именем prefix-XXXXXX в $TMPDIR (или
+// в /tmp) для тестов и замеров; пустая строка, если создать не удалось
+inline std::string temporaryFile(const char* prefix) {
+    const char* directory = std::getenv("TMPDIR");
+    std::string pattern = std::string(directory != 0 && *directory != 0 ? directory : "/tmp") + "/" + prefix + "-XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back(0);
+    int fd = ::mkstemp(name.data());
+    if (fd < 0)
+        return std::string();
+    ::close(fd);
+    return std::string(name.data());
+}
+
+// Тестирование
+void testColumnFile() {
+    const std::string path = temporaryFile("laba3-columns");
+    assert(!path.empty());
+    std::mt19937_64 rng(13);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+
+    // Кватернионы: по одному и целыми наборами, больше одного буфера
+    const size_t n = 3 * ColumnFileWriter<Quaternion>::BUFFER_ELEMENTS + 17;
+    QuaternionBatch expected;
+    {
+        ColumnFileWriter<Quaternion> writer(path, n + 1000);
+        assert(writer.valid());
+        QuaternionBatch part;
+        for (size_t i = 0; i < n; ++i) {
+            Quaternion q(dist(rng), dist(rng), dist(rng), dist(rng));
+            expected.append(q);
+            if (i < n / 2) {
+                assert(writer.append(q));
+            } else {
+                part.append(q);
+            }
+        }
+        assert(writer.append(part, 0, 100));
+        assert(writer.append(part, 100, part.size()));
+        assert(writer.size() == n);
+        assert(writer.close());
+    }
+
+    ColumnFile file(path);
+    assert(file.valid() && file.type() == QUATERNION && file.size() == n);
+    assert(file.holds<Quaternion>() && !file.holds<ComplexNumber>() && !file.holds<BasicQuaternion<float> >());
+    ColumnView<Quaternion> view = file.view<Quaternion>();
+    assert(view.size() == n);
+    for (int k = 0; k < 4; ++k) {
+        assert(reinterpret_cast<uintptr_t>(view.data(k)) % COLUMN_FILE_ALIGNMENT == 0);
+        assert(std::memcmp(view.data(k), expected.data(k), n * sizeof(double)) == 0);
+    }
+    assert(file.view<ComplexNumber>().size() == 0);
+    AnyBatch loaded;
+    assert(loadBatch(file, loaded) && numberType(loaded) == QUATERNION);
+    assert(std::get<QuaternionBatch>(loaded).get(n - 1).getC() == expected.get(n - 1).getC());
+
+    // Вид годится прямо для ядер и для копирования в набор
+    QuaternionBatch product;
+    product.resize(n);
+    double* out[4] = { product.data(0), product.data(1), product.data(2), product.data(3) };
+    assert(NumberTraits<Quaternion>::apply('*', view.columnData(), view.columnData(), out, n));
+    Quaternion square = expected.get(n - 1) * expected.get(n - 1);
+    assert(product.get(n - 1).getA() == square.getA() && product.get(n - 1).getD() == square.getD());
+    // Неизвестная операция отвергается и не трогает результат
+    assert(!NumberTraits<Quaternion>::apply('%', view.columnData(), view.columnData(), out, n));
+    assert(product.get(n - 1).getA() == square.getA() && product.get(n - 1).getD() == square.getD());
+    QuaternionBatch copy;
+    view.copyTo(copy, 10, 20);
+    assert(copy.size() == 10 && copy.get(0).getB() == expected.get(10).getB());
+    file.close();
+
+    // Комплексные числа над float, пустой файл
+    {
+        ColumnFileWriter<BasicComplexNumber<float> > writer(path, 4);
+        assert(writer.append(BasicComplexNumber<float>(1.5f, -2)));
+        assert(writer.append(BasicComplexNumber<float>(3, 4)));
+    }
+    assert(file.open(path) && file.type() == COMPLEX && file.scalarSize() == sizeof(float));
+    assert(file.view<BasicComplexNumber<float> >().get(0).getImaginary() == -2);
+    assert(file.view<BasicComplexNumber<float> >().get(1).getReal() == 3);
+    {
+        ColumnFileWriter<ComplexNumber> writer(path, 0);
+    }
+    assert(file.open(path) && file.size() == 0);
+
+    // Переполнение ёмкости - ошибка записи, недописанный файл не открывается
+    {
+        ColumnFileWriter<ComplexNumber> writer(path, 1);
+        assert(writer.append(ComplexNumber(1, 1)));
+        assert(!writer.append(ComplexNumber(2, 2)));
+        assert(!writer.valid() && !writer.errorMessage().empty());
+        assert(!writer.close());
+    }
+    assert(!file.open(path));
+
+    // Испорченные файлы не открываются
+    {
+        ColumnFileWriter<ComplexNumber> writer(path, 100);
+        for (int i = 0; i < 100; ++i)
+            writer.append(ComplexNumber(i, -i));
+    }
+    assert(truncate(path.c_str(), 64 + 100 * sizeof(double) + 8) == 0);
+    assert(!file.open(path) && !file.errorMessage().empty());
+    {
+        std::ofstream garbage(path.c_str(), std::ios::binary);
+        garbage << std::string(128, 'x');
+    }
+    assert(!file.open(path) && !file.valid());
+    std::remove(path.c_str());
+    assert(!file.open(path));
+
+    std::cout << "All tests passed for ColumnFile!" << std::endl;
+}
+
+// ------------------------------------------------------------------
+// Скомпилированные формулы калькулятора: выражение разбирается один раз
+// в компактный байт-код, который потом выполняется сколько угодно раз
+// на разных значениях переменных без выделения памяти
+// ------------------------------------------------------------------
+
+// Лексема формулы
+struct FormulaToken {
+    enum Kind { NUMBER, NAME, OPERATOR, OPEN, CLOSE, END, BAD };
+
+    Kind kind;
+    size_t position;
+    double value;      // для NUMBER
+    int component;     // для NUMBER: 0 - действительная часть, 1..3 - i, j, k
+    std::string name;  // для NAME
+    char symbol;       // для OPERATOR
+};
+
+// Разбиение формулы на лексемы
+class FormulaLexer {
+private:
+    const std::string& text;
+    size_t position;
+
+public:
+    explicit FormulaLexer(const std::string& text) : text(text), position(0) {}
+
+    FormulaToken next() {
+        while (position < text.size() && isspace((unsigned char)text[position]))
+            ++position;
+
+        FormulaToken token;
+        token.kind = FormulaToken::END;
+        token.position = position;
+        token.value = 0;
+        token.component = 0;
+        token.symbol = 0;
+        if (position >= text.size())
+            return token;
+
+        char ch = text[position];
+        if (isdigit((unsigned char)ch) || ch == '.') {
+            const char* begin = text.data() + position;
+            const char* end = text.data() + text.size();
+            std::from_chars_result parsed = std::from_chars(begin, end, token.value);
+            if (parsed.ec != std::errc()) {
+                token.kind = FormulaToken::BAD;
+                return token;
+            }
+            position += parsed.ptr - begin;
+            // Мнимые единицы: 2i, 3j, 4k
+            if (position < text.size() && (text[position] == 'i' || text[position] == 'j' || text[position] == 'k')) {
+                token.component = text[position] - 'i' + 1;
+                ++position;
+            }
+            token.kind = FormulaToken::NUMBER;
+        } else if (isalpha((unsigned char)ch) || ch == '_') {
+            size_t start = position;
+            while (position < text.size() && (isalnum((unsigned char)text[position]) || text[position] == '_'))
+                ++position;
+            token.kind = FormulaToken::NAME;
+            token.name = text.substr(start, position - start);
+        } else if (ch == '+' || ch == '-' || ch == '*' || ch == '/') {
+            token.kind = FormulaToken::OPERATOR;
+            token.symbol = ch;
+            ++position;
+        } else if (ch == '(') {
+            token.kind = FormulaToken::OPEN;
+            ++position;
+        } else if (ch == ')') {
+            token.kind = FormulaToken::CLOSE;
+            ++position;
+        } else {
+            token.kind = FormulaToken::BAD;
+        }
+        return token;
+    }
+};
+
+// Формула, скомпилированная в байт-код стековой машины.
+// Переменные нумеруются в порядке первого появления в формуле.
+template <typename Number>
+class CalculatorProgram {
+public:
+    enum Opcode : unsigned char { LOAD_VARIABLE, LOAD_CONSTANT, NEGATE, ADD, SUB, MUL, DIV };
+
+    struct Instruction {
+        Opcode opcode;
+        unsigned short operand;
+    };
+
+    typedef NumberTraits<Number> Traits;
+    typedef typename Traits::Scalar Scalar;
+    typedef typename Traits::Batch Batch;
+
+    // Наибольшая глубина стека, которую поддерживает столбцовое выполнение
+    static const size_t MAX_COLUMN_DEPTH = 64;
+
+private:
+    std::vector<Instruction> code;
+    std::vector<Number> constants;
+    std::vector<std::string> variables;
+    size_t depth;
+    std::string error;
+    size_t errorPosition;
+    // Заранее выделенные стек для run() и буфер для runColumns()
+    mutable std::vector<Number> registers;
+    mutable AlignedVector<Scalar> columnScratch;
+
+    bool fail(const std::string& message, size_t position) {
+        if (error.empty()) {
+            error = message;
+            errorPosition = position;
+        }
+        return false;
+    }
+
+    // Добавление инструкции с контролем глубины стека
+    bool emit(Opcode opcode, unsigned short operand, size_t& current, size_t position) {
+        if (opcode == LOAD_VARIABLE || opcode == LOAD_CONSTANT) {
+            ++current;
+        } else if (opcode == NEGATE) {
+            if (current < 1)
+                return fail("missing operand", position);
+        } else {
+            if (current < 2)
+                return fail("missing operand", position);
+            --current;
+        }
+        if (current > depth)
+            depth = current;
+        Instruction instruction = { opcode, operand };
+        code.push_back(instruction);
+        return true;
+    }
+
+    bool emitToken(const FormulaToken& token, size_t& current) {
+        switch (token.kind) {
+            case FormulaToken::NUMBER: {
+                if (token.component >= Traits::components)
+                    return fail("imaginary unit is not supported by this number type", token.position);
+                if (constants.size() > 0xFFFF)
+                    return fail("too many constants", token.position);
+                typename Traits::Scalar c[Traits::components] = {};
+                c[token.component] = token.value;
+                constants.push_back(Traits::join(c));
+                return emit(LOAD_CONSTANT, (unsigned short)(constants.size() - 1), current, token.position);
+            }
+            case FormulaToken::NAME: {
+                int index = variableIndex(token.name);
+                if (index < 0) {
+                    if (variables.size() > 0xFFFF)
+                        return fail("too many variables", token.position);
+                    variables.push_back(token.name);
+                    index = (int)variables.size() - 1;
+                }
+                return emit(LOAD_VARIABLE, (unsigned short)index, current, token.position);
+            }
+            case FormulaToken::OPERATOR:
+                switch (token.symbol) {
+                    case '+': return emit(ADD, 0, current, token.position);
+                    case '-': return emit(SUB, 0, current, token.position);
+                    case '*': return emit(MUL, 0, current, token.position);
+                    case '/': return emit(DIV, 0, current, token.position);
+                    default: return emit(NEGATE, 0, current, token.position);
+                }
+            default:
+                return fail("unexpected token", token.position);
+        }
+    }
+
+    bool finish(size_t current, size_t position) {
+        if (current != 1)
+            return fail(current == 0 ? "empty expression" : "missing operator", position);
+        if (depth > MAX_COLUMN_DEPTH)
+            return fail("expression is nested too deeply", position);
+        registers.resize(depth);
+        return true;
+    }
+
+    static int precedence(char symbol) {
+        if (symbol == '~')
+            return 3;
+        return symbol == '*' || symbol == '/' ? 2 : 1;
+    }
+
+    // Разбор инфиксной записи: + - * /, унарный минус, скобки,
+    // переменные и константы вида 2.5, 3i, 4j, 5k (алгоритм сортировочной станции)
+    bool parseInfix(const std::string& expression) {
+        ArenaScope scope;
+        FormulaLexer lexer(expression);
+        ArenaVector<FormulaToken> operators;
+        size_t current = 0;
+        bool expectOperand = true;
+        FormulaToken token = lexer.next();
+        for (; token.kind != FormulaToken::END; token = lexer.next()) {
+            if (token.kind == FormulaToken::BAD)
+                return fail("unexpected character", token.position);
+            if (token.kind == FormulaToken::NUMBER || token.kind == FormulaToken::NAME) {
+                if (!expectOperand)
+                    return fail("missing operator", token.position);
+                if (!emitToken(token, current))
+                    return false;
+                expectOperand = false;
+            } else if (token.kind == FormulaToken::OPEN) {
+                if (!expectOperand)
+                    return fail("missing operator", token.position);
+                operators.push_back(token);
+            } else if (token.kind == FormulaToken::CLOSE) {
+                if (expectOperand)
+                    return fail("missing operand", token.position);
+                while (!operators.empty() && operators.back().kind != FormulaToken::OPEN) {
+                    if (!emitToken(operators.back(), current))
+                        return false;
+                    operators.pop_back();
+                }
+                if (operators.empty())
+                    return fail("unbalanced ')'", token.position);
+                operators.pop_back();
+            } else if (expectOperand) {
+                // Унарные минус и плюс
+                if (token.symbol == '-') {
+                    token.symbol = '~';
+                    operators.push_back(token);
+                } else if (token.symbol != '+') {
+                    return fail("missing operand", token.position);
+                }
+            } else {
+                while (!operators.empty() && operators.back().kind == FormulaToken::OPERATOR &&
+                       precedence(operators.back().symbol) >= precedence(token.symbol)) {
+                    if (!emitToken(operators.back(), current))
+                        return false;
+                    operators.pop_back();
+                }
+                operators.push_back(token);
+                expectOperand = true;
+            }
+        }
+        if (expectOperand && !(current == 0 && operators.empty()))
+            return fail("missing operand", token.position);
+        while (!operators.empty()) {
+            if (operators.back().kind == FormulaToken::OPEN)
+                return fail("unbalanced '('", operators.back().position);
+            if (!emitToken(operators.back(), current))
+                return false;
+            operators.pop_back();
+        }
+        return finish(current, token.position);
+    }
+
+    // Разбор обратной польской записи: "x y * z +"
+    bool parseRpn(const std::string& expression) {
+        FormulaLexer lexer(expression);
+        size_t current = 0;
+        FormulaToken token = lexer.next();
+        for (; token.kind != FormulaToken::END; token = lexer.next()) {
+            if (token.kind == FormulaToken::OPEN || token.kind == FormulaToken::CLOSE || token.kind == FormulaToken::BAD)
+                return fail("unexpected character", token.position);
+            if (!emitToken(token, current))
+                return false;
+        }
+        return finish(current, token.position);
+    }
+
+public:
+    // Конструктор по умолчанию: пустая (невалидная) программа
+    CalculatorProgram() : depth(0), error("empty expression"), errorPosition(0) {}
+
+    // Компиляция инфиксной записи
+    static CalculatorProgram fromInfix(const std::string& expression) {
+        CalculatorProgram program;
+        program.error.clear();
+        program.parseInfix(expression);
+        return program;
+    }
+
+    // Компиляция обратной польской записи
+    static CalculatorProgram fromRpn(const std::string& expression) {
+        CalculatorProgram program;
+        program.error.clear();
+        program.parseRpn(expression);
+        return program;
+    }
+
+    bool valid() const { return error.empty(); }
+    const std::string& errorMessage() const { return error; }
+    size_t errorOffset() const { return errorPosition; }
+
+    // Сведения о программе
+    size_t size() const { return code.size(); }
+    size_t stackDepth() const { return depth; }
+    size_t variableCount() const { return variables.size(); }
+    const std::string& variableName(size_t i) const { return variables[i]; }
+
+    int variableIndex(const std::string& name) const {
+        for (size_t i = 0; i < variables.size(); ++i)
+            if (variables[i] == name)
+                return (int)i;
+        return -1;
+    }
+
+    // Выполнение на значениях переменных inputs[0..variableCount()),
+    // stack - буфер не меньше stackDepth() элементов
+    Number run(const Number* inputs, Number* stack) const {
+        assert(valid());
+        Number* top = stack;
+        for (const Instruction& instruction : code) {
+            switch (instruction.opcode) {
+                case LOAD_VARIABLE:
+                    *top++ = inputs[instruction.operand];
+                    break;
+                case LOAD_CONSTANT:
+                    *top++ = constants[instruction.operand];
+                    break;
+                case NEGATE:
+                    top[-1] = Number() - top[-1];
+                    break;
+                case ADD:
+                    --top;
+                    top[-1] = top[-1] + top[0];
+                    break;
+                case SUB:
+                    --top;
+                    top[-1] = top[-1] - top[0];
+                    break;
+                case MUL:
+                    --top;
+                    top[-1] = top[-1] * top[0];
+                    break;
+                case DIV:
+                    --top;
+                    top[-1] = top[-1] / top[0];
+                    break;
+            }
+        }
+        return stack[0];
+    }
+
+    // То же на собственном заранее выделенном стеке (не для нескольких потоков)
+    Number run(const Number* inputs) const {
+        return run(inputs, registers.data());
+    }
+
+    // Выполнение для rows наборов переменных, лежащих подряд:
+    // bindings[row * variableCount() + variable]
+    void runMany(const Number* bindings, size_t rows, Number* results) const {
+        size_t stride = variables.size();
+        for (size_t row = 0; row < rows; ++row)
+            results[row] = run(bindings + row * stride, registers.data());
+    }
+
+    // Длина куска для столбцового выполнения: все регистры-столбцы
+    // вместе занимают около COLUMN_WORKING_SET байт и остаются в кэше
+    static const size_t COLUMN_WORKING_SET = 64 * 1024;
+
+    size_t columnChunk() const {
+        size_t perElement = (depth + 1) * Traits::components * sizeof(Scalar);
+        size_t chunk = COLUMN_WORKING_SET / perElement;
+        chunk -= chunk % 16;
+        return chunk < 16 ? 16 : chunk;
+    }
+
+    // Размер рабочего буфера (в скалярах) для runColumns с куском chunk
+    size_t columnScratchSize(size_t chunk) const {
+        return (depth + constants.size() + 1) * Traits::components * chunk;
+    }
+
+    // Выполнение над столбцами: inputs[v] - набор значений переменной v,
+    // результат для строк [begin, end) записывается в out (размер out
+    // должен быть не меньше end). Строки обрабатываются кусками по chunk
+    // элементов, каждая инструкция проходит по куску пакетным ядром.
+    // scratch - буфер из columnScratchSize(chunk) скаляров.
+    void runColumns(const Batch* const* inputs, Batch& out, size_t begin, size_t end,
+                    Scalar* scratch, size_t chunk) const {
+        assert(valid());
+        const int components = Traits::components;
+
+        // Столбцы констант и нулевой столбец для унарного минуса
+        Scalar* constantColumns = scratch + depth * components * chunk;
+        for (size_t c = 0; c <= constants.size(); ++c) {
+            Scalar value[components] = {};
+            if (c < constants.size())
+                Traits::split(constants[c], value);
+            for (int k = 0; k < components; ++k)
+                std::fill(constantColumns + (c * components + k) * chunk,
+                          constantColumns + (c * components + k + 1) * chunk, value[k]);
+        }
+        const Scalar* zero[components];
+        for (int k = 0; k < components; ++k)
+            zero[k] = constantColumns + (constants.size() * components + k) * chunk;
+
+        // Стек из указателей на столбцы компонент
+        const Scalar* stack[MAX_COLUMN_DEPTH][components];
+        assert(depth <= MAX_COLUMN_DEPTH);
+
+        for (size_t start = begin; start < end; start += chunk) {
+            size_t n = end - start < chunk ? end - start : chunk;
+            size_t top = 0;
+            for (size_t pc = 0; pc < code.size(); ++pc) {
+                const Instruction& instruction = code[pc];
+                if (instruction.opcode == LOAD_VARIABLE) {
+                    for (int k = 0; k < components; ++k)
+                        stack[top][k] = inputs[instruction.operand]->data(k) + start;
+                    ++top;
+                    continue;
+                }
+                if (instruction.opcode == LOAD_CONSTANT) {
+                    for (int k = 0; k < components; ++k)
+                        stack[top][k] = constantColumns + (instruction.operand * components + k) * chunk;
+                    ++top;
+                    continue;
+                }
+
+                const Scalar* const* x;
+                const Scalar* const* y;
+                size_t target;
+                char operation;
+                if (instruction.opcode == NEGATE) {
+                    x = zero;
+                    y = stack[top - 1];
+                    target = top - 1;
+                    operation = '-';
+                } else {
+                    x = stack[top - 2];
+                    y = stack[top - 1];
+                    target = top - 2;
+                    operation = instruction.opcode == ADD ? '+' : instruction.opcode == SUB ? '-'
+                              : instruction.opcode == MUL ? '*' : '/';
+                    --top;
+                }
+
+                // Последняя инструкция пишет сразу в out
+                Scalar* result[components];
+                for (int k = 0; k < components; ++k)
+                    result[k] = pc + 1 == code.size() ? out.data(k) + start
+                                                      : scratch + (target * components + k) * chunk;
+                // operation получена из кода инструкции и всегда допустима
+                Traits::apply(operation, x, y, result, n);
+                for (int k = 0; k < components; ++k)
+                    stack[target][k] = result[k];
+            }
+
+            // Формула из одной переменной или константы
+            if (code.size() == 1)
+                for (int k = 0; k < components; ++k)
+                    std::copy(stack[0][k], stack[0][k] + n, out.data(k) + start);
+        }
+    }
+
+    // Выполнение над столбцами целиком на собственном рабочем буфере
+    void runColumns(const Batch* const* inputs, Batch& out) const {
+        size_t rows = variables.empty() ? out.size() : inputs[0]->size();
+        for (size_t v = 0; v < variables.size(); ++v)
+            assert(inputs[v]->size() == rows);
+        out.resize(rows);
+        size_t chunk = columnChunk();
+        columnScratch.resize(columnScratchSize(chunk));
+        runColumns(inputs, out, 0, rows, columnScratch.data(), chunk);
+    }
+};
+
+// Скомпилированная формула для вида чисел, выбранного во время выполнения
+typedef std::variant<CalculatorProgram<ComplexNumber>, CalculatorProgram<Quaternion> > AnyProgram;
+
+// Формула над числами обоих видов: каждое значение остаётся в самом
+// узком виде, комплексное число расширяется только при встрече с кватернионом
+typedef CalculatorProgram<AnyNumber> MixedProgram;
+
+// Чтение записей "x, y, ..." - по одной строке на запись, значения
+// переменных через запятую - из файлового дескриптора блоками
+// фиксированного размера. Неполная последняя строка блока переносится
+// в следующий, поэтому память не зависит от длины потока.
+template <typename Number>
+class RecordReader {
+public:
+    typedef LiteralParser<Number> Parser;
+    typedef typename NumberTraits<Number>::Batch Batch;
+
+    static const size_t BLOCK_BYTES = 1 << 20;
+
+private:
+    int fd;
+    size_t variables;
+    std::vector<char> text;
+    size_t carry;
+    size_t line;
+    bool finished;
+
+    ParseStatus failure(const char* message, size_t column) const {
+        ParseStatus status = { message, line, column };
+        return status;
+    }
+
+    // Разбор одной записи [first, last) в строку row столбцов
+    ParseStatus parseRecord(const char* first, const char* last, std::vector<Batch>& columns, size_t row) const {
+        const char* p = first;
+        for (size_t v = 0; v < variables; ++v) {
+            Number value;
+            const char* error = 0;
+            const char* stop = Parser::parse(p, last, value, error);
+            if (error)
+                return failure(error, stop - first + 1);
+            if (v + 1 < variables) {
+                if (stop == last || *stop != ',')
+                    return failure("expected ',' before the next value", stop - first + 1);
+                p = stop + 1;
+            } else if (stop != last) {
+                return failure(*stop == ',' ? "too many values in the record" : "unexpected characters after the number",
+                               stop - first + 1);
+            }
+            columns[v].set(row, value);
+        }
+        return failure(0, 0);
+    }
+
+public:
+    RecordReader(int fd, size_t variables, size_t blockBytes = BLOCK_BYTES)
+        : fd(fd), variables(variables), text(blockBytes), carry(0), line(1), finished(false) {}
+
+    // Следующий блок: его полные строки разбираются в columns (по набору
+    // на переменную). При ошибке в columns остаются записи до неё.
+    // Возвращает false, когда поток закончился или случилась ошибка
+    bool next(std::vector<Batch>& columns, ParseStatus& status) {
+        status = failure(0, 0);
+        columns.resize(variables);
+        size_t end = carry;
+        while (end < text.size() && !finished) {
+            ssize_t got = read(fd, text.data() + end, text.size() - end);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0) {
+                status = failure("read failed", 0);
+                return false;
+            }
+            if (got == 0)
+                finished = true;
+            end += got;
+        }
+
+        // Разбираются только полные строки; в конце потока - всё
+        size_t complete = end;
+        if (!finished) {
+            while (complete > 0 && text[complete - 1] != '\n')
+                --complete;
+            if (complete == 0) {
+                status = failure("record is longer than the read block", 0);
+                return false;
+            }
+        }
+
+        const char* first = text.data();
+        const char* last = first + complete;
+        size_t lines = std::count(first, last, '\n') + 1;
+        for (size_t v = 0; v < variables; ++v)
+            columns[v].resize(lines);
+        size_t rows = 0;
+        while (first < last) {
+            const char* lineEnd = static_cast<const char*>(std::memchr(first, '\n', last - first));
+            if (!lineEnd)
+                lineEnd = last;
+            const char* content = first;
+            while (content < lineEnd && (*content == ' ' || *content == '\t' || *content == '\r'))
+                ++content;
+            if (content < lineEnd) {
+                const char* recordEnd = lineEnd;
+                if (recordEnd > first && recordEnd[-1] == '\r')
+                    --recordEnd;
+                status = parseRecord(first, recordEnd, columns, rows);
+                if (!status.ok())
+                    break;
+                ++rows;
+            }
+            ++line;
+            first = lineEnd + 1;
+        }
+        for (size_t v = 0; v < variables; ++v)
+            columns[v].resize(rows);
+
+        carry = end - complete;
+        std::memmove(text.data(), text.data() + complete, carry);
+        return status.ok() && !finished;
+    }
+};
+
+// ------------------------------------------------------------------
+// Счётчики Calculator::performOperation. Включаются сборкой
+// с -DENABLE_INSTRUMENTATION=1; без неё вызовов в performOperation
+// нет, а снимки остаются нулевыми. По умолчанию выключены: даже один
+// инкремент счётчика потока и ветка выборки заметны на операции в
+// несколько наносекунд (кватернионное сложение на стеке - 4 нс против 6-9)
+// ------------------------------------------------------------------
+
+#ifndef ENABLE_INSTRUMENTATION
+#define ENABLE_INSTRUMENTATION 0
+#endif
+
+// Проверки числа для счётчиков. Вид числа известен при компиляции,
+// кроме AnyNumber; конечность проверяется одним сравнением
+// (x - x равно 0 только для конечного x), разбор NaN и бесконечности -
+// только на редком пути
+template <typename Number>
+constexpr NumberType numberKind(const Number&) {
+    return Number::kind;
+}
+
+inline NumberType numberKind(const AnyNumber& value) {
+    return numberType(value);
+}
+
+template <typename Number>
+FORCE_INLINE bool isFiniteNumber(const Number& value) {
+    typedef NumberTraits<Number> Traits;
+    typename Traits::Scalar c[Traits::components];
+    Traits::split(value, c);
+    typename Traits::Scalar zero = 0;
+    for (int k = 0; k < Traits::components; ++k)
+        zero += c[k] - c[k];
+    return zero == 0;
+}
+
+inline bool isFiniteNumber(const AnyNumber& value) {
+    return std::visit([](const auto& number) { return isFiniteNumber(number); }, value);
+}
+
+template <typename Number>
+bool hasNanComponent(const Number& value) {
+    typedef NumberTraits<Number> Traits;
+    typename Traits::Scalar c[Traits::components];
+    Traits::split(value, c);
+    for (int k = 0; k < Traits::components; ++k)
+        if (std::isnan(c[k]))
+            return true;
+    return false;
+}
+
+inline bool hasNanComponent(const AnyNumber& value) {
+    return std::visit([](const auto& number) { return hasNanComponent(number); }, value);
+}
+
+// Квадрат модуля ниже наименьшего нормализованного скаляра: деление
+// на такое число теряет точность или даёт бесконечность
+template <typename Number>
+FORCE_INLINE bool isNearZero(const Number& value) {
+    typedef NumberTraits<Number> Traits;
+    typedef typename Traits::Scalar Scalar;
+    Scalar c[Traits::components];
+    Traits::split(value, c);
+    Scalar magnitude = 0;
+    for (int k = 0; k < Traits::components; ++k)
+        magnitude += c[k] * c[k];
+    return magnitude < std::numeric_limits<Scalar>::min();
+}
+
+inline bool isNearZero(const AnyNumber& value) {
+    return std::visit([](const auto& number) { return isNearZero(number); }, value);
+}
+
+// Снимок счётчиков всех потоков. Индексы: вид числа (COMPLEX,
+// QUATERNION) и операция ('+', '-', '*', '/'). Задержки, NaN,
+// бесконечности и почти нулевые делители - выборка каждой SAMPLE_PERIOD-й
+// операции вида в потоке; корзина задержек i - от 2^i до 2^(i+1) нс
+// (вместе с самим замером), последняя - всё, что дольше
+struct OperationSnapshot {
+    static const int TYPES = 2;
+    static const int OPERATIONS = 4;
+    static const int LATENCY_BUCKETS = 24;
+
+    uint64_t operations[TYPES][OPERATIONS];
+    uint64_t nanResults[TYPES][OPERATIONS];
+    uint64_t infResults[TYPES][OPERATIONS];
+    uint64_t latency[TYPES][OPERATIONS][LATENCY_BUCKETS];
+    uint64_t latencySumNs[TYPES][OPERATIONS];
+    uint64_t nearZeroDivisions[TYPES];
+    uint64_t invalidOperations[TYPES];
+
+    static const char* typeName(int type) { return type == COMPLEX ? "complex" : "quaternion"; }
+    static const char* operationName(int operation) {
+        static const char* names[OPERATIONS] = { "add", "sub", "mul", "div" };
+        return names[operation];
+    }
+
+    static int operationIndex(char operation) {
+        switch (operation) {
+            case '+': return 0;
+            case '-': return 1;
+            case '*': return 2;
+            case '/': return 3;
+            default: return -1;
+        }
+    }
+
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for (int t = 0; t < TYPES; ++t)
+            for (int o = 0; o < OPERATIONS; ++o)
+                sum += operations[t][o];
+        return sum;
+    }
+
+    uint64_t samples(int type, int operation) const {
+        uint64_t sum = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; ++b)
+            sum += latency[type][operation][b];
+        return sum;
+    }
+
+    // Разность с более ранним снимком: что произошло между ними
+    OperationSnapshot since(const OperationSnapshot& earlier) const {
+        OperationSnapshot delta = *this;
+        const uint64_t* from = reinterpret_cast<const uint64_t*>(&earlier);
+        uint64_t* to = reinterpret_cast<uint64_t*>(&delta);
+        for (size_t i = 0; i < sizeof(OperationSnapshot) / sizeof(uint64_t); ++i)
+            to[i] -= from[i];
+        return delta;
+    }
+
+    void writeJson(std::ostream& out) const {
+        out << "{\n  \"operations\": [";
+        bool first = true;
+        for (int t = 0; t < TYPES; ++t) {
+            for (int o = 0; o < OPERATIONS; ++o) {
+                out << (first ? "\n" : ",\n")
+                    << "    {\"type\": \"" << typeName(t) << "\", \"operation\": \"" << operationName(o)
+                    << "\", \"count\": " << operations[t][o]
+                    << ", \"nan\": " << nanResults[t][o]
+                    << ", \"inf\": " << infResults[t][o]
+                    << ", \"latency_samples\": " << samples(t, o)
+                    << ", \"latency_sum_ns\": " << latencySumNs[t][o]
+                    << ", \"latency_log2_ns\": [";
+                for (int b = 0; b < LATENCY_BUCKETS; ++b)
+                    out << (b == 0 ? "" : ", ") << latency[t][o][b];
+                out << "]}";
+                first = false;
+            }
+        }
+        out << "\n  ],\n  \"near_zero_divisions\": {\"complex\": " << nearZeroDivisions[COMPLEX]
+            << ", \"quaternion\": " << nearZeroDivisions[QUATERNION] << "},\n"
+            << "  \"invalid_operations\": {\"complex\": " << invalidOperations[COMPLEX]
+            << ", \"quaternion\": " << invalidOperations[QUATERNION] << "}\n}\n";
+    }
+
+    // Текстовый формат Prometheus
+    void writePrometheus(std::ostream& out) const {
+        out << "# HELP laba3_operations_total Operations performed by Calculator::performOperation.\n"
+            << "# TYPE laba3_operations_total counter\n";
+        writeCounters(out, "laba3_operations_total", operations);
+        out << "# HELP laba3_nan_results_total Operations that produced a NaN component.\n"
+            << "# TYPE laba3_nan_results_total counter\n";
+        writeCounters(out, "laba3_nan_results_total", nanResults);
+        out << "# HELP laba3_inf_results_total Operations that produced an infinite component.\n"
+            << "# TYPE laba3_inf_results_total counter\n";
+        writeCounters(out, "laba3_inf_results_total", infResults);
+        out << "# HELP laba3_near_zero_divisions_total Divisions by a number whose squared norm underflows.\n"
+            << "# TYPE laba3_near_zero_divisions_total counter\n";
+        for (int t = 0; t < TYPES; ++t)
+            out << "laba3_near_zero_divisions_total{type=\"" << typeName(t) << "\"} " << nearZeroDivisions[t] << '\n';
+        out << "# HELP laba3_invalid_operations_total Unknown operation characters.\n"
+            << "# TYPE laba3_invalid_operations_total counter\n";
+        for (int t = 0; t < TYPES; ++t)
+            out << "laba3_invalid_operations_total{type=\"" << typeName(t) << "\"} " << invalidOperations[t] << '\n';
+        out << "# HELP laba3_operation_latency_ns Sampled latency of one operation.\n"
+            << "# TYPE laba3_operation_latency_ns histogram\n";
+        for (int t = 0; t < TYPES; ++t) {
+            for (int o = 0; o < OPERATIONS; ++o) {
+                uint64_t cumulative = 0;
+                for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+                    cumulative += latency[t][o][b];
+                    out << "laba3_operation_latency_ns_bucket{type=\"" << typeName(t) << "\",operation=\""
+                        << operationName(o) << "\",le=\"";
+                    if (b + 1 < LATENCY_BUCKETS)
+                        out << (uint64_t(1) << (b + 1));
+                    else
+                        out << "+Inf";
+                    out << "\"} " << cumulative << '\n';
+                }
+                out << "laba3_operation_latency_ns_sum{type=\"" << typeName(t) << "\",operation=\""
+                    << operationName(o) << "\"} " << latencySumNs[t][o] << '\n'
+                    << "laba3_operation_latency_ns_count{type=\"" << typeName(t) << "\",operation=\""
+                    << operationName(o) << "\"} " << cumulative << '\n';
+            }
+        }
+    }
+
+private:
+    static void writeCounters(std::ostream& out, const char* name, const uint64_t (&values)[TYPES][OPERATIONS]) {
+        for (int t = 0; t < TYPES; ++t)
+            for (int o = 0; o < OPERATIONS; ++o)
+                out << name << "{type=\"" << typeName(t) << "\",operation=\"" << operationName(o)
+                    << "\"} " << values[t][o] << '\n';
+    }
+};
+
+// Счётчики всех потоков. Частый путь - обычные целые в thread_local
+// блоке без конструктора и деструктора: обращение к нему - смещение от
+// регистра потока, без проверки инициализации и без атомарных операций.
+// Счётчик операции вида заодно отмеряет выборку: время замеряется только
+// у каждой SAMPLE_PERIOD-й операции вида в потоке (начиная с первой).
+// NaN и бесконечности в результате и почти нулевые делители считаются у
+// всех операций: одно сравнение на частом пути, подсчёт - на редком.
+// Раз в PUBLISH_PERIOD операций вида поток копирует счётчики в свой общий блок,
+// откуда их читает snapshot(). snapshot() сначала публикует счётчики
+// вызывающего потока, завершившийся поток публикует их при выходе, так что
+// от работающих чужих потоков снимок отстаёт не больше чем на PUBLISH_PERIOD
+// операций каждого вида. Общие блоки не освобождаются: счёт потоков не теряется
+class OperationStats {
+public:
+    static const unsigned SAMPLE_PERIOD = 64;
+    static const unsigned PUBLISH_PERIOD = 64 * SAMPLE_PERIOD;
+    static_assert((SAMPLE_PERIOD & (SAMPLE_PERIOD - 1)) == 0, "SAMPLE_PERIOD must be a power of two");
+
+private:
+    typedef OperationSnapshot Snapshot;
+    static const size_t WORDS = sizeof(Snapshot) / sizeof(uint64_t);
+
+    struct Local {
+        Snapshot counts;
+        uint64_t ticks;
+    };
+
+    // Копия счётчиков потока на момент последней публикации
+    struct alignas(64) Shared {
+        std::atomic<uint64_t> words[WORDS];
+
+        Shared() {
+            for (size_t i = 0; i < WORDS; ++i)
+                words[i].store(0, std::memory_order_relaxed);
+        }
+    };
+
+    // Общий блок потока и публикация при выходе из потока
+    struct Registration {
+        Shared* shared;
+
+        Registration() : shared(instance().registerThread()) {}
+        ~Registration() { publish(*shared); }
+    };
+
+    static inline thread_local Local local;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Shared> > threads;
+
+    Shared* registerThread() {
+        std::unique_ptr<Shared> created(new Shared());
+        std::lock_guard<std::mutex> lock(mutex);
+        threads.push_back(std::move(created));
+        return threads.back().get();
+    }
+
+    static void publish(Shared& shared) {
+        const uint64_t* from = reinterpret_cast<const uint64_t*>(&local.counts);
+        for (size_t i = 0; i < WORDS; ++i)
+            shared.words[i].store(from[i], std::memory_order_relaxed);
+    }
+
+    NO_INLINE static void publishLocal() {
+        thread_local Registration registration;
+        publish(*registration.shared);
+    }
+
+public:
+    static OperationStats& instance() {
+        static OperationStats stats;
+        return stats;
+    }
+
+    // Начало одной операции: счётчик операции этого вида у потока и,
+    // если подошла очередь выборки, время начала
+    struct Probe {
+        int type;
+        int index;
+        bool sampled;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    template <typename Number>
+    static FORCE_INLINE Probe begin(const Number& operand, char operation) {
+        Probe probe;
+        probe.type = numberKind(operand) == QUATERNION ? QUATERNION : COMPLEX;
+        probe.index = Snapshot::operationIndex(operation);
+        uint64_t& counter = probe.index < 0 ? local.counts.invalidOperations[probe.type]
+                                            : local.counts.operations[probe.type][probe.index];
+        probe.sampled = (counter++ & (SAMPLE_PERIOD - 1)) == 0;
+        if (probe.sampled)
+            startSample(probe);
+        return probe;
+    }
+
+    NO_INLINE static void startSample(Probe& probe) {
+        probe.start = std::chrono::steady_clock::now();
+    }
+
+    // Конец операции: result - её результат, divisor - второй операнд.
+    // На частом пути - проверка результата на конечность и, у деления,
+    // делителя на почти ноль; подсчёт и замер вынесены из performOperation,
+    // чтобы она по-прежнему встраивалась
+    template <typename Number>
+    static FORCE_INLINE void end(const Probe& probe, const Number& result, const Number& divisor) {
+        if (!isFiniteNumber(result) || (probe.index == 3 && isNearZero(divisor)))
+            recordUnusual(probe, result, divisor);
+        if (probe.sampled)
+            recordSample(probe);
+    }
+
+    // NaN или бесконечность в результате, почти нулевой делитель
+    template <typename Number>
+    NO_INLINE static void recordUnusual(const Probe& probe, const Number& result, const Number& divisor) {
+        Snapshot& c = local.counts;
+        int type = probe.type, index = probe.index;
+        if (index < 0)
+            return;
+        if (!isFiniteNumber(result))
+            ++(hasNanComponent(result) ? c.nanResults[type][index] : c.infResults[type][index]);
+        if (index == 3 && isNearZero(divisor))
+            ++c.nearZeroDivisions[type];
+    }
+
+    // Выборка: время операции; время от времени - публикация счётчиков потока
+    NO_INLINE static void recordSample(const Probe& probe) {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - probe.start).count();
+        Snapshot& c = local.counts;
+        int type = probe.type, index = probe.index;
+        uint64_t count = index < 0 ? c.invalidOperations[type] : c.operations[type][index];
+        if (index >= 0) {
+            int bucket = 0;
+            while (bucket + 1 < Snapshot::LATENCY_BUCKETS && (ns >> (bucket + 1)) != 0)
+                ++bucket;
+            ++c.latency[type][index][bucket];
+            c.latencySumNs[type][index] += ns;
+        }
+        if (count % PUBLISH_PERIOD == 1)
+            publishLocal();
+    }
+
+    Snapshot snapshot() {
+        publishLocal();
+        Snapshot s = Snapshot();
+        uint64_t* to = reinterpret_cast<uint64_t*>(&s);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::unique_ptr<Shared>& shared : threads)
+            for (size_t i = 0; i < WORDS; ++i)
+                to[i] += shared->words[i].load(std::memory_order_relaxed);
+        return s;
+    }
+};
+
+class Calculator {
+private:
+    NumberType type;
+    // Рабочие буферы столбцового выполнения, по одному на исполнителя пула;
+    // выделяются при первом использовании и дальше переиспользуются
+    std::vector<AlignedVector<unsigned char> > workerScratch;
+
+    // Запись всех bytes байт в файловый дескриптор
+    static bool writeOutput(int fd, const char* data, size_t bytes) {
+        while (bytes > 0) {
+            ssize_t written = write(fd, data, bytes);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0)
+                return false;
+            data += written;
+            bytes -= written;
+        }
+        return true;
+    }
+
+public:
+    // Строк в одной задаче пула: несколько кусков столбцового выполнения
+    static const size_t CHUNKS_PER_TASK = 8;
+    // Фиксированный размер блока свёртки, от него зависит порядок сложения
+    static const size_t REDUCE_BLOCK = 4096;
+
+    Calculator() : type(CALCULATOR) {
+        std::cout << "Calculator initialized with default constructor." << std::endl;
+    }
+
+    // Конструктор инициализации
+    Calculator(int value) : type(CALCULATOR) {
+        std::cout << "Calculator initialized with value: " << value << std::endl;
+    }
+
+    // Конструктор копирования
+    Calculator(const Calculator& other) : type(CALCULATOR) {
+        std::cout << "Calculator copied." << std::endl;
+    }
+    
+    // Метод для выполнения операции над числами любого типа
+    // (ComplexNumber, Quaternion и их варианты над float / long double)
+    // на std::stack с любым контейнером, в том числе ArenaStack
+    template <typename Number, typename Container>
+    void performOperation(std::stack<Number, Container>& stack, char operation) {
+        // Второй операнд забирается перемещением, результат пишется
+        // на место первого: без копии top() и без лишних pop/push
+        Number num2 = std::move(stack.top());
+        stack.pop();
+        Number& num1 = stack.top();
+#if ENABLE_INSTRUMENTATION
+        OperationStats::Probe probe = OperationStats::begin(num1, operation);
+#endif
+
+        switch (operation) {
+            case '+':
+                num1 = num1 + num2;
+                break;
+            case '-':
+                num1 = num1 - num2;
+                break;
+            case '*':
+                num1 = num1 * num2;
+                break;
+            case '/':
+                num1 = num1 / num2;
+                break;
+            default:
+                std::cout << "Invalid operation" << std::endl;
+                num1 = Number();
+                break;
+        }
+#if ENABLE_INSTRUMENTATION
+        OperationStats::end(probe, num1, num2);
+#endif
+    }
+
+    // Счётчики performOperation всех потоков на текущий момент
+    OperationSnapshot statistics() const {
+        return OperationStats::instance().snapshot();
+    }
+
+    // Стек операндов в арене потока: память возвращается при выходе
+    // из охватывающей ArenaScope, повторные вычисления не вызывают malloc
+    template <typename Number>
+    ArenaStack<Number> makeStack(size_t capacity = 16) const {
+        ArenaVector<Number> storage;
+        storage.reserve(capacity);
+        return ArenaStack<Number>(std::move(storage));
+    }
+
+    // Компиляция формулы в инфиксной записи, например "(x * y + z) / w"
+    template <typename Number>
+    CalculatorProgram<Number> compile(const std::string& expression) const {
+        return CalculatorProgram<Number>::fromInfix(expression);
+    }
+
+    // Компиляция формулы в обратной польской записи, например "x y * z + w /"
+    template <typename Number>
+    CalculatorProgram<Number> compileRpn(const std::string& expression) const {
+        return CalculatorProgram<Number>::fromRpn(expression);
+    }
+
+    // Компиляция для вида чисел (COMPLEX или QUATERNION), известного
+    // только во время выполнения
+    AnyProgram compile(NumberType type, const std::string& expression) const {
+        if (type == QUATERNION)
+            return compile<Quaternion>(expression);
+        return compile<ComplexNumber>(expression);
+    }
+
+    // Выполнение скомпилированной формулы над столбцами значений:
+    // columns[v] - набор значений переменной program.variableName(v).
+    // Вместо стека на каждую строку формула проходит по столбцам кусками,
+    // которые помещаются в кэш, с той же семантикой + - * /
+    template <typename Number>
+    void evaluateBatch(const CalculatorProgram<Number>& program,
+                       const typename NumberTraits<Number>::Batch* const* columns,
+                       typename NumberTraits<Number>::Batch& out) const {
+        program.runColumns(columns, out);
+    }
+
+    // То же на пуле потоков: строки делятся на задачи по CHUNKS_PER_TASK
+    // кусков, у каждого исполнителя свой рабочий буфер
+    template <typename Number>
+    void evaluateBatch(const CalculatorProgram<Number>& program,
+                       const typename NumberTraits<Number>::Batch* const* columns,
+                       typename NumberTraits<Number>::Batch& out, ThreadPool& pool) {
+        typedef typename NumberTraits<Number>::Scalar Scalar;
+        size_t rows = program.variableCount() == 0 ? out.size() : columns[0]->size();
+        for (size_t v = 0; v < program.variableCount(); ++v)
+            assert(columns[v]->size() == rows);
+        out.resize(rows);
+        size_t chunk = program.columnChunk();
+        size_t bytes = program.columnScratchSize(chunk) * sizeof(Scalar);
+        if (workerScratch.size() < pool.size())
+            workerScratch.resize(pool.size());
+        pool.parallelFor(0, rows, chunk * CHUNKS_PER_TASK, [&](size_t begin, size_t end, size_t worker) {
+            AlignedVector<unsigned char>& scratch = workerScratch[worker];
+            if (scratch.size() < bytes)
+                scratch.resize(bytes);
+            program.runColumns(columns, out, begin, end, reinterpret_cast<Scalar*>(scratch.data()), chunk);
+        });
+    }
+
+    // Потоковое выполнение формулы: записи со значениями переменных
+    // в порядке program.variableName() читаются из input (см. RecordReader),
+    // результаты пишутся в output по строке на запись, кратчайшей записью.
+    // Пока один кусок считается и записывается, второй поток читает
+    // и разбирает следующий, так что в памяти не больше двух кусков.
+    // Возвращает первую ошибку разбора или ввода-вывода.
+    template <typename Number>
+    ParseStatus evaluateStream(const CalculatorProgram<Number>& program, int input, int output,
+                               ThreadPool& pool, size_t blockBytes = RecordReader<Number>::BLOCK_BYTES) {
+        typedef typename NumberTraits<Number>::Batch Batch;
+        struct Slot {
+            std::vector<Batch> columns;
+            ParseStatus status;
+            bool more;
+            bool full;
+        };
+
+        ParseStatus status = { 0, 0, 0 };
+        if (program.variableCount() == 0) {
+            status.message = "formula has no variables to read";
+            return status;
+        }
+
+        Slot slots[2];
+        slots[0].full = slots[1].full = false;
+        bool cancelled = false;
+        std::mutex mutex;
+        std::condition_variable changed;
+
+        std::thread producer([&]() {
+            RecordReader<Number> reader(input, program.variableCount(), blockBytes);
+            for (size_t i = 0;; ++i) {
+                Slot& slot = slots[i % 2];
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [&]() { return !slot.full || cancelled; });
+                    if (cancelled)
+                        return;
+                }
+                slot.more = reader.next(slot.columns, slot.status);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    slot.full = true;
+                }
+                changed.notify_all();
+                if (!slot.more)
+                    return;
+            }
+        });
+
+        std::vector<char> buffer(blockBytes);
+        std::vector<const Batch*> inputs(program.variableCount());
+        Batch out;
+        for (size_t i = 0;; ++i) {
+            Slot& slot = slots[i % 2];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() { return slot.full; });
+            }
+            for (size_t v = 0; v < inputs.size(); ++v)
+                inputs[v] = &slot.columns[v];
+            evaluateBatch(program, inputs.data(), out, pool);
+
+            bool written = true;
+            for (size_t done = 0; done < out.size() && written;) {
+                char* end = 0;
+                done += LiteralFormatter<Number>::formatBatch(out, done, out.size(), buffer.data(),
+                                                              buffer.data() + buffer.size(), end);
+                written = writeOutput(output, buffer.data(), end - buffer.data());
+            }
+            bool more = slot.more && written;
+            status = written ? slot.status : ParseStatus{ "write failed", 0, 0 };
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.full = false;
+                cancelled = !more;
+            }
+            changed.notify_all();
+            if (!more)
+                break;
+        }
+        producer.join();
+        return status;
+    }
+
+    // Выполнение формулы над наборами, вид которых известен только во время
+    // выполнения. Вид выбирается один раз на весь набор, дальше работает
+    // типизированный evaluateBatch. false, если вид столбца не совпадает
+    // с видом формулы
+    bool evaluateBatch(const AnyProgram& program, const AnyBatch* const* columns, AnyBatch& out, ThreadPool& pool) {
+        return std::visit([&](const auto& typed) {
+            typedef typename std::decay<decltype(typed)>::type Program;
+            typedef typename Program::Batch Batch;
+            ArenaScope scope;
+            ArenaVector<const Batch*> inputs(typed.variableCount());
+            for (size_t v = 0; v < inputs.size(); ++v)
+                if (!(inputs[v] = std::get_if<Batch>(columns[v])))
+                    return false;
+            if (!std::holds_alternative<Batch>(out))
+                out.template emplace<Batch>();
+            evaluateBatch(typed, inputs.data(), std::get<Batch>(out), pool);
+            return true;
+        }, program);
+    }
+
+    // Поэлементная операция '+', '-', '*' или '/' над наборами одной длины;
+    // false, если это не так. Комплексный набор с кватернионным дают
+    // кватернионный набор без расширения комплексного операнда
+    bool applyBatch(char operation, const AnyBatch& x, const AnyBatch& y, AnyBatch& out) const {
+        if (operation != '+' && operation != '-' && operation != '*' && operation != '/')
+            return false;
+        return std::visit([&](const auto& left, const auto& right) {
+            typedef typename std::decay<decltype(left)>::type Left;
+            typedef typename std::decay<decltype(right)>::type Right;
+            if (right.size() != left.size())
+                return false;
+            if constexpr (std::is_same<Left, Right>::value) {
+                if (!std::holds_alternative<Left>(out))
+                    out.template emplace<Left>();
+                Left& result = std::get<Left>(out);
+                switch (operation) {
+                    case '+': Left::add(left, right, result); break;
+                    case '-': Left::sub(left, right, result); break;
+                    case '*': Left::mul(left, right, result); break;
+                    default: Left::div(left, right, result); break;
+                }
+            } else {
+                if (!std::holds_alternative<QuaternionBatch>(out))
+                    out.template emplace<QuaternionBatch>();
+                return mixedBatch(operation, left, right, std::get<QuaternionBatch>(out));
+            }
+            return true;
+        }, x, y);
+    }
+
+    // Сумма ('+') или произведение ('*') всех элементов набора слева направо.
+    // Блоки по REDUCE_BLOCK сворачиваются параллельно, затем по порядку,
+    // поэтому результат не зависит от числа потоков, а множители
+    // кватернионов не переставляются.
+    template <typename Batch>
+    typename Batch::Number reduceBatch(const Batch& batch, char operation, ThreadPool& pool) const {
+        typedef typename Batch::Number Number;
+        typedef NumberTraits<Number> Traits;
+        typename Traits::Scalar unit[Traits::components] = {};
+        if (operation == '*')
+            unit[0] = 1;
+        Number identity = Traits::join(unit);
+        return pool.parallelReduce(0, batch.size(), REDUCE_BLOCK, identity,
+            [&](size_t begin, size_t end) {
+                Number accumulator = batch.get(begin);
+                for (size_t i = begin + 1; i < end; ++i)
+                    accumulator = operation == '*' ? accumulator * batch.get(i) : accumulator + batch.get(i);
+                return accumulator;
+            },
+            [operation](const Number& x, const Number& y) { return operation == '*' ? x * y : x + y; });
+    }
+
+    // То же для набора, вид которого известен только во время выполнения
+    AnyNumber reduceBatch(const AnyBatch& batch, char operation, ThreadPool& pool) const {
+        return std::visit([&](const auto& typed) { return AnyNumber(reduceBatch(typed, operation, pool)); }, batch);
+    }
+
+
+void runTests() {
+    // Тесты для комплексных чисел
+    std::stack<ComplexNumber> complexStack;
+    complexStack.push(ComplexNumber(3, 4));  // 3 + 4i
+    complexStack.push(ComplexNumber(1, 2));  // 1 + 2i
+
+    // Сложение
+    performOperation(complexStack, '+');
+    ComplexNumber result = complexStack.top();
+    assert(result.getReal() == 4 && result.getImaginary() == 6);
+    std::cout << "Test 1 - Complex Addition passed.\n";
+
+    // Вычитание
+    complexStack.push(ComplexNumber(3, 4));
+    complexStack.push(ComplexNumber(1, 2));
+    performOperation(complexStack, '-');
+    result = complexStack.top();
+    assert(result.getReal() == 2 && result.getImaginary() == 2);
+    std::cout << "Test 2 - Complex Subtraction passed.\n";
+
+    // Умножение
+    complexStack.push(ComplexNumber(3, 4));
+    complexStack.push(ComplexNumber(1, 2));
+    performOperation(complexStack, '*');
+    result = complexStack.top();
+    assert(result.getReal() == -5 && result.getImaginary() == 10);
+    std::cout << "Test 3 - Complex Multiplication passed.\n";
+
+    // Деление
+    complexStack.push(ComplexNumber(3, 4));
+    complexStack.push(ComplexNumber(1, 2));
+    performOperation(complexStack, '/');
+    result = complexStack.top();
+    assert(std::abs(result.getReal() - 2.2) < 1e-6 && std::abs(result.getImaginary() + 0.4) < 1e-6);
+    std::cout << "Test 4 - Complex Division passed.\n";
+
+    // Тесты для кватернионов
+    std::stack<Quaternion> quaternionStack;
+    quaternionStack.push(Quaternion(1, 2, 3, 4));  // 1 + 2i + 3j + 4k
+    quaternionStack.push(Quaternion(5, 6, 7, 8));  // 5 + 6i + 7j + 8k
+
+    // Сложение
+    performOperation(quaternionStack, '+');
+    Quaternion qResult = quaternionStack.top();
+    assert(qResult.getReal() == 6 && qResult.getB() == 8 && qResult.getC() == 10 && qResult.getD() == 12);
+    std::cout << "Test 5 - Quaternion Addition passed.\n";
+
+    // Вычитание
+    quaternionStack.push(Quaternion(1, 8, 3, 4));
+    quaternionStack.push(Quaternion(5, 6, 7, 8));
+    performOperation(quaternionStack, '-');
+    qResult = quaternionStack.top();
+    assert(qResult.getReal() == -4 && qResult.getB() == 2 && qResult.getC() == -4 && qResult.getD() == -4);
+    std::cout << "Test 6 - Quaternion Subtraction passed.\n";
+
+    // Умножение
+    quaternionStack.push(Quaternion(1, 2, 3, 4));
+    quaternionStack.push(Quaternion(5, 6, 7, 8));
+    performOperation(quaternionStack, '*');
+    qResult = quaternionStack.top();
+    assert(qResult.getReal() == -60 && qResult.getB() == 12 && qResult.getC() == 30 && qResult.getD() == 24);
+    std::cout << "Test 7 - Quaternion Multiplication passed.\n";
+
+    // Деление
+    quaternionStack.push(Quaternion(1, 2, 3, 4));
+    quaternionStack.push(Quaternion(5, 6, 7, 8));
+    performOperation(quaternionStack, '/');
+    qResult = quaternionStack.top();
+    assert(std::abs(qResult.getReal() - 0.402299) < 1e-6 &&
            std::abs(qResult.getB() - 0.045977) < 1e-6 &&
            std::abs(qResult.getC()) < 1e-6 &&
            std::abs(qResult.getD() - 0.091954) < 1e-6);
     std::cout << "Test 8 - Quaternion Division passed.\n";
+
+    // Скомпилированные формулы
+    CalculatorProgram<Quaternion> program = compile<Quaternion>("(x * y + z) / w");
+    assert(program.valid() && program.variableCount() == 4 && program.stackDepth() == 2);
+    assert(program.variableName(0) == "x" && program.variableIndex("w") == 3);
+    CalculatorProgram<Quaternion> rpnProgram = compileRpn<Quaternion>("x y * z + w /");
+    assert(rpnProgram.valid() && rpnProgram.size() == program.size());
+    Quaternion inputs[4] = { Quaternion(1, 2, 3, 4), Quaternion(5, 6, 7, 8),
+                             Quaternion(-1, 0.5, 2, -3), Quaternion(2, -1, 0.25, 1) };
+    Quaternion expected = (inputs[0] * inputs[1] + inputs[2]) / inputs[3];
+    for (int repeat = 0; repeat < 3; ++repeat) {
+        qResult = program.run(inputs);
+        assert(qResult.getA() == expected.getA() && qResult.getB() == expected.getB() &&
+               qResult.getC() == expected.getC() && qResult.getD() == expected.getD());
+        qResult = rpnProgram.run(inputs);
+        assert(qResult.getA() == expected.getA() && qResult.getD() == expected.getD());
+    }
+    std::cout << "Test 9 - Compiled quaternion formula passed.\n";
+
+    CalculatorProgram<ComplexNumber> complexProgram = compile<ComplexNumber>("-a * (3 + 4i) - 2 / b");
+    assert(complexProgram.valid() && complexProgram.variableCount() == 2);
+    ComplexNumber bindings[3][2] = { { ComplexNumber(1, 2), ComplexNumber(1, 0) },
+                                     { ComplexNumber(0, 1), ComplexNumber(0, 2) },
+                                     { ComplexNumber(-2, 3), ComplexNumber(4, -1) } };
+    ComplexNumber results[3];
+    complexProgram.runMany(&bindings[0][0], 3, results);
+    for (int row = 0; row < 3; ++row) {
+        ComplexNumber a = bindings[row][0], b = bindings[row][1];
+        ComplexNumber value = (ComplexNumber() - a) * ComplexNumber(3, 4) - ComplexNumber(2, 0) / b;
+        assert(results[row].getReal() == value.getReal() && results[row].getImaginary() == value.getImaginary());
+    }
+    assert(results[0].getReal() == 3 && results[0].getImaginary() == -10);
+    std::cout << "Test 10 - Compiled complex formula passed.\n";
+
+    // Ошибки разбора не бросают исключений, а сообщают позицию
+    CalculatorProgram<ComplexNumber> broken = compile<ComplexNumber>("x + * y");
+    assert(!broken.valid() && broken.errorOffset() == 4);
+    assert(!compile<ComplexNumber>("(x + y").valid());
+    assert(!compile<ComplexNumber>("x + y)").valid());
+    assert(!compile<ComplexNumber>("x y").valid());
+    assert(!compile<ComplexNumber>("2j").valid());
+    assert(!compile<ComplexNumber>("").valid());
+    assert(!compileRpn<ComplexNumber>("x y + *").valid());
+    assert(compile<Quaternion>("2j * x + 1k").valid());
+    std::cout << "Test 11 - Formula errors reported.\n";
+
+    // Столбцовое выполнение совпадает с построчным
+    const size_t rows = 5003;
+    std::mt19937_64 rng(11);
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+    QuaternionBatch qColumns[4];
+    ComplexBatch cColumns[2];
+    for (size_t i = 0; i < rows; ++i) {
+        for (int v = 0; v < 4; ++v)
+            qColumns[v].append(Quaternion(dist(rng), dist(rng), dist(rng), dist(rng)));
+        for (int v = 0; v < 2; ++v)
+            cColumns[v].append(ComplexNumber(dist(rng), dist(rng)));
+    }
+    const QuaternionBatch* qInputs[4] = { &qColumns[0], &qColumns[1], &qColumns[2], &qColumns[3] };
+    const ComplexBatch* cInputs[2] = { &cColumns[0], &cColumns[1] };
+    QuaternionBatch qOut;
+    ComplexBatch cOut;
+    evaluateBatch(program, qInputs, qOut);
+    evaluateBatch(complexProgram, cInputs, cOut);
+    assert(qOut.size() == rows && cOut.size() == rows);
+    // Допуск (см. matchesOperator) от (|x| |y| + |z|) / |w| и 5 |a| + 2 / |b|
+    for (size_t i = 0; i < rows; ++i) {
+        Quaternion row[4] = { qColumns[0].get(i), qColumns[1].get(i), qColumns[2].get(i), qColumns[3].get(i) };
+        Quaternion qExpected = program.run(row);
+        Quaternion qActual = qOut.get(i);
+        double qScale = (std::sqrt(row[0].norm() * row[1].norm()) + std::sqrt(row[2].norm())) / std::sqrt(row[3].norm());
+        assert(matchesOperator(qExpected.getA(), qActual.getA(), qScale) &&
+               matchesOperator(qExpected.getB(), qActual.getB(), qScale) &&
+               matchesOperator(qExpected.getC(), qActual.getC(), qScale) &&
+               matchesOperator(qExpected.getD(), qActual.getD(), qScale));
+
+        ComplexNumber cRow[2] = { cColumns[0].get(i), cColumns[1].get(i) };
+        ComplexNumber cExpected = complexProgram.run(cRow);
+        double cScale = 5 * std::hypot(cRow[0].getReal(), cRow[0].getImaginary()) +
+                        2 / std::hypot(cRow[1].getReal(), cRow[1].getImaginary());
+        assert(matchesOperator(cExpected.getReal(), cOut.get(i).getReal(), cScale) &&
+               matchesOperator(cExpected.getImaginary(), cOut.get(i).getImaginary(), cScale));
+    }
+
+    // Формула из одной переменной тоже работает
+    CalculatorProgram<ComplexNumber> identity = compile<ComplexNumber>("b");
+    evaluateBatch(identity, cInputs, cOut);
+    assert(cOut.get(rows - 1).getReal() == cColumns[0].get(rows - 1).getReal());
+    std::cout << "Test 12 - Column evaluation passed.\n";
+
+    // Многопоточное выполнение и детерминированные свёртки
+    QuaternionBatch unitQuaternions;
+    for (size_t i = 0; i < rows; ++i) {
+        Quaternion q = qColumns[0].get(i);
+        unitQuaternions.append(q * (1 / std::sqrt(q.norm())));
+    }
+    Quaternion sequential = unitQuaternions.get(0);
+    for (size_t i = 1; i < rows; ++i)
+        sequential = sequential * unitQuaternions.get(i);
+
+    QuaternionBatch singleThreaded;
+    evaluateBatch(program, qInputs, singleThreaded);
+    Quaternion firstProduct;
+    ComplexNumber firstSum;
+    for (size_t threads = 1; threads <= 4; ++threads) {
+        ThreadPool pool(threads);
+        QuaternionBatch parallel;
+        evaluateBatch(program, qInputs, parallel, pool);
+        for (size_t i = 0; i < rows; ++i)
+            for (int k = 0; k < 4; ++k)
+                assert(parallel.data(k)[i] == singleThreaded.data(k)[i]);
+
+        Quaternion product = reduceBatch(unitQuaternions, '*', pool);
+        ComplexNumber sum = reduceBatch(cColumns[0], '+', pool);
+        if (threads == 1) {
+            firstProduct = product;
+            firstSum = sum;
+        }
+        // Побитово одинаково при любом числе потоков
+        assert(product.getA() == firstProduct.getA() && product.getB() == firstProduct.getB() &&
+               product.getC() == firstProduct.getC() && product.getD() == firstProduct.getD());
+        assert(sum.getReal() == firstSum.getReal() && sum.getImaginary() == firstSum.getImaginary());
+        // Порядок множителей сохранён: совпадает с последовательной свёрткой
+        assert(std::fabs(product.getA() - sequential.getA()) < 1e-9);
+        assert(std::fabs(product.getB() - sequential.getB()) < 1e-9);
+        assert(std::fabs(product.getC() - sequential.getC()) < 1e-9);
+        assert(std::fabs(product.getD() - sequential.getD()) < 1e-9);
+    }
+    std::cout << "Test 13 - Multithreaded evaluation and reductions passed.\n";
+
+    // Потоковое выполнение: маленькие блоки, чтобы записи переходили
+    // через границы блоков
+    const std::string streamInputPath = temporaryFile("laba3-stream-in");
+    const std::string streamOutputPath = temporaryFile("laba3-stream-out");
+    assert(!streamInputPath.empty() && !streamOutputPath.empty());
+    const char* streamInput = streamInputPath.c_str();
+    const char* streamOutput = streamOutputPath.c_str();
+    CalculatorProgram<Quaternion> streamProgram = compile<Quaternion>("(x * y + z) / w");
+    std::string records;
+    char field[MAX_FORMAT_LENGTH];
+    for (size_t i = 0; i < rows; ++i) {
+        for (int v = 0; v < 4; ++v) {
+            char* end = qColumns[v].get(i).format(field, field + sizeof(field));
+            records.append(field, end);
+            records += v < 3 ? ", " : (i % 100 == 0 ? "\r\n\n" : "\n");
+        }
+    }
+    QuaternionBatch expectedStream;
+    evaluateBatch(streamProgram, qInputs, expectedStream);
+
+    ThreadPool streamPool(2);
+    for (int broken = 0; broken < 2; ++broken) {
+        std::string text = records;
+        size_t errorLine = 0;
+        if (broken) {
+            size_t at = 0;
+            for (int n = 0; n < 700; ++n)
+                at = text.find('\n', at) + 1;
+            errorLine = 701;
+            text.insert(at, "1, 2, 3 4\n");
+        }
+        {
+            std::ofstream file(streamInput, std::ios::binary);
+            file << text;
+        }
+        int input = ::open(streamInput, O_RDONLY);
+        int output = ::open(streamOutput, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ParseStatus status = evaluateStream(streamProgram, input, output, streamPool, 4096);
+        ::close(input);
+        ::close(output);
+
+        std::ifstream file(streamOutput, std::ios::binary);
+        std::string results((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        QuaternionBatch streamed;
+        assert(LiteralParser<Quaternion>::parseBuffer(results.data(), results.size(), streamed).ok());
+        if (broken) {
+            assert(!status.ok() && status.line == errorLine && status.column == 9);
+            assert(streamed.size() > 0 && streamed.size() < rows);
+        } else {
+            assert(status.ok() && streamed.size() == rows);
+        }
+        for (size_t i = 0; i < streamed.size(); ++i)
+            for (int k = 0; k < 4; ++k)
+                assert(streamed.data(k)[i] == expectedStream.data(k)[i]);
+    }
+
+    // Запись длиннее блока - ошибка, а не рост памяти
+    {
+        std::ofstream file(streamInput, std::ios::binary);
+        file << std::string(100, ' ') << "1, 2, 3, 4\n";
+    }
+    int input = ::open(streamInput, O_RDONLY);
+    int output = ::open(streamOutput, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(!evaluateStream(streamProgram, input, output, streamPool, 64).ok());
+    ::close(input);
+    ::close(output);
+    std::remove(streamInput);
+    std::remove(streamOutput);
+    std::cout << "Test 14 - Streaming evaluation passed.\n";
+
+    // Стек в арене: после первого прохода вычисления не выделяют память
+    size_t allocations = 0;
+    for (int round = 0; round < 3; ++round) {
+        size_t before = allocationsSoFar();
+        for (size_t i = 0; i < rows; ++i) {
+            ArenaScope scope;
+            ArenaStack<Quaternion> stack = makeStack<Quaternion>();
+            stack.push(qColumns[0].get(i));
+            stack.push(qColumns[1].get(i));
+            performOperation(stack, '*');
+            stack.push(qColumns[2].get(i));
+            performOperation(stack, '+');
+            stack.push(qColumns[3].get(i));
+            performOperation(stack, '/');
+            Quaternion value = stack.top();
+            double scale = (std::sqrt(qColumns[0].get(i).norm() * qColumns[1].get(i).norm()) +
+                            std::sqrt(qColumns[2].get(i).norm())) / std::sqrt(qColumns[3].get(i).norm());
+            assert(matchesOperator(expectedStream.get(i).getA(), value.getA(), scale) &&
+                   matchesOperator(expectedStream.get(i).getD(), value.getD(), scale));
+        }
+        allocations = allocationsSoFar() - before;
+    }
+    assert(allocations == 0);
+
+    // Скомпилированная программа и столбцовое выполнение тоже
+    QuaternionBatch steady;
+    evaluateBatch(streamProgram, qInputs, steady);
+    size_t before = allocationsSoFar();
+    Quaternion row[4];
+    for (size_t i = 0; i < rows; ++i) {
+        for (int v = 0; v < 4; ++v)
+            row[v] = qColumns[v].get(i);
+        streamProgram.run(row);
+    }
+    evaluateBatch(streamProgram, qInputs, steady);
+    assert(allocationsSoFar() == before);
+    std::cout << "Test 15 - Allocation-free steady-state evaluation "
+              << (COUNT_ALLOCATIONS ? "passed.\n" : "skipped (build with -DCOUNT_ALLOCATIONS=1).\n");
+
+    // Вид чисел известен только во время выполнения: вариант
+    // разбирается один раз на набор
+    AnyBatch anyColumns[4];
+    for (int v = 0; v < 4; ++v)
+        anyColumns[v] = qColumns[v];
+    const AnyBatch* anyInputs[4] = { &anyColumns[0], &anyColumns[1], &anyColumns[2], &anyColumns[3] };
+    AnyProgram anyProgram = compile(QUATERNION, "(x * y + z) / w");
+    AnyBatch anyOut;
+    assert(evaluateBatch(anyProgram, anyInputs, anyOut, streamPool));
+    assert(numberType(anyOut) == QUATERNION);
+    const QuaternionBatch& typedOut = std::get<QuaternionBatch>(anyOut);
+    for (int k = 0; k < 4; ++k)
+        assert(std::memcmp(typedOut.data(k), expectedStream.data(k), rows * sizeof(double)) == 0);
+
+    anyColumns[2] = cColumns[0];
+    assert(!evaluateBatch(anyProgram, anyInputs, anyOut, streamPool));
+    AnyProgram anyComplexProgram = compile(COMPLEX, "x * y");
+    assert(evaluateBatch(anyComplexProgram, anyInputs + 2, anyOut, streamPool) == false);
+    AnyBatch complexColumns[2] = { cColumns[0], cColumns[1] };
+    const AnyBatch* complexInputs[2] = { &complexColumns[0], &complexColumns[1] };
+    assert(evaluateBatch(anyComplexProgram, complexInputs, anyOut, streamPool));
+    AnyBatch product;
+    assert(applyBatch('*', complexColumns[0], complexColumns[1], product));
+    for (int k = 0; k < 2; ++k)
+        assert(std::memcmp(std::get<ComplexBatch>(product).data(k), std::get<ComplexBatch>(anyOut).data(k),
+                           rows * sizeof(double)) == 0);
+    assert(!applyBatch('%', complexColumns[0], complexColumns[1], product));
+
+    AnyNumber anySum = reduceBatch(complexColumns[0], '+', streamPool);
+    ComplexNumber typedSum = reduceBatch(cColumns[0], '+', streamPool);
+    assert(numberType(anySum) == COMPLEX && std::get<ComplexNumber>(anySum).getReal() == typedSum.getReal());
+    std::cout << "Test 16 - Runtime-typed batches passed.\n";
+
+    // Смешанные операции совпадают с операциями над расширенным
+    // до кватерниона комплексным числом
+    const char mixedOperations[4] = { '+', '-', '*', '/' };
+    for (size_t i = 0; i < rows; ++i) {
+        ComplexNumber z = cColumns[0].get(i);
+        Quaternion q = qColumns[0].get(i);
+        Quaternion promoted(z);
+        assert(promoted.getA() == z.getReal() && promoted.getB() == z.getImaginary() && promoted.getC() == 0);
+        Quaternion left[4] = { z + q, z - q, z * q, z / q };
+        Quaternion right[4] = { q + z, q - z, q * z, q / z };
+        Quaternion promotedLeft[4] = { promoted + q, promoted - q, promoted * q, promoted / q };
+        Quaternion promotedRight[4] = { q + promoted, q - promoted, q * promoted, q / promoted };
+        // Допуск (см. matchesOperator): слияние зависит от места вызова
+        double zSize = std::hypot(z.getReal(), z.getImaginary()), qSize = std::sqrt(q.norm());
+        double leftScales[4] = { 0, 0, zSize * qSize, zSize / qSize };
+        double rightScales[4] = { 0, 0, zSize * qSize, qSize / zSize };
+        for (int k = 0; k < 4; ++k) {
+            assert(matchesOperator(promotedLeft[k].getA(), left[k].getA(), leftScales[k]) &&
+                   matchesOperator(promotedLeft[k].getB(), left[k].getB(), leftScales[k]));
+            assert(matchesOperator(promotedLeft[k].getC(), left[k].getC(), leftScales[k]) &&
+                   matchesOperator(promotedLeft[k].getD(), left[k].getD(), leftScales[k]));
+            assert(matchesOperator(promotedRight[k].getA(), right[k].getA(), rightScales[k]) &&
+                   matchesOperator(promotedRight[k].getB(), right[k].getB(), rightScales[k]));
+            assert(matchesOperator(promotedRight[k].getC(), right[k].getC(), rightScales[k]) &&
+                   matchesOperator(promotedRight[k].getD(), right[k].getD(), rightScales[k]));
+        }
+    }
+
+    // Стек из чисел обоих видов: расширение только там, где нужен кватернион
+    std::stack<AnyNumber> mixedStack;
+    mixedStack.push(ComplexNumber(1, 2));
+    mixedStack.push(ComplexNumber(3, -1));
+    performOperation(mixedStack, '*');
+    assert(numberType(mixedStack.top()) == COMPLEX);
+    assert(std::get<ComplexNumber>(mixedStack.top()).getReal() == 5);
+    mixedStack.push(Quaternion(0, 0, 1, 0));
+    performOperation(mixedStack, '+');
+    assert(numberType(mixedStack.top()) == QUATERNION);
+    assert(std::get<Quaternion>(mixedStack.top()).getC() == 1);
+
+    MixedProgram mixed = MixedProgram::fromInfix("x * y + 2i");
+    assert(mixed.valid());
+    AnyNumber mixedInputs[2] = { ComplexNumber(1, 1), ComplexNumber(2, 0) };
+    AnyNumber mixedValue = mixed.run(mixedInputs);
+    assert(numberType(mixedValue) == COMPLEX && std::get<ComplexNumber>(mixedValue).getImaginary() == 4);
+    mixedInputs[1] = Quaternion(2, 0, 0, 1);
+    mixedValue = mixed.run(mixedInputs);
+    assert(numberType(mixedValue) == QUATERNION);
+    const Quaternion& mixedQuaternion = std::get<Quaternion>(mixedValue);
+    assert(mixedQuaternion.getA() == 2 && mixedQuaternion.getB() == 4);
+    assert(mixedQuaternion.getC() == -1 && mixedQuaternion.getD() == 1);
+    assert(numberType(MixedProgram::fromInfix("x + 4j").run(mixedInputs)) == QUATERNION);
+
+    // Смешанные наборы: кватернионный результат, равный расширенному
+    QuaternionBatch widened(rows);
+    for (size_t i = 0; i < rows; ++i)
+        widened.set(i, Quaternion(cColumns[0].get(i)));
+    AnyBatch mixedLeft = cColumns[0];
+    AnyBatch mixedRight = qColumns[0];
+    SimdLevel savedLevel = simdLevel();
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+    for (SimdLevel level : levels) {
+        if (level > detectSimdLevel())
+            continue;
+        setSimdLevel(level);
+        for (char operation : mixedOperations) {
+            AnyBatch mixedOut, swappedOut;
+            assert(applyBatch(operation, mixedLeft, mixedRight, mixedOut));
+            assert(numberType(mixedOut) == QUATERNION);
+            AnyBatch promotedOut;
+            assert(applyBatch(operation, AnyBatch(widened), mixedRight, promotedOut));
+            assert(applyBatch(operation, mixedRight, mixedLeft, swappedOut));
+            assert(numberType(swappedOut) == QUATERNION);
+            for (size_t i = 0; i < rows; ++i) {
+                ComplexNumber z = cColumns[0].get(i);
+                Quaternion q = qColumns[0].get(i);
+                Quaternion a = std::get<QuaternionBatch>(mixedOut).get(i);
+                Quaternion b = std::get<QuaternionBatch>(promotedOut).get(i);
+                Quaternion s = std::get<QuaternionBatch>(swappedOut).get(i);
+                Quaternion c = operation == '+' ? z + q : operation == '-' ? z - q : operation == '*' ? z * q : z / q;
+                Quaternion d = operation == '+' ? q + z : operation == '-' ? q - z : operation == '*' ? q * z : q / z;
+                // Допуск для слитых в FMA операторов - от модулей операндов
+                double zSize = std::hypot(z.getReal(), z.getImaginary()), qSize = std::sqrt(q.norm());
+                double left = operation == '*' ? zSize * qSize : operation == '/' ? zSize / qSize : 0;
+                double right = operation == '*' ? zSize * qSize : operation == '/' ? qSize / zSize : 0;
+                assert(matchesOperator(c.getA(), a.getA(), left) && matchesOperator(c.getB(), a.getB(), left));
+                assert(matchesOperator(c.getC(), a.getC(), left) && matchesOperator(c.getD(), a.getD(), left));
+                assert(matchesOperator(d.getA(), s.getA(), right) && matchesOperator(d.getB(), s.getB(), right));
+                assert(matchesOperator(d.getC(), s.getC(), right) && matchesOperator(d.getD(), s.getD(), right));
+                assert(std::fabs(a.getA() - b.getA()) <= 1e-12 * (1 + std::fabs(b.getA())));
+                assert(std::fabs(a.getD() - b.getD()) <= 1e-12 * (1 + std::fabs(b.getD())));
+            }
+        }
+        // Неизвестная операция отклоняется, а не считается делением
+        QuaternionBatch rejected;
+        AnyBatch rejectedAny;
+        assert(!mixedBatch('%', cColumns[0], qColumns[0], rejected));
+        assert(!mixedBatch('^', qColumns[0], cColumns[0], rejected));
+        assert(!applyBatch('%', mixedLeft, mixedRight, rejectedAny));
+        ComplexBatch untouched = cColumns[1];
+        const double* complexIn[2] = { cColumns[0].data(0), cColumns[0].data(1) };
+        double* complexOut[2] = { untouched.data(0), untouched.data(1) };
+        assert(!NumberTraits<ComplexNumber>::apply('%', complexIn, complexIn, complexOut, rows));
+        assert(untouched.get(rows - 1).getReal() == cColumns[1].get(rows - 1).getReal());
+    }
+    setSimdLevel(savedLevel);
+    std::cout << "Test 17 - Mixed complex and quaternion operands passed.\n";
+
+    // Счётчики performOperation: виды операций, NaN, бесконечности,
+    // деление на почти ноль, неверные операции и другие потоки
+    OperationSnapshot statsBefore = statistics();
+    std::stack<ComplexNumber> counted;
+    for (int i = 0; i < 1000; ++i) {
+        counted.push(ComplexNumber(i, 1));
+        counted.push(ComplexNumber(2, -1));
+        performOperation(counted, '*');
+        counted.pop();
+    }
+    // NaN, бесконечности и почти нулевые делители считаются у всех операций,
+    // а не только у выборки: в новом потоке выборка - первая и каждая
+    // SAMPLE_PERIOD-я операция вида, особые случаи стоят между ними
+    const unsigned period = OperationStats::SAMPLE_PERIOD;
+    std::thread sampledWorker([this, period]() {
+        std::stack<ComplexNumber> values;
+        for (unsigned i = 0; i <= 2 * period; ++i) {
+            values.push(ComplexNumber(1, 2));
+            values.push(i == 1 ? ComplexNumber(0, 0) : i == period + 1 ? ComplexNumber(1e-170, 0) : ComplexNumber(2, -1));
+            performOperation(values, '/');
+            values.pop();
+        }
+        values.push(ComplexNumber(1, 0));
+        values.push(ComplexNumber(1, 0));
+        performOperation(values, '+');
+        values.push(ComplexNumber(std::numeric_limits<double>::infinity(), 0));
+        performOperation(values, '+');
+    });
+    sampledWorker.join();
+    std::thread worker([this]() {
+        std::stack<Quaternion> other;
+        other.push(Quaternion(1, 2, 3, 4));
+        other.push(Quaternion(5, 6, 7, 8));
+        performOperation(other, '-');
+        other.push(Quaternion(1, 0, 0, 0));
+        performOperation(other, '%');
+    });
+    worker.join();
+    OperationSnapshot stats = statistics().since(statsBefore);
+    if (ENABLE_INSTRUMENTATION) {
+        assert(stats.total() == 1000 + 2 * period + 1 + 2 + 1);
+        assert(stats.operations[COMPLEX][2] == 1000 && stats.operations[COMPLEX][3] == 2 * period + 1);
+        assert(stats.nanResults[COMPLEX][3] == 1 && stats.infResults[COMPLEX][3] == 1);
+        assert(stats.infResults[COMPLEX][0] == 1 && stats.nearZeroDivisions[COMPLEX] == 2);
+        assert(stats.operations[QUATERNION][1] == 1 && stats.invalidOperations[QUATERNION] == 1);
+        assert(stats.operations[COMPLEX][0] == 2 && stats.samples(COMPLEX, 0) == 1);
+        assert(stats.samples(COMPLEX, 2) >= 1000 / period - 1 && stats.samples(COMPLEX, 3) == 3);
+    } else {
+        assert(stats.total() == 0);
+    }
+    std::ostringstream json, prometheus;
+    stats.writeJson(json);
+    stats.writePrometheus(prometheus);
+    assert(json.str().find("\"operation\": \"div\"") != std::string::npos);
+    assert(prometheus.str().find("laba3_operation_latency_ns_bucket{type=\"complex\",operation=\"mul\",le=\"+Inf\"}") !=
+           std::string::npos);
+    if (ENABLE_INSTRUMENTATION)
+        assert(prometheus.str().find("laba3_invalid_operations_total{type=\"quaternion\"} 1\n") != std::string::npos);
+    std::cout << "Test 18 - Operation counters passed.\n";
+}
+};
+
+
+// ------------------------------------------------------------------
+// Замеры производительности (запуск: ./laba3 bench)
+// ------------------------------------------------------------------
+
+// Прежний ComplexNumber: виртуальный print(), поле типа и ручной
+// конструктор копирования. Оставлен только как основа LegacyQuaternion.
+class LegacyComplexNumber {
+private:
+    double real;
+    double imaginary;
+    NumberType type;
+public:
+    LegacyComplexNumber(double r, double i) : real(r), imaginary(i), type(COMPLEX) {}
+    LegacyComplexNumber(const LegacyComplexNumber& other) : real(other.real), imaginary(other.imaginary), type(COMPLEX) {}
+    LegacyComplexNumber& operator=(const LegacyComplexNumber& other) = default;
+
+    double getReal() const { return real; }
+    double getImaginary() const { return imaginary; }
+    void setReal(double r) { real = r; }
+    void setImaginary(double i) { imaginary = i; }
+
+    virtual void print() const {}
+};
+
+// Прежнее размещение кватерниона: наследник ComplexNumber с вложенным
+// ComplexNumber и собственным полем типа. Оставлено только для сравнения.
+class LegacyQuaternion : public LegacyComplexNumber {
+private:
+    LegacyComplexNumber second;
+    NumberType type;
+public:
+    LegacyQuaternion() : LegacyComplexNumber(0, 0), second(0, 0), type(QUATERNION) {}
+    LegacyQuaternion(long double a, long double b, long double c, long double d)
+        : LegacyComplexNumber(a, b), second(c, d), type(QUATERNION) {}
+    LegacyQuaternion(const LegacyQuaternion& other)
+        : LegacyComplexNumber(other.getA(), other.getB()), second(other.getC(), other.getD()), type(other.type) {}
+    LegacyQuaternion& operator=(const LegacyQuaternion& other) {
+        setReal(other.getReal());
+        setImaginary(other.getImaginary());
+        second = LegacyComplexNumber(other.getC(), other.getD());
+        type = other.type;
+        return *this;
+    }
+
+    long double getA() const { return getReal(); }
+    long double getB() const { return getImaginary(); }
+    long double getC() const { return second.getReal(); }
+    long double getD() const { return second.getImaginary(); }
+
+    LegacyQuaternion operator*(const LegacyQuaternion& other) const {
+        long double a = getA();
+        long double b = getB();
+        long double c = getC();
+        long double d = getD();
+
+        long double new_a = a * other.getA() - b * other.getB() - c * other.getC() - d * other.getD();
+        long double new_b = a * other.getB() + b * other.getA() + c * other.getD() - d * other.getC();
+        long double new_c = a * other.getC() - b * other.getD() + c * other.getA() + d * other.getB();
+        long double new_d = a * other.getD() + b * other.getC() - c * other.getB() + d * other.getA();
+
+        return LegacyQuaternion(new_a, new_b, new_c, new_d);
+    }
+
+    virtual void print() const override {}
+};
+
+// Сюда складываются результаты, чтобы компилятор не выбросил замеряемый код
+volatile double benchSink = 0;
+
+// Лучшее из нескольких повторов время одной операции в наносекундах
+template <typename F>
+double measureNs(size_t operations, F body) {
+    const int repeats = 5;
+    double best = 0;
+    for (int r = 0; r < repeats; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        auto finish = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(finish - start).count() / operations;
+        if (r == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+// Случайные значения одного типа для замеров
+template <typename Number>
+std::vector<Number> randomNumbers(size_t n, unsigned seed) {
+    typedef NumberTraits<Number> Traits;
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    std::vector<Number> numbers;
+    numbers.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        typename Traits::Scalar c[Traits::components];
+        for (int k = 0; k < Traits::components; ++k)
+            c[k] = dist(rng);
+        numbers.push_back(Traits::join(c));
+    }
+    return numbers;
+}
+
+// Сравнение плоского Quaternion с прежним размещением
+template <typename Q>
+void benchQuaternionLayout(const char* name, size_t n) {
+    std::mt19937_64 rng(1);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    std::vector<Q> x, y, out(n);
+    x.reserve(n);
+    y.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        x.push_back(Q(dist(rng), dist(rng), dist(rng), dist(rng)));
+        y.push_back(Q(dist(rng), dist(rng), dist(rng), dist(rng)));
+    }
+
+    double productNs = measureNs(n, [&]() {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = x[i] * y[i];
+        benchSink = benchSink + (double)out[n / 2].getA();
+    });
+    double copyNs = measureNs(n, [&]() {
+        std::vector<Q> copy(x);
+        benchSink = benchSink + (double)copy[n / 2].getB();
+    });
+
+    std::cout << name << ": sizeof = " << sizeof(Q)
+              << " B, product " << productNs << " ns/op"
+              << ", copy " << copyNs << " ns/element\n";
+}
+
+// Цепочка (x * y + z) / w: обычные операторы против ленивого выражения
+void benchExpressions(size_t n) {
+    std::mt19937_64 rng(2);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    QuaternionBatch x, y, z, w, out;
+    std::vector<Quaternion> xs, ys, zs, ws, outs(n);
+    for (size_t i = 0; i < n; ++i) {
+        Quaternion q[4];
+        for (int k = 0; k < 4; ++k)
+            q[k] = Quaternion(dist(rng), dist(rng), dist(rng), dist(rng));
+        x.append(q[0]);
+        y.append(q[1]);
+        z.append(q[2]);
+        w.append(q[3]);
+        xs.push_back(q[0]);
+        ys.push_back(q[1]);
+        zs.push_back(q[2]);
+        ws.push_back(q[3]);
+    }
+
+    typedef decltype((lazy(x) * lazy(y) + lazy(z)) / lazy(w)) Chain;
+    const int intermediates = Chain::operations - 1;
+
+    double scalarNs = measureNs(n, [&]() {
+        for (size_t i = 0; i < n; ++i)
+            outs[i] = (xs[i] * ys[i] + zs[i]) / ws[i];
+        benchSink = benchSink + outs[n / 2].getA();
+    });
+    double eagerNs = measureNs(n, [&]() {
+        out = (x * y + z) / w;
+        benchSink = benchSink + out.data(0)[n / 2];
+    });
+    double lazyNs = measureNs(n, [&]() {
+        out = (lazy(x) * lazy(y) + lazy(z)) / lazy(w);
+        benchSink = benchSink + out.data(0)[n / 2];
+    });
+
+    std::cout << "Lazy expressions, (x * y + z) / w over " << n << " quaternions\n"
+              << "  scalar operators: " << scalarNs << " ns/element, "
+              << intermediates << " intermediate Quaternion per element\n"
+              << "  batch operators:  " << eagerNs << " ns/element, "
+              << intermediates << " intermediate batches (" << intermediates * n << " elements)\n"
+              << "  lazy expression:  " << lazyNs << " ns/element, 0 intermediates\n";
+}
+
+// Формула (x * y + z) / w: четыре push и три performOperation на строку
+// против заранее скомпилированной программы
+void benchCalculator(size_t n) {
+    std::mt19937_64 rng(4);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    std::vector<Quaternion> bindings;
+    for (size_t i = 0; i < 4 * n; ++i)
+        bindings.push_back(Quaternion(dist(rng), dist(rng), dist(rng), dist(rng)));
+    std::vector<Quaternion> results(n);
+
+    Calculator calc;
+    // Выделений памяти на строку за последний повтор замера
+    double stackAllocations = 0, arenaAllocations = 0, programAllocations = 0, columnAllocations = 0;
+    double stackNs = measureNs(n, [&]() {
+        size_t before = allocationsSoFar();
+        for (size_t i = 0; i < n; ++i) {
+            const Quaternion* row = &bindings[4 * i];
+            std::stack<Quaternion> stack;
+            stack.push(row[0]);
+            stack.push(row[1]);
+            calc.performOperation(stack, '*');
+            stack.push(row[2]);
+            calc.performOperation(stack, '+');
+            stack.push(row[3]);
+            calc.performOperation(stack, '/');
+            results[i] = stack.top();
+        }
+        stackAllocations = double(allocationsSoFar() - before) / n;
+        benchSink = benchSink + results[n / 2].getA();
+    });
+    double arenaNs = measureNs(n, [&]() {
+        size_t before = allocationsSoFar();
+        for (size_t i = 0; i < n; ++i) {
+            const Quaternion* row = &bindings[4 * i];
+            ArenaScope scope;
+            ArenaStack<Quaternion> stack = calc.makeStack<Quaternion>();
+            stack.push(row[0]);
+            stack.push(row[1]);
+            calc.performOperation(stack, '*');
+            stack.push(row[2]);
+            calc.performOperation(stack, '+');
+            stack.push(row[3]);
+            calc.performOperation(stack, '/');
+            results[i] = stack.top();
+        }
+        arenaAllocations = double(allocationsSoFar() - before) / n;
+        benchSink = benchSink + results[n / 2].getA();
+    });
+
+    CalculatorProgram<Quaternion> program = calc.compile<Quaternion>("(x * y + z) / w");
+    double programNs = measureNs(n, [&]() {
+        size_t before = allocationsSoFar();
+        program.runMany(bindings.data(), n, results.data());
+        programAllocations = double(allocationsSoFar() - before) / n;
+        benchSink = benchSink + results[n / 2].getA();
+    });
+
+    std::vector<QuaternionBatch> columns(4);
+    for (size_t i = 0; i < n; ++i)
+        for (int v = 0; v < 4; ++v)
+            columns[v].append(bindings[4 * i + v]);
+    const QuaternionBatch* inputs[4] = { &columns[0], &columns[1], &columns[2], &columns[3] };
+    QuaternionBatch out;
+    double columnNs = measureNs(n, [&]() {
+        size_t before = allocationsSoFar();
+        calc.evaluateBatch(program, inputs, out);
+        columnAllocations = double(allocationsSoFar() - before) / n;
+        benchSink = benchSink + out.data(0)[n / 2];
+    });
+
+    // Выделения считаются только в сборке с COUNT_ALLOCATIONS
+    auto allocations = [](double perRow) {
+        std::ostringstream text;
+        if (COUNT_ALLOCATIONS)
+            text << ", " << perRow << " allocations/row";
+        return text.str();
+    };
+    std::cout << "Calculator, (x * y + z) / w over " << n << " rows\n"
+              << "  performOperation + std::stack: " << stackNs << " ns/row" << allocations(stackAllocations) << "\n"
+              << "  performOperation + ArenaStack: " << arenaNs << " ns/row" << allocations(arenaAllocations) << "\n"
+              << "  compiled program, row by row:  " << programNs << " ns/row" << allocations(programAllocations) << "\n"
+              << "  compiled program, by columns:  " << columnNs << " ns/row" << allocations(columnAllocations) << "\n";
+}
+
+// Масштабирование по числу потоков: столбцовое выполнение формулы
+// и произведение кватернионов
+void benchThreads(size_t n) {
+    std::mt19937_64 rng(5);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    std::vector<QuaternionBatch> columns(4);
+    QuaternionBatch units;
+    for (size_t i = 0; i < n; ++i) {
+        for (int v = 0; v < 4; ++v)
+            columns[v].append(Quaternion(dist(rng), dist(rng), dist(rng), dist(rng)));
+        Quaternion q(dist(rng), dist(rng), dist(rng), dist(rng));
+        units.append(q * (1 / std::sqrt(q.norm())));
+    }
+    const QuaternionBatch* inputs[4] = { &columns[0], &columns[1], &columns[2], &columns[3] };
+
+    Calculator calc;
+    CalculatorProgram<Quaternion> program = calc.compile<Quaternion>("(x * y + z) / w");
+    size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    std::cout << "Thread scaling over " << n << " rows (" << hardware << " hardware threads)\n";
+    double baseline = 0;
+    for (size_t threads = 1;; threads *= 2) {
+        if (threads > hardware)
+            threads = hardware;
+        ThreadPool pool(threads);
+        QuaternionBatch out;
+        double formulaNs = measureNs(n, [&]() {
+            calc.evaluateBatch(program, inputs, out, pool);
+            benchSink = benchSink + out.data(0)[n / 2];
+        });
+        double productNs = measureNs(n, [&]() {
+            benchSink = benchSink + calc.reduceBatch(units, '*', pool).getA();
+        });
+        if (threads == 1)
+            baseline = formulaNs;
+        std::cout << "  " << threads << " threads: formula " << formulaNs << " ns/row (x"
+                  << baseline / formulaNs << "), product " << productNs << " ns/element\n";
+        if (threads == hardware)
+            break;
+    }
+}
+
+// Композиция поворотов: последовательная свёртка против параллельных
+void benchRotationChains(size_t n) {
+    std::mt19937_64 rng(6);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    std::vector<Quaternion> rotations, scan(n);
+    for (size_t i = 0; i < n; ++i)
+        rotations.push_back(Quaternion(dist(rng), dist(rng), dist(rng), dist(rng)).normalized());
+
+    ThreadPool pool;
+    double sequentialNs = measureNs(n, [&]() {
+        benchSink = benchSink + sequentialProduct(rotations.data(), 0, n, 0).getA();
+    });
+    double reduceNs = measureNs(n, [&]() {
+        benchSink = benchSink + reduceProduct(rotations.data(), n, pool).getA();
+    });
+    double renormalizedNs = measureNs(n, [&]() {
+        benchSink = benchSink + reduceProduct(rotations.data(), n, pool, 1024).getA();
+    });
+    double scanNs = measureNs(n, [&]() {
+        inclusiveScanProduct(rotations.data(), n, scan.data(), pool);
+        benchSink = benchSink + scan[n - 1].getA();
+    });
+
+    std::cout << "Rotation chains over " << n << " quaternions, " << pool.size() << " threads\n"
+              << "  sequential fold:            " << sequentialNs << " ns/element\n"
+              << "  reduceProduct:              " << reduceNs << " ns/element\n"
+              << "  reduceProduct, renormalize: " << renormalizedNs << " ns/element\n"
+              << "  inclusiveScanProduct:       " << scanNs << " ns/element\n";
+}
+
+// Единичные кватернионы: поворот за 15 умножений против q * v * q^-1
+// и деление без нормы против общего деления. n небольшое, чтобы
+// наборы помещались в кэш и мерились вычисления, а не память
+void benchUnitQuaternions(size_t n) {
+    QuaternionBatch rotations, units, quotients, pure, half;
+    Vector3Batch vectors, rotated;
+    for (const Quaternion& q : randomNumbers<Quaternion>(n, 23))
+        rotations.append(q);
+    QuaternionBatch::normalize(rotations, units);
+    for (const Quaternion& q : randomNumbers<Quaternion>(n, 24)) {
+        vectors.append(Vector3(q.getB(), q.getC(), q.getD()));
+        pure.append(Quaternion(0, q.getB(), q.getC(), q.getD()));
+    }
+
+    double rotateNs = measureNs(n, [&]() {
+        QuaternionBatch::rotate(units, vectors, rotated);
+        benchSink = benchSink + rotated.data(0)[n / 2];
+    });
+    double sandwichNs = measureNs(n, [&]() {
+        QuaternionBatch::mul(units, pure, half);
+        QuaternionBatch::div(half, units, quotients);
+        benchSink = benchSink + quotients.data(1)[n / 2];
+    });
+    double scalarRotateNs = measureNs(n, [&]() {
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i)
+            sum += units.get(i).rotate(vectors.get(i)).x;
+        benchSink = benchSink + sum;
+    });
+    double scalarSandwichNs = measureNs(n, [&]() {
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            Quaternion q = units.get(i);
+            sum += (q * pure.get(i) * q.conjugate()).getB();
+        }
+        benchSink = benchSink + sum;
+    });
+    double divNs = measureNs(n, [&]() {
+        QuaternionBatch::div(rotations, units, quotients);
+        benchSink = benchSink + quotients.data(0)[n / 2];
+    });
+    double divUnitNs = measureNs(n, [&]() {
+        QuaternionBatch::divUnit(rotations, units, quotients);
+        benchSink = benchSink + quotients.data(0)[n / 2];
+    });
+
+    std::cout << "Unit quaternions, " << n << " elements\n"
+              << "  rotate (15 mul), batch:     " << rotateNs << " ns/element\n"
+              << "  q * v / q, batch:           " << sandwichNs << " ns/element\n"
+              << "  rotate (15 mul), scalar:    " << scalarRotateNs << " ns/element\n"
+              << "  q * v * conj(q), scalar:    " << scalarSandwichNs << " ns/element\n"
+              << "  div, batch:                 " << divNs << " ns/element\n"
+              << "  divUnit, batch:             " << divUnitNs << " ns/element\n";
+}
+
+// Разбор текста, напечатанного print(): мегабайты в секунду
+void benchParser(size_t n) {
+    std::vector<Quaternion> values = randomNumbers<Quaternion>(n, 12);
+    std::string text;
+    for (const Quaternion& q : values)
+        text += printed(q);
+
+    QuaternionBatch out;
+    ThreadPool pool;
+    double sequentialNs = measureNs(text.size(), [&]() {
+        LiteralParser<Quaternion>::parseBuffer(text.data(), text.size(), out);
+        benchSink = benchSink + out.data(0)[n / 2];
+    });
+    double parallelNs = measureNs(text.size(), [&]() {
+        LiteralParser<Quaternion>::parseBuffer(text.data(), text.size(), out, pool);
+        benchSink = benchSink + out.data(0)[n / 2];
+    });
+
+    std::cout << "Parsing " << n << " printed quaternions (" << text.size() / (1 << 20) << " MiB)\n"
+              << "  1 thread:   " << 1e3 / sequentialNs << " MB/s\n"
+              << "  " << pool.size() << " threads:  " << 1e3 / parallelNs << " MB/s\n";
+}
+
+// Запись значений текстом: прежние вставки в поток против буфера
+void benchFormatter(size_t n) {
+    std::vector<Quaternion> values = randomNumbers<Quaternion>(n, 14);
+    double streamNs = measureNs(n, [&]() {
+        std::ostringstream out;
+        for (const Quaternion& q : values) {
+            out << q.getA() << " + " << q.getB() << "i";
+            if (q.getC() >= 0)
+                out << " + " << q.getC() << "j";
+            else
+                out << " - " << std::fabs(q.getC()) << "j";
+            if (q.getD() >= 0)
+                out << " + " << q.getD() << "k";
+            else
+                out << " - " << std::fabs(q.getD()) << "k";
+            out << "\n";
+        }
+        benchSink = benchSink + (double)out.tellp();
+    });
+
+    std::vector<char> buffer(1 << 16);
+    for (int precision : { 6, ROUND_TRIP_PRECISION }) {
+        double bufferNs = measureNs(n, [&]() {
+            size_t bytes = 0;
+            for (size_t done = 0; done < n;) {
+                char* written = 0;
+                done += LiteralFormatter<Quaternion>::formatArray(values.data(), done, n, buffer.data(),
+                                                                  buffer.data() + buffer.size(), written, precision);
+                bytes += written - buffer.data();
+            }
+            benchSink = benchSink + (double)bytes;
+        });
+        if (precision == 6)
+            std::cout << "Formatting " << n << " quaternions\n"
+                      << "  std::ostream insertions:   " << streamNs << " ns/value\n"
+                      << "  to_chars, precision 6:     " << bufferNs << " ns/value\n";
+        else
+            std::cout << "  to_chars, round-trip:      " << bufferNs << " ns/value\n";
+    }
+}
+
+// Столбцовый файл: запись, открытие и проход по отображённым данным
+void benchColumnFile(size_t n) {
+    const std::string path = temporaryFile("laba3-bench-columns");
+    QuaternionBatch batch;
+    for (const Quaternion& q : randomNumbers<Quaternion>(n, 16))
+        batch.append(q);
+    size_t bytes = n * sizeof(Quaternion);
+
+    double writeNs = measureNs(bytes, [&]() {
+        ColumnFileWriter<Quaternion> writer(path, n);
+        writer.append(batch);
+        writer.close();
+    });
+    double openNs = measureNs(1, [&]() {
+        ColumnFile file(path);
+        benchSink = benchSink + (double)file.view<Quaternion>().size();
+    });
+    ColumnFile file(path);
+    ColumnView<Quaternion> view = file.view<Quaternion>();
+    double scanNs = measureNs(n, [&]() {
+        double sum = 0;
+        for (int k = 0; k < 4; ++k)
+            for (size_t i = 0; i < n; ++i)
+                sum += view.data(k)[i];
+        benchSink = benchSink + sum;
+    });
+    file.close();
+    std::remove(path.c_str());
+
+    std::cout << "Column file with " << n << " quaternions (" << bytes / (1 << 20) << " MiB)\n"
+              << "  streaming write: " << 1e3 / writeNs << " MB/s\n"
+              << "  open and map:    " << openNs / 1e3 << " us\n"
+              << "  scan of view:    " << scanNs << " ns/element\n";
+}
+
+// Способы комплексного деления: скорость на текущем уровне SIMD и
+// точность относительно деления в long double. Вторая выборка - числа
+// с показателями от 2^-1000 до 2^1000, где c^2 + d^2 выходит за double
+void benchDivision(size_t n) {
+    std::mt19937_64 rng(20);
+    std::uniform_real_distribution<double> mantissa(0.5, 1.0);
+    std::uniform_int_distribution<int> exponent(-1000, 1000);
+    std::uniform_int_distribution<int> sign(0, 1);
+    ComplexBatch moderateX, moderateY, wideX, wideY, out;
+    for (const ComplexNumber& z : randomNumbers<ComplexNumber>(n, 21))
+        moderateX.append(z);
+    for (const ComplexNumber& z : randomNumbers<ComplexNumber>(n, 22))
+        moderateY.append(z);
+    for (size_t i = 0; i < n; ++i) {
+        double parts[4];
+        for (double& part : parts)
+            part = std::ldexp(sign(rng) ? -mantissa(rng) : mantissa(rng), exponent(rng));
+        wideX.append(ComplexNumber(parts[0], parts[1]));
+        wideY.append(ComplexNumber(parts[2], parts[3]));
+    }
+
+    // Скорость меряем на наборе, который помещается в кэш L1
+    const size_t cached = 1024;
+    ComplexBatch cachedX, cachedY, cachedOut;
+    for (size_t i = 0; i < cached; ++i) {
+        cachedX.append(moderateX.get(i));
+        cachedY.append(moderateY.get(i));
+    }
+
+    std::cout << "Complex division, " << n << " elements (" << simdLevelName(simdLevel()) << ")\n";
+    const DivisionMode modes[] = { DIVISION_NAIVE, DIVISION_SMITH, DIVISION_RECIPROCAL };
+    for (DivisionMode mode : modes) {
+        double ns = measureNs(cached, [&]() {
+            ComplexBatch::div(cachedX, cachedY, cachedOut, mode);
+            benchSink = benchSink + cachedOut.realData()[cached / 2];
+        });
+
+        // Наибольшая относительная ошибка в единицах epsilon и число
+        // нечисловых результатов
+        const ComplexBatch* xs[2] = { &moderateX, &wideX };
+        const ComplexBatch* ys[2] = { &moderateY, &wideY };
+        double worst[2] = { 0, 0 };
+        size_t broken[2] = { 0, 0 };
+        for (int set = 0; set < 2; ++set) {
+            ComplexBatch::div(*xs[set], *ys[set], out, mode);
+            for (size_t i = 0; i < n; ++i) {
+                BasicComplexNumber<long double> x(xs[set]->realData()[i], xs[set]->imagData()[i]);
+                BasicComplexNumber<long double> y(ys[set]->realData()[i], ys[set]->imagData()[i]);
+                BasicComplexNumber<long double> reference = x / y;
+                // Точный результат вне диапазона double не учитываем
+                long double size = std::hypot(reference.getReal(), reference.getImaginary());
+                if (size > std::numeric_limits<double>::max() || size < std::numeric_limits<double>::min())
+                    continue;
+                long double re = out.realData()[i], im = out.imagData()[i];
+                if (!std::isfinite(re) || !std::isfinite(im)) {
+                    ++broken[set];
+                    continue;
+                }
+                long double error = std::hypot(re - reference.getReal(), im - reference.getImaginary()) / size;
+                worst[set] = std::max(worst[set], (double)(error / std::numeric_limits<double>::epsilon()));
+            }
+        }
+        std::cout << "  " << divisionModeName(mode) << ":\t" << ns << " ns/element, max error "
+                  << worst[0] << " eps (moderate), " << worst[1] << " eps, "
+                  << broken[1] << " non-finite (wide)\n";
+    }
+}
+
+// Комплексный набор на кватернионный: смешанное ядро против
+// расширения комплексного набора до кватернионного
+void benchMixed(size_t n) {
+    ComplexBatch x;
+    QuaternionBatch y, widened(n), out;
+    for (const ComplexNumber& z : randomNumbers<ComplexNumber>(n, 18))
+        x.append(z);
+    for (const Quaternion& q : randomNumbers<Quaternion>(n, 19))
+        y.append(q);
+
+    double mixedNs = measureNs(n, [&]() {
+        mixedBatch('*', x, y, out);
+        benchSink = benchSink + out.data(3)[n / 2];
+    });
+    double widenNs = measureNs(n, [&]() {
+        for (size_t i = 0; i < n; ++i)
+            widened.set(i, Quaternion(x.get(i)));
+        QuaternionBatch::mul(widened, y, out);
+        benchSink = benchSink + out.data(3)[n / 2];
+    });
+    double promotedNs = measureNs(n, [&]() {
+        QuaternionBatch::mul(widened, y, out);
+        benchSink = benchSink + out.data(3)[n / 2];
+    });
+
+    std::cout << "Mixed complex * quaternion, " << n << " elements\n"
+              << "  mixed kernel:              " << mixedNs << " ns/element\n"
+              << "  widen, then quaternion:    " << widenNs << " ns/element\n"
+              << "  quaternion (pre-widened):  " << promotedNs << " ns/element\n";
+}
+
+// БПФ против ДПФ по определению и масштабирование по потокам
+void benchFft() {
+    std::mt19937_64 rng(41);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+
+    const size_t small = 1024;
+    std::vector<ComplexNumber> signal;
+    ComplexBatch batch, spectrum;
+    for (size_t i = 0; i < small; ++i) {
+        signal.push_back(ComplexNumber(dist(rng), dist(rng)));
+        batch.append(signal.back());
+    }
+    double naiveNs = measureNs(1, [&]() { benchSink = benchSink + naiveDft(signal)[1].getReal(); });
+    double smallNs = measureNs(1000, [&]() {
+        for (int r = 0; r < 1000; ++r)
+            fft(batch, spectrum);
+        benchSink = benchSink + spectrum.realData()[1];
+    });
+    ComplexBatch work;
+    double reusedNs = measureNs(1000, [&]() {
+        for (int r = 0; r < 1000; ++r)
+            fft(batch, spectrum, work);
+        benchSink = benchSink + spectrum.realData()[1];
+    });
+    std::cout << "FFT, n = " << small << "\n"
+              << "  naive DFT (ComplexNumber):  " << naiveNs / 1000 << " us/transform\n"
+              << "  fft:                        " << smallNs / 1000 << " us/transform\n"
+              << "  fft, reused work buffer:    " << reusedNs / 1000 << " us/transform\n";
+
+    // Простая длина: один этап по Блюстейну
+    const size_t prime = 10007;
+    ComplexBatch primeBatch;
+    for (size_t i = 0; i < prime; ++i)
+        primeBatch.append(ComplexNumber(dist(rng), dist(rng)));
+    double primeNs = measureNs(1, [&]() {
+        fft(primeBatch, spectrum, work);
+        benchSink = benchSink + spectrum.realData()[1];
+    });
+    std::cout << "FFT, n = " << prime << " (prime)\n"
+              << "  fft (Bluestein):            " << primeNs / 1000 << " us/transform\n";
+
+    ThreadPool pool;
+    const size_t sizes[] = { 1 << 20, 3 * 5 * (1 << 16) };
+    for (size_t n : sizes) {
+        ComplexBatch large, out;
+        std::vector<double> real;
+        for (size_t i = 0; i < n; ++i) {
+            large.append(ComplexNumber(dist(rng), dist(rng)));
+            real.push_back(dist(rng));
+        }
+        double singleNs = measureNs(n, [&]() {
+            fft(large, out);
+            benchSink = benchSink + out.realData()[1];
+        });
+        double pooledNs = measureNs(n, [&]() {
+            fft(large, out, false, &pool);
+            benchSink = benchSink + out.realData()[1];
+        });
+        double realNs = measureNs(n, [&]() {
+            realFft(real.data(), n, out, &pool);
+            benchSink = benchSink + out.realData()[1];
+        });
+        // 5 n log2 n - принятая оценка числа операций БПФ
+        double gflops = 5 * std::log2((double)n) / singleNs;
+        std::cout << "FFT, n = " << n << "\n"
+                  << "  fft, 1 thread:              " << singleNs << " ns/point, " << gflops << " GFLOP/s\n"
+                  << "  fft, " << pool.size() << " threads:             " << pooledNs << " ns/point\n"
+                  << "  realFft, " << pool.size() << " threads:         " << realNs << " ns/point\n";
+    }
+}
+
+// a * b + c одним проходом через fma против умножения и сложения
+// отдельными проходами, и цена режимов накопления скалярного произведения
+void benchFma(size_t n) {
+    ComplexBatch a, b, c, product, out;
+    QuaternionBatch x, y, z, quaternionProduct, quaternionOut;
+    for (const ComplexNumber& v : randomNumbers<ComplexNumber>(3 * n, 81)) {
+        ComplexBatch& target = a.size() < n ? a : b.size() < n ? b : c;
+        target.append(v);
+    }
+    for (const Quaternion& v : randomNumbers<Quaternion>(3 * n, 82)) {
+        QuaternionBatch& target = x.size() < n ? x : y.size() < n ? y : z;
+        target.append(v);
+    }
+    const int rounds = 200;
+    double complexSeparateNs = measureNs(rounds * n, [&]() {
+        for (int r = 0; r < rounds; ++r) {
+            ComplexBatch::mul(a, b, product);
+            ComplexBatch::add(product, c, out);
+        }
+        benchSink = benchSink + out.realData()[1];
+    });
+    double complexFusedNs = measureNs(rounds * n, [&]() {
+        for (int r = 0; r < rounds; ++r)
+            ComplexBatch::fma(a, b, c, out);
+        benchSink = benchSink + out.realData()[1];
+    });
+    double quaternionSeparateNs = measureNs(rounds * n, [&]() {
+        for (int r = 0; r < rounds; ++r) {
+            QuaternionBatch::mul(x, y, quaternionProduct);
+            QuaternionBatch::add(quaternionProduct, z, quaternionOut);
+        }
+        benchSink = benchSink + quaternionOut.data(0)[1];
+    });
+    double quaternionFusedNs = measureNs(rounds * n, [&]() {
+        for (int r = 0; r < rounds; ++r)
+            QuaternionBatch::fma(x, y, z, quaternionOut);
+        benchSink = benchSink + quaternionOut.data(0)[1];
+    });
+    std::cout << "Fused multiply-add, " << n << " elements (" << simdLevelName(simdLevel())
+              << (hasHardwareFma() ? ", hardware fma" : "") << ")\n"
+              << "  complex mul + add:          " << complexSeparateNs << " ns/element\n"
+              << "  complex fma:                " << complexFusedNs << " ns/element\n"
+              << "  quaternion mul + add:       " << quaternionSeparateNs << " ns/element\n"
+              << "  quaternion fma:             " << quaternionFusedNs << " ns/element\n";
+
+    const AccumulationMode modes[] = { ACCUMULATE_PLAIN, ACCUMULATE_FUSED, ACCUMULATE_COMPENSATED };
+    for (AccumulationMode mode : modes) {
+        double complexNs = measureNs(n, [&]() { benchSink = benchSink + dot(a, b, mode).getReal(); });
+        double quaternionNs = measureNs(n, [&]() { benchSink = benchSink + dot(x, y, mode).getA(); });
+        std::cout << "  dot, " << accumulationModeName(mode) << ":" << std::string(22 - std::strlen(accumulationModeName(mode)), ' ')
+                  << complexNs << " / " << quaternionNs << " ns/element (complex / quaternion)\n";
+    }
+}
+
+// Блочное умножение матриц против тройного цикла на операторах
+template <typename Number>
+void benchMatrix(const char* name, size_t n, double flopsPerTerm) {
+    typedef Matrix<Number> M;
+    M a(n, n), b(n, n), c;
+    std::vector<Number> values = randomNumbers<Number>(2 * n * n, 61);
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            a.set(i, j, values[i * n + j]);
+            b.set(i, j, values[n * n + i * n + j]);
+        }
+    }
+    // Время одного слагаемого a[i][k] * b[k][j]
+    size_t terms = n * n * n;
+    ThreadPool pool;
+    double naiveNs = measureNs(terms, [&]() {
+        M::multiplyNaive(a, b, c);
+        benchSink = benchSink + c.data(0)[1];
+    });
+    double blockedNs = measureNs(terms, [&]() {
+        M::multiply(a, b, c);
+        benchSink = benchSink + c.data(0)[1];
+    });
+    double pooledNs = measureNs(terms, [&]() {
+        M::multiply(a, b, c, &pool);
+        benchSink = benchSink + c.data(0)[1];
+    });
+    std::cout << name << " matrix multiply, " << n << " x " << n << " (" << simdLevelName(simdLevel()) << ")\n"
+              << "  naive triple loop:          " << flopsPerTerm / naiveNs << " GFLOP/s\n"
+              << "  blocked:                    " << flopsPerTerm / blockedNs << " GFLOP/s\n"
+              << "  blocked, " << pool.size() << " threads:         " << flopsPerTerm / pooledNs << " GFLOP/s\n";
+}
+
+// Многочлен степени degree в n точках: цикл на операторах против
+// пакетных Горнера и Эстрина; корни - методом Аберта - Эрлиха
+void benchPolynomial(size_t n, size_t degree) {
+    std::vector<ComplexNumber> coefficients = randomNumbers<ComplexNumber>(degree + 1, 91);
+    Polynomial p(coefficients);
+    ComplexBatch points, values(n);
+    for (const ComplexNumber& z : randomNumbers<ComplexNumber>(n, 92))
+        points.append(z);
+
+    ThreadPool pool;
+    double loopNs = measureNs(n, [&]() {
+        for (size_t i = 0; i < n; ++i) {
+            ComplexNumber z = points.get(i);
+            ComplexNumber value = coefficients[degree];
+            for (size_t k = degree; k-- > 0;)
+                value = value * z + coefficients[k];
+            values.set(i, value);
+        }
+        benchSink = benchSink + values.realData()[1];
+    });
+    double hornerNs = measureNs(n, [&]() {
+        p.evaluate(points, values);
+        benchSink = benchSink + values.realData()[1];
+    });
+    double estrinNs = measureNs(n, [&]() {
+        p.evaluate(points, values, POLYNOMIAL_ESTRIN);
+        benchSink = benchSink + values.realData()[1];
+    });
+    double pooledNs = measureNs(n, [&]() {
+        p.evaluate(points, values, POLYNOMIAL_ESTRIN, &pool);
+        benchSink = benchSink + values.realData()[1];
+    });
+    // Цепочка зависимых точек: здесь важна латентность, а не пропускная способность
+    const size_t chainLength = n / 16;
+    double chainNs[2];
+    for (int scheme = POLYNOMIAL_HORNER; scheme <= POLYNOMIAL_ESTRIN; ++scheme) {
+        chainNs[scheme] = measureNs(chainLength, [&]() {
+            ComplexNumber z = points.get(0);
+            for (size_t i = 0; i < chainLength; ++i) {
+                ComplexNumber value = p.evaluate(z, PolynomialScheme(scheme));
+                z = ComplexNumber(points.realData()[0] + value.getReal() * 1e-30, points.imagData()[0]);
+            }
+            benchSink = benchSink + z.getReal();
+        });
+    }
+    std::cout << "Polynomial of degree " << degree << " at " << n << " points (" << simdLevelName(simdLevel())
+              << ")\n"
+              << "  operator loop:              " << 1e3 / loopNs << " Mpoints/s\n"
+              << "  horner:                     " << 1e3 / hornerNs << " Mpoints/s\n"
+              << "  estrin:                     " << 1e3 / estrinNs << " Mpoints/s\n"
+              << "  estrin, " << pool.size() << " threads:          " << 1e3 / pooledNs << " Mpoints/s\n"
+              << "  dependent chain, horner:    " << chainNs[POLYNOMIAL_HORNER] << " ns/point\n"
+              << "  dependent chain, estrin:    " << chainNs[POLYNOMIAL_ESTRIN] << " ns/point\n";
+
+    const size_t rootDegree = 128;
+    Polynomial q(randomNumbers<ComplexNumber>(rootDegree + 1, 93));
+    std::vector<ComplexNumber> roots;
+    RootStatus status = { false, 0 };
+    double rootsNs = measureNs(1, [&]() { status = q.roots(roots); });
+    double pooledRootsNs = measureNs(1, [&]() { status = q.roots(roots, &pool); });
+    std::cout << "  roots, degree " << rootDegree << ":         " << rootsNs / 1e6 << " ms, "
+              << status.iterations << " iterations" << (status.converged ? "" : " (not converged)") << "\n"
+              << "  roots, " << pool.size() << " threads:           " << pooledRootsNs / 1e6 << " ms\n";
+}
+
+void runBenchmarks() {
+    const size_t n = 1 << 20;
+    std::cout << "Quaternion layout, " << n << " elements\n";
+    benchQuaternionLayout<LegacyQuaternion>("  legacy (base + second + type)", n);
+    benchQuaternionLayout<Quaternion>("  flat (4 x double)", n);
+    benchExpressions(n);
+    benchCalculator(n);
+    benchThreads(n);
+    benchRotationChains(n);
+    benchUnitQuaternions(4096);
+    benchParser(n);
+    benchFormatter(n);
+    benchColumnFile(n);
+    benchMixed(n);
+    benchDivision(n);
+    benchFma(4096);
+    benchFft();
+    // Умножение и сложение: 4 + 2 + 2 операции у комплексных, 16 + 12 + 4 у кватернионов
+    benchMatrix<ComplexNumber>("Complex", 384, 8);
+    benchMatrix<Quaternion>("Quaternion", 256, 32);
+    benchPolynomial(n, 32);
 }
+
+// ------------------------------------------------------------------
+// Набор бенчмарков с выводом в JSON (запуск: ./laba3 bench-suite [out.json])
+// ------------------------------------------------------------------
+
+// Результат одного замера
+struct BenchmarkResult {
+    std::string name;
+    size_t elements;
+    size_t workingSetBytes;
+    size_t iterations;
+    double nsPerOp;
+};
+
+// Замеры по размерам данных: каждая функция вызывается столько раз,
+// чтобы всего набралось не меньше MIN_OPERATIONS операций. Таблица
+// для человека печатается сразу, JSON пишется в файл в конце
+class BenchmarkSuite {
+private:
+    std::vector<BenchmarkResult> results;
+public:
+    static const size_t MIN_OPERATIONS = 1 << 22;
+
+    // pass выполняет elements операций над рабочим набором workingSetBytes байт
+    template <typename F>
+    void run(const std::string& name, size_t elements, size_t workingSetBytes, F pass) {
+        size_t passes = std::max<size_t>(1, MIN_OPERATIONS / elements);
+        BenchmarkResult result;
+        result.name = name;
+        result.elements = elements;
+        result.workingSetBytes = workingSetBytes;
+        result.iterations = passes * elements;
+        result.nsPerOp = measureNs(result.iterations, [&]() {
+            for (size_t p = 0; p < passes; ++p)
+                pass();
+        });
+        results.push_back(result);
+        std::cout << "  " << name << ": " << result.nsPerOp << " ns/op, "
+                  << 1e9 / result.nsPerOp << " ops/s\n";
+    }
+
+    // Формат близок к Google Benchmark: контекст и список замеров
+    void writeJson(std::ostream& out) const {
+        out << "{\n  \"context\": {\n"
+            << "    \"simd\": \"" << simdLevelName(simdLevel()) << "\",\n"
+            << "    \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n"
+            << "    \"min_operations\": " << MIN_OPERATIONS << "\n  },\n"
+            << "  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BenchmarkResult& r = results[i];
+            out << (i == 0 ? "\n" : ",\n")
+                << "    {\"name\": \"" << r.name << "\", \"elements\": " << r.elements
+                << ", \"working_set_bytes\": " << r.workingSetBytes
+                << ", \"iterations\": " << r.iterations
+                << ", \"ns_per_op\": " << r.nsPerOp
+                << ", \"ops_per_second\": " << 1e9 / r.nsPerOp << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
 };
 
+// Все операторы, performOperation, пакетные операции и скомпилированная
+// формула для одного типа и одного размера
+template <typename Number>
+void suiteNumberType(BenchmarkSuite& suite, Calculator& calc, const std::string& type, size_t n) {
+    typedef typename NumberTraits<Number>::Batch Batch;
+    std::vector<Number> x = randomNumbers<Number>(n, 7), y = randomNumbers<Number>(n, 8), out(n);
+    size_t bytes = 3 * n * sizeof(Number);
+    std::string suffix = "/" + std::to_string(n);
+
+    const char operations[] = { '+', '-', '*', '/' };
+    const char* names[] = { "add", "sub", "mul", "div" };
+    for (int k = 0; k < 4; ++k) {
+        char operation = operations[k];
+        suite.run(type + "/operator/" + names[k] + suffix, n, bytes, [&]() {
+            for (size_t i = 0; i < n; ++i) {
+                if (operation == '+')
+                    out[i] = x[i] + y[i];
+                else if (operation == '-')
+                    out[i] = x[i] - y[i];
+                else if (operation == '*')
+                    out[i] = x[i] * y[i];
+                else
+                    out[i] = x[i] / y[i];
+            }
+            benchSink = benchSink + (double)out[n / 2].getReal();
+        });
+    }
+
+    for (int k = 0; k < 4; ++k) {
+        char operation = operations[k];
+        suite.run(type + "/performOperation/" + names[k] + suffix, n, bytes, [&]() {
+            std::stack<Number> stack;
+            for (size_t i = 0; i < n; ++i) {
+                stack.push(x[i]);
+                stack.push(y[i]);
+                calc.performOperation(stack, operation);
+                out[i] = stack.top();
+                stack.pop();
+            }
+            benchSink = benchSink + (double)out[n / 2].getReal();
+        });
+    }
+
+    Batch xs, ys, result;
+    for (size_t i = 0; i < n; ++i) {
+        xs.append(x[i]);
+        ys.append(y[i]);
+    }
+    void (*batchOperations[])(const Batch&, const Batch&, Batch&) = { Batch::add, Batch::sub, Batch::mul, Batch::div };
+    for (int k = 0; k < 4; ++k) {
+        suite.run(type + "/batch/" + names[k] + suffix, n, bytes, [&]() {
+            batchOperations[k](xs, ys, result);
+            benchSink = benchSink + (double)result.data(0)[n / 2];
+        });
+    }
+
+    CalculatorProgram<Number> program = calc.compile<Number>("(x * y + x) / y");
+    const Batch* inputs[2] = { &xs, &ys };
+    suite.run(type + "/program/columns" + suffix, n, bytes, [&]() {
+        calc.evaluateBatch(program, inputs, result);
+        benchSink = benchSink + (double)result.data(0)[n / 2];
+    });
+}
+
+// Размеры от помещающихся в L1 до заведомо больших, чем L3
+void runBenchmarkSuite(const char* jsonPath) {
+    const size_t sizes[] = { 256, 4096, 65536, 1 << 20 };
+    BenchmarkSuite suite;
+    Calculator calc;
+    std::cout << "Benchmark suite (SIMD: " << simdLevelName(simdLevel()) << ")\n";
+    for (size_t n : sizes) {
+        suiteNumberType<ComplexNumber>(suite, calc, "ComplexNumber", n);
+        suiteNumberType<Quaternion>(suite, calc, "Quaternion", n);
+    }
+
+    ThreadPool pool;
+    std::vector<Quaternion> rotations = randomNumbers<Quaternion>(sizes[3], 9);
+    for (Quaternion& q : rotations)
+        q = q.normalized();
+    suite.run("Quaternion/reduceProduct/" + std::to_string(sizes[3]), sizes[3], sizes[3] * sizeof(Quaternion), [&]() {
+        benchSink = benchSink + reduceProduct(rotations.data(), rotations.size(), pool).getA();
+    });
+
+    for (size_t n : sizes) {
+        std::vector<Quaternion> values = randomNumbers<Quaternion>(n, 13);
+        std::string text;
+        for (const Quaternion& q : values)
+            text += printed(q);
+        QuaternionBatch out;
+        suite.run("Quaternion/parseBuffer/" + std::to_string(n), n, text.size() + n * sizeof(Quaternion), [&]() {
+            LiteralParser<Quaternion>::parseBuffer(text.data(), text.size(), out);
+            benchSink = benchSink + out.data(0)[n / 2];
+        });
+    }
+
+    std::vector<char> buffer(1 << 16);
+    for (size_t n : sizes) {
+        std::vector<Quaternion> values = randomNumbers<Quaternion>(n, 15);
+        suite.run("Quaternion/formatArray/" + std::to_string(n), n, buffer.size() + n * sizeof(Quaternion), [&]() {
+            for (size_t done = 0; done < n;) {
+                char* written = 0;
+                done += LiteralFormatter<Quaternion>::formatArray(values.data(), done, n, buffer.data(),
+                                                                  buffer.data() + buffer.size(), written);
+                benchSink = benchSink + (double)(written - buffer.data());
+            }
+        });
+    }
+
+    std::ofstream json(jsonPath);
+    if (!json) {
+        std::cout << "Cannot write " << jsonPath << std::endl;
+        return;
+    }
+    suite.writeJson(json);
+    std::cout << "Results written to " << jsonPath << std::endl;
+}
+
+
+// Потоковый режим: ./laba3 stream complex|quaternion "формула" [вход] [выход].
+// Записи - по строке, значения переменных через запятую в порядке их
+// появления в формуле. Вход и выход по умолчанию (или "-") - stdin и stdout
+template <typename Number>
+int runStream(const std::string& formula, const char* inputPath, const char* outputPath) {
+    Calculator calc;
+    CalculatorProgram<Number> program = calc.compile<Number>(formula);
+    if (!program.valid()) {
+        std::cerr << "formula error at offset " << program.errorOffset() << ": " << program.errorMessage() << std::endl;
+        return 2;
+    }
+
+    int input = STDIN_FILENO;
+    int output = STDOUT_FILENO;
+    if (std::strcmp(inputPath, "-") != 0 && (input = ::open(inputPath, O_RDONLY)) < 0) {
+        std::cerr << "cannot open " << inputPath << ": " << std::strerror(errno) << std::endl;
+        return 2;
+    }
+    if (std::strcmp(outputPath, "-") != 0 && (output = ::open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        std::cerr << "cannot create " << outputPath << ": " << std::strerror(errno) << std::endl;
+        return 2;
+    }
+
+    ThreadPool pool;
+    ParseStatus status = calc.evaluateStream(program, input, output, pool);
+    if (input != STDIN_FILENO)
+        ::close(input);
+    if (output != STDOUT_FILENO && ::close(output) != 0 && status.ok())
+        status.message = "write failed";
+    if (status.ok())
+        return 0;
+    if (status.line != 0)
+        std::cerr << "line " << status.line << ", column " << status.column << ": ";
+    std::cerr << status.message << std::endl;
+    return 1;
+}
+
+int runStreamMode(int argc, char* argv[]) {
+    std::string type = argc > 2 ? argv[2] : "";
+    if (argc < 4 || argc > 6 || (type != "complex" && type != "quaternion")) {
+        std::cerr << "usage: " << argv[0] << " stream complex|quaternion \"formula\" [input|-] [output|-]" << std::endl;
+        return 2;
+    }
+    // stdout занят результатами, служебные сообщения уходят в stderr
+    std::streambuf* saved = std::cout.rdbuf(std::cerr.rdbuf());
+    const char* inputPath = argc > 4 ? argv[4] : "-";
+    const char* outputPath = argc > 5 ? argv[5] : "-";
+    int code = type == "complex" ? runStream<ComplexNumber>(argv[3], inputPath, outputPath)
+                                 : runStream<Quaternion>(argv[3], inputPath, outputPath);
+    std::cout.rdbuf(saved);
+    return code;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        runBenchmarks();
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "stream")
+        return runStreamMode(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "bench-suite") {
+        runBenchmarkSuite(argc > 2 ? argv[2] : "bench.json");
+        return 0;
+    }
+
+    ComplexNumber::test();
+    BasicComplexNumber<float>::test();
+    BasicComplexNumber<long double>::test();
+    Quaternion::test();
+    BasicQuaternion<float>::test();
+    BasicQuaternion<long double>::test();
+    ComplexBatch::test();
+    BasicComplexBatch<float>::test();
+    BasicComplexBatch<long double>::test();
+    QuaternionBatch::test();
+    BasicQuaternionBatch<float>::test();
+    BasicQuaternionBatch<long double>::test();
+    testExpressions();
+    testAccumulation();
+    MonotonicArena::test();
+    ThreadPool::test();
+    testQuaternionChains();
+    testFft();
+    ComplexMatrix::test();
+    QuaternionMatrix::test();
+    Polynomial::test();
+    BasicPolynomial<float>::test();
+    testLiteralParser();
+    testLiteralFormatter();
+    testColumnFile();
 
-int main() {
     Calculator calc;
 
     calc.runTests();